@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "asyncoutputstream.hh"
+#include "profile.hh"
+
+using std::vector;
+
+AsyncOutputStream::AsyncOutputStream (std::unique_ptr<AudioOutputStream> out_stream) :
+  m_out_stream (std::move (out_stream)),
+  m_n_channels (m_out_stream->n_channels())
+{
+  m_thread = std::thread (&AsyncOutputStream::writer_run, this);
+}
+
+AsyncOutputStream::~AsyncOutputStream()
+{
+  close();
+}
+
+int
+AsyncOutputStream::bit_depth() const
+{
+  return m_out_stream->bit_depth();
+}
+
+int
+AsyncOutputStream::sample_rate() const
+{
+  return m_out_stream->sample_rate();
+}
+
+int
+AsyncOutputStream::n_channels() const
+{
+  return m_n_channels;
+}
+
+void
+AsyncOutputStream::writer_run()
+{
+  for (;;)
+    {
+      vector<float> block;
+      {
+        std::unique_lock<std::mutex> lock (m_mutex);
+        m_cond.wait (lock, [&] { return m_quit || !m_queue.empty(); });
+        if (m_queue.empty())
+          return;
+
+        /* the block stays in the queue while it is written, so the queue size limits the memory usage */
+        block = std::move (m_queue.front());
+      }
+      Error err;
+      {
+        Profile::Span span ("async_write");
+        err = m_out_stream->write_frames (block);
+      }
+
+      std::lock_guard<std::mutex> lg (m_mutex);
+      m_queue.pop_front();
+      if (err && !m_error)
+        m_error = err;
+      m_cond.notify_all();
+    }
+}
+
+Error
+AsyncOutputStream::queue_block()
+{
+  std::unique_lock<std::mutex> lock (m_mutex);
+  m_cond.wait (lock, [&] { return m_queue.size() < max_queued_blocks || m_error; });
+  if (m_error)
+    return m_error;
+
+  m_queue.push_back (std::move (m_block));
+  m_block = vector<float>();
+  m_cond.notify_all();
+  return Error::Code::NONE;
+}
+
+Error
+AsyncOutputStream::write_frames (const vector<float>& frames)
+{
+  return write_frames (frames.data(), frames.size() / m_n_channels);
+}
+
+Error
+AsyncOutputStream::write_frames (const float *frames, size_t count)
+{
+  if (m_block.empty())
+    m_block.reserve (block_frames * m_n_channels);
+
+  m_block.insert (m_block.end(), frames, frames + count * m_n_channels);
+  if (m_block.size() >= block_frames * m_n_channels)
+    return queue_block();
+
+  std::lock_guard<std::mutex> lg (m_mutex);
+  return m_error;
+}
+
+Error
+AsyncOutputStream::close()
+{
+  if (m_closed)
+    return Error::Code::NONE;
+
+  Error err;
+  if (!m_block.empty())
+    err = queue_block();
+  {
+    std::lock_guard<std::mutex> lg (m_mutex);
+    m_quit = true;
+    m_cond.notify_all();
+  }
+  m_thread.join();
+  m_closed = true;
+
+  /* the writer thread is done, so no locking is required */
+  if (!err)
+    err = m_error;
+
+  Error close_err = m_out_stream->close();
+  return err ? err : close_err;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_ASYNC_OUTPUT_STREAM_HH
+#define AUDIOWMARK_ASYNC_OUTPUT_STREAM_HH
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "audiostream.hh"
+
+/*
+ * Writes to another output stream from a writer thread.
+ *
+ * The frames passed to write_frames() are collected into large blocks, which
+ * are queued for the writer thread, so the caller (the watermark embedding)
+ * only has to wait for slow disks or pipes if the queue is full. The sample
+ * conversion of the output stream also runs in the writer thread.
+ *
+ * Errors of the writer thread are returned by the next write_frames() or by
+ * close(). close() writes all remaining frames before it closes the output
+ * stream (which for instance writes the final wav header), so the result is
+ * identical to writing to the output stream directly.
+ */
+class AsyncOutputStream : public AudioOutputStream
+{
+public:
+  static constexpr size_t block_frames = 64 * 1024;
+  static constexpr size_t max_queued_blocks = 4;
+
+  AsyncOutputStream (std::unique_ptr<AudioOutputStream> out_stream);
+  ~AsyncOutputStream();
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  int     n_channels() const override;
+
+  Error   write_frames (const std::vector<float>& frames) override;
+  Error   write_frames (const float *frames, size_t count) override;
+  Error   close() override;
+
+private:
+  std::unique_ptr<AudioOutputStream> m_out_stream;
+  int                                m_n_channels = 0;
+  std::vector<float>                 m_block;       // frames which are not queued yet
+
+  std::mutex                         m_mutex;
+  std::condition_variable            m_cond;
+  std::deque<std::vector<float>>     m_queue;       // the first block is being written by the writer thread
+  Error                              m_error;       // first error of the writer thread
+  bool                               m_quit = false;
+  bool                               m_closed = false;
+  std::thread                        m_thread;
+
+  Error queue_block();
+  void  writer_run();
+};
+
+#endif /* AUDIOWMARK_ASYNC_OUTPUT_STREAM_HH */
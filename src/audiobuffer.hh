@@ -20,35 +20,89 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <vector>
+
+/*
+ * FIFO for interleaved audio frames, implemented as ring buffer
+ *
+ * the capacity grows if necessary, but is never reduced, so once the maximum
+ * fill level is reached, reading and writing doesn't allocate memory
+ */
 class AudioBuffer
 {
   const int           n_channels = 0;
   std::vector<float>  buffer;
+  size_t              read_pos = 0;     // position of first value in buffer
+  size_t              n_values = 0;     // number of values in buffer
+
+  void
+  grow (size_t min_values)
+  {
+    std::vector<float> new_buffer (std::max (min_values, buffer.size() * 2));
+
+    read_values (new_buffer.data(), n_values);
+    read_pos = 0;
+    buffer.swap (new_buffer);
+  }
+  void
+  read_values (float *out, size_t n) const
+  {
+    const size_t first = std::min (n, buffer.size() - read_pos);
 
+    std::copy_n (buffer.data() + read_pos, first, out);
+    std::copy_n (buffer.data(), n - first, out + first);
+  }
 public:
   AudioBuffer (int n_channels) :
     n_channels (n_channels)
   {
   }
   void
+  write_frames (const float *samples, size_t frames)
+  {
+    const size_t n = frames * n_channels;
+    if (!n)
+      return;
+
+    if (n_values + n > buffer.size())
+      grow (n_values + n);
+
+    const size_t write_pos = (read_pos + n_values) % buffer.size();
+    const size_t first = std::min (n, buffer.size() - write_pos);
+
+    std::copy_n (samples, first, buffer.data() + write_pos);
+    std::copy_n (samples + first, n - first, buffer.data());
+    n_values += n;
+  }
+  void
   write_frames (const std::vector<float>& samples)
   {
-    buffer.insert (buffer.end(), samples.begin(), samples.end());
+    write_frames (samples.data(), samples.size() / n_channels);
+  }
+  void
+  read_frames (float *out, size_t frames)
+  {
+    const size_t n = frames * n_channels;
+    assert (n <= n_values);
+    if (!n)
+      return;
+
+    read_values (out, n);
+    read_pos = (read_pos + n) % buffer.size();
+    n_values -= n;
   }
   std::vector<float>
   read_frames (size_t frames)
   {
-    assert (frames * n_channels <= buffer.size());
-    const auto begin = buffer.begin();
-    const auto end   = begin + frames * n_channels;
-    std::vector<float> result (begin, end);
-    buffer.erase (begin, end);
+    std::vector<float> result (frames * n_channels);
+    read_frames (result.data(), frames);
     return result;
   }
   size_t
   can_read_frames() const
   {
-    return buffer.size() / n_channels;
+    return n_values / n_channels;
   }
 };
 
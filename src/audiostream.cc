@@ -18,6 +18,7 @@
 #include "audiostream.hh"
 #include "wmcommon.hh"
 #include "sfinputstream.hh"
+#include "mmapwavinputstream.hh"
 #include "sfoutputstream.hh"
 #include "mp3inputstream.hh"
 #include "rawconverter.hh"
@@ -25,12 +26,50 @@
 #include "stdoutwavoutputstream.hh"
 #include "wavpipeinputstream.hh"
 
+#include <algorithm>
+
+#include <assert.h>
+
 using std::string;
 
 AudioStream::~AudioStream()
 {
 }
 
+/* fallback for streams which only implement the std::vector API (needs a temporary copy) */
+Error
+AudioInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  std::vector<float> buffer;
+
+  Error err = read_frames (buffer, count);
+  if (err)
+    return err;
+
+  assert (buffer.size() <= count * n_channels());
+  std::copy (buffer.begin(), buffer.end(), samples);
+  frames_read = buffer.size() / n_channels();
+  return Error::Code::NONE;
+}
+
+Error
+AudioInputStream::seek (size_t frame)
+{
+  return Error ("input stream does not support seeking");
+}
+
+Error
+AudioOutputStream::write_frames (const float *frames, size_t count)
+{
+  return write_frames (std::vector<float> (frames, frames + count * n_channels()));
+}
+
+Error
+AudioOutputStream::flush()
+{
+  return Error::Code::NONE;
+}
+
 std::unique_ptr<AudioInputStream>
 AudioInputStream::create (const string& filename, Error& err)
 {
@@ -38,6 +77,13 @@ AudioInputStream::create (const string& filename, Error& err)
 
   if (Params::input_format == Format::AUTO)
     {
+      /* uncompressed wav files can be read from a memory mapping, everything else is read using libsndfile */
+      MMapWavInputStream *mwstream = new MMapWavInputStream();
+      in_stream.reset (mwstream);
+      err = mwstream->open (filename);
+      if (!err)
+        return in_stream;
+
       SFInputStream *sistream = new SFInputStream();
       in_stream.reset (sistream);
       err = sistream->open (filename);
@@ -49,6 +49,16 @@ public:
   virtual Encoding encoding() const = 0;
 
   virtual Error read_frames (std::vector<float>& samples, size_t count) = 0;
+
+  /* read up to count frames into caller provided memory (count * n_channels() values)
+   *
+   * frames_read is set to the number of frames actually read, which is only
+   * less than count at the end of the stream
+   */
+  virtual Error read_frames (float *samples, size_t count, size_t& frames_read);
+
+  /* continue reading at sample frame (only supported by streams with known length, which are not pipes) */
+  virtual Error seek (size_t frame);
 };
 
 class AudioOutputStream : public AudioStream
@@ -58,6 +68,12 @@ public:
     int n_channels, int sample_rate, int bit_depth, Encoding encoding, size_t n_frames, Error& err);
 
   virtual Error write_frames (const std::vector<float>& frames) = 0;
+
+  /* write count frames from caller provided memory (count * n_channels() values) */
+  virtual Error write_frames (const float *frames, size_t count);
+
+  /* write buffered data, so it becomes visible to a reader of the output (for add --low-latency) */
+  virtual Error flush();
   virtual Error close() = 0;
 };
 
@@ -26,6 +26,7 @@
 #include <random>
 #include <algorithm>
 #include <memory>
+#include <thread>
 
 #include "wavdata.hh"
 #include "utils.hh"
@@ -33,7 +34,12 @@
 #include "wmcommon.hh"
 #include "shortcode.hh"
 #include "hls.hh"
+#include "video.hh"
+#include "spectrumindex.hh"
 #include "resample.hh"
+#include "threadpool.hh"
+#include "rawinputstream.hh"
+#include "profile.hh"
 
 #include <assert.h>
 
@@ -54,28 +60,95 @@ print_usage()
   printf ("  * create a watermarked wav file with a message\n");
   printf ("    audiowmark add <input_wav> <watermarked_wav> <message_hex>\n");
   printf ("\n");
+  printf ("  * create many watermarked wav files, one for each line of the batch file\n");
+  printf ("    audiowmark add --batch <batch_file> <input_wav>\n");
+  printf ("\n");
+  printf ("  * watermark an edited input again, only changed parts are re-embedded\n");
+  printf ("    audiowmark add --reuse <old_watermarked_wav> --diff <old_input_wav>\n");
+  printf ("                   <input_wav> <watermarked_wav> <message_hex>\n");
+  printf ("\n");
   printf ("  * retrieve message\n");
   printf ("    audiowmark get <watermarked_wav>\n");
   printf ("\n");
+  printf ("  * quickly check if a file contains a watermark (exit status 0: marked, 1: not marked)\n");
+  printf ("    audiowmark get --screen <wav>\n");
+  printf ("\n");
+  printf ("  * retrieve messages from many files (list file or directory), one JSON record per file\n");
+  printf ("    audiowmark get --batch <list_file|dir> [ --max-jobs <n> ]\n");
+  printf ("\n");
   printf ("  * compare watermark message with expected message\n");
   printf ("    audiowmark cmp <watermarked_wav> <message_hex>\n");
   printf ("\n");
+  printf ("  * split detection of a long file into parts (for instance for several machines), then merge the results\n");
+  printf ("    audiowmark get --range <start>:<end> --json <part_json> <watermarked_wav>\n");
+  printf ("    audiowmark merge-results <part_json>...\n");
+  printf ("\n");
+  printf ("  * analyze a file once, then retrieve messages with any key from its spectrum index\n");
+  printf ("    audiowmark index <input_wav> <index_file> [ --hop <n> ]\n");
+  printf ("    audiowmark get --from-index <index_file>\n");
+  printf ("\n");
+  printf ("  * watermark the audio of a video file (the video is copied), and retrieve the message\n");
+  printf ("    audiowmark video-add <input_video> <watermarked_video> <message_hex>\n");
+  printf ("    audiowmark video-get <watermarked_video>\n");
+  printf ("\n");
+  printf ("  * detection server: read filenames or JSON requests, write JSON results\n");
+  printf ("    audiowmark serve [ --socket <path> ] [ --max-jobs <n> ]\n");
+  printf ("\n");
+  printf ("  * measure speed and robustness of add / get for a grid of settings\n");
+  printf ("    audiowmark bench-add <input_wav> [ --strength <s1>,<s2>,... ] [ --codec <cmd> ] [ --json <file> ]\n");
+  printf ("\n");
   printf ("  * generate 128-bit watermarking key, to be used with --key option\n");
   printf ("    audiowmark gen-key <key_file> [ --name <key_name> ]\n");
   printf ("\n");
+  printf ("  * tune FFT plans for this machine, to be used with --fft-wisdom option\n");
+  printf ("    audiowmark fft-tune <wisdom_file> [ --channels <n> ] [ --patient ]\n");
+  printf ("\n");
   printf ("Global options:\n");
   printf ("  -q, --quiet             disable information messages\n");
   printf ("  --strict                treat (minor) problems as errors\n");
+  printf ("  --threads <n>           limit the number of worker threads\n");
+  printf ("  --numa                  bind worker threads to NUMA nodes (Linux)\n");
+  printf ("  --max-memory <mb>       memory budget for get (chunk size, threads, speed search)\n");
+  printf ("  --read-buffer <kb>      read buffer size for raw / wav pipe input  [1024]\n");
+  printf ("\n");
+  printf ("Options for add:\n");
+  printf ("  --mark-channels <list>  only watermark these channels (like 0,1)  [all]\n");
+  printf ("  --mark-downmix          watermark the downmix, same signal for each channel\n");
+  printf ("  --native-rate           generate the watermark at the input sample rate (faster)\n");
+  printf ("  --low-latency <ms>      live input: keep the delay of the output below <ms>\n");
+  printf ("  --reuse <wav>           copy unchanged parts from this previous add output\n");
+  printf ("  --regions <list>        changed parts of the input (like 10:40,95.5:100)\n");
+  printf ("  --diff <wav>            find changed parts by comparing with the old input\n");
   printf ("\n");
   printf ("Options for get / cmp:\n");
   printf ("  --detect-speed          detect and correct replay speed difference\n");
   printf ("  --detect-speed-patient  slower, more accurate speed detection\n");
+  printf ("  --speed-engine <e>      speed detection grid search: full or coarse (faster) [full]\n");
   printf ("  --json <file>           write JSON results into file\n");
+  printf ("  --ndjson <file>         write JSON lines for each match as it is found\n");
+  printf ("  --stream                bounded memory, print block results as they are found\n");
+  printf ("  --live                  low latency streaming, print JSON lines for live input\n");
+  printf ("  --screen                get only: check if input is watermarked, no decoding\n");
+  printf ("  --from-index            input is a spectrum index created by audiowmark index\n");
+  printf ("  --silence-threshold <t> skip silent frames below <t> dB (e.g. -80)  [off]\n");
+  printf ("  --compact-samples       store input with 16 bits per sample (less memory)\n");
+  printf ("  --first-match           stop as soon as a message has been found\n");
+  printf ("  --min-matches <n>       stop as soon as a message has been found <n> times\n");
+  printf ("  --time-budget <s>       stop after <s> seconds, with partial results\n");
+  printf ("  --sample-every <s>      only decode windows starting every <s> seconds (seekable input)\n");
+  printf ("  --sample-length <s>     length of these windows in seconds  [%.6g]\n", Params::get_sample_length);
+  printf ("  --range <start>:<end>   only analyze this part of the input (in seconds)\n");
+  printf ("  --profile               print time spent in each stage (and add \"stats\" to JSON)\n");
+  printf ("  --trace <file>          write trace of all threads (Chrome trace format) into file\n");
+  printf ("  --short-nearest         short payload: correct remaining bit errors (slower)\n");
   printf ("\n");
   printf ("Options for add / get / cmp:\n");
   printf ("  --key <file>            load watermarking key from file\n");
+  printf ("  --key-cache <dir>       cache tables computed from the key in <dir>\n");
   printf ("  --short <bits>          enable short payload mode\n");
   printf ("  --strength <s>          set watermark strength              [%.6g]\n", Params::water_delta * 1000);
+  printf ("  --fft-wisdom <file>     load FFT plans created by fft-tune\n");
+  printf ("  --resample-quality <q>  resampler quality: fast, default or best  [default]\n");
   printf ("\n");
   printf ("  --input-format raw      use raw stream as input\n");
   printf ("  --output-format raw     use raw stream as output\n");
@@ -95,13 +168,20 @@ print_usage_hls()
   printf ("Commands:\n");
   printf ("  * prepare HLS segments for streaming:\n");
   printf ("    audiowmark hls-prepare <input_dir> <output_dir> <playlist_name> <audio_master>\n");
+  printf ("    (with --variants <message_hex>,... watermarked variants of each segment are precomputed)\n");
   printf ("\n");
   printf ("  * watermark one HLS segment:\n");
   printf ("    audiowmark hls-add <input_ts> <output_ts> <message_hex>\n");
   printf ("\n");
+  printf ("  * watermark HLS segments requested over a unix socket:\n");
+  printf ("    audiowmark hls-serve [ --socket <path> ] [ --max-jobs <n> ] [ --cache-size <n> ]\n");
+  printf ("\n");
   printf ("Global options:\n");
   printf ("  -q, --quiet           disable information messages\n");
   printf ("  --strict              treat (minor) problems as errors\n");
+  printf ("  --threads <n>         limit the number of worker threads\n");
+  printf ("  --numa                bind worker threads to NUMA nodes (Linux)\n");
+  printf ("  --read-buffer <kb>    read buffer size for raw / wav pipe input  [1024]\n");
   printf ("\n");
   printf ("Watermarking options:\n");
   printf ("  --strength <s>        set watermark strength              [%.6g]\n", Params::water_delta * 1000);
@@ -397,14 +477,14 @@ test_speed (const Key& key, int seed)
 }
 
 int
-test_gen_noise (const Key& key, const string& out_file, double seconds, int rate, int bits)
+test_gen_noise (const Key& key, const string& out_file, double seconds, int rate, int bits, float volume)
 {
   const int channels = 2;
 
   vector<float> noise;
   Random rng (key, 0, /* there is no stream for this test */ Random::Stream::data_up_down);
   for (size_t i = 0; i < size_t (rate * seconds) * channels; i++)
-    noise.push_back (rng.random_double() * 2 - 1);
+    noise.push_back ((rng.random_double() * 2 - 1) * volume);
 
   WavData out_wav_data (noise, channels, rate, bits);
   Error err = out_wav_data.save (out_file);
@@ -426,7 +506,13 @@ test_change_speed (const string& in_file, const string& out_file, double speed)
       error ("audiowmark: error loading %s: %s\n", in_file.c_str(), err.message());
       return 1;
     }
-  WavData out_data = resample_ratio (in_data, 1 / speed, in_data.sample_rate());
+  WavData out_data;
+  err = resample_ratio (in_data, 1 / speed, in_data.sample_rate(), out_data);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
   err = out_data.save (out_file);
   if (err)
     {
@@ -446,7 +532,13 @@ test_resample (const string& in_file, const string& out_file, int new_rate)
       error ("audiowmark: error loading %s: %s\n", in_file.c_str(), err.message());
       return 1;
     }
-  WavData out_data = resample (in_data, new_rate);
+  WavData out_data;
+  err = resample (in_data, new_rate, out_data);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
   err = out_data.save (out_file);
   if (err)
     {
@@ -476,6 +568,17 @@ test_info (const string& in_file, const string& property)
       printf ("%zd\n", in_data.n_frames());
       return 0;
     }
+  if (property == "channel_peaks")
+    {
+      const int n_channels = in_data.n_channels();
+      vector<float> peaks (n_channels);
+      for (size_t i = 0; i < in_data.n_values(); i++)
+        peaks[i % n_channels] = std::max (peaks[i % n_channels], std::abs (in_data.samples()[i]));
+      for (int ch = 0; ch < n_channels; ch++)
+        printf ("%s%g", ch ? " " : "", peaks[ch]);
+      printf ("\n");
+      return 0;
+    }
   error ("audiowmark: unsupported property for test_info: %s\n", property.c_str());
   return 1;
 }
@@ -528,6 +631,29 @@ gen_key (const string& outfile, const string& key_name)
   return 0;
 }
 
+int
+fft_tune (const string& outfile, int n_channels, bool patient)
+{
+  /* keep wisdom that is already stored in the file (for instance for other channel counts) */
+  fft_import_wisdom (outfile);
+
+  /* batched ffts are used for all channels of one or more frames */
+  vector<size_t> batch_counts;
+  for (size_t f = 1; f <= FFTAnalyzer::max_batch_frames; f++)
+    batch_counts.push_back (f * n_channels);
+
+  info ("Tuning FFT plans for %d channel(s), this may take a while...\n", n_channels);
+  fft_tune_plans (Params::frame_size, batch_counts, patient);
+  fft_tune_plans (Params::frame_size / 2, batch_counts, patient); // used by speed detection, same batch sizes
+
+  if (!fft_export_wisdom (outfile))
+    {
+      error ("audiowmark: error writing fft wisdom to file %s\n", outfile.c_str());
+      return 1;
+    }
+  return 0;
+}
+
 static bool
 is_option (const string& arg)
 {
@@ -658,6 +784,80 @@ public:
   }
 };
 
+/* split comma separated list, like "0,1" */
+vector<string>
+split_list (const string& str)
+{
+  vector<string> items;
+  size_t pos = 0;
+  while (pos <= str.size())
+    {
+      size_t end = str.find (',', pos);
+      if (end == string::npos)
+        end = str.size();
+
+      items.push_back (str.substr (pos, end - pos));
+      pos = end + 1;
+    }
+  return items;
+}
+
+vector<int>
+parse_channel_list (const string& str)
+{
+  vector<int> channels;
+  for (const auto& item : split_list (str))
+    {
+      int ch = atoi_or_die (item);
+      if (item.empty() || ch < 0 || std::find (channels.begin(), channels.end(), ch) != channels.end())
+        {
+          error ("audiowmark: bad channel list '%s'\n", str.c_str());
+          exit (1);
+        }
+      channels.push_back (ch);
+    }
+  return channels;
+}
+
+/* add --regions: comma separated list of <start>:<end> (in seconds) */
+vector<std::pair<double, double>>
+parse_regions (const string& str)
+{
+  vector<std::pair<double, double>> regions;
+  for (const auto& item : split_list (str))
+    {
+      size_t colon = item.find (':');
+      if (colon == string::npos || colon == 0 || colon + 1 == item.size())
+        {
+          error ("audiowmark: bad region '%s', needs to be <start>:<end> (in seconds)\n", item.c_str());
+          exit (1);
+        }
+      double start = atof_or_die (item.substr (0, colon));
+      double end = atof_or_die (item.substr (colon + 1));
+      if (start < 0 || end <= start)
+        {
+          error ("audiowmark: bad region '%s', end needs to be larger than start\n", item.c_str());
+          exit (1);
+        }
+      regions.emplace_back (start, end);
+    }
+  return regions;
+}
+
+ResampleQuality
+parse_resample_quality (const string& quality)
+{
+  if (quality == "fast")
+    return ResampleQuality::FAST;
+  else if (quality == "default")
+    return ResampleQuality::DEFAULT;
+  else if (quality == "best")
+    return ResampleQuality::BEST;
+
+  error ("audiowmark: unsupported resample quality '%s' (use fast, default or best)\n", quality.c_str());
+  exit (1);
+}
+
 void
 parse_shared_options (ArgParser& ap)
 {
@@ -677,6 +877,25 @@ parse_shared_options (ArgParser& ap)
     {
       Params::mix = false;
     }
+  ap.parse_opt ("--key-cache", Params::key_cache_dir);
+
+  string quality;
+  if (ap.parse_opt ("--resample-quality", quality))
+    Params::resample_quality = parse_resample_quality (quality);
+
+  string fft_wisdom;
+  if (const char *env_wisdom = getenv ("AUDIOWMARK_FFTW_WISDOM"))
+    fft_wisdom = env_wisdom;
+  ap.parse_opt ("--fft-wisdom", fft_wisdom);
+  if (fft_wisdom != "" && !fft_import_wisdom (fft_wisdom))
+    {
+      if (Params::strict)
+        {
+          error ("audiowmark: error loading fft wisdom from file %s\n", fft_wisdom.c_str());
+          exit (1);
+        }
+      warning ("audiowmark: warning: unable to load fft wisdom from file %s\n", fft_wisdom.c_str());
+    }
 }
 
 vector<Key>
@@ -687,7 +906,12 @@ parse_key_list (ArgParser& ap)
   for (auto f : key_files)
     {
       Key key;
-      key.load_key (f);
+      Error err = key.load_key_file (f);
+      if (err)
+        {
+          error ("audiowmark: %s\n", err.message());
+          exit (get_error_status());
+        }
       key_list.push_back (key);
     }
   vector<string> test_keys = ap.parse_multi_opt ("--test-key");
@@ -717,12 +941,21 @@ parse_key (ArgParser& ap)
   return key_list[0];
 }
 
+void
+parse_strength (ArgParser& ap)
+{
+  float f;
+  if (ap.parse_opt ("--strength", f))
+    {
+      Params::water_delta = f / 1000;
+    }
+}
+
 void
 parse_add_options (ArgParser& ap)
 {
   string s;
   int i;
-  float f;
 
   ap.parse_opt ("--set-input-label", Params::input_label);
   ap.parse_opt ("--set-output-label", Params::output_label);
@@ -730,6 +963,32 @@ parse_add_options (ArgParser& ap)
     {
       Params::snr = true;
     }
+  if (ap.parse_opt ("--mark-channels", s))
+    {
+      Params::mark_channels = parse_channel_list (s);
+    }
+  if (ap.parse_opt ("--mark-downmix"))
+    {
+      Params::mark_downmix = true;
+    }
+  if (ap.parse_opt ("--native-rate"))
+    {
+      Params::mark_native_rate = true;
+    }
+  float latency_ms;
+  if (ap.parse_opt ("--low-latency", latency_ms))
+    {
+      if (latency_ms <= 0)
+        {
+          error ("audiowmark: --low-latency needs a positive number of milliseconds\n");
+          exit (1);
+        }
+      Params::add_low_latency = latency_ms;
+
+      /* shortest resampler filters, unless another quality was chosen explicitly */
+      if (Params::resample_quality == ResampleQuality::DEFAULT)
+        Params::resample_quality = ResampleQuality::FAST;
+    }
   if (ap.parse_opt ("--input-format", s))
     {
       Params::input_format = parse_format (s);
@@ -803,10 +1062,52 @@ parse_add_options (ArgParser& ap)
       error ("audiowmark: using rf64 as input format has no effect\n");
       exit (1);
     }
-  if (ap.parse_opt ("--strength", f))
+  parse_strength (ap);
+}
+
+static string trace_file; // get / cmp --trace
+
+/* print --profile results and write --trace file after get / cmp */
+static int
+finish_profile (int rc)
+{
+  if (Profile::enabled())
+    Profile::print();
+
+  if (Profile::tracing())
     {
-      Params::water_delta = f / 1000;
+      Error err = Profile::write_trace (trace_file);
+      if (err)
+        {
+          error ("audiowmark: %s\n", err.message());
+          return 1;
+        }
     }
+  return rc;
+}
+
+/* get / cmp --from-index: the index contains no samples, so options which need the samples can't be used */
+static bool
+check_from_index_options()
+{
+  if (Params::get_live || !Params::ndjson_output.empty() || Params::detect_speed || Params::detect_speed_patient ||
+      Params::try_speed > 0 || SilenceMap::enabled() || Params::get_sample_every > 0 || Params::get_range_start >= 0)
+    {
+      error ("audiowmark: --live, --ndjson, --detect-speed, --try-speed, --silence-threshold, --sample-every and --range can not be combined with --from-index\n");
+      return false;
+    }
+  return true;
+}
+
+/* get / cmp --max-memory: the thread pool width is derived from the budget, --threads can only make it smaller */
+static void
+limit_threads_by_memory (int threads)
+{
+  if (!MemoryBudget::enabled())
+    return;
+
+  size_t n_threads = threads ? threads : std::max (std::thread::hardware_concurrency(), 1u);
+  ThreadPool::set_max_threads (MemoryBudget::max_threads (n_threads));
 }
 
 void
@@ -823,6 +1124,10 @@ parse_get_options (ArgParser& ap)
     {
       Params::hard = true;
     }
+  if (ap.parse_opt ("--short-nearest"))
+    {
+      Params::short_nearest = true;
+    }
   if (ap.parse_opt ("--test-no-sync"))
     {
       Params::test_no_sync = true;
@@ -846,38 +1151,174 @@ parse_get_options (ArgParser& ap)
   if (speed_options > 1)
     {
       error ("audiowmark: can only use one option: --detect-speed or --detect-speed-patient or --try-speed\n");
-      exit (1);
+      exit (get_error_status());
     }
   if (ap.parse_opt ("--test-speed", f))
     {
       Params::test_speed = f;
     }
+  if (ap.parse_opt ("--speed-engine", s))
+    {
+      if (s == "full")
+        Params::speed_engine = SpeedEngine::FULL;
+      else if (s == "coarse")
+        Params::speed_engine = SpeedEngine::COARSE;
+      else
+        {
+          error ("audiowmark: unsupported speed engine '%s' (use full or coarse)\n", s.c_str());
+          exit (get_error_status());
+        }
+    }
   if (ap.parse_opt ("--json", s))
     {
       Params::json_output = s;
     }
+  if (ap.parse_opt ("--ndjson", s))
+    {
+      Params::ndjson_output = s;
+    }
   if (ap.parse_opt ("--chunk-size", f))
     {
       if (f < 10)
         {
           error ("audiowmark: --chunk-size needs to be at least 10 minutes\n");
-          exit (1);
+          exit (get_error_status());
         }
       Params::get_chunk_size = f;
     }
+  if (ap.parse_opt ("--stream"))
+    {
+      Params::get_stream = true;
+    }
+  if (ap.parse_opt ("--live"))
+    {
+      Params::get_live = true;
+    }
+  if (ap.parse_opt ("--compact-samples"))
+    {
+      Params::compact_samples = true;
+    }
+  if (ap.parse_opt ("--first-match"))
+    {
+      Params::get_min_matches = 1;
+    }
+  if (ap.parse_opt ("--min-matches", i))
+    {
+      if (i < 1)
+        {
+          error ("audiowmark: --min-matches needs to be at least 1\n");
+          exit (get_error_status());
+        }
+      Params::get_min_matches = i;
+    }
+  if (Params::get_min_matches > 0 && (Params::get_live || Params::get_screen))
+    {
+      error ("audiowmark: --first-match and --min-matches can not be combined with --live or --screen\n");
+      exit (get_error_status());
+    }
+  if (ap.parse_opt ("--time-budget", f))
+    {
+      if (f <= 0)
+        {
+          error ("audiowmark: --time-budget needs to be a positive number of seconds\n");
+          exit (get_error_status());
+        }
+      Params::get_time_budget = f;
+    }
+  if (Params::get_time_budget > 0 && (Params::get_live || Params::get_screen))
+    {
+      error ("audiowmark: --time-budget can not be combined with --live or --screen\n");
+      exit (get_error_status());
+    }
+  if (ap.parse_opt ("--sample-every", f))
+    {
+      if (f <= 0)
+        {
+          error ("audiowmark: --sample-every needs to be a positive number of seconds\n");
+          exit (get_error_status());
+        }
+      Params::get_sample_every = f;
+    }
+  if (ap.parse_opt ("--sample-length", f))
+    {
+      if (f <= 0)
+        {
+          error ("audiowmark: --sample-length needs to be a positive number of seconds\n");
+          exit (get_error_status());
+        }
+      Params::get_sample_length = f;
+    }
+  if (Params::get_sample_every > 0)
+    {
+      if (Params::get_live || Params::get_screen || !Params::ndjson_output.empty())
+        {
+          error ("audiowmark: --sample-every can not be combined with --live, --screen or --ndjson\n");
+          exit (get_error_status());
+        }
+      if (Params::get_sample_length > Params::get_sample_every)
+        {
+          error ("audiowmark: --sample-length can not be larger than --sample-every\n");
+          exit (get_error_status());
+        }
+    }
+  if (ap.parse_opt ("--range", s))
+    {
+      /* <start>:<end> in seconds, without end: until the end of the input */
+      size_t colon = s.find (':');
+      if (colon == string::npos || colon == 0)
+        {
+          error ("audiowmark: --range needs to be <start>:<end> (in seconds)\n");
+          exit (get_error_status());
+        }
+      Params::get_range_start = atof_or_die (s.substr (0, colon));
+      if (colon + 1 < s.size())
+        Params::get_range_end = atof_or_die (s.substr (colon + 1));
+      if (Params::get_range_start < 0 || Params::get_range_end <= Params::get_range_start)
+        {
+          error ("audiowmark: bad --range '%s', end needs to be larger than start\n", s.c_str());
+          exit (get_error_status());
+        }
+      if (Params::get_live || Params::get_sample_every > 0)
+        {
+          error ("audiowmark: --range can not be combined with --live or --sample-every\n");
+          exit (get_error_status());
+        }
+    }
   if (ap.parse_opt ("--sync-threshold", f))
     {
       Params::sync_threshold2 = f;
     }
+  if (ap.parse_opt ("--silence-threshold", f))
+    {
+      Params::silence_threshold = f;
+    }
+  if (ap.parse_opt ("--profile"))
+    {
+      Profile::set_enabled (true);
+    }
+  if (ap.parse_opt ("--trace", trace_file))
+    {
+      Profile::start_trace();
+    }
   if (ap.parse_opt ("--n-best", i))
     {
       if (i < 0)
         {
           error ("audiowmark: --n-best should not be a negative number\n");
-          exit (1);
+          exit (get_error_status());
         }
       Params::get_n_best = i;
     }
+  else if (Params::get_live)
+    {
+      /* live mode decodes many small chunks: n-best decoding would output low quality matches for each chunk */
+      Params::get_n_best = 0;
+    }
+  else if (Params::get_screen)
+    {
+      /* screening only needs the best sync score, which is always kept with n-best 1 */
+      Params::get_n_best = 1;
+    }
 }
 
 template <class ... Args>
@@ -908,8 +1349,8 @@ parse_positional (ArgParser& ap, Args ... arg_names)
   exit (1);
 }
 
-int
-main (int argc, char **argv)
+static int
+run_command (int argc, char **argv)
 {
   ArgParser ap (argc, argv);
   vector<string> args;
@@ -937,9 +1378,45 @@ main (int argc, char **argv)
     {
       Params::strict = true;
     }
+  int threads = 0;
+  if (ap.parse_opt ("--threads", threads))
+    {
+      if (threads < 1)
+        {
+          error ("audiowmark: --threads needs to be at least 1\n");
+          return 1;
+        }
+      ThreadPool::set_max_threads (threads);
+    }
+  int max_memory_mb;
+  if (ap.parse_opt ("--max-memory", max_memory_mb))
+    {
+      if (max_memory_mb < 1)
+        {
+          error ("audiowmark: --max-memory needs to be at least 1 (mb)\n");
+          return 1;
+        }
+      Params::max_memory = size_t (max_memory_mb) << 20;
+    }
+  if (ap.parse_opt ("--numa"))
+    {
+      ThreadPool::set_numa_affinity (true);
+    }
+  int read_buffer_kb;
+  if (ap.parse_opt ("--read-buffer", read_buffer_kb))
+    {
+      /* at most 1 GB */
+      if (read_buffer_kb < 4 || read_buffer_kb > 1024 * 1024)
+        {
+          error ("audiowmark: --read-buffer needs to be between 4 and 1048576 (kb)\n");
+          return 1;
+        }
+      InputBuffer::set_buffer_size (size_t (read_buffer_kb) * 1024);
+    }
   if (ap.parse_cmd ("hls-add"))
     {
       parse_shared_options (ap);
+      parse_strength (ap);
 
       ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
 
@@ -947,41 +1424,290 @@ main (int argc, char **argv)
       args = parse_positional (ap, "input_ts", "output_ts", "message_hex");
       return hls_add (key, args[0], args[1], args[2]);
     }
+  else if (ap.parse_cmd ("hls-serve"))
+    {
+      parse_shared_options (ap);
+      parse_strength (ap);
+
+      ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
+
+      string socket_path;
+      ap.parse_opt ("--socket", socket_path);
+
+      int max_jobs = ThreadPool().n_threads();
+      if (ap.parse_opt ("--max-jobs", max_jobs) && max_jobs < 1)
+        {
+          error ("audiowmark: --max-jobs needs to be at least 1\n");
+          return 1;
+        }
+      int cache_size = 64;
+      if (ap.parse_opt ("--cache-size", cache_size) && cache_size < 1)
+        {
+          error ("audiowmark: --cache-size needs to be at least 1\n");
+          return 1;
+        }
+      Key key = parse_key (ap);
+      args = parse_positional (ap);
+      return hls_serve (key, socket_path, max_jobs, cache_size);
+    }
   else if (ap.parse_cmd ("hls-prepare"))
     {
+      parse_shared_options (ap);
+      parse_strength (ap);
+
       ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
 
+      vector<string> variants;
+      string variants_str;
+      if (ap.parse_opt ("--variants", variants_str))
+        {
+          size_t pos = 0;
+          while (pos <= variants_str.size())
+            {
+              size_t end = variants_str.find (',', pos);
+              if (end == string::npos)
+                end = variants_str.size();
+
+              variants.push_back (variants_str.substr (pos, end - pos));
+              if (parse_payload (variants.back()).empty())
+                return 1;
+              pos = end + 1;
+            }
+        }
+      Key key = parse_key (ap);
       args = parse_positional (ap, "input_dir", "output_dir", "playlist_name", "audio_master");
-      return hls_prepare (args[0], args[1], args[2], args[3]);
+      return hls_prepare (args[0], args[1], args[2], args[3], key, variants);
     }
   else if (ap.parse_cmd ("add"))
     {
       parse_shared_options (ap);
       parse_add_options (ap);
 
+      string batch_file;
+      if (ap.parse_opt ("--batch", batch_file))
+        {
+          if (Params::mark_native_rate)
+            {
+              error ("audiowmark: --native-rate can not be combined with --batch\n");
+              return 1;
+            }
+          if (Params::add_low_latency > 0)
+            {
+              error ("audiowmark: --low-latency can not be combined with --batch\n");
+              return 1;
+            }
+          Key key = parse_key (ap);
+          args = parse_positional (ap, "input_wav");
+          return add_watermark_batch (key, args[0], batch_file);
+        }
+      string reuse_file, regions, diff_file;
+      ap.parse_opt ("--reuse", reuse_file);
+      ap.parse_opt ("--regions", regions);
+      ap.parse_opt ("--diff", diff_file);
+      if (reuse_file != "" || regions != "" || diff_file != "")
+        {
+          if (reuse_file == "" || (regions == "" && diff_file == ""))
+            {
+              error ("audiowmark: --reuse needs --regions and/or --diff (and the other way around)\n");
+              return 1;
+            }
+          if (Params::add_low_latency > 0)
+            {
+              error ("audiowmark: --low-latency can not be combined with --reuse\n");
+              return 1;
+            }
+          vector<std::pair<double, double>> region_list;
+          if (regions != "")
+            region_list = parse_regions (regions);
+
+          Key key = parse_key (ap);
+          args = parse_positional (ap, "input_wav", "watermarked_wav", "message_hex");
+          return add_watermark_reuse (key, args[0], args[1], args[2], reuse_file, region_list, diff_file);
+        }
       Key key = parse_key (ap);
       args = parse_positional (ap, "input_wav", "watermarked_wav", "message_hex");
       return add_watermark (key, args[0], args[1], args[2]);
     }
   else if (ap.parse_cmd ("get"))
     {
+      limit_threads_by_memory (threads);
+
+      if (ap.parse_opt ("--screen"))
+        Params::get_screen = true;
+      bool from_index = ap.parse_opt ("--from-index");
+
       parse_shared_options (ap);
       parse_get_options (ap);
 
+      if (Params::get_screen && (Params::get_stream || Params::get_live))
+        {
+          error ("audiowmark: --screen can not be combined with --stream or --live\n");
+          return get_error_status();
+        }
+      if (!Params::ndjson_output.empty() && (Params::get_live || Params::get_screen || !Params::json_output.empty()))
+        {
+          error ("audiowmark: --ndjson can not be combined with --live, --screen or --json\n");
+          return get_error_status();
+        }
+
       vector<Key> key_list = parse_key_list (ap);
+
+      if (from_index)
+        {
+          if (!check_from_index_options())
+            return get_error_status();
+
+          args = parse_positional (ap, "index_file");
+          return finish_profile (get_watermark_from_index (key_list, args[0], /* no ber */ ""));
+        }
+
+      string batch;
+      if (ap.parse_opt ("--batch", batch))
+        {
+          if (Params::get_stream || Params::get_live || Params::get_screen || !Params::json_output.empty() || !Params::ndjson_output.empty() ||
+              Params::get_time_budget > 0 || Params::get_sample_every > 0 || Params::get_range_start >= 0 || Profile::enabled() || Profile::tracing())
+            {
+              error ("audiowmark: --stream, --live, --screen, --json, --ndjson, --time-budget, --sample-every, --range, --profile and --trace can not be combined with --batch\n");
+              return get_error_status();
+            }
+          int max_jobs = ThreadPool().n_threads();
+          if (ap.parse_opt ("--max-jobs", max_jobs) && max_jobs < 1)
+            {
+              error ("audiowmark: --max-jobs needs to be at least 1\n");
+              return get_error_status();
+            }
+          args = parse_positional (ap);
+          return get_watermark_batch (key_list, batch, max_jobs);
+        }
       args = parse_positional (ap, "watermarked_wav");
-      return get_watermark (key_list, args[0], /* no ber */ "");
+      return finish_profile (get_watermark (key_list, args[0], /* no ber */ ""));
     }
   else if (ap.parse_cmd ("cmp"))
     {
+      limit_threads_by_memory (threads);
+
       parse_shared_options (ap);
       parse_get_options (ap);
 
       ap.parse_opt ("--expect-matches", Params::expect_matches);
+      bool from_index = ap.parse_opt ("--from-index");
 
       vector<Key> key_list = parse_key_list (ap);
+      if (from_index)
+        {
+          if (!check_from_index_options())
+            return 1;
+
+          args = parse_positional (ap, "index_file", "message_hex");
+          return finish_profile (get_watermark_from_index (key_list, args[0], args[1]));
+        }
       args = parse_positional (ap, "watermarked_wav", "message_hex");
-      return get_watermark (key_list, args[0], args[1]);
+      return finish_profile (get_watermark (key_list, args[0], args[1]));
+    }
+  else if (ap.parse_cmd ("merge-results"))
+    {
+      ap.parse_opt ("--json", Params::json_output);
+
+      args = ap.remaining_args();
+      if (args.empty())
+        {
+          error ("audiowmark: usage: audiowmark merge-results [ --json <file> ] <part_json>...\n");
+          return 1;
+        }
+      for (const auto& arg : args)
+        {
+          if (is_option (arg))
+            {
+              error ("audiowmark: unsupported option '%s' for command 'merge-results' (use audiowmark -h)\n", arg.c_str());
+              return 1;
+            }
+        }
+      return merge_results (args);
+    }
+  else if (ap.parse_cmd ("index"))
+    {
+      int hop = Params::sync_search_step;
+      ap.parse_opt ("--hop", hop);
+
+      parse_shared_options (ap);
+
+      args = parse_positional (ap, "input_wav", "index_file");
+      return create_spectrum_index (args[0], args[1], hop);
+    }
+  else if (ap.parse_cmd ("video-add"))
+    {
+      parse_shared_options (ap);
+      parse_add_options (ap);
+
+      Key key = parse_key (ap);
+      args = parse_positional (ap, "input_video", "watermarked_video", "message_hex");
+      return video_add (key, args[0], args[1], args[2]);
+    }
+  else if (ap.parse_cmd ("video-get"))
+    {
+      parse_shared_options (ap);
+      parse_get_options (ap);
+
+      vector<Key> key_list = parse_key_list (ap);
+      args = parse_positional (ap, "watermarked_video");
+      return finish_profile (video_get (key_list, args[0]));
+    }
+  else if (ap.parse_cmd ("serve"))
+    {
+      parse_shared_options (ap);
+      parse_get_options (ap);
+
+      if (Params::get_stream || Params::get_live || Params::get_screen || Params::get_time_budget > 0 || Params::get_sample_every > 0 ||
+          Params::get_range_start >= 0 || Profile::enabled() || Profile::tracing())
+        {
+          error ("audiowmark: --stream, --live, --screen, --time-budget, --sample-every, --range, --profile and --trace are not supported by serve\n");
+          return 1;
+        }
+      string socket_path;
+      ap.parse_opt ("--socket", socket_path);
+
+      int max_jobs = ThreadPool().n_threads();
+      if (ap.parse_opt ("--max-jobs", max_jobs) && max_jobs < 1)
+        {
+          error ("audiowmark: --max-jobs needs to be at least 1\n");
+          return 1;
+        }
+      vector<Key> key_list = parse_key_list (ap);
+      args = parse_positional (ap);
+      return serve (key_list, socket_path, max_jobs);
+    }
+  else if (ap.parse_cmd ("bench-add"))
+    {
+      /* the grid options are lists, they are parsed before the shared options */
+      BenchAddGrid grid;
+      string s;
+      if (ap.parse_opt ("--strength", s))
+        {
+          for (const auto& item : split_list (s))
+            grid.strengths.push_back (atof_or_die (item));
+        }
+      if (ap.parse_opt ("--frames-per-bit", s))
+        {
+          for (const auto& item : split_list (s))
+            grid.frames_per_bit.push_back (atoi_or_die (item));
+        }
+      if (ap.parse_opt ("--resample-quality", s))
+        {
+          for (const auto& item : split_list (s))
+            grid.resample_qualities.push_back (parse_resample_quality (item));
+        }
+      ap.parse_opt ("--payload", grid.payload);
+      ap.parse_opt ("--codec", grid.codec);
+
+      string json_file;
+      ap.parse_opt ("--json", json_file);
+
+      parse_shared_options (ap);
+      parse_add_options (ap);
+
+      Key key = parse_key (ap);
+      args = parse_positional (ap, "input_wav");
+      return bench_add (key, args[0], grid, json_file);
     }
   else if (ap.parse_cmd ("gen-key"))
     {
@@ -990,6 +1716,19 @@ main (int argc, char **argv)
       args = parse_positional (ap, "key_file");
       return gen_key (args[0], key_name);
     }
+  else if (ap.parse_cmd ("fft-tune"))
+    {
+      int n_channels = 2;
+      ap.parse_opt ("--channels", n_channels);
+      if (n_channels < 1)
+        {
+          error ("audiowmark: unsupported number of channels %d\n", n_channels);
+          return 1;
+        }
+      bool patient = ap.parse_opt ("--patient");
+      args = parse_positional (ap, "wisdom_file");
+      return fft_tune (args[0], n_channels, patient);
+    }
   else if (ap.parse_cmd ("gentest"))
     {
       args = parse_positional (ap, "input_wav", "output_wav");
@@ -1031,10 +1770,12 @@ main (int argc, char **argv)
       parse_shared_options (ap);
       int bits = 16;
       ap.parse_opt ("--bits", bits);
+      float volume = 1;
+      ap.parse_opt ("--volume", volume);
 
       Key key = parse_key (ap);
       args = parse_positional (ap, "output_wav", "seconds", "sample_rate");
-      return test_gen_noise (key, args[0], atof_or_die (args[1].c_str()), atoi_or_die (args[2].c_str()), bits);
+      return test_gen_noise (key, args[0], atof_or_die (args[1].c_str()), atoi_or_die (args[2].c_str()), bits, volume);
     }
   else if (ap.parse_cmd ("test-change-speed"))
     {
@@ -1073,3 +1814,24 @@ main (int argc, char **argv)
   error ("audiowmark: error parsing commandline args (use audiowmark -h)\n");
   return 1;
 }
+
+int
+main (int argc, char **argv)
+{
+  Error err = Random::init();
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+  int rc = run_command (argc, argv);
+
+  /* gcrypt errors while running the command */
+  err = Random::check_errors();
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+  return rc;
+}
@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for the hot paths of audiowmark (make bench)
+ *
+ * Each benchmark runs until it took at least --min-time seconds, the results
+ * are written as JSON (in the format of google-benchmark, so the usual tools
+ * for comparing runs can be used).
+ */
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <random>
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "utils.hh"
+#include "wmcommon.hh"
+#include "convcode.hh"
+#include "shortcode.hh"
+#include "limiter.hh"
+#include "rawconverter.hh"
+#include "syncfinder.hh"
+#include "spectrumcache.hh"
+#include "wmspeed.hh"
+#include "libaudiowmark.hh"
+
+using std::string;
+using std::vector;
+
+namespace
+{
+
+struct BenchResult
+{
+  string  name;
+  size_t  iterations = 0;
+  double  ns_per_iteration = 0;
+  double  items_per_second = 0;
+  string  item_name;
+};
+
+class Bench
+{
+  double              m_min_time = 0.5;
+  string              m_filter;
+  vector<BenchResult> m_results;
+public:
+  Bench (double min_time, const string& filter) :
+    m_min_time (min_time),
+    m_filter (filter)
+  {
+  }
+  /* run func repeatedly, one call processes items_per_call items (frames, bits, ...) */
+  void
+  run (const string& name, const string& item_name, double items_per_call, const std::function<void()>& func)
+  {
+    if (!m_filter.empty() && name.find (m_filter) == string::npos)
+      return;
+
+    func(); // warm up (caches, plans, tables)
+
+    size_t iterations = 0;
+    double start = get_time(), end;
+    do
+      {
+        func();
+        iterations++;
+        end = get_time();
+      }
+    while (end - start < m_min_time);
+
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    result.ns_per_iteration = (end - start) * 1e9 / iterations;
+    result.items_per_second = items_per_call * iterations / (end - start);
+    result.item_name = item_name;
+    m_results.push_back (result);
+
+    fprintf (stderr, "%-32s %12.0f ns %14.1f %s/s\n", name.c_str(), result.ns_per_iteration, result.items_per_second, item_name.c_str());
+  }
+  string
+  json() const
+  {
+    string out = "{\n";
+    out += "  \"context\": {\n";
+    out += string_printf ("    \"executable\": \"benchmark\",\n");
+    out += string_printf ("    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+    out += string_printf ("    \"min_time\": %f\n", m_min_time);
+    out += "  },\n";
+    out += "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < m_results.size(); i++)
+      {
+        const BenchResult& r = m_results[i];
+        out += "    {\n";
+        out += string_printf ("      \"name\": \"%s\",\n", json_escape (r.name).c_str());
+        out += string_printf ("      \"iterations\": %zd,\n", r.iterations);
+        out += string_printf ("      \"real_time\": %f,\n", r.ns_per_iteration);
+        out += string_printf ("      \"time_unit\": \"ns\",\n");
+        out += string_printf ("      \"items_per_second\": %f,\n", r.items_per_second);
+        out += string_printf ("      \"label\": \"%s\"\n", json_escape (r.item_name).c_str());
+        out += string_printf ("    }%s\n", i + 1 < m_results.size() ? "," : "");
+      }
+    out += "  ]\n";
+    out += "}\n";
+    return out;
+  }
+};
+
+vector<float>
+gen_noise (size_t n_values, unsigned seed)
+{
+  std::mt19937 rng (seed);
+  std::uniform_real_distribution<float> dist (-0.5, 0.5);
+
+  vector<float> samples (n_values);
+  for (auto& s : samples)
+    s = dist (rng);
+  return samples;
+}
+
+/* soft input for the decoders: coded bits with some noise */
+vector<float>
+gen_soft_bits (const vector<int>& coded_bits, unsigned seed)
+{
+  std::mt19937 rng (seed);
+  std::normal_distribution<float> dist (0, 0.2);
+
+  vector<float> soft_bits;
+  for (auto b : coded_bits)
+    soft_bits.push_back ((b ? 1 : -1) + dist (rng));
+  return soft_bits;
+}
+
+vector<int>
+gen_bits (size_t n_bits, unsigned seed)
+{
+  std::mt19937 rng (seed);
+
+  vector<int> bits;
+  for (size_t i = 0; i < n_bits; i++)
+    bits.push_back (rng() & 1);
+  return bits;
+}
+
+void
+bench_fft (Bench& bench)
+{
+  const int n_channels = 2;
+  FFTAnalyzer fft_analyzer (n_channels);
+  vector<float> samples = gen_noise (Params::frame_size * n_channels, 1);
+  vector<std::complex<float>> fft_out (Params::frame_size / 2 + 1);
+
+  bench.run ("FFTAnalyzer::run_fft", "frames", 1, [&]() {
+    fft_analyzer.run_fft (samples, 0, 0, fft_out.data());
+  });
+
+  const size_t n_frames = FFTAnalyzer::max_batch_frames;
+  vector<float> batch_samples = gen_noise (Params::frame_size * n_frames * n_channels, 2);
+  vector<size_t> start_index;
+  for (size_t f = 0; f < n_frames; f++)
+    start_index.push_back (f * Params::frame_size);
+
+  bench.run ("FFTAnalyzer::run_fft_batch", "frames", n_frames, [&]() {
+    fft_analyzer.run_fft_batch (batch_samples, start_index.data(), n_frames);
+  });
+}
+
+void
+bench_conv_decode (Bench& bench)
+{
+  for (auto block_type : { ConvBlockType::a, ConvBlockType::ab })
+    {
+      vector<int>   bits = gen_bits (Params::payload_size, 3);
+      vector<float> soft_bits = gen_soft_bits (conv_encode (block_type, bits), 4);
+
+      const string name = block_type == ConvBlockType::a ? "conv_decode_soft/a" : "conv_decode_soft/ab";
+      bench.run (name, "bits", bits.size(), [&]() {
+        conv_decode_soft (block_type, soft_bits);
+      });
+    }
+}
+
+void
+bench_short_decode (Bench& bench)
+{
+  const size_t old_payload_size = Params::payload_size;
+  const bool   old_payload_short = Params::payload_short;
+
+  for (size_t k : { 12, 16, 20 })
+    {
+      Params::payload_size = k;
+      Params::payload_short = true;
+      short_code_init (k);
+
+      vector<int>   bits = gen_bits (k, 5);
+      vector<float> soft_bits = gen_soft_bits (short_encode (ConvBlockType::a, bits), 6);
+
+      bench.run (string_printf ("code_decode_soft/short%zd", k), "bits", k, [&]() {
+        code_decode_soft (ConvBlockType::a, soft_bits);
+      });
+    }
+  Params::payload_size = old_payload_size;
+  Params::payload_short = old_payload_short;
+}
+
+void
+bench_limiter (Bench& bench)
+{
+  Limiter limiter (2, 44100);
+  limiter.set_block_size_ms (Params::limiter_block_size_ms);
+  limiter.set_ceiling (Params::limiter_ceiling);
+
+  const size_t n_frames = 1024;
+  vector<float> samples = gen_noise (n_frames * 2, 7);
+  for (auto& s : samples)
+    s *= 2.5; // make sure the limiter has to do something
+  vector<float> out;
+
+  bench.run ("Limiter::process", "frames", n_frames, [&]() {
+    limiter.process (samples, out);
+  });
+}
+
+void
+bench_raw_converter (Bench& bench)
+{
+  const size_t n_values = 1024 * 2;
+  vector<float> samples = gen_noise (n_values, 8);
+
+  for (int bit_depth : { 16, 24, 32 })
+    {
+      RawFormat format (2, 44100, bit_depth);
+      Error err;
+      std::unique_ptr<RawConverter> converter (RawConverter::create (format, err));
+      if (err)
+        {
+          error ("benchmark: %s\n", err.message());
+          continue;
+        }
+      vector<unsigned char> bytes (n_values * bit_depth / 8);
+      vector<float> out (n_values);
+
+      bench.run (string_printf ("RawConverter::to_raw/s%d", bit_depth), "samples", n_values, [&]() {
+        converter->to_raw (samples.data(), bytes.data(), n_values);
+      });
+      bench.run (string_printf ("RawConverter::from_raw/s%d", bit_depth), "samples", n_values, [&]() {
+        converter->from_raw (bytes.data(), out.data(), n_values);
+      });
+    }
+}
+
+/* watermarked test signal, used for sync / speed / get benchmarks */
+vector<float>
+gen_watermarked (double seconds, int sample_rate)
+{
+  AudioWmark::Status status;
+  auto embedder = AudioWmark::Embedder::create ({}, status);
+  if (!status.ok)
+    {
+      error ("benchmark: %s\n", status.message.c_str());
+      exit (1);
+    }
+  vector<float> samples = gen_noise (size_t (seconds * sample_rate) * 2, 9), out;
+  status = embedder->embed ("0123456789abcdef0123456789abcdef", samples, 2, sample_rate, out);
+  if (!status.ok)
+    {
+      error ("benchmark: %s\n", status.message.c_str());
+      exit (1);
+    }
+  return out;
+}
+
+void
+bench_sync (Bench& bench, const vector<float>& watermarked)
+{
+  /* SyncFinder::search is dominated by sync_decode (and the sync fft) */
+  WavData wav_data (watermarked, 2, Params::mark_sample_rate, 16);
+  vector<Key> key_list (1);
+
+  bench.run ("SyncFinder::search/block", "frames", wav_data.n_frames(), [&]() {
+    SpectrumCache spectrum_cache (wav_data);
+    SyncFinder sync_finder;
+    sync_finder.search (key_list, wav_data, spectrum_cache, SyncFinder::Mode::BLOCK);
+  });
+}
+
+void
+bench_speed (Bench& bench, const vector<float>& watermarked)
+{
+  /* detect_speed is dominated by SpeedSync::compare */
+  WavData wav_data (watermarked, 2, Params::mark_sample_rate, 16);
+  vector<Key> key_list (1);
+
+  bench.run ("detect_speed", "frames", wav_data.n_frames(), [&]() {
+    vector<DetectSpeedResult> speed_results;
+    detect_speed (key_list, wav_data, false, speed_results);
+  });
+}
+
+void
+bench_end_to_end (Bench& bench, const vector<float>& watermarked)
+{
+  const int sample_rate = Params::mark_sample_rate;
+  const size_t n_frames = watermarked.size() / 2;
+
+  AudioWmark::Status status;
+  auto embedder = AudioWmark::Embedder::create ({}, status);
+  auto detector = AudioWmark::Detector::create ({}, status);
+  if (!status.ok)
+    {
+      error ("benchmark: %s\n", status.message.c_str());
+      return;
+    }
+  vector<float> samples = gen_noise (watermarked.size(), 10), out;
+
+  bench.run ("add", "frames", n_frames, [&]() {
+    embedder->embed ("0123456789abcdef0123456789abcdef", samples, 2, sample_rate, out);
+  });
+  bench.run ("get", "frames", n_frames, [&]() {
+    AudioWmark::Detector::Result result;
+    detector->detect (watermarked, 2, sample_rate, result);
+  });
+}
+
+void
+usage()
+{
+  printf ("usage: benchmark [--min-time <seconds>] [--filter <substring>] [--output <json_file>] [--seconds <signal_length>]\n");
+}
+
+}
+
+int
+main (int argc, char **argv)
+{
+  double min_time = 0.5;
+  double seconds = 30;
+  string filter;
+  string output;
+
+  for (int i = 1; i < argc; i++)
+    {
+      if (strcmp (argv[i], "--min-time") == 0 && i + 1 < argc)
+        min_time = atof (argv[++i]);
+      else if (strcmp (argv[i], "--filter") == 0 && i + 1 < argc)
+        filter = argv[++i];
+      else if (strcmp (argv[i], "--output") == 0 && i + 1 < argc)
+        output = argv[++i];
+      else if (strcmp (argv[i], "--seconds") == 0 && i + 1 < argc)
+        seconds = atof (argv[++i]);
+      else
+        {
+          usage();
+          return 1;
+        }
+    }
+  set_log_level (Log::WARNING);
+
+  Bench bench (min_time, filter);
+
+  bench_fft (bench);
+  bench_conv_decode (bench);
+  bench_short_decode (bench);
+  bench_limiter (bench);
+  bench_raw_converter (bench);
+
+  vector<float> watermarked = gen_watermarked (seconds, Params::mark_sample_rate);
+  bench_sync (bench, watermarked);
+  bench_speed (bench, watermarked);
+  bench_end_to_end (bench, watermarked);
+
+  const string json = bench.json();
+  if (output.empty())
+    {
+      fputs (json.c_str(), stdout);
+    }
+  else
+    {
+      FILE *file = fopen (output.c_str(), "w");
+      if (!file)
+        {
+          error ("benchmark: error opening output file '%s': %s\n", output.c_str(), strerror (errno));
+          return 1;
+        }
+      fputs (json.c_str(), file);
+      fclose (file);
+    }
+  return 0;
+}
@@ -20,7 +20,10 @@
 
 #include <array>
 #include <algorithm>
+
 #include <assert.h>
+#include <math.h>
+#include <string.h>
 
 using std::vector;
 using std::string;
@@ -124,8 +127,37 @@ conv_encode (ConvBlockType block_type, const vector<int>& in_bits)
   return out_vec;
 }
 
-/* decode using viterbi algorithm */
-vector<int>
+static inline uint32_t
+float_bits (float f)
+{
+  uint32_t i;
+  memcpy (&i, &f, sizeof (i));
+  return i;
+}
+
+static inline float
+bits_float (uint32_t i)
+{
+  float f;
+  memcpy (&f, &i, sizeof (f));
+  return f;
+}
+
+/*
+ * decode using viterbi algorithm
+ *
+ * Each new state n has two possible predecessor states, (n >> 1) and
+ * (n >> 1) | (state_count / 2), and the input bit for the transition is
+ * always (n & 1). So for each step, we compute the error for both
+ * predecessors, select the better one and store one survivor bit per state
+ * (0: first predecessor, 1: second predecessor).
+ *
+ * The loops are written so that they can be vectorized by the compiler
+ * (no branches, bit masks instead of conditional floating point values),
+ * and the error terms are added in the same order as in a straight forward
+ * implementation, so the result doesn't depend on vectorization.
+ */
+AUDIOWMARK_EXTRA_OPT vector<int>
 conv_decode_soft (ConvBlockType block_type, const vector<float>& coded_bits, float *error_out)
 {
   auto generators = get_block_type_generators (block_type);
@@ -133,75 +165,77 @@ conv_decode_soft (ConvBlockType block_type, const vector<float>& coded_bits, flo
   vector<int> decoded_bits;
 
   assert (coded_bits.size() % rate == 0);
+  const size_t n_steps = coded_bits.size() / rate;
 
-  struct StateEntry
-  {
-    int   last_state;
-    float delta;
-    int   bit;
-  };
-  vector<vector<StateEntry>> error_count;
-  for (size_t i = 0; i < coded_bits.size() + rate; i += rate) /* 1 extra element */
-    error_count.emplace_back (state_count, StateEntry {0, -1, 0});
-
-  error_count[0][0].delta = 0; /* start state */
-
-  /* precompute state -> output bits table */
-  vector<float> state2bits;
+  /* precompute state -> output bits table, bit p is the output of generator p */
+  vector<uint32_t> state2bits (state_count);
   for (unsigned int state = 0; state < state_count; state++)
     {
       for (size_t p = 0; p < generators.size(); p++)
-        {
-          int out_bit = parity (state & generators[p]);
-          state2bits.push_back (out_bit);
-        }
+        state2bits[state] |= parity (state & generators[p]) << p;
     }
 
-  for (size_t i = 0; i < coded_bits.size(); i += rate)
-    {
-      vector<StateEntry>& old_table = error_count[i / rate];
-      vector<StateEntry>& new_table = error_count[i / rate + 1];
+  /* error for states which are not reachable from state=0 at time=0 is infinite */
+  vector<float> delta (state_count, INFINITY);
+  vector<float> delta0 (state_count);
+  vector<float> delta1 (state_count);
+  delta[0] = 0; /* start state */
+
+  constexpr unsigned int half_state_count = state_count / 2;
+  constexpr unsigned int survivor_words = state_count / 32;
+  vector<uint32_t> survivors (n_steps * survivor_words);
+  vector<uint32_t> selected (state_count);
 
+  for (size_t step = 0; step < n_steps; step++)
+    {
       for (unsigned int state = 0; state < state_count; state++)
         {
-          /* this check enforces that we only consider states reachable from state=0 at time=0*/
-          if (old_table[state].delta >= 0)
+          delta0[state] = delta[state >> 1];
+          delta1[state] = delta[(state >> 1) + half_state_count];
+        }
+      for (size_t p = 0; p < rate; p++)
+        {
+          /* decoding error weight for this bit; if input is only 0.0 and 1.0, this is the hamming distance */
+          const float    cbit = coded_bits[step * rate + p];
+          const uint32_t err0 = float_bits (cbit * cbit);
+          const uint32_t err1 = float_bits ((cbit - 1) * (cbit - 1));
+
+          for (unsigned int state = 0; state < state_count; state++)
             {
-              for (int bit = 0; bit < 2; bit++)
-                {
-                  int   new_state = ((state << 1) | bit) & state_mask;
-
-                  float delta = old_table[state].delta;
-                  int   sbit_pos = new_state * rate;
-
-                  for (size_t p = 0; p < rate; p++)
-                    {
-                      const float cbit = coded_bits[i + p];
-                      const float sbit = state2bits[sbit_pos + p];
-
-                      /* decoding error weight for this bit; if input is only 0.0 and 1.0, this is the hamming distance */
-                      delta += (cbit - sbit) * (cbit - sbit);
-                    }
-
-                  if (delta < new_table[new_state].delta || new_table[new_state].delta < 0) /* better match with this link? replace entry */
-                    {
-                      new_table[new_state].delta      = delta;
-                      new_table[new_state].last_state = state;
-                      new_table[new_state].bit        = bit;
-                    }
-                }
+              const uint32_t mask = -((state2bits[state] >> p) & 1);
+              const float    err  = bits_float ((err1 & mask) | (err0 & ~mask));
+
+              delta0[state] += err;
+              delta1[state] += err;
             }
         }
+      /* add-compare-select: only use the second predecessor if it is a better match */
+      for (unsigned int state = 0; state < state_count; state++)
+        {
+          const uint32_t mask = -uint32_t (delta1[state] < delta0[state]);
+
+          delta[state] = bits_float ((float_bits (delta1[state]) & mask) | (float_bits (delta0[state]) & ~mask));
+          selected[state] = mask & 1;
+        }
+      uint32_t *step_survivors = &survivors[step * survivor_words];
+      for (unsigned int word = 0; word < survivor_words; word++)
+        {
+          uint32_t bits = 0;
+          for (unsigned int b = 0; b < 32; b++)
+            bits |= selected[word * 32 + b] << b;
+          step_survivors[word] = bits;
+        }
     }
 
   unsigned int state = 0;
   if (error_out)
-    *error_out = error_count.back()[state].delta / coded_bits.size();
-  for (size_t idx = error_count.size() - 1; idx > 0; idx--)
+    *error_out = delta[state] / coded_bits.size();
+  for (size_t step = n_steps; step > 0; step--)
     {
-      decoded_bits.push_back (error_count[idx][state].bit);
+      decoded_bits.push_back (state & 1);
 
-      state = error_count[idx][state].last_state;
+      const uint32_t survivor = (survivors[(step - 1) * survivor_words + state / 32] >> (state % 32)) & 1;
+      state = (state >> 1) | (survivor * half_state_count);
     }
   std::reverse (decoded_bits.begin(), decoded_bits.end());
 
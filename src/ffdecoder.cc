@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "ffdecoder.hh"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+using std::string;
+using std::vector;
+using std::min;
+
+namespace
+{
+
+/* input file with libavformat context, closed automatically */
+class FFInput
+{
+public:
+  AVFormatContext *fmt_ctx = nullptr;
+
+  ~FFInput()
+  {
+    avformat_close_input (&fmt_ctx);
+  }
+  Error
+  open (const string& filename, const char *format)
+  {
+    av_log_set_level (AV_LOG_ERROR);
+
+    const AVInputFormat *input_format = nullptr;
+    if (format)
+      {
+        input_format = av_find_input_format (format);
+        if (!input_format)
+          return Error (string_printf ("unsupported input format '%s'", format));
+      }
+    int ret = avformat_open_input (&fmt_ctx, filename.c_str(), input_format, nullptr);
+    if (ret < 0)
+      return Error (string_printf ("%s: %s", filename.c_str(), av_err2str (ret)));
+
+    ret = avformat_find_stream_info (fmt_ctx, nullptr);
+    if (ret < 0)
+      return Error (string_printf ("%s: could not find stream info: %s", filename.c_str(), av_err2str (ret)));
+
+    return Error::Code::NONE;
+  }
+};
+
+/* decoder with interleaved float output */
+class FFAudioDecoder
+{
+  AVCodecContext *m_dec = nullptr;
+  SwrContext     *m_swr_ctx = nullptr;
+  AVFrame        *m_frame = nullptr;
+  vector<float>   m_buffer;
+public:
+  ~FFAudioDecoder()
+  {
+    avcodec_free_context (&m_dec);
+    swr_free (&m_swr_ctx);
+    av_frame_free (&m_frame);
+  }
+  Error
+  open (const AVStream *st)
+  {
+    const AVCodec *codec = avcodec_find_decoder (st->codecpar->codec_id);
+    if (!codec)
+      return Error (string_printf ("could not find decoder for '%s'", avcodec_get_name (st->codecpar->codec_id)));
+
+    m_dec = avcodec_alloc_context3 (codec);
+    if (!m_dec)
+      return Error ("could not alloc a decoding context");
+
+    int ret = avcodec_parameters_to_context (m_dec, st->codecpar);
+    if (ret < 0)
+      return Error ("could not copy the stream parameters");
+
+    ret = avcodec_open2 (m_dec, codec, nullptr);
+    if (ret < 0)
+      return Error (string_printf ("could not open audio codec: %s", av_err2str (ret)));
+
+    m_frame = av_frame_alloc();
+    if (!m_frame)
+      return Error ("error allocating an audio frame");
+
+    return Error::Code::NONE;
+  }
+  int
+  n_channels() const
+  {
+    return m_dec->ch_layout.nb_channels;
+  }
+  int
+  sample_rate() const
+  {
+    return m_dec->sample_rate;
+  }
+  /* decode pkt (nullptr: flush decoder) and append the samples to out */
+  Error
+  decode (const AVPacket *pkt, vector<float>& out)
+  {
+    int ret = avcodec_send_packet (m_dec, pkt);
+    if (ret < 0 && ret != AVERROR_EOF)
+      return Error (string_printf ("error decoding audio packet: %s", av_err2str (ret)));
+
+    while ((ret = avcodec_receive_frame (m_dec, m_frame)) >= 0)
+      {
+        if (!m_swr_ctx)
+          {
+            ret = swr_alloc_set_opts2 (&m_swr_ctx,
+                                       &m_frame->ch_layout, AV_SAMPLE_FMT_FLT, m_frame->sample_rate,
+                                       &m_frame->ch_layout, AVSampleFormat (m_frame->format), m_frame->sample_rate,
+                                       0, nullptr);
+            if (ret < 0 || swr_init (m_swr_ctx) < 0)
+              return Error ("failed to initialize the sample format conversion");
+          }
+        const size_t n_values = size_t (m_frame->nb_samples) * m_frame->ch_layout.nb_channels;
+        const size_t pos = out.size();
+
+        /* convert directly into the output vector */
+        out.resize (pos + n_values);
+        uint8_t *out_data = reinterpret_cast<uint8_t *> (out.data() + pos);
+        ret = swr_convert (m_swr_ctx, &out_data, m_frame->nb_samples, (const uint8_t **) m_frame->extended_data, m_frame->nb_samples);
+        if (ret < 0)
+          return Error ("error while converting");
+
+        out.resize (pos + size_t (ret) * m_frame->ch_layout.nb_channels);
+        av_frame_unref (m_frame);
+      }
+    if (ret != AVERROR (EAGAIN) && ret != AVERROR_EOF)
+      return Error (string_printf ("error decoding audio frame: %s", av_err2str (ret)));
+
+    return Error::Code::NONE;
+  }
+};
+
+}
+
+Error
+ff_probe (const string& filename, FFStreamInfo& info)
+{
+  FFInput input;
+  Error err = input.open (filename, nullptr);
+  if (err)
+    return err;
+
+  info = FFStreamInfo();
+  info.n_streams = input.fmt_ctx->nb_streams;
+  if (!info.n_streams)
+    return Error::Code::NONE;
+
+  const AVStream *st = input.fmt_ctx->streams[0];
+  info.codec_name = avcodec_get_name (st->codecpar->codec_id);
+  info.n_channels = st->codecpar->ch_layout.nb_channels;
+
+  char layout[256];
+  if (av_channel_layout_describe (&st->codecpar->ch_layout, layout, sizeof (layout)) > 0)
+    info.channel_layout = layout;
+
+  if (st->start_time != AV_NOPTS_VALUE)
+    info.start_time = string_printf ("%f", st->start_time * av_q2d (st->time_base));
+
+  return Error::Code::NONE;
+}
+
+Error
+ff_decode_audio (const string& filename, const char *format, WavData& out_wav_data)
+{
+  FFInput input;
+  Error err = input.open (filename, format);
+  if (err)
+    return err;
+
+  const int stream_index = av_find_best_stream (input.fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+  if (stream_index < 0)
+    return Error (string_printf ("%s: no audio stream found", filename.c_str()));
+
+  FFAudioDecoder decoder;
+  err = decoder.open (input.fmt_ctx->streams[stream_index]);
+  if (err)
+    return err;
+
+  AVPacket *pkt = av_packet_alloc();
+  if (!pkt)
+    return Error ("could not allocate AVPacket");
+
+  vector<float> samples;
+  int ret;
+  while ((ret = av_read_frame (input.fmt_ctx, pkt)) >= 0)
+    {
+      if (pkt->stream_index == stream_index)
+        err = decoder.decode (pkt, samples);
+      av_packet_unref (pkt);
+      if (err)
+        break;
+    }
+  av_packet_free (&pkt);
+  if (err)
+    return err;
+  if (ret != AVERROR_EOF)
+    return Error (string_printf ("%s: read error: %s", filename.c_str(), av_err2str (ret)));
+
+  err = decoder.decode (nullptr, samples);
+  if (err)
+    return err;
+
+  /* same bit depth as ffmpeg -f wav output (pcm_s16le) */
+  out_wav_data = WavData (samples, decoder.n_channels(), decoder.sample_rate(), 16);
+  return Error::Code::NONE;
+}
+
+struct FFAudioInputStream::Impl
+{
+  FFInput        input;
+  FFAudioDecoder decoder;
+  int            stream_index = -1;
+  AVPacket      *pkt = nullptr;
+  PacketFunc     packet_func;
+  vector<float>  buffer;          // decoded samples, not yet returned by read_frames()
+  size_t         buffer_pos = 0;  // in values
+  bool           eof = false;
+
+  ~Impl()
+  {
+    av_packet_free (&pkt);
+  }
+  /* read the next packet from the file, decode it if it belongs to the audio stream */
+  Error
+  read_packet()
+  {
+    int ret = av_read_frame (input.fmt_ctx, pkt);
+    if (ret == AVERROR_EOF)
+      {
+        eof = true;
+        return decoder.decode (nullptr, buffer);
+      }
+    if (ret < 0)
+      return Error (string_printf ("read error: %s", av_err2str (ret)));
+
+    Error err;
+    if (pkt->stream_index == stream_index)
+      err = decoder.decode (pkt, buffer);
+    else if (packet_func)
+      err = packet_func (pkt);
+    av_packet_unref (pkt);
+    return err;
+  }
+};
+
+FFAudioInputStream::FFAudioInputStream() :
+  impl (new Impl())
+{
+}
+
+FFAudioInputStream::~FFAudioInputStream()
+{
+}
+
+Error
+FFAudioInputStream::open (const string& filename)
+{
+  Error err = impl->input.open (filename, nullptr);
+  if (err)
+    return err;
+
+  AVFormatContext *fmt_ctx = impl->input.fmt_ctx;
+  for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+    {
+      if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        {
+          if (impl->stream_index >= 0)
+            return Error (string_printf ("%s: more than one audio stream found", filename.c_str()));
+          impl->stream_index = i;
+        }
+    }
+  if (impl->stream_index < 0)
+    return Error (string_printf ("%s: no audio stream found", filename.c_str()));
+
+  err = impl->decoder.open (fmt_ctx->streams[impl->stream_index]);
+  if (err)
+    return err;
+
+  impl->pkt = av_packet_alloc();
+  if (!impl->pkt)
+    return Error ("could not allocate AVPacket");
+
+  return Error::Code::NONE;
+}
+
+void
+FFAudioInputStream::set_packet_func (const PacketFunc& packet_func)
+{
+  impl->packet_func = packet_func;
+}
+
+AVFormatContext *
+FFAudioInputStream::format_context() const
+{
+  return impl->input.fmt_ctx;
+}
+
+int
+FFAudioInputStream::audio_stream_index() const
+{
+  return impl->stream_index;
+}
+
+Error
+FFAudioInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  const size_t n_values = count * n_channels();
+
+  while (impl->buffer.size() - impl->buffer_pos < n_values && !impl->eof)
+    {
+      /* drop the samples that have already been returned before the buffer grows */
+      if (impl->buffer_pos)
+        {
+          impl->buffer.erase (impl->buffer.begin(), impl->buffer.begin() + impl->buffer_pos);
+          impl->buffer_pos = 0;
+        }
+      Error err = impl->read_packet();
+      if (err)
+        return err;
+    }
+  const size_t n = min (n_values, impl->buffer.size() - impl->buffer_pos);
+  std::copy (impl->buffer.begin() + impl->buffer_pos, impl->buffer.begin() + impl->buffer_pos + n, samples);
+  impl->buffer_pos += n;
+
+  frames_read = n / n_channels();
+  return Error::Code::NONE;
+}
+
+Error
+FFAudioInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  size_t frames_read;
+
+  samples.resize (count * n_channels());
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * n_channels());
+  return err;
+}
+
+int
+FFAudioInputStream::bit_depth() const
+{
+  /* same bit depth as ffmpeg -f wav output (pcm_s16le) */
+  return 16;
+}
+
+int
+FFAudioInputStream::sample_rate() const
+{
+  return impl->decoder.sample_rate();
+}
+
+int
+FFAudioInputStream::n_channels() const
+{
+  return impl->decoder.n_channels();
+}
+
+size_t
+FFAudioInputStream::n_frames() const
+{
+  /* the container duration is not exact, so the length is only known at eof */
+  return N_FRAMES_UNKNOWN;
+}
+
+Encoding
+FFAudioInputStream::encoding() const
+{
+  return Encoding::SIGNED;
+}
+
+Error
+ff_audio_stream_size (const string& filename, size_t& size)
+{
+  FFInput input;
+  Error err = input.open (filename, nullptr);
+  if (err)
+    return err;
+
+  const int stream_index = av_find_best_stream (input.fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+  if (stream_index < 0)
+    return Error (string_printf ("%s: no audio stream found", filename.c_str()));
+
+  AVPacket *pkt = av_packet_alloc();
+  if (!pkt)
+    return Error ("could not allocate AVPacket");
+
+  size = 0;
+  int ret;
+  while ((ret = av_read_frame (input.fmt_ctx, pkt)) >= 0)
+    {
+      if (pkt->stream_index == stream_index)
+        {
+          /* packets without ADTS header get a 7 byte header in an ADTS file */
+          const bool adts = pkt->size >= 2 && pkt->data[0] == 0xff && (pkt->data[1] & 0xf0) == 0xf0;
+          size += pkt->size + (adts ? 0 : 7);
+        }
+      av_packet_unref (pkt);
+    }
+  av_packet_free (&pkt);
+  if (ret != AVERROR_EOF)
+    return Error (string_printf ("%s: read error: %s", filename.c_str(), av_err2str (ret)));
+
+  return Error::Code::NONE;
+}
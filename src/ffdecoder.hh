@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_FF_DECODER_HH
+#define AUDIOWMARK_FF_DECODER_HH
+
+#include <string>
+#include <memory>
+#include <functional>
+
+#include "utils.hh"
+#include "wavdata.hh"
+#include "audiostream.hh"
+
+struct AVFormatContext;
+struct AVPacket;
+
+/*
+ * In-process replacements for the ffmpeg / ffprobe command line tools, used
+ * by hls-prepare and hls-add. Using libavformat / libavcodec directly avoids
+ * starting subprocesses and writing temporary files.
+ */
+struct FFStreamInfo
+{
+  int         n_streams = 0;
+  std::string codec_name;
+  int         n_channels = 0;
+  std::string channel_layout;
+  std::string start_time;     // in seconds, empty if unknown
+};
+
+/* properties of the first stream of filename (like ffprobe -show_streams) */
+Error ff_probe (const std::string& filename, FFStreamInfo& info);
+
+/* decode the audio of filename (format: libavformat input format name, nullptr: auto detect) */
+Error ff_decode_audio (const std::string& filename, const char *format, WavData& out_wav_data);
+
+/* number of bytes of the compressed audio stream, as it would be stored in an ADTS file */
+Error ff_audio_stream_size (const std::string& filename, size_t& size);
+
+/*
+ * Reads the audio stream of a media file (for instance a video) and decodes
+ * it while the file is read, so no intermediate wav file is needed. The
+ * file must contain exactly one audio stream. The packets of all other
+ * streams are passed to the packet function (if set), which can copy them
+ * to an output file (video-add).
+ */
+class FFAudioInputStream : public AudioInputStream
+{
+public:
+  /* the packet is unreferenced after the call, the function may move its contents */
+  typedef std::function<Error (AVPacket *pkt)> PacketFunc;
+
+  FFAudioInputStream();
+  ~FFAudioInputStream();
+
+  Error   open (const std::string& filename);
+  void    set_packet_func (const PacketFunc& packet_func);
+
+  /* demuxer context of the input file, and the index of the audio stream in it */
+  AVFormatContext *format_context() const;
+  int     audio_stream_index() const;
+
+  Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  int     n_channels() const override;
+  size_t  n_frames() const override;
+  Encoding encoding() const override;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+#endif /* AUDIOWMARK_FF_DECODER_HH */
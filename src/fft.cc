@@ -19,17 +19,22 @@
 
 #include <fftw3.h>
 
+#include <assert.h>
+
 #include <map>
 #include <mutex>
 
 using std::vector;
 using std::complex;
 using std::map;
+using std::string;
 
 static struct FFTPlanMap
 {
   std::map<size_t, fftwf_plan> fft_plan;
   std::map<size_t, fftwf_plan> ifft_plan;
+  std::map<std::pair<size_t, size_t>, fftwf_plan> fft_many_plan;
+  std::map<std::pair<size_t, size_t>, fftwf_plan> ifft_many_plan;
 
   ~FFTPlanMap()
   {
@@ -43,12 +48,58 @@ static struct FFTPlanMap
       };
     free_plans (fft_plan);
     free_plans (ifft_plan);
+    free_plans (fft_many_plan);
+    free_plans (ifft_many_plan);
   }
 } fft_plan_map;
 
 static std::mutex fft_planner_mutex;
+static bool       fft_have_wisdom = false;
 
-FFTProcessor::FFTProcessor (size_t N)
+/* plan_func is called with the planner flags and returns a plan (or nullptr) */
+template<class PlanFunc> static fftwf_plan
+create_plan (PlanFunc plan_func)
+{
+  fftwf_plan plan = nullptr;
+  if (fft_have_wisdom)
+    plan = plan_func (FFTW_MEASURE | FFTW_WISDOM_ONLY | FFTW_PRESERVE_INPUT);
+  if (!plan)
+    plan = plan_func (FFTW_ESTIMATE | FFTW_PRESERVE_INPUT);
+  return plan;
+}
+
+static fftwf_plan
+plan_r2c (int N, float *in, float *out, unsigned flags)
+{
+  return fftwf_plan_dft_r2c_1d (N, in, (fftwf_complex *) out, flags);
+}
+
+static fftwf_plan
+plan_c2r (int N, float *in, float *out, unsigned flags)
+{
+  return fftwf_plan_dft_c2r_1d (N, (fftwf_complex *) in, out, flags);
+}
+
+static fftwf_plan
+plan_r2c_many (int N, int count, float *in, complex<float> *out, unsigned flags)
+{
+  return fftwf_plan_many_dft_r2c (1, &N, count,
+                                  in, nullptr, 1, N,
+                                  (fftwf_complex *) out, nullptr, 1, N / 2 + 1,
+                                  flags);
+}
+
+static fftwf_plan
+plan_c2r_many (int N, int count, complex<float> *in, float *out, unsigned flags)
+{
+  return fftwf_plan_many_dft_c2r (1, &N, count,
+                                  (fftwf_complex *) in, nullptr, 1, N / 2 + 1,
+                                  out, nullptr, 1, N,
+                                  flags);
+}
+
+FFTProcessor::FFTProcessor (size_t N) :
+  m_n (N)
 {
   std::lock_guard<std::mutex> lg (fft_planner_mutex);
 
@@ -60,17 +111,15 @@ FFTProcessor::FFTProcessor (size_t N)
   /* plan if not done already */
   fftwf_plan& pfft = fft_plan_map.fft_plan[N];
   if (!pfft)
-    pfft = fftwf_plan_dft_r2c_1d (N, m_in, (fftwf_complex *) m_out, FFTW_ESTIMATE | FFTW_PRESERVE_INPUT);
+    pfft = create_plan ([&] (unsigned flags) { return plan_r2c (N, m_in, m_out, flags); });
 
   fftwf_plan& pifft = fft_plan_map.ifft_plan[N];
   if (!pifft)
-    pifft = fftwf_plan_dft_c2r_1d (N, (fftwf_complex *) m_in, m_out, FFTW_ESTIMATE | FFTW_PRESERVE_INPUT);
+    pifft = create_plan ([&] (unsigned flags) { return plan_c2r (N, m_in, m_out, flags); });
 
   /* store plan for size N as member variables */
   plan_fft = pfft;
   plan_ifft = pifft;
-
-  // we could add code for saving plans here, and use patient planning
 }
 
 FFTProcessor::~FFTProcessor()
@@ -91,16 +140,52 @@ FFTProcessor::ifft()
   fftwf_execute_dft_c2r (plan_ifft, (fftwf_complex *) m_in, m_out);
 }
 
+/* FFTW new-array execute needs the same alignment the plan was created with */
+bool
+FFTProcessor::can_use_array (const void *ptr)
+{
+  return fftwf_alignment_of ((float *) ptr) == fftwf_alignment_of (m_in);
+}
+
+void
+FFTProcessor::fft (const float *in, complex<float> *out)
+{
+  /* plans are created with FFTW_PRESERVE_INPUT, so in is not modified */
+  if (can_use_array (in) && can_use_array (out))
+    {
+      fftwf_execute_dft_r2c (plan_fft, const_cast<float *> (in), (fftwf_complex *) out);
+    }
+  else
+    {
+      if (in != m_in)
+        std::copy (in, in + m_n, m_in);
+      fft();
+      std::copy (m_out, m_out + m_n + 2, reinterpret_cast<float *> (out));
+    }
+}
+
+void
+FFTProcessor::ifft (const complex<float> *in, float *out)
+{
+  if (can_use_array (in) && can_use_array (out))
+    {
+      fftwf_execute_dft_c2r (plan_ifft, (fftwf_complex *) const_cast<complex<float> *> (in), out);
+    }
+  else
+    {
+      if (in != reinterpret_cast<complex<float> *> (m_in))
+        std::copy (in, in + m_n / 2 + 1, reinterpret_cast<complex<float> *> (m_in));
+      ifft();
+      std::copy (m_out, m_out + m_n, out);
+    }
+}
+
 vector<float>
 FFTProcessor::ifft (const vector<complex<float>>& in)
 {
   vector<float> out ((in.size() - 1) * 2);
 
-  /* complex<float> vector and m_out have the same layout in memory */
-  std::copy (in.begin(), in.end(), reinterpret_cast<complex<float> *> (m_in));
-  ifft();
-  std::copy (m_out, m_out + out.size(), &out[0]);
-
+  ifft (in.data(), out.data());
   return out;
 }
 
@@ -109,10 +194,102 @@ FFTProcessor::fft (const vector<float>& in)
 {
   vector<complex<float>> out (in.size() / 2 + 1);
 
-  /* complex<float> vector and m_out have the same layout in memory */
-  std::copy (in.begin(), in.end(), m_in);
-  fft();
-  std::copy (m_out, m_out + out.size() * 2, reinterpret_cast<float *> (&out[0]));
-
+  fft (in.data(), out.data());
   return out;
 }
+
+FFTBatchProcessor::FFTBatchProcessor (size_t N, size_t max_count) :
+  m_n (N),
+  m_max_count (max_count),
+  m_in (N * max_count),
+  m_out ((N / 2 + 1) * max_count),
+  m_plans (max_count + 1),
+  m_iplans (max_count + 1)
+{
+}
+
+void
+FFTBatchProcessor::fft (size_t count)
+{
+  assert (count <= m_max_count);
+  if (!count)
+    return;
+
+  fftwf_plan& plan = m_plans[count];
+  if (!plan)
+    {
+      std::lock_guard<std::mutex> lg (fft_planner_mutex);
+
+      /* plans are shared between processors, the arrays always have AlignedArray alignment */
+      fftwf_plan& pmany = fft_plan_map.fft_many_plan[{ m_n, count }];
+      /* the planner doesn't modify the arrays here: it only estimates or uses wisdom */
+      if (!pmany)
+        pmany = create_plan ([&] (unsigned flags) { return plan_r2c_many (m_n, count, m_in.data(), m_out.data(), flags); });
+
+      plan = pmany;
+    }
+  fftwf_execute_dft_r2c (plan, m_in.data(), (fftwf_complex *) m_out.data());
+}
+
+void
+FFTBatchProcessor::ifft (size_t count)
+{
+  assert (count <= m_max_count);
+  if (!count)
+    return;
+
+  fftwf_plan& plan = m_iplans[count];
+  if (!plan)
+    {
+      std::lock_guard<std::mutex> lg (fft_planner_mutex);
+
+      fftwf_plan& pmany = fft_plan_map.ifft_many_plan[{ m_n, count }];
+      if (!pmany)
+        pmany = create_plan ([&] (unsigned flags) { return plan_c2r_many (m_n, count, m_out.data(), m_in.data(), flags); });
+
+      plan = pmany;
+    }
+  fftwf_execute_dft_c2r (plan, (fftwf_complex *) m_out.data(), m_in.data());
+}
+
+bool
+fft_import_wisdom (const string& filename)
+{
+  std::lock_guard<std::mutex> lg (fft_planner_mutex);
+
+  if (!fftwf_import_wisdom_from_filename (filename.c_str()))
+    return false;
+
+  fft_have_wisdom = true;
+  return true;
+}
+
+bool
+fft_export_wisdom (const string& filename)
+{
+  std::lock_guard<std::mutex> lg (fft_planner_mutex);
+
+  return fftwf_export_wisdom_to_filename (filename.c_str());
+}
+
+/* measuring overwrites the arrays, so this uses its own arrays and plans which are not kept */
+void
+fft_tune_plans (size_t N, const vector<size_t>& batch_counts, bool patient)
+{
+  std::lock_guard<std::mutex> lg (fft_planner_mutex);
+
+  const unsigned flags = (patient ? FFTW_PATIENT : FFTW_MEASURE) | FFTW_PRESERVE_INPUT;
+
+  AlignedArray<float> in (N + 2);
+  AlignedArray<float> out (N + 2);
+  fftwf_destroy_plan (plan_r2c (N, in.data(), out.data(), flags));
+  fftwf_destroy_plan (plan_c2r (N, in.data(), out.data(), flags));
+
+  for (auto count : batch_counts)
+    {
+      AlignedArray<float> many_in (N * count);
+      AlignedArray<complex<float>> many_out ((N / 2 + 1) * count);
+      fftwf_destroy_plan (plan_r2c_many (N, count, many_in.data(), many_out.data(), flags));
+    }
+  fft_have_wisdom = true;
+}
@@ -19,15 +19,86 @@
 #define AUDIOWMARK_FFT_HH
 
 #include <complex>
+#include <string>
 #include <vector>
+#include <new>
+#include <algorithm>
+
+#include <stdlib.h>
 #include <fftw3.h>
 
+/*
+ * zero initialized array with 64 byte alignment
+ *
+ * this is meant for buffers owned by the caller of the FFTProcessor fft/ifft
+ * functions: if input and output are aligned, FFTW can directly work on them
+ */
+template<class T>
+class AlignedArray
+{
+  T      *m_data = nullptr;
+  size_t  m_size = 0;
+public:
+  static constexpr size_t alignment = 64;
+
+  AlignedArray()
+  {
+  }
+  AlignedArray (size_t n)
+  {
+    resize (n);
+  }
+  AlignedArray (AlignedArray&& other) :
+    m_data (other.m_data),
+    m_size (other.m_size)
+  {
+    other.m_data = nullptr;
+    other.m_size = 0;
+  }
+  AlignedArray (const AlignedArray&) = delete;
+  AlignedArray& operator= (const AlignedArray&) = delete;
+  ~AlignedArray()
+  {
+    free (m_data);
+  }
+  /* the contents are not preserved if the size changes */
+  void
+  resize (size_t n)
+  {
+    if (n == m_size)
+      return;
+
+    free (m_data);
+    m_data = nullptr;
+    m_size = 0;
+
+    if (n)
+      {
+        void *ptr = nullptr;
+        if (posix_memalign (&ptr, alignment, n * sizeof (T)) != 0)
+          throw std::bad_alloc();
+
+        m_data = static_cast<T *> (ptr);
+        m_size = n;
+        std::fill_n (m_data, m_size, T());
+      }
+  }
+  T       *data()                         { return m_data; }
+  const T *data() const                   { return m_data; }
+  size_t   size() const                   { return m_size; }
+  T&       operator[] (size_t i)          { return m_data[i]; }
+  const T& operator[] (size_t i) const    { return m_data[i]; }
+};
+
 class FFTProcessor
 {
   fftwf_plan plan_fft;
   fftwf_plan plan_ifft;
   float *m_in = nullptr;
   float *m_out = nullptr;
+  size_t m_n = 0;
+
+  bool   can_use_array (const void *ptr);
 public:
   FFTProcessor (size_t N);
   ~FFTProcessor();
@@ -38,9 +109,50 @@ public:
   float *in()  { return m_in; }
   float *out() { return m_out; };
 
+  /* caller memory: in/out must not overlap, with aligned memory (see AlignedArray) no copy is needed */
+  void   fft (const float *in, std::complex<float> *out);
+  void   ifft (const std::complex<float> *in, float *out);
+
   /* high level (convenient) */
   std::vector<std::complex<float>> fft (const std::vector<float>& in);
   std::vector<float>               ifft (const std::vector<std::complex<float>>& in);
 };
 
+/*
+ * r2c fft of many blocks at once (using a FFTW plan_many plan)
+ *
+ * input:  count blocks of N values, stored one after another in in()
+ * output: count blocks of N / 2 + 1 values, stored one after another in out()
+ *
+ * ifft() is the c2r inverse: it transforms count blocks from out() to in()
+ */
+class FFTBatchProcessor
+{
+  const size_t                      m_n = 0;
+  const size_t                      m_max_count = 0;
+  AlignedArray<float>               m_in;
+  AlignedArray<std::complex<float>> m_out;
+  std::vector<fftwf_plan>           m_plans;
+  std::vector<fftwf_plan>           m_iplans;
+public:
+  FFTBatchProcessor (size_t N, size_t max_count);
+
+  void                 fft (size_t count);
+  void                 ifft (size_t count);
+  float               *in()  { return m_in.data(); }
+  std::complex<float> *out() { return m_out.data(); }
+  size_t               max_count() const { return m_max_count; }
+};
+
+/*
+ * FFTW wisdom: after importing wisdom, plans are created from the wisdom if
+ * possible (and estimated otherwise, like without wisdom)
+ *
+ * fft_tune_plans() measures the plans for N point transforms and batched
+ * transforms with batch_counts blocks, the results can be exported as wisdom
+ */
+bool fft_import_wisdom (const std::string& filename);
+bool fft_export_wisdom (const std::string& filename);
+void fft_tune_plans (size_t N, const std::vector<size_t>& batch_counts, bool patient);
+
 #endif /* AUDIOWMARK_FFT_HH */
@@ -17,9 +17,11 @@
 
 #include <string>
 #include <regex>
+#include <mutex>
+#include <memory>
+#include <algorithm>
 
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -29,6 +31,7 @@
 #include "sfoutputstream.hh"
 #include "wmcommon.hh"
 #include "wavdata.hh"
+#include "threadpool.hh"
 
 #include "config.h"
 
@@ -40,7 +43,8 @@ using std::min;
 
 #if !HAVE_FFMPEG
 int
-hls_prepare (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master)
+hls_prepare (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master,
+             const Key& key, const vector<string>& variants)
 {
   error ("audiowmark: hls support is not available in this build of audiowmark\n");
   return 1;
@@ -52,9 +56,18 @@ hls_add (const Key& key, const string& infile, const string& outfile, const stri
   error ("audiowmark: hls support is not available in this build of audiowmark\n");
   return 1;
 }
+
+int
+hls_serve (const Key& key, const string& socket_path, int max_jobs, size_t cache_size)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
 #else
 
 #include "hlsoutputstream.hh"
+#include "ffdecoder.hh"
+#include "memorystream.hh"
 
 static bool
 file_exists (const string& filename)
@@ -68,270 +81,355 @@ file_exists (const string& filename)
   return false;
 }
 
-static string
-args2string (const vector<string>& args)
+Error
+ff_decode (const string& filename, WavData& out_wav_data)
 {
-  string result;
-  bool first = true;
+  return ff_decode_audio (filename, "mpegts", out_wav_data);
+}
+
+/*
+ * Everything that is needed to watermark a prepared segment: the decoded
+ * audio (segment with context, from the embedded full.flac) and the segment
+ * variables. This doesn't depend on the payload, so hls-serve keeps it in
+ * memory for segments that are requested more than once - together with the
+ * watermark analysis of the audio, which replaces the audio in this case.
+ */
+struct HLSSegmentContext
+{
+  WavData audio;
+  int     n_channels = 0;
+  int     sample_rate = 0;
+  int     bit_depth = 0;
+  size_t  start_pos = 0;
+  size_t  prev_size = 0;
+  size_t  size = 0;
+  double  pts_start = 0;
+  int     bit_rate = 0;
+  string  channel_layout;
+
+  std::shared_ptr<const WatermarkAnalysis> analysis;
+};
+
+static Error
+load_segment_context (const string& infile, TSReader& reader, HLSSegmentContext& ctx)
+{
+  const TSReader::Entry *full_flac = reader.find ("full.flac");
+  if (!full_flac)
+    return Error (string_printf ("no embedded context found in %s", infile.c_str()));
+
+  SFInputStream in_stream;
+  Error err = in_stream.open (&full_flac->data);
+  if (err)
+    return err;
 
-  for (auto a : args)
+  err = ctx.audio.load (&in_stream);
+  if (err)
+    return err;
+
+  ctx.n_channels  = ctx.audio.n_channels();
+  ctx.sample_rate = ctx.audio.sample_rate();
+  ctx.bit_depth   = ctx.audio.bit_depth();
+
+  map<string, string> vars = reader.parse_vars ("vars");
+  for (auto var : { "start_pos", "prev_size", "size", "pts_start", "bit_rate", "channel_layout" })
     {
-      if (!first)
-        result += " ";
-      first = false;
-      result += a;
+      if (vars.find (var) == vars.end())
+        return Error (string_printf ("hls segment is missing value for required variable '%s'", var));
     }
-  return result;
+  ctx.start_pos      = atoi (vars["start_pos"].c_str());
+  ctx.prev_size      = atoi (vars["prev_size"].c_str());
+  ctx.size           = atoi (vars["size"].c_str());
+  ctx.pts_start      = atof (vars["pts_start"].c_str());
+  ctx.bit_rate       = atoi (vars["bit_rate"].c_str());
+  ctx.channel_layout = vars["channel_layout"];
+
+  return Error::Code::NONE;
 }
 
 static Error
-run (const vector<string>& args, vector<string> *pipe_out = nullptr)
+hls_add_context (const Key& key, const HLSSegmentContext& ctx, const string& outfile, const string& bits, int& bit_rate)
 {
-  auto report_error = [=] { error ("audiowmark: failed to execute %s\n", args2string (args).c_str()); };
+  size_t prev_ctx = min<size_t> (1024 * 3, ctx.prev_size);
 
-  char *argv[args.size() + 1];
-  for (size_t i = 0; i < args.size(); i++)
-    argv[i] = (char *) args[i].c_str();
-  argv[args.size()] = nullptr;
+  bit_rate = ctx.bit_rate;
+  if (Params::hls_bit_rate)  // command line option overrides vars bit-rate
+    bit_rate = Params::hls_bit_rate;
 
-  int pipe_fds[2];
-  if (pipe_out)
-    {
-      if (pipe (pipe_fds) == -1)
-        {
-          report_error();
-          return Error ("pipe() failed");
-        }
-    }
-  pid_t pid = fork();
-  if (pid < 0)
-    {
-      if (pipe_out)
-        {
-          close (pipe_fds[0]);
-          close (pipe_fds[1]);
-        }
-      report_error();
-      return Error ("fork() failed");
-    }
-  if (pid == 0) /* child process */
-    {
-      if (pipe_out)
-        {
-          // replace stdout with pipe
-          if (dup2 (pipe_fds[1], STDOUT_FILENO) == -1)
-            {
-              perror ("audiowmark: dup2() failed");
-              exit (127);
-            }
+  HLSOutputStream out_stream (ctx.n_channels, ctx.sample_rate, ctx.bit_depth);
 
-          // close remaining pipe fds
-          close (pipe_fds[0]);
-          close (pipe_fds[1]);
-        }
-      execvp (argv[0], argv);
-      perror ("audiowmark: execvp() failed");
+  out_stream.set_bit_rate (bit_rate);
+  out_stream.set_channel_layout (ctx.channel_layout);
 
-      // should not be reached in normal operation, so exec failed
-      exit (127);
-    }
+  /* ffmpeg aac encode adds one frame of latency - it would be possible to compensate for this
+   * by setting shift = 1024, but it can also be done by adjusting the presentation timestamp
+   */
+  const size_t shift = 0;
+  const size_t cut_aac_frames = (prev_ctx + shift) / 1024;
+  const size_t delete_input_start = ctx.prev_size - prev_ctx;
+  const size_t keep_aac_frames = ctx.size / 1024;
 
-  /* parent process */
-  if (pipe_out) /* capture child stdout */
-    {
-      close (pipe_fds[1]); // close pipe write fd
+  Error err = out_stream.open (outfile, cut_aac_frames, keep_aac_frames, ctx.pts_start, delete_input_start);
+  if (err)
+    return Error (string_printf ("error opening HLS output stream %s: %s", outfile.c_str(), err.message()));
 
-      FILE *f = fdopen (pipe_fds[0], "r");
-      if (!f)
-        {
-          close (pipe_fds[0]);
-          report_error();
-          return Error ("fdopen() pipe failed");
-        }
-      char buffer[1024];
-      while (fgets (buffer, 1024, f))
-        {
-          if (strlen (buffer) && buffer[strlen (buffer) - 1] == '\n')
-            buffer[strlen (buffer) - 1] = 0;
-          if (pipe_out)
-            pipe_out->push_back (buffer);
-        }
-      fclose (f);        // close pipe read fd
-    }
-  int status;
-  pid_t exited = waitpid (pid, &status, 0);
-  if (exited < 0)
-    {
-      report_error();
-      return Error ("waitpid() failed");
-    }
-  if (WIFEXITED (status))
+  int wm_rc;
+  if (ctx.analysis)
     {
-      int exit_status = WEXITSTATUS (status);
-      if (exit_status != 0)
-        {
-          report_error();
-          return Error (string_printf ("subprocess failed / exit status %d", exit_status));
-        }
+      wm_rc = add_analyzed_watermark (key, *ctx.analysis, &out_stream, bits);
     }
   else
     {
-      report_error();
-      return Error ("child didn't exit normally");
-    }
-  return Error::Code::NONE;
-}
+      const WavData& audio = ctx.audio;
+      MemoryInputStream in_stream (audio.samples().data(), audio.n_frames(), audio.n_channels(), audio.sample_rate());
 
-Error
-ff_decode (const string& filename, WavData& out_wav_data)
-{
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
-
-  if (!tmp_file)
-    return Error ("failed to create temp file");
-
-  Error err = run ({"ffmpeg", "-v", "error", "-nostdin", "-y", "-f",  "mpegts", "-i", filename, "-f", "wav", tmp_file_name});
-  if (err)
-    return err;
+      wm_rc = add_stream_watermark (key, &in_stream, &out_stream, bits, ctx.start_pos - ctx.prev_size);
+    }
+  if (wm_rc != 0)
+    return Error (string_printf ("watermarking hls segment %s failed", outfile.c_str()));
 
-  err = out_wav_data.load (tmp_file_name);
-  return err;
+  return Error::Code::NONE;
 }
 
 int
 hls_add (const Key& key, const string& infile, const string& outfile, const string& bits)
 {
   TSReader reader;
+  HLSSegmentContext ctx;
 
   Error err = reader.load (infile);
+  if (!err)
+    err = load_segment_context (infile, reader, ctx);
   if (err)
     {
-      error ("hls: %s\n", err.message());
+      error ("audiowmark: hls: %s\n", err.message());
       return 1;
     }
 
-  const TSReader::Entry *full_flac = reader.find ("full.flac");
-  if (!full_flac)
+  int bit_rate;
+  err = hls_add_context (key, ctx, outfile, bits, bit_rate);
+  if (err)
     {
-      error ("hls: no embedded context found in %s\n", infile.c_str());
+      error ("audiowmark: hls: %s\n", err.message());
       return 1;
     }
+  info ("AAC Bitrate:  %d\n", bit_rate);
+  return 0;
+}
 
-  SFInputStream in_stream;
-  err = in_stream.open (&full_flac->data);
-  if (err)
+/*
+ * Segment contexts of hls-serve, for the most recently used segments. The
+ * cache is content addressed: a segment is identified by the hash of its
+ * embedded audio and its variables, so a modified file is never served from
+ * the cache, and copies of a segment share one entry.
+ *
+ * Cached contexts contain the watermark analysis of the audio (which depends
+ * on the key), so only the payload dependent synthesis and the AAC encoding
+ * are done for each request.
+ */
+class HLSContextCache
+{
+  struct CacheEntry
+  {
+    std::shared_ptr<const HLSSegmentContext> ctx;
+    uint64_t                                 last_use = 0;
+  };
+  const Key&               m_key;
+  std::mutex               m_mutex;
+  map<string, CacheEntry>  m_entries;
+  uint64_t                 m_use_counter = 0;
+  const size_t             m_max_entries = 0;
+public:
+  HLSContextCache (const Key& key, size_t max_entries) :
+    m_key (key),
+    m_max_entries (max_entries)
+  {
+  }
+  Error
+  get (const string& infile, std::shared_ptr<const HLSSegmentContext>& ctx)
+  {
+    TSReader reader;
+    Error err = reader.load (infile);
+    if (err)
+      return err;
+
+    const TSReader::Entry *full_flac = reader.find ("full.flac");
+    const TSReader::Entry *vars = reader.find ("vars");
+    if (!full_flac || !vars)
+      return Error (string_printf ("no embedded context found in %s", infile.c_str()));
+
+    const string content_id = Random::sha256_hex (full_flac->data) + ":" + string (vars->data.begin(), vars->data.end());
     {
-      error ("hls: %s\n", err.message());
-      return 1;
+      std::lock_guard<std::mutex> lg (m_mutex);
+
+      auto it = m_entries.find (content_id);
+      if (it != m_entries.end())
+        {
+          it->second.last_use = ++m_use_counter;
+          ctx = it->second.ctx;
+          return Error::Code::NONE;
+        }
     }
+    /* load without holding the lock, so that other segments can be served in the meantime */
+    auto new_ctx = std::make_shared<HLSSegmentContext>();
+    err = load_segment_context (infile, reader, *new_ctx);
+    if (err)
+      return err;
 
-  map<string, string> vars = reader.parse_vars ("vars");
-  bool missing_vars = false;
+    const WavData& audio = new_ctx->audio;
+    MemoryInputStream in_stream (audio.samples().data(), audio.n_frames(), audio.n_channels(), audio.sample_rate());
+    err = analyze_watermark_input (m_key, &in_stream, new_ctx->start_pos - new_ctx->prev_size, new_ctx->analysis);
+    if (err)
+      return err;
+    new_ctx->audio = WavData(); // the analysis contains everything needed for watermarking
 
-  auto get_var = [&] (const std::string& var) {
-    auto it = vars.find (var);
-    if (it == vars.end())
+    std::lock_guard<std::mutex> lg (m_mutex);
+    if (m_max_entries)
       {
-        error ("audiowmark: hls segment is missing value for required variable '%s'\n", var.c_str());
-        missing_vars = true;
-        return "";
+        while (m_entries.size() >= m_max_entries)
+          {
+            auto lru = std::min_element (m_entries.begin(), m_entries.end(),
+                                         [] (const auto& a, const auto& b) { return a.second.last_use < b.second.last_use; });
+            m_entries.erase (lru);
+          }
+        CacheEntry& entry = m_entries[content_id];
+        entry.ctx      = new_ctx;
+        entry.last_use = ++m_use_counter;
       }
-    else
-      return it->second.c_str();
-  };
-  size_t start_pos = atoi (get_var ("start_pos"));
-  size_t prev_size = atoi (get_var ("prev_size"));
-  size_t size      = atoi (get_var ("size"));
-  double pts_start = atof (get_var ("pts_start"));
-  int    bit_rate  = atoi (get_var ("bit_rate"));
-  size_t prev_ctx  = min<size_t> (1024 * 3, prev_size);
+    ctx = new_ctx;
+    return Error::Code::NONE;
+  }
+};
 
-  string channel_layout = get_var ("channel_layout");
+/* hls-serve request: "<input_ts> <output_ts> <message_hex>" */
+static string
+hls_serve_request (const Key& key, HLSContextCache& cache, const string& request)
+{
+  vector<string> args;
+  string arg;
+  for (char c : request + " ")
+    {
+      if (isspace (c))
+        {
+          if (!arg.empty())
+            args.push_back (arg);
+          arg.clear();
+        }
+      else
+        {
+          arg += c;
+        }
+    }
+  if (args.size() != 3)
+    return "{ \"error\": \"request: expected <input_ts> <output_ts> <message_hex>\" }";
 
-  if (missing_vars)
-    return 1;
+  const string response = "{ \"output\": \"" + json_escape (args[1]) + "\"";
+  const double start_time = get_time();
 
-  if (Params::hls_bit_rate)  // command line option overrides vars bit-rate
-    bit_rate = Params::hls_bit_rate;
+  std::shared_ptr<const HLSSegmentContext> ctx;
+  Error err = cache.get (args[0], ctx);
+  if (!err)
+    {
+      int bit_rate;
+      err = hls_add_context (key, *ctx, args[1], args[2], bit_rate);
+    }
+  if (err)
+    return response + ", \"error\": \"" + json_escape (err.message()) + "\" }";
 
-  HLSOutputStream out_stream (in_stream.n_channels(), in_stream.sample_rate(), in_stream.bit_depth());
+  return response + string_printf (", \"time\": %.3f }", get_time() - start_time);
+}
 
-  out_stream.set_bit_rate (bit_rate);
-  out_stream.set_channel_layout (channel_layout);
+int
+hls_serve (const Key& key, const string& socket_path, int max_jobs, size_t cache_size)
+{
+  /* watermarking prints several info lines per segment, which is not useful for a server */
+  set_log_level (std::max (get_log_level(), Log::WARNING));
 
-  /* ffmpeg aac encode adds one frame of latency - it would be possible to compensate for this
-   * by setting shift = 1024, but it can also be done by adjusting the presentation timestamp
-   */
-  const size_t shift = 0;
-  const size_t cut_aac_frames = (prev_ctx + shift) / 1024;
-  const size_t delete_input_start = prev_size - prev_ctx;
-  const size_t keep_aac_frames = size / 1024;
+  HLSContextCache cache (key, cache_size);
+  return serve_requests (socket_path, max_jobs, [&] (const string& request) { return hls_serve_request (key, cache, request); });
+}
 
-  err = out_stream.open (outfile, cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
-  if (err)
-    {
-      error ("audiowmark: error opening HLS output stream %s: %s\n", outfile.c_str(), err.message());
-      return 1;
-    }
+/* name of the precomputed variant of a segment: "seg5.ts" -> "seg5.v0.ts" */
+static string
+variant_name (const string& segment, size_t index)
+{
+  const string suffix = string_printf (".v%zd", index);
 
-  int wm_rc = add_stream_watermark (key, &in_stream, &out_stream, bits, start_pos - prev_size);
-  if (wm_rc != 0)
-    return wm_rc;
+  const size_t dot = segment.rfind ('.');
+  if (dot == string::npos || segment.find ('/', dot) != string::npos)
+    return segment + suffix;
 
-  info ("AAC Bitrate:  %d\n", bit_rate);
-  return 0;
+  return segment.substr (0, dot) + suffix + segment.substr (dot);
 }
 
-Error
-bit_rate_from_m3u8 (const string& m3u8, const WavData& wav_data, int& bit_rate)
+/* watermark a prepared segment with each of the variant messages */
+static Error
+hls_prepare_variants (const Key& key, const string& segment_file, const vector<string>& variants)
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
-
-  if (!tmp_file)
-    return Error ("failed to create temp file");
+  TSReader reader;
+  HLSSegmentContext ctx;
 
-  Error err = run ({"ffmpeg", "-v", "error", "-nostdin", "-y", "-i", m3u8, "-c:a", "copy", "-f", "adts", tmp_file_name});
+  Error err = reader.load (segment_file);
+  if (!err)
+    err = load_segment_context (segment_file, reader, ctx);
   if (err)
     return err;
 
-  struct stat stat_buf;
-  if (stat (tmp_file_name.c_str(), &stat_buf) != 0)
+  /* the analysis is shared by all variants, so each variant only needs the synthesis and AAC encoding */
+  if (variants.size() > 1)
     {
-      return Error (string_printf ("failed to stat temporary aac file: %s", strerror (errno)));
+      const WavData& audio = ctx.audio;
+      MemoryInputStream in_stream (audio.samples().data(), audio.n_frames(), audio.n_channels(), audio.sample_rate());
+
+      err = analyze_watermark_input (key, &in_stream, ctx.start_pos - ctx.prev_size, ctx.analysis);
+      if (err)
+        return err;
     }
-  double seconds = double (wav_data.n_frames()) / wav_data.sample_rate();
-  bit_rate = stat_buf.st_size / seconds * 8;
+  for (size_t v = 0; v < variants.size(); v++)
+    {
+      if (file_exists (variant_name (segment_file, v)))
+        return Error (string_printf ("output file already exists: %s", variant_name (segment_file, v).c_str()));
+    }
+
+  ThreadPool thread_pool;
+  vector<Error> errors (variants.size());
+  for (size_t v = 0; v < variants.size(); v++)
+    {
+      thread_pool.add_job ([&, v]() {
+        int bit_rate;
+        errors[v] = hls_add_context (key, ctx, variant_name (segment_file, v), variants[v], bit_rate);
+      });
+    }
+  thread_pool.wait_all();
+
+  for (auto& e : errors)
+    if (e)
+      return e;
+
   return Error::Code::NONE;
 }
 
 Error
-load_audio_master (const string& filename, WavData& audio_master_data)
+bit_rate_from_m3u8 (const string& m3u8, const WavData& wav_data, int& bit_rate)
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
-
-  if (!tmp_file)
-    return Error ("failed to create temp file");
-
-  /* extract wav */
-  Error err = run ({"ffmpeg", "-v", "error", "-nostdin", "-y", "-i", filename, "-f", "wav", tmp_file_name});
-  if (err)
-    return err;
-
-  err = audio_master_data.load (tmp_file_name);
+  /* size of the AAC stream of all segments (like ffmpeg -i m3u8 -c:a copy -f adts) */
+  size_t aac_size;
+  Error err = ff_audio_stream_size (m3u8, aac_size);
   if (err)
     return err;
 
+  double seconds = double (wav_data.n_frames()) / wav_data.sample_rate();
+  bit_rate = aac_size / seconds * 8;
   return Error::Code::NONE;
 }
 
 Error
-probe_input_segment (const string& filename, map<string, string>& params)
+load_audio_master (const string& filename, WavData& audio_master_data)
+{
+  return ff_decode_audio (filename, nullptr, audio_master_data);
+}
+
+Error
+probe_input_segment (const string& filename, FFStreamInfo& info)
 {
   TSReader reader;
 
@@ -348,45 +446,18 @@ probe_input_segment (const string& filename, map<string, string>& params)
       return Error ("input for hls-prepare must not contain context");
     }
 
-  vector<string> format_out;
-  err = run ({"ffprobe", "-v", "error", "-print_format", "compact", "-show_streams", filename}, &format_out);
+  err = ff_probe (filename, info);
   if (err)
     {
       error ("audiowmark: hls: failed to validate input file: %s\n", filename.c_str());
       return err;
     }
-  for (auto o : format_out)
-    {
-      /* parse assignments stream|index=0|codec_name=aac|... */
-      string key, value;
-      bool in_key = true;
-      for (char c : '|' + o + '|')
-        {
-          if (c == '=')
-            {
-              in_key = false;
-            }
-          else if (c == '|')
-            {
-              params[key] = value;
-              in_key = true;
-              key = "";
-              value = "";
-            }
-          else
-            {
-              if (in_key)
-                key += c;
-              else
-                value += c;
-            }
-        }
-    }
   return Error::Code::NONE;
 }
 
 int
-hls_prepare (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master)
+hls_prepare (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master,
+             const Key& key, const vector<string>& variants)
 {
   string in_name = in_dir + "/" + filename;
   FILE *in_file = fopen (in_name.c_str(), "r");
@@ -462,49 +533,48 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
     }
   for (auto& segment : segments)
     {
-      map<string, string> params;
+      FFStreamInfo info;
       string segname = in_dir + "/" + segment.name;
 
-      Error err = probe_input_segment (segname, params);
+      Error err = probe_input_segment (segname, info);
       if (err)
         {
           error ("audiowmark: hls: %s\n", err.message());
           return 1;
         }
       /* validate input segment */
-      if (atoi (params["index"].c_str()) != 0)
+      if (info.n_streams != 1)
         {
           error ("audiowmark: hls segment '%s' contains more than one stream\n", segname.c_str());
           return 1;
         }
-      if (params["codec_name"] != "aac")
+      if (info.codec_name != "aac")
         {
           error ("audiowmark: hls segment '%s' is not encoded using AAC\n", segname.c_str());
           return 1;
         }
-      int segment_channels = atoi (params["channels"].c_str());
-      if (segment_channels != audio_master_data.n_channels())
+      if (info.n_channels != audio_master_data.n_channels())
         {
           error ("audiowmark: number of channels mismatch:\n - hls segment '%s' has %d channels\n - audio master '%s' has %d channels\n",
-                 segname.c_str(), segment_channels, audio_master.c_str(), audio_master_data.n_channels());
+                 segname.c_str(), info.n_channels, audio_master.c_str(), audio_master_data.n_channels());
           return 1;
         }
 
       /* get segment parameters */
-      if (params["channel_layout"].empty())
+      if (info.channel_layout.empty())
         {
           error ("audiowmark: hls segment '%s' has no channel_layout entry\n", segname.c_str());
           return 1;
         }
-      segment.vars["channel_layout"] = params["channel_layout"];
+      segment.vars["channel_layout"] = info.channel_layout;
 
       /* get start pts */
-      if (params["start_time"].empty())
+      if (info.start_time.empty())
         {
           error ("audiowmark: hls segment '%s' has no start_time entry\n", segname.c_str());
           return 1;
         }
-      segment.vars["pts_start"] = params["start_time"];
+      segment.vars["pts_start"] = info.start_time;
     }
 
   /* find bitrate for AAC encoder */
@@ -526,6 +596,8 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
     }
 
   info ("Segments:     %zd\n", segments.size());
+  if (variants.size())
+    info ("Variants:     %zd\n", variants.size());
   size_t start_pos = 0;
   for (auto& segment : segments)
     {
@@ -593,7 +665,7 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
       /* store everything we need in a mpegts file */
       TSWriter writer;
 
-      writer.append_data ("full.flac", full_flac_mem);
+      writer.append_data ("full.flac", std::move (full_flac_mem));
       writer.append_vars ("vars", segment.vars);
 
       string out_segment = out_dir + "/" + segment.name;
@@ -608,6 +680,21 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
           error ("audiowmark: processing hls segment %s failed: %s\n", segment.name.c_str(), err.message());
           return 1;
         }
+      if (variants.size())
+        {
+          /* the watermarking details of each variant are not useful here */
+          const Log log_level = get_log_level();
+          set_log_level (std::max (log_level, Log::WARNING));
+
+          err = hls_prepare_variants (key, out_segment, variants);
+
+          set_log_level (log_level);
+          if (err)
+            {
+              error ("audiowmark: generating variants of hls segment %s failed: %s\n", segment.name.c_str(), err.message());
+              return 1;
+            }
+        }
 
       /* start position for the next segment */
       start_pos += segment.size;
@@ -19,9 +19,12 @@
 #define AUDIOWMARK_HLS_HH
 
 #include <string>
+#include <vector>
 
 int hls_add (const Key& key, const std::string& infile, const std::string& outfile, const std::string& bits);
-int hls_prepare (const std::string& in_dir, const std::string& out_dir, const std::string& filename, const std::string& audio_master);
+int hls_serve (const Key& key, const std::string& socket_path, int max_jobs, size_t cache_size);
+int hls_prepare (const std::string& in_dir, const std::string& out_dir, const std::string& filename, const std::string& audio_master,
+                 const Key& key, const std::vector<std::string>& variants);
 
 Error ff_decode (const std::string& filename, WavData& out_wav_data);
 
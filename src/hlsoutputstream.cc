@@ -17,6 +17,9 @@
 
 #include "hlsoutputstream.hh"
 
+#include <map>
+#include <mutex>
+
 #undef av_err2str
 #define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
 
@@ -48,11 +51,79 @@ using std::vector;
 using std::string;
 using std::min;
 
+/*
+ * Encoder state that doesn't depend on the output file: the opened codec
+ * context, the input frames and the packet. A server encodes many segments
+ * with the same parameters, so after close() the state is kept in the
+ * HLSEncoderPool and reused by the next output stream with the same sample
+ * rate, channel layout and bit rate.
+ *
+ * The codec context itself is only reused if the encoder can be reset to
+ * its initial state (AV_CODEC_CAP_ENCODER_FLUSH); the output must never
+ * depend on segments that were encoded before.
+ */
+struct HLSEncoder
+{
+  string          key;
+  AVCodecContext *enc = nullptr;
+  AVFrame        *frame = nullptr;     // input frame in encoder sample format
+  AVFrame        *tmp_frame = nullptr; // interleaved float input frame (only if the encoder needs a conversion)
+  SwrContext     *swr_ctx = nullptr;
+  AVPacket       *pkt = nullptr;
+
+  ~HLSEncoder()
+  {
+    avcodec_free_context (&enc);
+    av_frame_free (&frame);
+    av_frame_free (&tmp_frame);
+    swr_free (&swr_ctx);
+    av_packet_free (&pkt);
+  }
+};
+
+class HLSEncoderPool
+{
+  static constexpr size_t max_idle = 32;
+
+  std::mutex                                         m_mutex;
+  std::multimap<string, std::unique_ptr<HLSEncoder>> m_idle;
+public:
+  static HLSEncoderPool&
+  the()
+  {
+    static HLSEncoderPool pool;
+    return pool;
+  }
+  std::unique_ptr<HLSEncoder>
+  take (const string& key)
+  {
+    std::lock_guard<std::mutex> lg (m_mutex);
+
+    auto it = m_idle.find (key);
+    if (it == m_idle.end())
+      return nullptr;
+
+    std::unique_ptr<HLSEncoder> encoder = std::move (it->second);
+    m_idle.erase (it);
+    return encoder;
+  }
+  void
+  give_back (std::unique_ptr<HLSEncoder> encoder)
+  {
+    std::lock_guard<std::mutex> lg (m_mutex);
+
+    if (m_idle.size() < max_idle)
+      {
+        const string key = encoder->key;
+        m_idle.emplace (key, std::move (encoder));
+      }
+  }
+};
+
 HLSOutputStream::HLSOutputStream (int n_channels, int sample_rate, int bit_depth) :
   m_bit_depth (bit_depth),
   m_sample_rate (sample_rate),
-  m_n_channels (n_channels),
-  m_audio_buffer (n_channels)
+  m_n_channels (n_channels)
 {
   av_log_set_level (AV_LOG_ERROR);
 }
@@ -74,39 +145,30 @@ HLSOutputStream::~HLSOutputStream()
   close();
 }
 
-/* Add an output stream. */
+/* create and open the codec context */
 Error
-HLSOutputStream::add_stream (const AVCodec **codec, enum AVCodecID codec_id)
+HLSOutputStream::create_encoder (const AVCodec *codec)
 {
-  /* find the encoder */
-  *codec = avcodec_find_encoder (codec_id);
-  if (!(*codec))
-    return Error (string_printf ("could not find encoder for '%s'", avcodec_get_name (codec_id)));
-
-  m_st = avformat_new_stream (m_fmt_ctx, NULL);
-  if (!m_st)
-    return Error ("could not allocate stream");
-
-  m_st->id = m_fmt_ctx->nb_streams - 1;
-
-  m_enc = avcodec_alloc_context3 (*codec);
-  if (!m_enc)
+  AVCodecContext *enc = avcodec_alloc_context3 (codec);
+  if (!enc)
     return Error ("could not alloc an encoding context");
 
-  if ((*codec)->type != AVMEDIA_TYPE_AUDIO)
+  m_encoder->enc = enc;
+
+  if (codec->type != AVMEDIA_TYPE_AUDIO)
     return Error ("codec type must be audio");
 
-  m_enc->sample_fmt  = (*codec)->sample_fmts ? (*codec)->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-  m_enc->bit_rate    = m_bit_rate;
-  m_enc->sample_rate = m_sample_rate;
-  if ((*codec)->supported_samplerates)
+  enc->sample_fmt  = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+  enc->bit_rate    = m_bit_rate;
+  enc->sample_rate = m_sample_rate;
+  if (codec->supported_samplerates)
     {
       bool match = false;
-      for (int i = 0; (*codec)->supported_samplerates[i]; i++)
+      for (int i = 0; codec->supported_samplerates[i]; i++)
         {
-          if ((*codec)->supported_samplerates[i] == m_sample_rate)
+          if (codec->supported_samplerates[i] == m_sample_rate)
             {
-              m_enc->sample_rate = m_sample_rate;
+              enc->sample_rate = m_sample_rate;
               match = true;
             }
         }
@@ -118,140 +180,157 @@ HLSOutputStream::add_stream (const AVCodec **codec, enum AVCodecID codec_id)
   AVChannelLayout channel_layout = { AVChannelOrder (0), };
   if (av_channel_layout_from_string (&channel_layout, m_channel_layout.c_str()) != 0)
     return Error (string_printf ("bad channel layout '%s'", m_channel_layout.c_str()));
-  av_channel_layout_uninit (&m_enc->ch_layout);
-  av_channel_layout_copy (&m_enc->ch_layout, &channel_layout);
-  if ((*codec)->ch_layouts)
+  av_channel_layout_uninit (&enc->ch_layout);
+  av_channel_layout_copy (&enc->ch_layout, &channel_layout);
+  if (codec->ch_layouts)
     {
-      av_channel_layout_uninit (&m_enc->ch_layout);
-      av_channel_layout_copy (&m_enc->ch_layout, &(*codec)->ch_layouts[0]);
-      for (int i = 0; (*codec)->ch_layouts[i].nb_channels; i++)
+      av_channel_layout_uninit (&enc->ch_layout);
+      av_channel_layout_copy (&enc->ch_layout, &codec->ch_layouts[0]);
+      for (int i = 0; codec->ch_layouts[i].nb_channels; i++)
         {
-          if (av_channel_layout_compare (&(*codec)->ch_layouts[i], &channel_layout) == 0) {
-            av_channel_layout_uninit (&m_enc->ch_layout);
-            av_channel_layout_copy (&m_enc->ch_layout, &(*codec)->ch_layouts[i]);
+          if (av_channel_layout_compare (&codec->ch_layouts[i], &channel_layout) == 0) {
+            av_channel_layout_uninit (&enc->ch_layout);
+            av_channel_layout_copy (&enc->ch_layout, &codec->ch_layouts[i]);
           }
         }
     }
-  if (av_channel_layout_compare (&channel_layout, &m_enc->ch_layout) != 0)
+  if (av_channel_layout_compare (&channel_layout, &enc->ch_layout) != 0)
     return Error (string_printf ("codec: unsupported channel layout '%s'", m_channel_layout.c_str()));
   av_channel_layout_uninit (&channel_layout);
-  m_st->time_base = (AVRational){ 1, m_enc->sample_rate };
 
   /* Some formats want stream headers to be separate. */
   if (m_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-    m_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  /* open it */
+  int ret = avcodec_open2 (enc, codec, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("could not open audio codec: %s", av_err2str (ret)));
 
   return Error::Code::NONE;
 }
 
-
-AVFrame *
-HLSOutputStream::alloc_audio_frame (AVSampleFormat sample_fmt, const AVChannelLayout *channel_layout, int sample_rate, int nb_samples, Error& err)
+/* get encoder state from the pool, or create what is missing */
+Error
+HLSOutputStream::open_encoder()
 {
-  AVFrame *frame = av_frame_alloc();
-
-  if (!frame)
+  const string key = string_printf ("%d:%s:%d:%d", m_sample_rate, m_channel_layout.c_str(), m_bit_rate,
+                                    m_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+  m_encoder = HLSEncoderPool::the().take (key);
+  if (!m_encoder)
     {
-      err = Error ("error allocating an audio frame");
-      return nullptr;
+      m_encoder.reset (new HLSEncoder());
+      m_encoder->key = key;
     }
+  if (!m_encoder->enc)
+    {
+      /* find the encoder */
+      const AVCodec *codec = avcodec_find_encoder (AV_CODEC_ID_AAC);
+      if (!codec)
+        return Error (string_printf ("could not find encoder for '%s'", avcodec_get_name (AV_CODEC_ID_AAC)));
 
-  frame->format = sample_fmt;
-  av_channel_layout_copy (&frame->ch_layout, channel_layout);
-  frame->sample_rate = sample_rate;
-  frame->nb_samples = nb_samples;
-
-  if (nb_samples)
+      Error err = create_encoder (codec);
+      if (err)
+        return err;
+    }
+  if (!m_encoder->frame)
     {
-      int ret = av_frame_get_buffer (frame, 0);
-      if (ret < 0)
+      AVCodecContext *enc = m_encoder->enc;
+
+      int nb_samples;
+      if (enc->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
+        nb_samples = 10000;
+      else
+        nb_samples = enc->frame_size;
+
+      Error err;
+      m_encoder->frame = alloc_audio_frame (enc->sample_fmt, &enc->ch_layout, enc->sample_rate, nb_samples, err);
+      if (err)
+        return err;
+
+      /* float samples are written directly into the encoder frame, other formats need a conversion */
+      if (enc->sample_fmt != AV_SAMPLE_FMT_FLTP && enc->sample_fmt != AV_SAMPLE_FMT_FLT)
         {
-          err = Error ("Error allocating an audio buffer");
-          return nullptr;
+          m_encoder->tmp_frame = alloc_audio_frame (AV_SAMPLE_FMT_FLT, &enc->ch_layout, enc->sample_rate, nb_samples, err);
+          if (err)
+            return err;
+
+          /* create resampler context */
+          SwrContext *swr_ctx = swr_alloc();
+          if (!swr_ctx)
+            return Error ("could not allocate resampler context");
+
+          m_encoder->swr_ctx = swr_ctx;
+
+          /* set options */
+          av_opt_set_chlayout   (swr_ctx, "in_chlayout",        &enc->ch_layout,     0);
+          av_opt_set_int        (swr_ctx, "in_sample_rate",     enc->sample_rate,    0);
+          av_opt_set_sample_fmt (swr_ctx, "in_sample_fmt",      AV_SAMPLE_FMT_FLT,   0);
+          av_opt_set_chlayout   (swr_ctx, "out_chlayout",       &enc->ch_layout,     0);
+          av_opt_set_int        (swr_ctx, "out_sample_rate",    enc->sample_rate,    0);
+          av_opt_set_sample_fmt (swr_ctx, "out_sample_fmt",     enc->sample_fmt,     0);
+
+          /* initialize the resampling context */
+          if (swr_init (swr_ctx) < 0)
+            return Error ("failed to initialize the resampling context");
         }
-    }
 
-  return frame;
+      m_encoder->pkt = av_packet_alloc();
+      if (!m_encoder->pkt)
+        return Error ("could not allocate AVPacket");
+    }
+  return Error::Code::NONE;
 }
 
-
+/* Add an output stream. */
 Error
-HLSOutputStream::open_audio (const AVCodec *codec, AVDictionary *opt_arg)
+HLSOutputStream::add_stream()
 {
-  int nb_samples;
-  int ret;
-  AVDictionary *opt = NULL;
-
-  /* open it */
-  av_dict_copy (&opt, opt_arg, 0);
-  ret = avcodec_open2 (m_enc, codec, &opt);
-  av_dict_free (&opt);
-  if (ret < 0)
-    return Error (string_printf ("could not open audio codec: %s", av_err2str (ret)));
-
-  if (m_enc->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)
-    nb_samples = 10000;
-  else
-    nb_samples = m_enc->frame_size;
-
-  Error err;
-  m_frame     = alloc_audio_frame (m_enc->sample_fmt, &m_enc->ch_layout, m_enc->sample_rate, nb_samples, err);
-  if (err)
-    return err;
-
-  m_tmp_frame = alloc_audio_frame (AV_SAMPLE_FMT_FLT, &m_enc->ch_layout, m_enc->sample_rate, nb_samples, err);
-  if (err)
-    return err;
+  m_st = avformat_new_stream (m_fmt_ctx, NULL);
+  if (!m_st)
+    return Error ("could not allocate stream");
 
-  m_tmp_pkt = av_packet_alloc();
-  if (!m_tmp_pkt)
-    return Error ("could not allocate AVPacket");
+  m_st->id = m_fmt_ctx->nb_streams - 1;
+  m_st->time_base = (AVRational){ 1, m_encoder->enc->sample_rate };
 
   /* copy the stream parameters to the muxer */
-  ret = avcodec_parameters_from_context (m_st->codecpar, m_enc);
+  int ret = avcodec_parameters_from_context (m_st->codecpar, m_encoder->enc);
   if (ret < 0)
     return Error ("could not copy the stream parameters");
 
-  /* create resampler context */
-  m_swr_ctx = swr_alloc();
-  if (!m_swr_ctx)
-    return Error ("could not allocate resampler context");
-
-  /* set options */
-  av_opt_set_chlayout   (m_swr_ctx, "in_chlayout",        &m_enc->ch_layout,     0);
-  av_opt_set_int        (m_swr_ctx, "in_sample_rate",     m_enc->sample_rate,    0);
-  av_opt_set_sample_fmt (m_swr_ctx, "in_sample_fmt",      AV_SAMPLE_FMT_FLT,     0);
-  av_opt_set_chlayout   (m_swr_ctx, "out_chlayout",       &m_enc->ch_layout,     0);
-  av_opt_set_int        (m_swr_ctx, "out_sample_rate",    m_enc->sample_rate,    0);
-  av_opt_set_sample_fmt (m_swr_ctx, "out_sample_fmt",     m_enc->sample_fmt,     0);
-
-  /* initialize the resampling context */
-  if ((ret = swr_init(m_swr_ctx)) < 0)
-    return Error ("failed to initialize the resampling context");
-
   return Error::Code::NONE;
 }
 
-/* fill audio frame with samples from AudioBuffer */
 AVFrame *
-HLSOutputStream::get_audio_frame()
+HLSOutputStream::alloc_audio_frame (AVSampleFormat sample_fmt, const AVChannelLayout *channel_layout, int sample_rate, int nb_samples, Error& err)
 {
-  AVFrame *frame = m_tmp_frame;
-
-  if (m_audio_buffer.can_read_frames() < size_t (frame->nb_samples))
-    return nullptr;
+  AVFrame *frame = av_frame_alloc();
 
-  vector<float> samples = m_audio_buffer.read_frames (frame->nb_samples);
+  if (!frame)
+    {
+      err = Error ("error allocating an audio frame");
+      return nullptr;
+    }
 
-  std::copy (samples.begin(), samples.end(), (float *)frame->data[0]);
+  frame->format = sample_fmt;
+  av_channel_layout_copy (&frame->ch_layout, channel_layout);
+  frame->sample_rate = sample_rate;
+  frame->nb_samples = nb_samples;
 
-  frame->pts = m_next_pts;
-  m_next_pts  += frame->nb_samples;
+  if (nb_samples)
+    {
+      int ret = av_frame_get_buffer (frame, 0);
+      if (ret < 0)
+        {
+          av_frame_free (&frame);
+          err = Error ("Error allocating an audio buffer");
+          return nullptr;
+        }
+    }
 
   return frame;
 }
 
-
 int
 HLSOutputStream::write_frame (const AVRational *time_base, AVStream *st, AVPacket *pkt)
 {
@@ -265,52 +344,41 @@ HLSOutputStream::write_frame (const AVRational *time_base, AVStream *st, AVPacke
 
 
 /*
- * encode one audio frame and send it to the muxer
+ * encode one complete audio frame (nullptr: flush encoder) and send it to the muxer
  *   returns EncResult: OK, ERROR, DONE
  */
 HLSOutputStream::EncResult
-HLSOutputStream::write_audio_frame (Error& err)
+HLSOutputStream::write_audio_frame (AVFrame *frame, Error& err)
 {
-  AVFrame *frame;
+  AVCodecContext *enc = m_encoder->enc;
   int ret;
 
-  frame = get_audio_frame();
   if (frame)
     {
-      /* convert samples from native format to destination codec format, using the resampler */
-
-      /* compute destination number of samples */
-      int dst_nb_samples = av_rescale_rnd (swr_get_delay (m_swr_ctx, m_enc->sample_rate) + frame->nb_samples,
-                                           m_enc->sample_rate, m_enc->sample_rate, AV_ROUND_UP);
-      av_assert0 (dst_nb_samples == frame->nb_samples);
-
-      /* when we pass a frame to the encoder, it may keep a reference to it
-       * internally;
-       * make sure we do not overwrite it here
-       */
-      ret = av_frame_make_writable (m_frame);
-      if (ret < 0)
-        {
-          err = Error ("error making frame writable");
-          return EncResult::ERROR;
-        }
-
-      /* convert to destination format */
-      ret = swr_convert (m_swr_ctx,
-                         m_frame->data, dst_nb_samples,
-                         (const uint8_t **)frame->data, frame->nb_samples);
-      if (ret < 0)
+      if (m_encoder->swr_ctx)
         {
-          err = Error ("error while converting");
-          return EncResult::ERROR;
+          /* convert samples from native format to destination codec format */
+          ret = av_frame_make_writable (m_encoder->frame);
+          if (ret < 0)
+            {
+              err = Error ("error making frame writable");
+              return EncResult::ERROR;
+            }
+          ret = swr_convert (m_encoder->swr_ctx,
+                             m_encoder->frame->data, frame->nb_samples,
+                             (const uint8_t **)frame->data, frame->nb_samples);
+          if (ret < 0)
+            {
+              err = Error ("error while converting");
+              return EncResult::ERROR;
+            }
+          frame = m_encoder->frame;
         }
-      frame = m_frame;
-
-      frame->pts = av_rescale_q (m_samples_count + m_start_pos, (AVRational){1, m_enc->sample_rate}, m_enc->time_base);
-      m_samples_count += dst_nb_samples;
+      frame->pts = av_rescale_q (m_samples_count + m_start_pos, (AVRational){1, enc->sample_rate}, enc->time_base);
+      m_samples_count += frame->nb_samples;
     }
 
-  ret = avcodec_send_frame (m_enc, frame);
+  ret = avcodec_send_frame (enc, frame);
   if (ret == AVERROR_EOF)
     {
       return EncResult::DONE; // encoder has nothing more to do
@@ -322,7 +390,7 @@ HLSOutputStream::write_audio_frame (Error& err)
     }
   for (;;)
     {
-      ret = avcodec_receive_packet (m_enc, m_tmp_pkt);
+      ret = avcodec_receive_packet (enc, m_encoder->pkt);
       if (ret == AVERROR (EAGAIN))
         {
           return EncResult::OK; // encoder needs more data to produce something
@@ -341,10 +409,11 @@ HLSOutputStream::write_audio_frame (Error& err)
       if (m_cut_aac_frames)
         {
           m_cut_aac_frames--;
+          av_packet_unref (m_encoder->pkt);
         }
       else if (m_keep_aac_frames)
         {
-          ret = write_frame (&m_enc->time_base, m_st, m_tmp_pkt);
+          ret = write_frame (&enc->time_base, m_st, m_encoder->pkt);
           if (ret < 0)
             {
               err = Error (string_printf ("error while writing audio frame: %s", av_err2str (ret)));
@@ -352,19 +421,13 @@ HLSOutputStream::write_audio_frame (Error& err)
             }
           m_keep_aac_frames--;
         }
+      else
+        {
+          av_packet_unref (m_encoder->pkt);
+        }
     }
 }
 
-void
-HLSOutputStream::close_stream()
-{
-  avcodec_free_context (&m_enc);
-  av_frame_free (&m_frame);
-  av_frame_free (&m_tmp_frame);
-  av_packet_free (&m_tmp_pkt);
-  swr_free (&m_swr_ctx);
-}
-
 Error
 HLSOutputStream::open (const string& out_filename, size_t cut_aac_frames, size_t keep_aac_frames, double pts_start, size_t delete_input_start)
 {
@@ -392,17 +455,16 @@ HLSOutputStream::open (const string& out_filename, size_t cut_aac_frames, size_t
   if (ret < 0)
     return Error (av_err2str (ret));
 
-  AVDictionary *opt = nullptr;
-  const AVCodec *audio_codec;
-  Error err = add_stream (&audio_codec, AV_CODEC_ID_AAC);
+  Error err = open_encoder();
   if (err)
     return err;
 
-  err = open_audio (audio_codec, opt);
+  err = add_stream();
   if (err)
     return err;
 
   /* Write the stream header, if any. */
+  AVDictionary *opt = nullptr;
   ret = avformat_write_header (m_fmt_ctx, &opt);
   if (ret < 0)
     {
@@ -425,20 +487,37 @@ HLSOutputStream::open (const string& out_filename, size_t cut_aac_frames, size_t
 Error
 HLSOutputStream::close()
 {
+  if (m_state == State::NEW && m_fmt_ctx)
+    {
+      /* open() failed: free everything, the encoder state is not reused */
+      m_state = State::CLOSED;
+      if (m_fmt_ctx->pb)
+        avio_closep (&m_fmt_ctx->pb);
+      avformat_free_context (m_fmt_ctx);
+      m_encoder.reset();
+    }
   if (m_state != State::OPEN)
     return Error::Code::NONE;
 
   // never close twice
   m_state = State::CLOSED;
 
+  /* samples of an incomplete last frame are not encoded */
   Error err;
-  while (write_audio_frame (err) == EncResult::OK);
-  if (err)
-    return err;
+  while (write_audio_frame (nullptr, err) == EncResult::OK);
+  if (!err)
+    {
+      av_write_trailer (m_fmt_ctx);
 
-  av_write_trailer (m_fmt_ctx);
+      /* reset encoder for the next output stream (if possible) */
+      if (m_encoder->enc->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)
+        avcodec_flush_buffers (m_encoder->enc);
+      else
+        avcodec_free_context (&m_encoder->enc);
 
-  close_stream();
+      HLSEncoderPool::the().give_back (std::move (m_encoder));
+    }
+  m_encoder.reset();
 
   /* Close the output file. */
   if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
@@ -447,31 +526,60 @@ HLSOutputStream::close()
   /* free the stream */
   avformat_free_context (m_fmt_ctx);
 
-  return Error::Code::NONE;
+  return err;
 }
 
 Error
 HLSOutputStream::write_frames (const std::vector<float>& frames)
 {
-  // if we don't need any more aac frames, just throw away samples (save cpu cycles)
-  if (m_keep_aac_frames == 0)
-    return Error::Code::NONE;
+  const float *samples = frames.data();
+  size_t n_frames = frames.size() / m_n_channels;
 
-  m_audio_buffer.write_frames (frames);
+  size_t delete_input = min (m_delete_input_start, n_frames);
+  samples += delete_input * m_n_channels;
+  n_frames -= delete_input;
+  m_delete_input_start -= delete_input;
 
-  size_t delete_input = min (m_delete_input_start, m_audio_buffer.can_read_frames());
-  if (delete_input)
-    {
-      m_audio_buffer.read_frames (delete_input);
-      m_delete_input_start -= delete_input;
-    }
+  /* samples are written directly to the input frame of the encoder, no intermediate buffer */
+  AVFrame *frame = m_encoder->tmp_frame ? m_encoder->tmp_frame : m_encoder->frame;
 
-  Error err;
-  while (m_audio_buffer.can_read_frames() >= 1024)
+  // if we don't need any more aac frames, just throw away samples (save cpu cycles)
+  while (n_frames && m_keep_aac_frames)
     {
-      write_audio_frame (err);
-      if (err)
-        return err;
+      if (m_frame_fill == 0)
+        {
+          /* the encoder may still keep a reference to the frame, make sure we do not overwrite it */
+          int ret = av_frame_make_writable (frame);
+          if (ret < 0)
+            return Error ("error making frame writable");
+        }
+      const size_t todo = min<size_t> (n_frames, frame->nb_samples - m_frame_fill);
+      if (frame->format == AV_SAMPLE_FMT_FLTP)
+        {
+          for (int ch = 0; ch < m_n_channels; ch++)
+            {
+              float *out = reinterpret_cast<float *> (frame->extended_data[ch]) + m_frame_fill;
+              for (size_t i = 0; i < todo; i++)
+                out[i] = samples[i * m_n_channels + ch];
+            }
+        }
+      else
+        {
+          std::copy (samples, samples + todo * m_n_channels, reinterpret_cast<float *> (frame->data[0]) + m_frame_fill * m_n_channels);
+        }
+      samples += todo * m_n_channels;
+      n_frames -= todo;
+      m_frame_fill += todo;
+
+      if (m_frame_fill == frame->nb_samples)
+        {
+          m_frame_fill = 0;
+
+          Error err;
+          write_audio_frame (frame, err);
+          if (err)
+            return err;
+        }
     }
   return Error::Code::NONE;
 }
@@ -19,7 +19,8 @@
 #define AUDIOWMARK_HLS_OUTPUT_STREAM_HH
 
 #include "audiostream.hh"
-#include "audiobuffer.hh"
+
+#include <memory>
 
 #include <assert.h>
 
@@ -32,29 +33,25 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+struct HLSEncoder;
+
 class HLSOutputStream : public AudioOutputStream {
   AVStream         *m_st = nullptr;
-  AVCodecContext   *m_enc = nullptr;
   AVFormatContext  *m_fmt_ctx = nullptr;
 
-  /* pts of the next frame that will be generated */
-  int64_t           m_next_pts = 0;
+  /* codec context, frames and packet: reused for other output streams after close() */
+  std::unique_ptr<HLSEncoder> m_encoder;
+  int               m_frame_fill = 0; // number of sample frames written to the input frame
+
   int               m_samples_count = 0;
   int               m_start_pos = 0;
 
-  AVFrame          *m_frame = nullptr;
-  AVFrame          *m_tmp_frame = nullptr;
-  AVPacket         *m_tmp_pkt = nullptr;
-
   size_t            m_cut_aac_frames = 0;
   size_t            m_keep_aac_frames = 0;
 
-  SwrContext       *m_swr_ctx = nullptr;
-
   int               m_bit_depth = 0;
   int               m_sample_rate = 0;
   int               m_n_channels = 0;
-  AudioBuffer       m_audio_buffer;
   size_t            m_delete_input_start = 0;
   int               m_bit_rate = 0;
   std::string       m_channel_layout;
@@ -66,16 +63,15 @@ class HLSOutputStream : public AudioOutputStream {
   };
   State             m_state = State::NEW;
 
-  Error add_stream (const AVCodec **codec, enum AVCodecID codec_id);
-  Error open_audio (const AVCodec *codec, AVDictionary *opt_arg);
-  AVFrame *get_audio_frame();
+  Error open_encoder();
+  Error create_encoder (const AVCodec *codec);
+  Error add_stream();
   enum class EncResult {
     OK,
     ERROR,
     DONE
   };
-  EncResult write_audio_frame (Error& err);
-  void close_stream();
+  EncResult write_audio_frame (AVFrame *frame, Error& err);
   AVFrame *alloc_audio_frame (AVSampleFormat sample_fmt, const AVChannelLayout *channel_layout, int sample_rate, int nb_samples, Error& err);
 
   int write_frame (const AVRational *time_base, AVStream *st, AVPacket *pkt);
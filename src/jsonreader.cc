@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jsonreader.hh"
+
+#include <string.h>
+#include <ctype.h>
+
+using std::string;
+
+void
+JsonReader::skip_space()
+{
+  while (pos < text.size() && strchr (" \t\r\n", text[pos]))
+    pos++;
+}
+
+/* skip space, then consume ch if it is the next character */
+bool
+JsonReader::parse_char (char ch)
+{
+  skip_space();
+  if (pos < text.size() && text[pos] == ch)
+    {
+      pos++;
+      return true;
+    }
+  return false;
+}
+
+bool
+JsonReader::at_end()
+{
+  skip_space();
+  return pos == text.size();
+}
+
+void
+JsonReader::append_utf8 (string& out, uint32_t c)
+{
+  if (c < 0x80)
+    {
+      out += char (c);
+    }
+  else if (c < 0x800)
+    {
+      out += char (0xC0 | (c >> 6));
+      out += char (0x80 | (c & 0x3F));
+    }
+  else if (c < 0x10000)
+    {
+      out += char (0xE0 | (c >> 12));
+      out += char (0x80 | ((c >> 6) & 0x3F));
+      out += char (0x80 | (c & 0x3F));
+    }
+  else
+    {
+      out += char (0xF0 | (c >> 18));
+      out += char (0x80 | ((c >> 12) & 0x3F));
+      out += char (0x80 | ((c >> 6) & 0x3F));
+      out += char (0x80 | (c & 0x3F));
+    }
+}
+
+bool
+JsonReader::parse_hex4 (uint32_t& c)
+{
+  if (pos + 4 > text.size())
+    return false;
+
+  c = 0;
+  for (int i = 0; i < 4; i++)
+    {
+      const char ch = text[pos++];
+      c <<= 4;
+      if (ch >= '0' && ch <= '9')
+        c += ch - '0';
+      else if (ch >= 'a' && ch <= 'f')
+        c += ch - 'a' + 10;
+      else if (ch >= 'A' && ch <= 'F')
+        c += ch - 'A' + 10;
+      else
+        return false;
+    }
+  return true;
+}
+
+bool
+JsonReader::parse_string (string& out)
+{
+  out.clear();
+  if (pos >= text.size() || text[pos] != '"')
+    return false;
+  pos++;
+
+  while (pos < text.size())
+    {
+      const char ch = text[pos++];
+      if (ch == '"')
+        return true;
+
+      if (ch != '\\')
+        {
+          out += ch;
+          continue;
+        }
+      if (pos >= text.size())
+        return false;
+
+      const char esc = text[pos++];
+      switch (esc)
+        {
+          case '"':  out += '"';  break;
+          case '\\': out += '\\'; break;
+          case '/':  out += '/';  break;
+          case 'b':  out += '\b'; break;
+          case 'f':  out += '\f'; break;
+          case 'n':  out += '\n'; break;
+          case 'r':  out += '\r'; break;
+          case 't':  out += '\t'; break;
+          case 'u':
+            {
+              uint32_t c;
+              if (!parse_hex4 (c))
+                return false;
+
+              /* surrogate pair */
+              uint32_t c2;
+              if (c >= 0xD800 && c < 0xDC00 && text.compare (pos, 2, "\\u") == 0)
+                {
+                  pos += 2;
+                  if (!parse_hex4 (c2) || c2 < 0xDC00 || c2 >= 0xE000)
+                    return false;
+                  c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+                }
+              append_utf8 (out, c);
+              break;
+            }
+          default:
+            return false;
+        }
+    }
+  return false;
+}
+
+/* value: raw is the value as JSON text, str is the unescaped value for strings */
+bool
+JsonReader::parse_value (string& raw, string& str, bool& is_string)
+{
+  const size_t start = pos;
+
+  is_string = pos < text.size() && text[pos] == '"';
+  if (is_string)
+    {
+      if (!parse_string (str))
+        return false;
+    }
+  else
+    {
+      while (pos < text.size() && (isalnum (text[pos]) || strchr ("+-.", text[pos])))
+        pos++;
+      if (pos == start)
+        return false;
+    }
+  raw = text.substr (start, pos - start);
+  return true;
+}
+
+/* skip any value, including objects and arrays */
+bool
+JsonReader::skip_value()
+{
+  skip_space();
+  if (parse_char ('{'))
+    {
+      if (parse_char ('}'))
+        return true;
+      do
+        {
+          string name;
+          skip_space();
+          if (!parse_string (name) || !parse_char (':') || !skip_value())
+            return false;
+        }
+      while (parse_char (','));
+      return parse_char ('}');
+    }
+  if (parse_char ('['))
+    {
+      if (parse_char (']'))
+        return true;
+      do
+        {
+          if (!skip_value())
+            return false;
+        }
+      while (parse_char (','));
+      return parse_char (']');
+    }
+  string raw, str;
+  bool   is_string;
+  return parse_value (raw, str, is_string);
+}
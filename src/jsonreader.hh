@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_JSON_READER_HH
+#define AUDIOWMARK_JSON_READER_HH
+
+#include <string>
+
+#include <stdint.h>
+
+/*
+ * Minimal JSON tokenizer, for the JSON that is read by audiowmark (serve
+ * requests, get --json results for merge-results)
+ *
+ * Only the values which are needed are parsed (strings and scalar values like
+ * numbers or true/false/null), other values (objects, arrays) can be skipped.
+ */
+class JsonReader
+{
+protected:
+  const std::string& text;
+  size_t             pos = 0;
+
+  static void append_utf8 (std::string& out, uint32_t c);
+  bool        parse_hex4 (uint32_t& c);
+public:
+  JsonReader (const std::string& text) :
+    text (text)
+  {
+  }
+
+  void skip_space();
+  bool parse_char (char ch);
+  bool parse_string (std::string& out);
+  bool parse_value (std::string& raw, std::string& str, bool& is_string);
+  bool skip_value();
+  bool at_end();
+};
+
+#endif /* AUDIOWMARK_JSON_READER_HH */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "keytables.hh"
+#include "shortcode.hh"
+
+using std::string;
+using std::vector;
+
+void
+KeyTables::compute (const Key& key)
+{
+  const int data_frame_count = mark_data_frame_count();
+  const int sync_frame_count = mark_sync_frame_count();
+
+  /* one Random object (and cipher key setup) is reseeded for all random streams */
+  Random random (key, /* seed */ 0, Random::Stream::data_up_down);
+
+  /* up/down bands */
+  UpDownGen data_up_down_gen (random, Random::Stream::data_up_down);
+  data_up_down_gen.get_all (data_frame_count, m_data_up, m_data_down);
+
+  UpDownGen sync_up_down_gen (random, Random::Stream::sync_up_down);
+  sync_up_down_gen.get_all (sync_frame_count, m_sync_up, m_sync_down);
+
+  /* frame positions: sync frames first, then data frames */
+  BitPosGen bit_pos_gen (random);
+  m_frame_pos.clear();
+  for (int f = 0; f < sync_frame_count; f++)
+    m_frame_pos.push_back (bit_pos_gen.sync_frame (f));
+  for (int f = 0; f < data_frame_count; f++)
+    m_frame_pos.push_back (bit_pos_gen.data_frame (f));
+
+  /* mix entries */
+  m_mix_entries.resize (data_frame_count * Params::bands_per_frame);
+  int entry = 0;
+  for (int f = 0; f < data_frame_count; f++)
+    {
+      const int index = data_frame (f);
+
+      for (size_t i = 0; i < Params::bands_per_frame; i++)
+        m_mix_entries[entry++] = { index, m_data_up[f][i], m_data_down[f][i] };
+    }
+  random.seed (0, Random::Stream::mix);
+  random.shuffle (m_mix_entries);
+
+  /* bit order */
+  m_bit_order.resize (code_size (ConvBlockType::a, Params::payload_size));
+  for (size_t i = 0; i < m_bit_order.size(); i++)
+    m_bit_order[i] = i;
+
+  random.seed (0, Random::Stream::bit_order);
+  random.shuffle (m_bit_order);
+}
+
+/* check that the tables have the expected sizes and all values are in range (for loading) */
+bool
+KeyTables::valid() const
+{
+  const size_t data_frame_count = mark_data_frame_count();
+  const size_t sync_frame_count = mark_sync_frame_count();
+  const int    total_frame_count = data_frame_count + sync_frame_count;
+
+  if (m_data_up.size() != data_frame_count || m_data_down.size() != data_frame_count ||
+      m_sync_up.size() != sync_frame_count || m_sync_down.size() != sync_frame_count ||
+      m_frame_pos.size() != size_t (total_frame_count) ||
+      m_mix_entries.size() != data_frame_count * Params::bands_per_frame ||
+      m_bit_order.size() != code_size (ConvBlockType::a, Params::payload_size))
+    return false;
+
+  auto band_ok = [] (int band) { return band >= Params::min_band && band <= Params::max_band; };
+  for (const auto& bands_vec : { &m_data_up, &m_data_down, &m_sync_up, &m_sync_down })
+    for (const auto& bands : *bands_vec)
+      for (auto band : bands)
+        if (!band_ok (band))
+          return false;
+
+  for (auto pos : m_frame_pos)
+    if (pos < 0 || pos >= total_frame_count)
+      return false;
+
+  for (const auto& mix_entry : m_mix_entries)
+    if (mix_entry.frame < 0 || mix_entry.frame >= total_frame_count || !band_ok (mix_entry.up) || !band_ok (mix_entry.down))
+      return false;
+
+  for (auto b : m_bit_order)
+    if (b >= m_bit_order.size())
+      return false;
+
+  return true;
+}
+
+/*
+ * cache file format: magic, followed by each table as element count + raw data
+ *
+ * the file is only used on the machine it was written on, so native byte
+ * order is fine
+ */
+static const char key_tables_magic[] = "audiowmark-key-tables-1\n";
+
+template<class T> static bool
+write_table (FILE *file, const vector<T>& table)
+{
+  const uint64_t size = table.size();
+
+  return fwrite (&size, sizeof (size), 1, file) == 1 &&
+         fwrite (table.data(), sizeof (T), table.size(), file) == table.size();
+}
+
+template<class T> static bool
+read_table (FILE *file, vector<T>& table)
+{
+  uint64_t size;
+
+  if (fread (&size, sizeof (size), 1, file) != 1 || size > 16 * 1024 * 1024)
+    return false;
+
+  table.resize (size);
+  return fread (table.data(), sizeof (T), table.size(), file) == table.size();
+}
+
+bool
+KeyTables::load (const string& filename)
+{
+  FILE *file = fopen (filename.c_str(), "rb");
+  if (!file)
+    return false;
+
+  char magic[sizeof (key_tables_magic) - 1];
+  bool ok = fread (magic, sizeof (magic), 1, file) == 1 && memcmp (magic, key_tables_magic, sizeof (magic)) == 0 &&
+            read_table (file, m_data_up) && read_table (file, m_data_down) &&
+            read_table (file, m_sync_up) && read_table (file, m_sync_down) &&
+            read_table (file, m_frame_pos) && read_table (file, m_mix_entries) &&
+            read_table (file, m_bit_order) && fgetc (file) == EOF;
+  fclose (file);
+
+  return ok && valid();
+}
+
+void
+KeyTables::save (const string& filename) const
+{
+  /* write to temporary file and rename, so concurrent processes never see incomplete files */
+  const string tmp_filename = string_printf ("%s.tmp%d", filename.c_str(), int (getpid()));
+
+  FILE *file = fopen (tmp_filename.c_str(), "wb");
+  if (!file)
+    {
+      warning ("audiowmark: unable to write key tables cache file '%s'\n", tmp_filename.c_str());
+      return;
+    }
+  bool ok = fwrite (key_tables_magic, sizeof (key_tables_magic) - 1, 1, file) == 1 &&
+            write_table (file, m_data_up) && write_table (file, m_data_down) &&
+            write_table (file, m_sync_up) && write_table (file, m_sync_down) &&
+            write_table (file, m_frame_pos) && write_table (file, m_mix_entries) &&
+            write_table (file, m_bit_order);
+  ok = (fclose (file) == 0) && ok;
+
+  if (!ok || rename (tmp_filename.c_str(), filename.c_str()) != 0)
+    {
+      warning ("audiowmark: unable to write key tables cache file '%s'\n", filename.c_str());
+      unlink (tmp_filename.c_str());
+    }
+}
+
+/*
+ * the cache file name must not reveal the key, so we use random numbers
+ * generated from the key as file name
+ */
+static string
+cache_filename (const Key& key)
+{
+  Random random (key, /* seed */ 0, Random::Stream::key_tables);
+  const uint64_t id1 = random();
+  const uint64_t id2 = random();
+
+  return string_printf ("%s/%016" PRIx64 "%016" PRIx64 "-%zd-%d.keytables", Params::key_cache_dir.c_str(), id1, id2,
+                        Params::payload_size, Params::frames_per_bit);
+}
+
+/* safe to call from any thread */
+const KeyTables&
+KeyTables::get (const Key& key)
+{
+  static std::mutex                                 cache_mutex;
+  static std::map<string, std::unique_ptr<KeyTables>> cache;
+
+  /* tables depend on the key and on the parameters that affect the frame/bit counts */
+  string cache_key ((const char *) key.aes_key(), Key::SIZE);
+  cache_key += string_printf (":%zd:%d", Params::payload_size, Params::frames_per_bit);
+
+  std::lock_guard<std::mutex> lg (cache_mutex);
+
+  std::unique_ptr<KeyTables>& tables = cache[cache_key];
+  if (!tables)
+    {
+      tables.reset (new KeyTables());
+
+      if (Params::key_cache_dir.empty())
+        {
+          tables->compute (key);
+        }
+      else
+        {
+          const string filename = cache_filename (key);
+          if (!tables->load (filename))
+            {
+              tables->compute (key);
+              tables->save (filename);
+            }
+        }
+    }
+  return *tables;
+}
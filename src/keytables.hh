@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_KEY_TABLES_HH
+#define AUDIOWMARK_KEY_TABLES_HH
+
+#include <vector>
+#include <string>
+
+#include "wmcommon.hh"
+
+/*
+ * KeyTables contains everything that is derived from the watermark key by
+ * the pseudo random generator:
+ *
+ *  - up/down bands for each data frame and each sync frame (UpDownGen)
+ *  - frame positions of the data and sync frames (BitPosGen)
+ *  - mix entries (data frame bands in random order, for Params::mix)
+ *  - bit order for the coded bits of one block (randomize_bit_order)
+ *
+ * The tables are computed once per key (and payload parameters) and then
+ * shared by embedding and detection. They are cached in memory and, if
+ * Params::key_cache_dir is set, in a file in this directory. Since the
+ * tables allow reading (and removing) watermarks just like the key, the
+ * cache directory needs to be protected like the key files.
+ *
+ * The tables are immutable, so they can be used from any thread.
+ */
+class KeyTables
+{
+  std::vector<UpDownArray>  m_data_up;
+  std::vector<UpDownArray>  m_data_down;
+  std::vector<UpDownArray>  m_sync_up;
+  std::vector<UpDownArray>  m_sync_down;
+  std::vector<int>          m_frame_pos;
+  std::vector<MixEntry>     m_mix_entries;
+  std::vector<unsigned int> m_bit_order;
+
+  void compute (const Key& key);
+  bool load (const std::string& filename);
+  void save (const std::string& filename) const;
+  bool valid() const;
+public:
+  static const KeyTables& get (const Key& key);
+
+  const UpDownArray&
+  data_up (int f) const
+  {
+    return m_data_up[f];
+  }
+  const UpDownArray&
+  data_down (int f) const
+  {
+    return m_data_down[f];
+  }
+  const UpDownArray&
+  sync_up (int f) const
+  {
+    return m_sync_up[f];
+  }
+  const UpDownArray&
+  sync_down (int f) const
+  {
+    return m_sync_down[f];
+  }
+  int
+  sync_frame (int f) const
+  {
+    assert (f >= 0 && size_t (f) < mark_sync_frame_count());
+    return m_frame_pos[f];
+  }
+  int
+  data_frame (int f) const
+  {
+    assert (f >= 0 && size_t (f) < mark_data_frame_count());
+    return m_frame_pos[f + mark_sync_frame_count()];
+  }
+  const std::vector<MixEntry>&
+  mix_entries() const
+  {
+    return m_mix_entries;
+  }
+  const std::vector<unsigned int>&
+  bit_order() const
+  {
+    return m_bit_order;
+  }
+};
+
+template<class T> std::vector<T>
+randomize_bit_order (const Key& key, const std::vector<T>& bit_vec, bool encode)
+{
+  const std::vector<unsigned int>& order = KeyTables::get (key).bit_order();
+  assert (order.size() == bit_vec.size());
+
+  std::vector<T> out_bits (bit_vec.size());
+  for (size_t i = 0; i < bit_vec.size(); i++)
+    {
+      if (encode)
+        out_bits[i] = bit_vec[order[i]];
+      else
+        out_bits[order[i]] = bit_vec[i];
+    }
+  return out_bits;
+}
+
+#endif /* AUDIOWMARK_KEY_TABLES_HH */
@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <mutex>
+
+#include "libaudiowmark.hh"
+#include "wmcommon.hh"
+#include "shortcode.hh"
+#include "memorystream.hh"
+
+using std::string;
+using std::vector;
+
+using AudioWmark::Status;
+using AudioWmark::KeySpec;
+using AudioWmark::Embedder;
+using AudioWmark::Detector;
+
+/* the Params which depend on Embedder::Settings / Detector::Settings */
+struct ParamValues
+{
+  double  water_delta;
+  bool    strict;
+  size_t  payload_size;
+  bool    payload_short;
+  bool    detect_speed;
+  bool    detect_speed_patient;
+  double  try_speed;
+  double  get_chunk_size;
+
+  static ParamValues
+  current()
+  {
+    ParamValues v;
+    v.water_delta          = Params::water_delta;
+    v.strict               = Params::strict;
+    v.payload_size         = Params::payload_size;
+    v.payload_short        = Params::payload_short;
+    v.detect_speed         = Params::detect_speed;
+    v.detect_speed_patient = Params::detect_speed_patient;
+    v.try_speed            = Params::try_speed;
+    v.get_chunk_size       = Params::get_chunk_size;
+    return v;
+  }
+  void
+  apply() const
+  {
+    Params::water_delta          = water_delta;
+    Params::strict               = strict;
+    Params::payload_size         = payload_size;
+    Params::payload_short        = payload_short;
+    Params::detect_speed         = detect_speed;
+    Params::detect_speed_patient = detect_speed_patient;
+    Params::try_speed            = try_speed;
+    Params::get_chunk_size       = get_chunk_size;
+    if (payload_short)
+      short_code_init (payload_size);
+  }
+};
+
+/*
+ * The watermarking code reads its settings from the Params statics. While a
+ * library call runs, ParamsScope holds a global lock, starts from the default
+ * values (the values before the first library call), and collects the error
+ * messages which would otherwise be printed. The previous state is restored
+ * afterwards.
+ */
+class ParamsScope
+{
+  static std::mutex           mutex;
+  std::lock_guard<std::mutex> lock;
+  ParamValues                 saved_values;
+  Log                         saved_log_level;
+  string                      error_message;
+public:
+  ParamsScope() :
+    lock (mutex),
+    saved_values (ParamValues::current()),
+    saved_log_level (get_log_level())
+  {
+    static const ParamValues default_values = saved_values;
+    default_values.apply();
+
+    set_log_level (Log::ERROR);
+    set_log_function ([this] (Log, const string& message)
+      {
+        /* keep the first error, without trailing newline */
+        if (error_message.empty())
+          error_message = message.substr (0, message.find_last_not_of ("\n") + 1);
+      });
+  }
+  ~ParamsScope()
+  {
+    set_log_function (nullptr);
+    set_log_level (saved_log_level);
+    saved_values.apply();
+  }
+  Status
+  error_status (const string& fallback_message) const
+  {
+    Status status;
+    status.ok = false;
+    status.message = error_message.empty() ? fallback_message : error_message;
+    return status;
+  }
+  bool
+  set_short_payload (int bits)
+  {
+    if (bits == 0)
+      return true;
+
+    if (bits < 0 || !short_code_init (bits))
+      {
+        error ("audiowmark: unsupported short payload size %d", bits);
+        return false;
+      }
+    Params::payload_size = bits;
+    Params::payload_short = true;
+    return true;
+  }
+};
+
+std::mutex ParamsScope::mutex;
+
+static Status
+error_status (const string& message)
+{
+  Status status;
+  status.ok = false;
+  status.message = message;
+  return status;
+}
+
+static Status
+error_status_from (Error err)
+{
+  if (err)
+    return error_status (string ("audiowmark: ") + err.message());
+  return Status();
+}
+
+static Status
+load_key (const KeySpec& key_spec, Key& key)
+{
+  if (!key_spec.key_file.empty())
+    {
+      Error err = key.load_key_file (key_spec.key_file);
+      if (err)
+        return error_status (string ("audiowmark: ") + err.message());
+    }
+  else if (key_spec.test_key >= 0)
+    {
+      key.set_test_key (key_spec.test_key);
+    }
+  return Status();
+}
+
+/* same limits as for input files: channels like libsndfile, sample rates the resampler supports */
+static constexpr int max_channels    = 1024;
+static constexpr int min_sample_rate = Params::mark_sample_rate / 16;
+static constexpr int max_sample_rate = Params::mark_sample_rate * 64;
+
+static Status
+check_format (size_t n_frames, int n_channels, int sample_rate, int bit_depth)
+{
+  if (n_channels <= 0 || n_channels > max_channels)
+    return error_status (string_printf ("audiowmark: unsupported number of channels: %d", n_channels));
+  if (sample_rate < min_sample_rate || sample_rate > max_sample_rate)
+    return error_status (string_printf ("audiowmark: unsupported sample rate: %d", sample_rate));
+  if (bit_depth != 16 && bit_depth != 24 && bit_depth != 32)
+    return error_status (string_printf ("audiowmark: unsupported bit depth: %d", bit_depth));
+  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
+    return error_status ("audiowmark: invalid number of frames");
+  return Status();
+}
+
+static Status
+check_format (const AudioInputStream& in_stream)
+{
+  return check_format (in_stream.n_frames(), in_stream.n_channels(), in_stream.sample_rate(), in_stream.bit_depth());
+}
+
+/* gcrypt errors can't be returned by the Random functions, they are collected and checked after each call */
+static Status
+check_random_errors()
+{
+  return error_status_from (Random::check_errors());
+}
+
+class Embedder::Impl
+{
+public:
+  Settings settings;
+  Key      key;
+};
+
+Embedder::Embedder (const Settings& settings) :
+  impl (new Impl())
+{
+  impl->settings = settings;
+}
+
+Embedder::~Embedder()
+{
+}
+
+std::unique_ptr<Embedder>
+Embedder::create (const Settings& settings, Status& status)
+{
+  status = error_status_from (Random::init());
+  if (!status.ok)
+    return nullptr;
+
+  std::unique_ptr<Embedder> embedder (new Embedder (settings));
+
+  status = load_key (settings.key, embedder->impl->key);
+  if (!status.ok)
+    return nullptr;
+
+  if (settings.strength < 0)
+    {
+      status = error_status (string_printf ("audiowmark: invalid watermark strength %.6g", settings.strength));
+      return nullptr;
+    }
+
+  ParamsScope params_scope;
+  if (!params_scope.set_short_payload (settings.short_payload))
+    {
+      status = params_scope.error_status ("audiowmark: unsupported short payload size");
+      return nullptr;
+    }
+  return embedder;
+}
+
+Status
+Embedder::embed (const string& bits, const float *samples, size_t n_frames, int n_channels, int sample_rate,
+                 vector<float>& out) const
+{
+  MemoryInputStream in_stream (samples, n_frames, n_channels, sample_rate);
+  Status status = check_format (in_stream);
+  if (!status.ok)
+    return status;
+
+  ParamsScope params_scope;
+  params_scope.set_short_payload (impl->settings.short_payload);
+  if (impl->settings.strength > 0)
+    Params::water_delta = impl->settings.strength / 1000;
+  Params::strict = impl->settings.strict;
+
+  out.clear();
+  out.reserve (n_frames * n_channels);
+
+  MemoryOutputStream out_stream (out, n_channels, sample_rate);
+  if (add_stream_watermark (impl->key, &in_stream, &out_stream, bits, 0) != 0)
+    {
+      out.clear();
+      return params_scope.error_status ("audiowmark: adding watermark failed");
+    }
+  status = check_random_errors();
+  if (!status.ok)
+    out.clear();
+  return status;
+}
+
+Status
+Embedder::embed (const string& bits, const vector<float>& samples, int n_channels, int sample_rate, vector<float>& out) const
+{
+  if (n_channels <= 0)
+    return check_format (0, n_channels, sample_rate, 32);
+
+  return embed (bits, samples.data(), samples.size() / n_channels, n_channels, sample_rate, out);
+}
+
+const Embedder::Settings&
+Embedder::settings() const
+{
+  return impl->settings;
+}
+
+class Detector::Impl
+{
+public:
+  Settings    settings;
+  vector<Key> key_list;
+};
+
+Detector::Detector (const Settings& settings) :
+  impl (new Impl())
+{
+  impl->settings = settings;
+}
+
+Detector::~Detector()
+{
+}
+
+std::unique_ptr<Detector>
+Detector::create (const Settings& settings, Status& status)
+{
+  status = error_status_from (Random::init());
+  if (!status.ok)
+    return nullptr;
+
+  std::unique_ptr<Detector> detector (new Detector (settings));
+
+  for (const auto& key_spec : settings.keys)
+    {
+      Key key;
+      status = load_key (key_spec, key);
+      if (!status.ok)
+        return nullptr;
+
+      detector->impl->key_list.push_back (key);
+    }
+  if (detector->impl->key_list.empty())
+    detector->impl->key_list.push_back (Key()); // default initialized with zero key
+
+  if (settings.try_speed < 0 || settings.chunk_size < 0)
+    {
+      status = error_status ("audiowmark: invalid speed or chunk size");
+      return nullptr;
+    }
+
+  ParamsScope params_scope;
+  if (!params_scope.set_short_payload (settings.short_payload))
+    {
+      status = params_scope.error_status ("audiowmark: unsupported short payload size");
+      return nullptr;
+    }
+  status = Status();
+  return detector;
+}
+
+Status
+Detector::detect (const float *samples, size_t n_frames, int n_channels, int sample_rate, Result& result) const
+{
+  std::unique_ptr<AudioInputStream> in_stream (new MemoryInputStream (samples, n_frames, n_channels, sample_rate));
+  Status status = check_format (*in_stream);
+  if (!status.ok)
+    return status;
+
+  ParamsScope params_scope;
+  params_scope.set_short_payload (impl->settings.short_payload);
+  Params::detect_speed         = impl->settings.detect_speed;
+  Params::detect_speed_patient = impl->settings.detect_speed_patient;
+  if (impl->settings.try_speed > 0)
+    Params::try_speed = impl->settings.try_speed;
+  if (impl->settings.chunk_size > 0)
+    Params::get_chunk_size = impl->settings.chunk_size;
+
+  result = Result();
+
+  Error err = get_watermark_matches (impl->key_list, std::move (in_stream), result);
+  if (err)
+    return params_scope.error_status (string ("audiowmark: ") + err.message());
+
+  status = check_random_errors();
+  if (!status.ok)
+    result = Result();
+  return status;
+}
+
+Status
+Detector::detect (const vector<float>& samples, int n_channels, int sample_rate, Result& result) const
+{
+  if (n_channels <= 0)
+    return check_format (0, n_channels, sample_rate, 32);
+
+  return detect (samples.data(), samples.size() / n_channels, n_channels, sample_rate, result);
+}
+
+const Detector::Settings&
+Detector::settings() const
+{
+  return impl->settings;
+}
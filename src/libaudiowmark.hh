@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_LIBAUDIOWMARK_HH
+#define AUDIOWMARK_LIBAUDIOWMARK_HH
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Public API of libaudiowmark: add and detect watermarks in process
+ *
+ * Audio is passed as caller provided interleaved float samples (-1..1) at the
+ * original sample rate, so no files or audiowmark processes are needed. The
+ * Embedder and Detector objects carry their own settings, which correspond to
+ * the command line options of audiowmark add / get. Errors are not printed,
+ * but returned in a Status.
+ *
+ * Internally, the watermarking code uses process wide parameters, so calls of
+ * all Embedder and Detector objects are serialized (each call can still use
+ * all cpu cores). Objects can be used from any thread.
+ */
+namespace AudioWmark
+{
+
+struct Status
+{
+  bool        ok = true;
+  std::string message;    // error message if !ok
+};
+
+struct KeySpec
+{
+  std::string  key_file;        // key file (audiowmark gen-key), like --key
+  int          test_key = -1;   // like --test-key, only used if key_file is empty; -1: default key
+};
+
+class Embedder
+{
+public:
+  struct Settings
+  {
+    KeySpec      key;
+    double       strength = 0;          // like --strength; 0: default strength
+    int          short_payload = 0;     // like --short: 12, 16 or 20 bits; 0: 128 bit payload
+    bool         strict = false;        // like --strict: payload must have exactly the payload size
+  };
+  static std::unique_ptr<Embedder> create (const Settings& settings, Status& status);
+  ~Embedder();
+
+  /* add watermark with payload bits (hex string) to n_frames interleaved frames,
+   * the output has the same number of frames, channels and sample rate as the input
+   */
+  Status embed (const std::string& bits, const float *samples, size_t n_frames, int n_channels, int sample_rate,
+                std::vector<float>& out) const;
+  Status embed (const std::string& bits, const std::vector<float>& samples, int n_channels, int sample_rate,
+                std::vector<float>& out) const;
+
+  const Settings& settings() const;
+
+private:
+  class Impl;
+
+  Embedder (const Settings& settings);
+
+  std::unique_ptr<Impl> impl;
+};
+
+class Detector
+{
+public:
+  struct Settings
+  {
+    std::vector<KeySpec> keys;          // keys to search for; empty: default key
+    int          short_payload = 0;     // like --short: 12, 16 or 20 bits; 0: 128 bit payload
+    bool         detect_speed = false;  // like --detect-speed
+    bool         detect_speed_patient = false; // like --detect-speed-patient
+    double       try_speed = 0;         // like --try-speed; 0: no speed correction
+    double       chunk_size = 0;        // like --chunk-size (minutes); 0: default chunk size
+  };
+  struct Match
+  {
+    std::string  key_name;
+    double       time = 0;              // position of the match (seconds)
+    std::string  bits;                  // payload (hex string)
+    double       quality = 0;           // sync quality
+    double       error = 0;             // decode error
+    double       rating = 0;
+    std::string  type;                  // like JSON output: "A", "B", "AB", "ALL", "CLIP-A", ... (with "-SPEED" suffix)
+    double       speed = 1;
+  };
+  struct Result
+  {
+    double              length = 0;     // input length (seconds)
+    std::vector<Match>  matches;        // sorted like the audiowmark get output
+  };
+  static std::unique_ptr<Detector> create (const Settings& settings, Status& status);
+  ~Detector();
+
+  /* detect watermarks in n_frames interleaved frames */
+  Status detect (const float *samples, size_t n_frames, int n_channels, int sample_rate, Result& result) const;
+  Status detect (const std::vector<float>& samples, int n_channels, int sample_rate, Result& result) const;
+
+  const Settings& settings() const;
+
+private:
+  class Impl;
+
+  Detector (const Settings& settings);
+
+  std::unique_ptr<Impl> impl;
+};
+
+}
+
+#endif /* AUDIOWMARK_LIBAUDIOWMARK_HH */
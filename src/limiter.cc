@@ -16,6 +16,9 @@
  */
 
 #include "limiter.hh"
+#include "wmcommon.hh"
+
+#include <algorithm>
 
 #include <assert.h>
 #include <math.h>
@@ -45,25 +48,43 @@ Limiter::set_ceiling (float new_ceiling)
 vector<float>
 Limiter::process (const vector<float>& samples)
 {
-  assert (block_size >= 1);
+  vector<float> out;
+  process (samples, out);
+  return out;
+}
+
+/* like process (samples), but reuses the memory of out for the result */
+void
+Limiter::process (const vector<float>& samples, vector<float>& out)
+{
   assert (samples.size() % n_channels == 0);    // process should be called with whole frames
 
-  buffer.insert (buffer.end(), samples.begin(), samples.end());
+  process (samples.data(), samples.size() / n_channels, out);
+}
+
+/* process n_frames interleaved frames, reuses the memory of out for the result */
+void
+Limiter::process (const float *samples, size_t n_frames, vector<float>& out)
+{
+  assert (block_size >= 1);
+
+  buffer.insert (buffer.end(), samples, samples + n_frames * n_channels);
 
   /* need at least two complete blocks in buffer to produce output */
   const uint buffered_blocks = buffer.size() / n_channels / block_size;
   if (buffered_blocks < 2)
-    return {};
+    {
+      out.clear();
+      return;
+    }
 
   const uint blocks_todo = buffered_blocks - 1;
 
-  vector<float> out (blocks_todo * block_size * n_channels);
+  out.resize (blocks_todo * block_size * n_channels);
   for (uint b = 0; b < blocks_todo; b++)
     process_block (&buffer[b * block_size * n_channels], &out[b * block_size * n_channels]);
 
   buffer.erase (buffer.begin(), buffer.begin() + blocks_todo * block_size * n_channels);
-
-  return out;
 }
 
 size_t
@@ -87,13 +108,93 @@ Limiter::skip (size_t zeros)
   return blocks_todo * block_size;
 }
 
+/* maximum of fabs (in[x]) and start, with independent lanes, so that the loop can be vectorized */
+static inline float
+block_max_loop (const float *in, size_t n, float start)
+{
+  constexpr size_t LANES = 8;
+
+  float lane_max[LANES];
+  for (size_t l = 0; l < LANES; l++)
+    lane_max[l] = start;
+
+  size_t x = 0;
+  for (; x + LANES <= n; x += LANES)
+    for (size_t l = 0; l < LANES; l++)
+      lane_max[l] = max (lane_max[l], fabsf (in[x + l]));
+  for (; x < n; x++)
+    lane_max[0] = max (lane_max[0], fabsf (in[x]));
+
+  float maximum = start;
+  for (size_t l = 0; l < LANES; l++)
+    maximum = max (maximum, lane_max[l]);
+  return maximum;
+}
+
+/* scale n_frames with a linear gain ramp */
+template<int N_CHANNELS>
+static inline void
+scale_loop (const float *in, float *out, size_t n_frames, uint n_channels, float scale_start, float scale_step)
+{
+  if (N_CHANNELS)
+    n_channels = N_CHANNELS;
+
+  for (size_t i = 0; i < n_frames; i++)
+    {
+      const float scale = scale_start + i * scale_step;
+
+      for (uint c = 0; c < n_channels; c++)
+        out[i * n_channels + c] = in[i * n_channels + c] * scale;
+    }
+}
+
+static inline void
+scale_channels_loop (const float *in, float *out, size_t n_frames, uint n_channels, float scale_start, float scale_step)
+{
+  switch (n_channels)
+    {
+      case 1:  scale_loop<1> (in, out, n_frames, n_channels, scale_start, scale_step);
+               break;
+      case 2:  scale_loop<2> (in, out, n_frames, n_channels, scale_start, scale_step);
+               break;
+      default: scale_loop<0> (in, out, n_frames, n_channels, scale_start, scale_step);
+    }
+}
+
+static float AUDIOWMARK_EXTRA_OPT
+block_max_generic (const float *in, size_t n, float start)
+{
+  return block_max_loop (in, n, start);
+}
+
+static void AUDIOWMARK_EXTRA_OPT
+scale_generic (const float *in, float *out, size_t n_frames, uint n_channels, float scale_start, float scale_step)
+{
+  scale_channels_loop (in, out, n_frames, n_channels, scale_start, scale_step);
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+static float AUDIOWMARK_EXTRA_OPT __attribute__((target ("avx2")))
+block_max_avx2 (const float *in, size_t n, float start)
+{
+  return block_max_loop (in, n, start);
+}
+
+static void AUDIOWMARK_EXTRA_OPT __attribute__((target ("avx2")))
+scale_avx2 (const float *in, float *out, size_t n_frames, uint n_channels, float scale_start, float scale_step)
+{
+  scale_channels_loop (in, out, n_frames, n_channels, scale_start, scale_step);
+}
+#endif
+
 float
 Limiter::block_max (const float *in)
 {
-  float maximum = ceiling;
-  for (uint x = 0; x < block_size * n_channels; x++)
-    maximum = max (maximum, fabs (in[x]));
-  return maximum;
+#if defined (__x86_64__) || defined (__i386__)
+  if (have_avx2())
+    return block_max_avx2 (in, block_size * n_channels, ceiling);
+#endif
+  return block_max_generic (in, block_size * n_channels, ceiling);
 }
 
 void
@@ -106,16 +207,22 @@ Limiter::process_block (const float *in, float *out)
   if (block_max_next < ceiling)
     block_max_next = block_max (in + block_size * n_channels);
 
-  const float scale_start = ceiling / max (block_max_last, block_max_current);
-  const float scale_end = ceiling / max (block_max_current, block_max_next);
-  const float scale_step = (scale_end - scale_start) / block_size;
-  for (size_t i = 0; i < block_size; i++)
+  if (block_max_last == ceiling && block_max_current == ceiling && block_max_next == ceiling)
     {
-      const float scale = scale_start + i * scale_step;
-
-      // debug_scale (scale);
-      for (uint c = 0; c < n_channels; c++)
-        out[i * n_channels + c] = in[i * n_channels + c] * scale;
+      /* fast path: no sample exceeds the ceiling, so the gain is 1 for the whole block */
+      std::copy (in, in + block_size * n_channels, out);
+    }
+  else
+    {
+      const float scale_start = ceiling / max (block_max_last, block_max_current);
+      const float scale_end = ceiling / max (block_max_current, block_max_next);
+      const float scale_step = (scale_end - scale_start) / block_size;
+#if defined (__x86_64__) || defined (__i386__)
+      if (have_avx2())
+        scale_avx2 (in, out, block_size, n_channels, scale_start, scale_step);
+      else
+#endif
+        scale_generic (in, out, block_size, n_channels, scale_start, scale_step);
     }
 
   block_max_last = block_max_current;
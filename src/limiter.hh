@@ -42,6 +42,8 @@ public:
   void set_ceiling (float ceiling);
 
   std::vector<float> process (const std::vector<float>& samples);
+  void               process (const std::vector<float>& samples, std::vector<float>& out);
+  void               process (const float *samples, size_t n_frames, std::vector<float>& out);
   size_t             skip (size_t zeros);
   std::vector<float> flush();
 };
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "memorystream.hh"
+
+using std::vector;
+using std::min;
+
+MemoryInputStream::MemoryInputStream (const float *samples, size_t n_frames, int n_channels, int sample_rate) :
+  m_samples (samples),
+  m_n_frames (n_frames),
+  m_n_channels (n_channels),
+  m_sample_rate (sample_rate)
+{
+}
+
+Error
+MemoryInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  samples.resize (count * m_n_channels);
+
+  size_t frames_read;
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * m_n_channels);
+  return err;
+}
+
+Error
+MemoryInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  frames_read = min (count, m_n_frames - m_read_pos);
+
+  std::copy_n (m_samples + m_read_pos * m_n_channels, frames_read * m_n_channels, samples);
+  m_read_pos += frames_read;
+  return Error::Code::NONE;
+}
+
+Error
+MemoryInputStream::seek (size_t frame)
+{
+  m_read_pos = min (frame, m_n_frames);
+  return Error::Code::NONE;
+}
+
+int
+MemoryInputStream::bit_depth() const
+{
+  return 32;
+}
+
+int
+MemoryInputStream::sample_rate() const
+{
+  return m_sample_rate;
+}
+
+size_t
+MemoryInputStream::n_frames() const
+{
+  return m_n_frames;
+}
+
+int
+MemoryInputStream::n_channels() const
+{
+  return m_n_channels;
+}
+
+Encoding
+MemoryInputStream::encoding() const
+{
+  return Encoding::FLOAT;
+}
+
+MemoryOutputStream::MemoryOutputStream (vector<float>& samples, int n_channels, int sample_rate) :
+  m_samples (samples),
+  m_n_channels (n_channels),
+  m_sample_rate (sample_rate)
+{
+}
+
+int
+MemoryOutputStream::bit_depth() const
+{
+  return 32;
+}
+
+int
+MemoryOutputStream::sample_rate() const
+{
+  return m_sample_rate;
+}
+
+int
+MemoryOutputStream::n_channels() const
+{
+  return m_n_channels;
+}
+
+Error
+MemoryOutputStream::write_frames (const vector<float>& frames)
+{
+  m_samples.insert (m_samples.end(), frames.begin(), frames.end());
+  return Error::Code::NONE;
+}
+
+Error
+MemoryOutputStream::write_frames (const float *frames, size_t count)
+{
+  m_samples.insert (m_samples.end(), frames, frames + count * m_n_channels);
+  return Error::Code::NONE;
+}
+
+Error
+MemoryOutputStream::close()
+{
+  return Error::Code::NONE;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_MEMORY_STREAM_HH
+#define AUDIOWMARK_MEMORY_STREAM_HH
+
+#include <vector>
+
+#include "audiostream.hh"
+
+/*
+ * Streams for interleaved float samples in memory, used by libaudiowmark to
+ * process caller provided buffers without any files
+ *
+ * The input stream doesn't copy the samples, so the caller memory must stay
+ * valid while the stream is used.
+ */
+class MemoryInputStream : public AudioInputStream
+{
+  const float  *m_samples = nullptr;
+  size_t        m_n_frames = 0;
+  int           m_n_channels = 0;
+  int           m_sample_rate = 0;
+  size_t        m_read_pos = 0; // in frames
+public:
+  MemoryInputStream (const float *samples, size_t n_frames, int n_channels, int sample_rate);
+
+  Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+  Error   seek (size_t frame) override;
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  size_t  n_frames() const override;
+  int     n_channels() const override;
+  Encoding encoding() const override;
+};
+
+class MemoryOutputStream : public AudioOutputStream
+{
+  std::vector<float>& m_samples;
+  int                 m_n_channels = 0;
+  int                 m_sample_rate = 0;
+public:
+  MemoryOutputStream (std::vector<float>& samples, int n_channels, int sample_rate);
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  int     n_channels() const override;
+
+  Error   write_frames (const std::vector<float>& frames) override;
+  Error   write_frames (const float *frames, size_t count) override;
+  Error   close() override;
+};
+
+#endif /* AUDIOWMARK_MEMORY_STREAM_HH */
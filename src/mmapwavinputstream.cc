@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mmapwavinputstream.hh"
+#include "rawconverter.hh"
+
+#include <algorithm>
+#include <array>
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+using std::min;
+
+static string
+get_4cc (const unsigned char *bytes)
+{
+  return string (reinterpret_cast<const char *> (bytes), 4);
+}
+
+static uint16_t
+get_u16 (const unsigned char *bytes)
+{
+  return bytes[0] + (bytes[1] << 8);
+}
+
+static uint32_t
+get_u32 (const unsigned char *bytes)
+{
+  return bytes[0] + (bytes[1] << 8) + (bytes[2] << 16) + (uint32_t (bytes[3]) << 24);
+}
+
+static uint64_t
+get_u64 (const unsigned char *bytes)
+{
+  return get_u32 (bytes) + (uint64_t (get_u32 (bytes + 4)) << 32);
+}
+
+MMapWavInputStream::~MMapWavInputStream()
+{
+  close();
+}
+
+Error
+MMapWavInputStream::open (const string& filename)
+{
+  assert (m_state == State::NEW);
+
+  if (filename == "-")
+    return Error ("wav input from stdin can not be mapped");
+
+  m_fd = ::open (filename.c_str(), O_RDONLY);
+  if (m_fd < 0)
+    return Error (strerror (errno));
+
+  struct stat st;
+  if (fstat (m_fd, &st) != 0)
+    {
+      Error err (strerror (errno));
+      close();
+      return err;
+    }
+  if (!S_ISREG (st.st_mode) || st.st_size < 12)
+    {
+      close();
+      return Error ("input file is not a regular wav file");
+    }
+
+  void *map = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+  if (map == MAP_FAILED)
+    {
+      Error err (string_printf ("failed to map wav input: %s", strerror (errno)));
+      close();
+      return err;
+    }
+  m_map = static_cast<unsigned char *> (map);
+  m_map_size = st.st_size;
+
+  Error err = parse_header();
+  if (err)
+    {
+      close();
+      return err;
+    }
+  /* samples are read from start to end */
+  madvise (m_map, m_map_size, MADV_SEQUENTIAL);
+
+  m_state = State::OPEN;
+  return Error::Code::NONE;
+}
+
+Error
+MMapWavInputStream::parse_header()
+{
+  const unsigned char *end = m_map + m_map_size;
+
+  if ((get_4cc (m_map) != "RIFF" && get_4cc (m_map) != "RF64") || get_4cc (m_map + 8) != "WAVE")
+    return Error ("input file is not a valid wav file");
+
+  const bool rf64 = get_4cc (m_map) == "RF64";
+  bool       have_ds64 = false;
+  uint64_t   ds64_data_size = 0;
+  bool       have_fmt_chunk = false;
+  RawFormat  format;
+
+  const unsigned char *ptr = m_map + 12;
+  while (end - ptr >= 8)
+    {
+      const unsigned char *chunk = ptr + 8;
+      const uint64_t       avail = end - chunk;
+      uint64_t             chunk_size = get_u32 (ptr + 4);
+
+      if (get_4cc (ptr) == "ds64" && rf64 && chunk_size >= 24 && chunk_size <= avail)
+        {
+          ds64_data_size = get_u64 (chunk + 8);
+          have_ds64 = true;
+        }
+      else if (get_4cc (ptr) == "fmt " && chunk_size >= 16 && chunk_size <= avail && !have_fmt_chunk)
+        {
+          int format_type = get_u16 (chunk);
+          if (format_type == 0xFFFE && chunk_size >= 40) /* extended: the format type is part of the sub format guid */
+            {
+              static const std::array<unsigned char, 14> fmt_guid_tail
+                {
+                  0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+                  0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+                };
+              if (!std::equal (fmt_guid_tail.begin(), fmt_guid_tail.end(), chunk + 26))
+                return Error ("wav input has unsupported extended format type");
+
+              format_type = get_u16 (chunk + 24);
+            }
+          format.set_channels (get_u16 (chunk + 2));
+          format.set_sample_rate (get_u32 (chunk + 4));
+          format.set_bit_depth (get_u16 (chunk + 14));
+
+          /* only formats where the samples can be converted without libsndfile producing different values */
+          if (format_type == 1 && format.bit_depth() == 16)
+            format.set_encoding (Encoding::SIGNED);
+          else if (format_type == 3 && format.bit_depth() == 32)
+            format.set_encoding (Encoding::FLOAT);
+          else
+            return Error ("wav input format is not supported for mapping");
+
+          if (format.n_channels() < 1 || format.sample_rate() < 1)
+            return Error ("wav input has invalid fmt chunk");
+
+          have_fmt_chunk = true;
+        }
+      else if (get_4cc (ptr) == "data")
+        {
+          if (!have_fmt_chunk)
+            return Error ("wav input is incomplete (missing fmt chunk)");
+
+          if (rf64 && chunk_size == 0xFFFFFFFF)
+            {
+              if (!have_ds64)
+                return Error ("rf64 input is incomplete (missing ds64 chunk)");
+              chunk_size = ds64_data_size;
+            }
+          const int sample_width = format.bit_depth() / 8;
+          if ((chunk - m_map) % sample_width != 0)
+            return Error ("wav input data chunk is not aligned");
+
+          Error err;
+          m_raw_converter.reset (RawConverter::create (format, err));
+          if (err)
+            return err;
+
+          /* truncated files: use the samples that are available */
+          m_data     = chunk;
+          m_n_frames = min (chunk_size, avail) / (sample_width * format.n_channels());
+          m_format   = format;
+          return Error::Code::NONE;
+        }
+      if (chunk_size > avail)
+        break;
+
+      ptr = chunk + chunk_size + (chunk_size & 1); /* chunks are padded to an even size */
+    }
+  return Error ("wav input is incomplete (no data chunk found)");
+}
+
+int
+MMapWavInputStream::sample_rate() const
+{
+  return m_format.sample_rate();
+}
+
+int
+MMapWavInputStream::bit_depth() const
+{
+  return m_format.bit_depth();
+}
+
+size_t
+MMapWavInputStream::n_frames() const
+{
+  return m_n_frames;
+}
+
+int
+MMapWavInputStream::n_channels() const
+{
+  return m_format.n_channels();
+}
+
+Encoding
+MMapWavInputStream::encoding() const
+{
+  return m_format.encoding();
+}
+
+Error
+MMapWavInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  size_t frames_read = 0;
+
+  samples.resize (count * m_format.n_channels());
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * m_format.n_channels());
+
+  return err;
+}
+
+Error
+MMapWavInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  assert (m_state == State::OPEN);
+
+  const size_t frame_bytes = m_format.n_channels() * m_format.bit_depth() / 8;
+
+  frames_read = min (count, m_n_frames - m_read_pos);
+  m_raw_converter->from_raw (m_data + m_read_pos * frame_bytes, samples, frames_read * m_format.n_channels());
+  m_read_pos += frames_read;
+
+  return Error::Code::NONE;
+}
+
+Error
+MMapWavInputStream::seek (size_t frame)
+{
+  assert (m_state == State::OPEN);
+
+  m_read_pos = min (frame, m_n_frames);
+  return Error::Code::NONE;
+}
+
+void
+MMapWavInputStream::close()
+{
+  if (m_map)
+    {
+      munmap (m_map, m_map_size);
+      m_map = nullptr;
+      m_map_size = 0;
+      m_data = nullptr;
+    }
+  if (m_fd >= 0)
+    {
+      ::close (m_fd);
+      m_fd = -1;
+    }
+  if (m_state == State::OPEN)
+    m_state = State::CLOSED;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_MMAP_WAV_INPUT_STREAM_HH
+#define AUDIOWMARK_MMAP_WAV_INPUT_STREAM_HH
+
+#include <string>
+#include <memory>
+
+#include "audiostream.hh"
+#include "rawinputstream.hh"
+
+/*
+ * Input stream for uncompressed 16-bit PCM and 32-bit float WAV/RF64 files,
+ * which maps the file into memory (instead of reading it using libsndfile)
+ *
+ * The samples are converted from the mapping directly into the memory
+ * provided by the caller, and the page cache is shared between processes
+ * that read the same file. Other formats (and stdin) are rejected by open(),
+ * so AudioInputStream::create can fall back to SFInputStream.
+ */
+class MMapWavInputStream : public AudioInputStream
+{
+  enum class State {
+    NEW,
+    OPEN,
+    CLOSED
+  };
+  State                 m_state = State::NEW;
+  RawFormat             m_format;
+  int                   m_fd = -1;
+  unsigned char        *m_map = nullptr;
+  size_t                m_map_size = 0;
+  const unsigned char  *m_data = nullptr;
+  size_t                m_n_frames = 0;
+  size_t                m_read_pos = 0; // in frames
+
+  std::unique_ptr<RawConverter> m_raw_converter;
+
+  Error   parse_header();
+public:
+  ~MMapWavInputStream();
+
+  Error   open (const std::string& filename);
+  Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+  Error   seek (size_t frame) override;
+  void    close();
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  size_t  n_frames() const override;
+  int     n_channels() const override;
+  Encoding encoding() const override;
+};
+
+#endif /* AUDIOWMARK_MMAP_WAV_INPUT_STREAM_HH */
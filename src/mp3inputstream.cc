@@ -19,11 +19,14 @@
 
 #include <mpg123.h>
 #include <assert.h>
+#include <string.h>
+#include <stdio.h>
 
 using std::min;
 using std::string;
+using std::vector;
 
-static void
+static Error
 mp3_init()
 {
   static bool mpg123_init_ok = false;
@@ -31,12 +34,53 @@ mp3_init()
     {
       int err = mpg123_init();
       if (err != MPG123_OK)
-        {
-          error ("audiowmark: init mpg123 lib failed\n");
-          exit (1);
-        }
+        return Error ("init mpg123 lib failed");
+
       mpg123_init_ok = true;
     }
+  return Error::Code::NONE;
+}
+
+namespace
+{
+
+struct ScopedMHandle
+{
+  mpg123_handle *mh         = nullptr;
+  bool           need_close = false;
+
+  ~ScopedMHandle()
+  {
+    if (mh && need_close)
+      mpg123_close (mh);
+
+    if (mh)
+      mpg123_delete (mh);
+  }
+};
+
+}
+
+static Error
+mp3_set_params (mpg123_handle *mh)
+{
+  int err = mpg123_param (mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+  if (err != MPG123_OK)
+    return Error ("setting quiet mode failed");
+
+  // allow arbitary amount of data for resync */
+  err = mpg123_param (mh, MPG123_RESYNC_LIMIT, -1, 0);
+  if (err != MPG123_OK)
+    return Error ("setting resync limit parameter failed");
+
+  /* after seeking, decode enough frames before the seek position to restore
+   * the bit reservoir, the imdct overlap and the synthesis filter state
+   */
+  err = mpg123_param (mh, MPG123_PREFRAMES, 4, 0);
+  if (err != MPG123_OK)
+    return Error ("setting preframes parameter failed");
+
+  return Error::Code::NONE;
 }
 
 MP3InputStream::~MP3InputStream()
@@ -47,22 +91,20 @@ MP3InputStream::~MP3InputStream()
 Error
 MP3InputStream::open (const string& filename)
 {
-  int err = 0;
-
-  mp3_init();
+  Error init_err = mp3_init();
+  if (init_err)
+    return init_err;
 
+  int err = 0;
   m_handle = mpg123_new (nullptr, &err);
   if (err != MPG123_OK)
     return Error ("mpg123_new failed");
 
-  err = mpg123_param (m_handle, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
-  if (err != MPG123_OK)
-    return Error ("setting quiet mode failed");
+  m_state = State::OPEN;
 
-  // allow arbitary amount of data for resync */
-  err = mpg123_param (m_handle, MPG123_RESYNC_LIMIT, -1, 0);
-  if (err != MPG123_OK)
-    return Error ("setting resync limit parameter failed");
+  Error params_err = mp3_set_params (m_handle);
+  if (params_err)
+    return params_err;
 
   // force floating point output
   {
@@ -86,7 +128,9 @@ MP3InputStream::open (const string& filename)
 
   m_need_close = true;
 
-  /* scan headers to get best possible length estimate */
+  /* scan headers to get best possible length estimate, this also builds
+   * the seek index for parallel decoding
+   */
   err = mpg123_scan (m_handle);
   if (err != MPG123_OK)
     return Error (mpg123_strerror (m_handle));
@@ -103,17 +147,126 @@ MP3InputStream::open (const string& filename)
   mpg123_format_none (m_handle);
   mpg123_format (m_handle, rate, channels, encoding);
 
-  m_n_values = mpg123_length (m_handle) * channels;
+  const off_t length = mpg123_length (m_handle);
+  if (length < 0)
+    return Error (mpg123_strerror (m_handle));
+
+  m_n_frames = length;
   m_n_channels = channels;
   m_sample_rate = rate;
-  m_frames_left = m_n_values / m_n_channels;
+  m_frames_left = m_n_frames;
+
+  const size_t n_workers = ParallelDecoder::n_workers (m_n_frames);
+  if (n_workers > 1)
+    {
+      off_t *offsets;
+      off_t  step;
+      size_t fill;
+
+      err = mpg123_index (m_handle, &offsets, &step, &fill);
+      if (err != MPG123_OK)
+        return Error (mpg123_strerror (m_handle));
+
+      const vector<off_t> index (offsets, offsets + fill);
+      auto new_decoder = [filename, index, step, rate, channels, encoding] ()
+        {
+          return new_segment_decoder (filename, index, step, rate, channels, encoding);
+        };
+      m_parallel_decoder.reset (new ParallelDecoder (new_decoder, m_n_frames, m_n_channels, n_workers));
+    }
 
   return Error::Code::NONE;
 }
 
+/* decoder for one worker of the parallel decoder, with its own mpg123 handle */
+ParallelDecoder::DecodeFunc
+MP3InputStream::new_segment_decoder (const string& filename, vector<off_t> index, off_t index_step, long rate, int channels, int encoding)
+{
+  auto smh = std::make_shared<ScopedMHandle>();
+  auto open_handle = [&] () -> Error
+    {
+      int err = 0;
+
+      smh->mh = mpg123_new (nullptr, &err);
+      if (err != MPG123_OK)
+        return Error ("mpg123_new failed");
+
+      Error params_err = mp3_set_params (smh->mh);
+      if (params_err)
+        return params_err;
+
+      mpg123_format_none (smh->mh);
+      err = mpg123_format (smh->mh, rate, channels, encoding);
+      if (err != MPG123_OK)
+        return Error (mpg123_strerror (smh->mh));
+
+      err = mpg123_open (smh->mh, filename.c_str());
+      if (err != MPG123_OK)
+        return Error (mpg123_strerror (smh->mh));
+
+      smh->need_close = true;
+
+      /* reuse the index of the main handle, so seeking doesn't need to scan the file again */
+      err = mpg123_set_index (smh->mh, index.data(), index_step, index.size());
+      if (err != MPG123_OK)
+        return Error (mpg123_strerror (smh->mh));
+
+      long h_rate;
+      int h_channels;
+      int h_encoding;
+      err = mpg123_getformat (smh->mh, &h_rate, &h_channels, &h_encoding);
+      if (err != MPG123_OK)
+        return Error (mpg123_strerror (smh->mh));
+
+      if (h_rate != rate || h_channels != channels)
+        return Error ("mp3 format changed during parallel decoding");
+
+      return Error::Code::NONE;
+    };
+  Error open_err = open_handle();
+
+  return [smh, open_err, channels] (size_t start_frame, size_t n_frames, float *out, size_t& frames_decoded) mutable -> Error
+    {
+      if (open_err)
+        return open_err;
+
+      /* sample accurate seek, frames before start_frame are decoded as preframes */
+      if (mpg123_seek (smh->mh, start_frame, SEEK_SET) < 0)
+        return Error (mpg123_strerror (smh->mh));
+
+      const size_t n_values = n_frames * channels;
+      size_t values_done = 0;
+      bool   eof = false;
+      while (!eof && values_done < n_values)
+        {
+          size_t done;
+          int err = mpg123_read (smh->mh, reinterpret_cast<unsigned char *> (out + values_done), (n_values - values_done) * sizeof (float), &done);
+          values_done += done / sizeof (float);
+
+          if (err == MPG123_DONE || err == MPG123_NEED_MORE)
+            eof = true; // see read_frames
+          else if (err != MPG123_OK)
+            return Error (mpg123_strerror (smh->mh));
+        }
+      /* pad zero samples at end, like the serial decoder, since the length is known */
+      memset (out + values_done, 0, (n_values - values_done) * sizeof (float));
+      frames_decoded = n_frames;
+      return Error::Code::NONE;
+    };
+}
+
 Error
 MP3InputStream::read_frames (std::vector<float>& samples, size_t count)
 {
+  if (m_parallel_decoder)
+    {
+      size_t frames_read = 0;
+
+      samples.resize (count * m_n_channels);
+      Error err = m_parallel_decoder->read_frames (samples.data(), count, frames_read);
+      samples.resize (frames_read * m_n_channels);
+      return err;
+    }
   while (!m_eof && m_read_buffer.size() < count * m_n_channels)
     {
       size_t buffer_bytes = mpg123_outblock (m_handle);
@@ -158,11 +311,32 @@ MP3InputStream::read_frames (std::vector<float>& samples, size_t count)
   return Error::Code::NONE;
 }
 
+Error
+MP3InputStream::seek (size_t frame)
+{
+  assert (m_state == State::OPEN);
+
+  /* the parallel decoder only reads the file from start to end, after seeking the file is decoded serially */
+  m_parallel_decoder.reset();
+
+  frame = min (frame, m_n_frames);
+  if (mpg123_seek (m_handle, frame, SEEK_SET) < 0)
+    return Error (mpg123_strerror (m_handle));
+
+  m_read_buffer.clear();
+  m_frames_left = m_n_frames - frame;
+  m_eof = false;
+  return Error::Code::NONE;
+}
+
 void
 MP3InputStream::close()
 {
   if (m_state == State::OPEN)
     {
+      /* stop the worker threads before closing */
+      m_parallel_decoder.reset();
+
       if (m_handle && m_need_close)
         mpg123_close (m_handle);
 
@@ -202,7 +376,7 @@ MP3InputStream::n_channels() const
 size_t
 MP3InputStream::n_frames() const
 {
-  return m_n_values / m_n_channels;
+  return m_n_frames;
 }
 
 /* there is no really simple way of detecting if something is an mp3
@@ -213,25 +387,10 @@ MP3InputStream::n_frames() const
 bool
 MP3InputStream::detect (const string& filename)
 {
-  struct ScopedMHandle
-  {
-    mpg123_handle *mh         = nullptr;
-    bool           need_close = false;
-
-    ~ScopedMHandle()
-    {
-      if (mh && need_close)
-        mpg123_close (mh);
-
-      if (mh)
-        mpg123_delete (mh);
-    }
-  };
+  if (mp3_init())
+    return false;
 
   int err = 0;
-
-  mp3_init();
-
   mpg123_handle *mh = mpg123_new (NULL, &err);
   if (err != MPG123_OK)
     return false;
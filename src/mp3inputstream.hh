@@ -18,10 +18,13 @@
 #ifndef AUDIOWMARK_MP3_INPUT_STREAM_HH
 #define AUDIOWMARK_MP3_INPUT_STREAM_HH
 
+#include <memory>
 #include <string>
+#include <vector>
 #include <mpg123.h>
 
 #include "audiostream.hh"
+#include "paralleldecoder.hh"
 
 class MP3InputStream : public AudioInputStream
 {
@@ -30,7 +33,7 @@ class MP3InputStream : public AudioInputStream
     OPEN,
     CLOSED
   };
-  int         m_n_values = 0;
+  size_t      m_n_frames = 0;
   int         m_n_channels = 0;
   int         m_sample_rate = 0;
   size_t      m_frames_left = 0;
@@ -40,11 +43,17 @@ class MP3InputStream : public AudioInputStream
 
   mpg123_handle     *m_handle = nullptr;
   std::vector<float> m_read_buffer;
+
+  std::unique_ptr<ParallelDecoder> m_parallel_decoder;
+
+  static ParallelDecoder::DecodeFunc new_segment_decoder (const std::string& filename, std::vector<off_t> index, off_t index_step,
+                                                          long rate, int channels, int encoding);
 public:
   ~MP3InputStream();
 
   Error   open (const std::string& filename);
   Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   seek (size_t frame) override;
   void    close();
 
   int     bit_depth() const override;
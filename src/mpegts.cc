@@ -17,8 +17,15 @@
 
 #include <array>
 #include <regex>
+#include <algorithm>
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "utils.hh"
 #include "mpegts.hh"
 
@@ -32,10 +39,13 @@ class TSPacket
 public:
   enum class ID { awmk_file, awmk_data, unknown };
 
+  static constexpr size_t packet_size = 188;
+  static constexpr size_t header_size = 12; // awmk packets: id bytes before the payload
+
 private:
-  std::array<unsigned char, 188> m_data;
+  std::array<unsigned char, packet_size> m_data;
 
-  std::array<unsigned char, 12>
+  std::array<unsigned char, header_size>
   get_id_bytes (ID type)
   {
     if (type == ID::awmk_file)
@@ -44,31 +54,22 @@ private:
       return { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'd', 'a', 't', 'a' };
     return {0,};
   }
-public:
-  bool
-  read (FILE *file, Error& err)
+  static bool
+  id_eq (const unsigned char *data, size_t offset, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
   {
-    size_t bytes_read = fread (m_data.data(), 1, m_data.size(), file);
-    if (bytes_read == 0) /* probably eof */
-      return false;
-
-    if (bytes_read == m_data.size()) /* successful read */
-      {
-        if (m_data[0] == 'G')
-          return true;
-
-        err = Error ("bad packet sync while reading transport (.ts) packet");
-        return false;
-      }
-
-    err = Error ("short read while reading transport stream (.ts) packet");
-    return false;
+    return data[offset] == a && data[offset + 1] == b && data[offset + 2] == c && data[offset + 3] == d;
   }
+public:
   Error
   write (FILE *file)
   {
-    size_t bytes_written = fwrite (m_data.data(), 1, m_data.size(), file);
-    if (bytes_written != m_data.size())
+    return write (m_data.data(), file);
+  }
+  static Error
+  write (const unsigned char *data, FILE *file)
+  {
+    size_t bytes_written = fwrite (data, 1, packet_size, file);
+    if (bytes_written != packet_size)
       return Error ("short write while writing transport stream (.ts) packet");
 
     return Error::Code::NONE;
@@ -85,32 +86,120 @@ public:
   {
     return m_data[n];
   }
-  bool
-  id_eq (size_t offset, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+  /* id of the packet data (packet_size bytes) */
+  static ID
+  get_id (const unsigned char *data)
   {
-    return m_data[offset] == a && m_data[offset + 1] == b && m_data[offset + 2] == c && m_data[offset + 3] == d;
-  }
-  ID
-  get_id()
-  {
-    if (id_eq (0, 'G', 0x1F, 0xFF, 0x10) && id_eq (4, 'A', 'W', 'M', 'K'))
+    if (id_eq (data, 0, 'G', 0x1F, 0xFF, 0x10) && id_eq (data, 4, 'A', 'W', 'M', 'K'))
       {
-        if (id_eq (8, 'f', 'i', 'l', 'e'))
+        if (id_eq (data, 8, 'f', 'i', 'l', 'e'))
           return ID::awmk_file;
-        if (id_eq (8, 'd', 'a', 't', 'a'))
+        if (id_eq (data, 8, 'd', 'a', 't', 'a'))
           return ID::awmk_data;
       }
     return ID::unknown;
   }
-  constexpr size_t
-  size()
+};
+
+/*
+ * Sequential access to the packets of a transport stream: regular files are
+ * mapped into memory, so the packets are used in place, without copying.
+ * Other input (stdin, pipes) is read in blocks of packets.
+ */
+class TSPacketInput
+{
+  FILE                 *m_file = nullptr;
+  bool                  m_close_file = false;
+  bool                  m_mapped = false;
+  unsigned char        *m_map = nullptr;
+  size_t                m_map_size = 0;
+  vector<unsigned char> m_buffer;
+  size_t                m_pos = 0;  // read position in map or buffer
+  size_t                m_size = 0; // valid bytes in map or buffer
+
+  static constexpr size_t packet_size = TSPacket::packet_size;
+public:
+  ~TSPacketInput()
+  {
+    if (m_map)
+      munmap (m_map, m_map_size);
+    if (m_close_file)
+      fclose (m_file);
+  }
+  Error
+  open (const string& filename)
   {
-    return m_data.size(); // is constant
+    if (filename == "-")
+      {
+        m_file = stdin;
+        return Error::Code::NONE;
+      }
+    int fd = ::open (filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return Error (string_printf ("error opening input .ts '%s'", filename.c_str()));
+
+    struct stat st;
+    if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+      {
+        m_mapped = true;
+        if (st.st_size > 0)
+          {
+            void *map = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+              {
+                Error err (string_printf ("failed to map input .ts '%s': %s", filename.c_str(), strerror (errno)));
+                ::close (fd);
+                return err;
+              }
+            m_map = static_cast<unsigned char *> (map);
+            m_map_size = m_size = st.st_size;
+            madvise (m_map, m_map_size, MADV_SEQUENTIAL);
+          }
+        ::close (fd); // the mapping stays valid
+        return Error::Code::NONE;
+      }
+    m_file = fdopen (fd, "r");
+    if (!m_file)
+      {
+        ::close (fd);
+        return Error (string_printf ("error opening input .ts '%s'", filename.c_str()));
+      }
+    m_close_file = true;
+    return Error::Code::NONE;
   }
-  const std::array<unsigned char, 188>&
-  data()
+  /* returns the next packet (packet_size bytes), or nullptr on eof / error */
+  const unsigned char *
+  next (Error& err)
   {
-    return m_data;
+    if (!m_mapped && m_pos == m_size)
+      {
+        /* refill buffer */
+        m_buffer.resize (packet_size * 256);
+        m_pos = 0;
+        m_size = fread (m_buffer.data(), 1, m_buffer.size(), m_file);
+        if (ferror (m_file))
+          {
+            err = Error ("read error while reading transport stream (.ts)");
+            return nullptr;
+          }
+      }
+    const size_t bytes_left = m_size - m_pos;
+    if (bytes_left == 0) /* eof */
+      return nullptr;
+
+    if (bytes_left < packet_size)
+      {
+        err = Error ("short read while reading transport stream (.ts) packet");
+        return nullptr;
+      }
+    const unsigned char *packet = (m_mapped ? m_map : m_buffer.data()) + m_pos;
+    if (packet[0] != 'G')
+      {
+        err = Error ("bad packet sync while reading transport (.ts) packet");
+        return nullptr;
+      }
+    m_pos += packet_size;
+    return packet;
   }
 };
 
@@ -126,7 +215,7 @@ TSWriter::append_file (const string& name, const string& filename)
   while ((c = fgetc (datafile)) >= 0)
     data.push_back (c);
 
-  entries.push_back ({name, data});
+  entries.push_back ({name, std::move (data)});
   return Error::Code::NONE;
 }
 
@@ -144,7 +233,7 @@ TSWriter::append_vars (const string& name, const map<string, string>& vars)
       data.push_back (0);
     }
 
-  entries.push_back ({name, data});
+  entries.push_back ({name, std::move (data)});
 }
 
 void
@@ -153,174 +242,169 @@ TSWriter::append_data (const string& name, const vector<unsigned char>& data)
   entries.push_back ({name, data});
 }
 
+void
+TSWriter::append_data (const string& name, vector<unsigned char>&& data)
+{
+  entries.push_back ({name, std::move (data)});
+}
+
 Error
 TSWriter::process (const string& inname, const string& outname)
 {
-  FILE *infile = fopen (inname.c_str(), "r");
-  FILE *outfile = fopen (outname.c_str(), "w");
-  ScopedFile infile_s (infile);
-  ScopedFile outfile_s (outfile);
-
-  if (!infile)
+  TSPacketInput input;
+  Error err = input.open (inname);
+  if (err)
     {
       error ("audiowmark: unable to open %s for reading\n", inname.c_str());
-      return Error (strerror (errno));
+      return err;
     }
 
+  FILE *outfile = fopen (outname.c_str(), "w");
+  ScopedFile outfile_s (outfile);
+
   if (!outfile)
     {
       error ("audiowmark: unable to open %s for writing\n", outname.c_str());
       return Error (strerror (errno));
     }
 
-  while (!feof (infile))
+  /* copy input packets as they are read */
+  while (const unsigned char *packet = input.next (err))
     {
-      TSPacket p;
-      Error err;
-      bool read_ok = p.read (infile, err);
-      if (!read_ok)
-        {
-          if (err)
-            return err;
-        }
-      else
-        {
-          err = p.write (outfile);
-          if (err)
-            return err;
-        }
+      err = TSPacket::write (packet, outfile);
+      if (err)
+        return err;
     }
+  if (err)
+    return err;
 
-  for (auto entry : entries)
+  /* entries: header and data are split into the payload of awmk packets without building a combined copy */
+  for (const auto& entry : entries)
     {
-      string header = string_printf ("%zd:%s", entry.data.size(), entry.name.c_str()) + '\0';
-      vector<unsigned char> data = entry.data;
-      for (size_t i = 0; i < header.size(); i++)
-        data.insert (data.begin() + i, header[i]);
+      const string header = string_printf ("%zd:%s", entry.data.size(), entry.name.c_str()) + '\0';
 
       TSPacket p_file;
       p_file.clear (TSPacket::ID::awmk_file);
-      size_t data_pos = 0;
-      int pos = 12;
-      while (data_pos < data.size())
+      size_t pos = TSPacket::header_size;
+
+      auto put_bytes = [&] (const unsigned char *bytes, size_t n_bytes)
         {
-          p_file[pos++] = data[data_pos];
-          if (pos == 188)
+          while (n_bytes)
             {
-              Error err = p_file.write (outfile);
-              if (err)
-                return err;
+              const size_t todo = std::min (n_bytes, TSPacket::packet_size - pos);
+              std::copy (bytes, bytes + todo, &p_file[pos]);
+              pos += todo;
+              bytes += todo;
+              n_bytes -= todo;
+              if (pos == TSPacket::packet_size)
+                {
+                  Error err = p_file.write (outfile);
+                  if (err)
+                    return err;
 
-              p_file.clear (TSPacket::ID::awmk_data);
-              pos = 12;
+                  p_file.clear (TSPacket::ID::awmk_data);
+                  pos = TSPacket::header_size;
+                }
             }
-          data_pos++;
-        }
-
-      if (pos != 12)
+          return Error (Error::Code::NONE);
+        };
+      err = put_bytes (reinterpret_cast<const unsigned char *> (header.data()), header.size());
+      if (err)
+        return err;
+      err = put_bytes (entry.data.data(), entry.data.size());
+      if (err)
+        return err;
+
+      if (pos != TSPacket::header_size)
         {
-          Error err = p_file.write (outfile);
+          err = p_file.write (outfile);
           if (err)
             return err;
         }
     }
+  if (fflush (outfile) != 0)
+    return Error (string_printf ("error writing %s: %s", outname.c_str(), strerror (errno)));
 
   return Error::Code::NONE;
 }
 
+/* parse entry header "<size>:<filename>" */
 bool
-TSReader::parse_header (Header& header, vector<unsigned char>& data)
+TSReader::parse_header (const string& header_str, Header& header)
 {
-  for (size_t i = 0; i < data.size(); i++)
+  static const regex header_re ("([0-9]*):(.*)");
+  std::smatch sm;
+  if (regex_match (header_str, sm, header_re))
     {
-      if (data[i] == 0) // header is terminated with one single 0 byte
-        {
-          string s = (const char *) (&data[0]);
-
-          static const regex header_re ("([0-9]*):(.*)");
-          std::smatch sm;
-          if (regex_match (s, sm, header_re))
-            {
-              header.data_size = atoi (sm[1].str().c_str());
-              header.filename = sm[2];
-
-              // erase header including null termination
-              data.erase (data.begin(), data.begin() + i + 1);
-              return true;
-            }
-        }
+      header.data_size = atoi (sm[1].str().c_str());
+      header.filename = sm[2];
+      return true;
     }
   return false;
 }
 
+/*
+ * The payload of the awmk packets is copied exactly once, directly into the
+ * data of the entry it belongs to. Other packets (audio) are only inspected
+ * in place.
+ */
 Error
 TSReader::load (const string& inname)
 {
-  if (inname == "-")
-    {
-      return load (stdin);
-    }
-  else
-    {
-      FILE *infile = fopen (inname.c_str(), "r");
-      ScopedFile infile_s (infile);
-      if (!infile)
-        return Error (string_printf ("error opening input .ts '%s'", inname.c_str()));
-      return load (infile);
-    }
-}
+  TSPacketInput input;
+  Error err = input.open (inname);
+  if (err)
+    return err;
 
-Error
-TSReader::load (FILE *infile)
-{
-  vector<unsigned char> awmk_stream;
+  enum class State { NONE, HEADER, DATA } state = State::NONE;
+  string header_str;
   Header header;
-  bool header_valid = false;
-  Error err;
-  while (!feof (infile))
+  Entry entry;
+  while (const unsigned char *packet = input.next (err))
     {
-      TSPacket p;
-      bool read_ok = p.read (infile, err);
-      if (!read_ok)
+      TSPacket::ID id = TSPacket::get_id (packet);
+      if (id == TSPacket::ID::awmk_file)
         {
-          if (err)
-            return err;
+          /* new stream start, clear old contents */
+          state = State::HEADER;
+          header_str.clear();
         }
-      else
+      if ((id != TSPacket::ID::awmk_file && id != TSPacket::ID::awmk_data) || state == State::NONE)
+        continue;
+
+      const unsigned char *payload = packet + TSPacket::header_size;
+      const unsigned char *payload_end = packet + TSPacket::packet_size;
+      if (state == State::HEADER)
         {
-          TSPacket::ID id = p.get_id();
-          if (id == TSPacket::ID::awmk_file)
+          // header is terminated with one single 0 byte
+          const unsigned char *header_end = std::find (payload, payload_end, 0);
+          header_str.append (payload, header_end);
+          if (header_end == payload_end)
+            continue;
+
+          if (!parse_header (header_str, header))
             {
-              /* new stream start, clear old contents */
-              header_valid = false;
-              awmk_stream.clear();
+              state = State::NONE; // invalid header: ignore data until the next stream start
+              continue;
             }
-          if (id == TSPacket::ID::awmk_file || id == TSPacket::ID::awmk_data)
-            {
-              awmk_stream.insert (awmk_stream.end(), p.data().begin() + 12, p.data().end());
-
-              if (!header_valid)
-                {
-                  if (parse_header (header, awmk_stream))
-                    {
-                      awmk_stream.reserve (header.data_size + p.size());
-                      header_valid = true;
-                    }
-                }
-              // done? do we have enough bytes for the complete entry?
-              if (header_valid && awmk_stream.size() >= header.data_size)
-                {
-                  awmk_stream.resize (header.data_size);
-
-                  m_entries.push_back ({ header.filename, std::move (awmk_stream)});
+          entry.filename = header.filename;
+          entry.data.clear();
+          entry.data.reserve (header.data_size);
+          payload = header_end + 1;
+          state = State::DATA;
+        }
+      const size_t todo = std::min<size_t> (payload_end - payload, header.data_size - entry.data.size());
+      entry.data.insert (entry.data.end(), payload, payload + todo);
 
-                  header_valid = false;
-                  awmk_stream.clear();
-                }
-            }
+      // done? do we have all bytes of the entry?
+      if (entry.data.size() == header.data_size)
+        {
+          m_entries.push_back (std::move (entry));
+          entry = Entry();
+          state = State::NONE;
         }
     }
-  return Error::Code::NONE;
+  return err;
 }
 
 const vector<TSReader::Entry>&
@@ -35,8 +35,7 @@ private:
     size_t      data_size = 0;
   };
   std::vector<Entry> m_entries;
-  bool parse_header (Header& header, std::vector<unsigned char>& data);
-  Error load (FILE *infile);
+  bool parse_header (const std::string& header_str, Header& header);
 public:
   Error load (const std::string& inname);
   const std::vector<Entry>& entries();
@@ -56,6 +55,7 @@ public:
   Error append_file (const std::string& name, const std::string& filename);
   void  append_vars (const std::string& name, const std::map<std::string, std::string>& vars);
   void  append_data (const std::string& name, const std::vector<unsigned char>& data);
+  void  append_data (const std::string& name, std::vector<unsigned char>&& data);
   Error process (const std::string& in_name, const std::string& out_name);
 };
 
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <string.h>
+
+#include "paralleldecoder.hh"
+#include "audiostream.hh"
+#include "threadpool.hh"
+#include "profile.hh"
+
+using std::min;
+using std::vector;
+
+size_t
+ParallelDecoder::n_workers (size_t n_frames)
+{
+  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
+    return 0;
+
+  const size_t n_segments = (n_frames + segment_frames - 1) / segment_frames;
+  if (n_segments < 2)
+    return 0;
+
+  ThreadPool thread_pool;
+  return min ({ n_segments, thread_pool.n_threads(), size_t (max_workers) });
+}
+
+ParallelDecoder::ParallelDecoder (const NewDecoderFunc& new_decoder, size_t n_frames, int n_channels, size_t n_workers) :
+  m_n_frames (n_frames),
+  m_n_channels (n_channels),
+  m_n_segments ((n_frames + segment_frames - 1) / segment_frames),
+  m_segments (2 * n_workers)
+{
+  for (size_t w = 0; w < n_workers; w++)
+    m_threads.emplace_back (&ParallelDecoder::worker_run, this, new_decoder, w, n_workers);
+}
+
+ParallelDecoder::~ParallelDecoder()
+{
+  {
+    std::lock_guard<std::mutex> lg (m_mutex);
+    m_quit = true;
+  }
+  m_cond.notify_all();
+
+  for (auto& t : m_threads)
+    t.join();
+}
+
+void
+ParallelDecoder::worker_run (const NewDecoderFunc& new_decoder, size_t worker, size_t n_workers)
+{
+  DecodeFunc decode = new_decoder();
+
+  for (size_t s = worker; s < m_n_segments; s += n_workers)
+    {
+      {
+        /* wait until the reader has consumed the segment that used our slot before */
+        std::unique_lock<std::mutex> lock (m_mutex);
+        m_cond.wait (lock, [&] { return m_quit || s < m_next_read + m_segments.size(); });
+        if (m_quit)
+          return;
+      }
+      const size_t start_frame = s * segment_frames;
+      const size_t n_frames = min (size_t (segment_frames), m_n_frames - start_frame);
+
+      vector<float> samples (n_frames * m_n_channels);
+      size_t frames_decoded = 0;
+      Error err;
+      {
+        Profile::Span span ("decode_segment");
+        err = decode (start_frame, n_frames, samples.data(), frames_decoded);
+      }
+      samples.resize (frames_decoded * m_n_channels);
+
+      std::lock_guard<std::mutex> lg (m_mutex);
+      Segment& segment = m_segments[s % m_segments.size()];
+      segment.samples = std::move (samples);
+      segment.error = err;
+      segment.done = true;
+      m_cond.notify_all();
+    }
+}
+
+Error
+ParallelDecoder::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  frames_read = 0;
+  while (frames_read < count && !m_eof && m_next_read < m_n_segments)
+    {
+      Segment& segment = m_segments[m_next_read % m_segments.size()];
+      {
+        std::unique_lock<std::mutex> lock (m_mutex);
+        m_cond.wait (lock, [&] { return segment.done; });
+      }
+      if (segment.error)
+        return segment.error;
+
+      /* the segment is not modified by the workers until we mark it as consumed */
+      const size_t segment_frames_decoded = segment.samples.size() / m_n_channels;
+      const size_t n = min (count - frames_read, segment_frames_decoded - m_read_pos);
+      memcpy (samples + frames_read * m_n_channels, segment.samples.data() + m_read_pos * m_n_channels, n * m_n_channels * sizeof (float));
+      frames_read += n;
+      m_read_pos += n;
+
+      if (m_read_pos == segment_frames_decoded)
+        {
+          /* a short segment is the last segment, even if the file was supposed to be longer */
+          if (segment_frames_decoded < min (size_t (segment_frames), m_n_frames - m_next_read * segment_frames))
+            m_eof = true;
+
+          std::lock_guard<std::mutex> lg (m_mutex);
+          segment.done = false;
+          segment.samples = vector<float>();
+          m_next_read++;
+          m_read_pos = 0;
+          m_cond.notify_all();
+        }
+    }
+  return Error::Code::NONE;
+}
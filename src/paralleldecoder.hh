@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_PARALLEL_DECODER_HH
+#define AUDIOWMARK_PARALLEL_DECODER_HH
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.hh"
+
+/*
+ * Decodes a compressed input file with a known length in parallel.
+ *
+ * The file is split into segments of segment_frames sample frames, which are
+ * decoded concurrently by worker threads, each with its own decoder (file
+ * handle). The segments are returned in order by read_frames(), and only a
+ * bounded number of segments is decoded ahead of the reader, so memory usage
+ * doesn't depend on the file length.
+ *
+ * The decoder is responsible for seeking to the start of a segment correctly,
+ * so that the parallel output is identical to decoding the file serially.
+ */
+class ParallelDecoder
+{
+public:
+  /* decode n_frames frames starting at start_frame to out, frames_decoded < n_frames means eof */
+  typedef std::function<Error (size_t start_frame, size_t n_frames, float *out, size_t& frames_decoded)> DecodeFunc;
+  /* called once by each worker thread to create its decoder */
+  typedef std::function<DecodeFunc()> NewDecoderFunc;
+
+  static constexpr size_t segment_frames = 512 * 1024;
+  static constexpr size_t max_workers = 8;
+
+  /* number of worker threads to use for a file of n_frames frames, < 2: decode serially */
+  static size_t n_workers (size_t n_frames);
+
+  ParallelDecoder (const NewDecoderFunc& new_decoder, size_t n_frames, int n_channels, size_t n_workers);
+  ~ParallelDecoder();
+
+  Error read_frames (float *samples, size_t count, size_t& frames_read);
+
+private:
+  struct Segment
+  {
+    bool               done = false;
+    Error              error;
+    std::vector<float> samples;
+  };
+  size_t                   m_n_frames = 0;
+  int                      m_n_channels = 0;
+  size_t                   m_n_segments = 0;
+
+  std::mutex               m_mutex;
+  std::condition_variable  m_cond;
+  std::vector<Segment>     m_segments;    // ring buffer: segment s is stored at m_segments[s % size]
+  size_t                   m_next_read = 0;
+  size_t                   m_read_pos = 0;
+  bool                     m_eof = false;
+  bool                     m_quit = false;
+  std::vector<std::thread> m_threads;
+
+  void worker_run (const NewDecoderFunc& new_decoder, size_t worker, size_t n_workers);
+};
+
+#endif /* AUDIOWMARK_PARALLEL_DECODER_HH */
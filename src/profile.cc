@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.hh"
+#include "utils.hh"
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+
+#include <string.h>
+#include <errno.h>
+
+using std::string;
+using std::vector;
+
+namespace
+{
+
+struct StageStats
+{
+  std::atomic<uint64_t> ns { 0 };
+  std::atomic<uint64_t> calls { 0 };
+};
+
+StageStats            stage_stats[size_t (Profile::Stage::COUNT)];
+std::atomic<uint64_t> counters[size_t (Profile::Counter::COUNT)];
+
+const char *
+stage_name (Profile::Stage stage)
+{
+  switch (stage)
+    {
+      case Profile::Stage::INPUT:          return "input";
+      case Profile::Stage::RESAMPLE:       return "resample";
+      case Profile::Stage::SPEED:          return "speed";
+      case Profile::Stage::BLOCK_DECODER:  return "block_decoder";
+      case Profile::Stage::CLIP_DECODER:   return "clip_decoder";
+      case Profile::Stage::CLIP_PADDING:   return "clip_padding";
+      case Profile::Stage::SYNC_SEARCH:    return "sync_search";
+      case Profile::Stage::SYNC_FFT:       return "sync_fft";
+      case Profile::Stage::SEARCH_REFINE:  return "search_refine";
+      case Profile::Stage::DECODE:         return "decode";
+      case Profile::Stage::COUNT:          break;
+    }
+  return "?";
+}
+
+struct TraceEvent
+{
+  const char       *name;
+  Profile::TimePoint start;
+  Profile::TimePoint end;
+};
+
+/* events are collected per thread (without locking), and kept after the thread exits */
+struct ThreadTrace
+{
+  int                tid = 0;
+  vector<TraceEvent> events;
+};
+
+std::mutex                           trace_mutex;
+vector<std::shared_ptr<ThreadTrace>> thread_traces;
+Profile::TimePoint                   trace_start;
+
+ThreadTrace&
+this_thread_trace()
+{
+  static thread_local std::shared_ptr<ThreadTrace> thread_trace;
+
+  if (!thread_trace)
+    {
+      thread_trace = std::make_shared<ThreadTrace>();
+
+      std::lock_guard<std::mutex> lg (trace_mutex);
+      thread_trace->tid = thread_traces.size() + 1;
+      thread_traces.push_back (thread_trace);
+    }
+  return *thread_trace;
+}
+
+const char *
+counter_name (Profile::Counter counter)
+{
+  switch (counter)
+    {
+      case Profile::Counter::FRAMES_FFT:          return "frames_fft";
+      case Profile::Counter::CANDIDATES_REFINED:  return "candidates_refined";
+      case Profile::Counter::DECODES:             return "decodes";
+      case Profile::Counter::BYTES_READ:          return "bytes_read";
+      case Profile::Counter::MEMORY_BUDGET:       return "memory_budget";
+      case Profile::Counter::MEMORY_CHUNK:        return "memory_chunk";
+      case Profile::Counter::MEMORY_SPEED:        return "memory_speed";
+      case Profile::Counter::MEMORY_THREADS:      return "memory_threads";
+      case Profile::Counter::COUNT:               break;
+    }
+  return "?";
+}
+
+}
+
+bool Profile::s_active = false;
+bool Profile::s_enabled = false;
+bool Profile::s_tracing = false;
+
+void
+Profile::set_enabled (bool enabled)
+{
+  s_enabled = enabled;
+  s_active = s_enabled || s_tracing;
+}
+
+void
+Profile::finish (Stage stage, TimePoint start)
+{
+  const TimePoint end = std::chrono::steady_clock::now();
+
+  if (s_enabled)
+    {
+      StageStats& stats = stage_stats[size_t (stage)];
+
+      stats.ns.fetch_add (std::chrono::duration_cast<std::chrono::nanoseconds> (end - start).count(), std::memory_order_relaxed);
+      stats.calls.fetch_add (1, std::memory_order_relaxed);
+    }
+  if (s_tracing)
+    trace (stage_name (stage), start, end);
+}
+
+void
+Profile::trace (const char *name, TimePoint start, TimePoint end)
+{
+  this_thread_trace().events.push_back ({ name, start, end });
+}
+
+/* start recording trace events (call before any other threads use the profiler) */
+void
+Profile::start_trace()
+{
+  trace_start = std::chrono::steady_clock::now();
+  this_thread_trace(); // main thread gets tid 1
+
+  s_tracing = true;
+  s_active = true;
+}
+
+/* write all events in Chrome trace format, must be called after all jobs are done */
+Error
+Profile::write_trace (const string& filename)
+{
+  FILE *file = fopen (filename.c_str(), "w");
+  if (!file)
+    return Error (string_printf ("error opening trace file '%s': %s", filename.c_str(), strerror (errno)));
+
+  auto us = [] (Profile::TimePoint t) {
+    return std::chrono::duration<double, std::micro> (t - trace_start).count();
+  };
+
+  std::lock_guard<std::mutex> lg (trace_mutex);
+  fprintf (file, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf (file, "  { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": { \"name\": \"audiowmark\" } }");
+  for (const auto& thread_trace : thread_traces)
+    {
+      fprintf (file, ",\n  { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": { \"name\": \"%s\" } }",
+               thread_trace->tid, thread_trace->tid == 1 ? "main" : string_printf ("thread %d", thread_trace->tid).c_str());
+      for (const auto& event : thread_trace->events)
+        fprintf (file, ",\n  { \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f }",
+                 event.name, thread_trace->tid, us (event.start), us (event.end) - us (event.start));
+    }
+  fprintf (file, "\n] }\n");
+
+  bool write_error = ferror (file);
+  if (fclose (file) != 0 || write_error)
+    return Error (string_printf ("error writing trace file '%s'", filename.c_str()));
+
+  return Error::Code::NONE;
+}
+
+void
+Profile::add_count (Counter counter, uint64_t n)
+{
+  counters[size_t (counter)].fetch_add (n, std::memory_order_relaxed);
+}
+
+void
+Profile::add_peak (Counter counter, uint64_t n)
+{
+  std::atomic<uint64_t>& value = counters[size_t (counter)];
+
+  uint64_t old_value = value.load (std::memory_order_relaxed);
+  while (n > old_value && !value.compare_exchange_weak (old_value, n, std::memory_order_relaxed))
+    ;
+}
+
+string
+Profile::json()
+{
+  string out = "{ \"stages\": {";
+  for (size_t s = 0; s < size_t (Stage::COUNT); s++)
+    {
+      const StageStats& stats = stage_stats[s];
+      out += string_printf ("%s \"%s\": { \"seconds\": %.6f, \"calls\": %lu }", s ? "," : "", stage_name (Stage (s)),
+                            stats.ns.load() * 1e-9, (unsigned long) stats.calls.load());
+    }
+  out += " }, \"counters\": {";
+  for (size_t c = 0; c < size_t (Counter::COUNT); c++)
+    out += string_printf ("%s \"%s\": %lu", c ? "," : "", counter_name (Counter (c)), (unsigned long) counters[c].load());
+  out += " } }";
+  return out;
+}
+
+void
+Profile::print()
+{
+  fprintf (stderr, "profile:\n");
+  for (size_t s = 0; s < size_t (Stage::COUNT); s++)
+    {
+      const StageStats& stats = stage_stats[s];
+      fprintf (stderr, "  %-20s %10.3f s %10lu calls\n", stage_name (Stage (s)), stats.ns.load() * 1e-9, (unsigned long) stats.calls.load());
+    }
+  for (size_t c = 0; c < size_t (Counter::COUNT); c++)
+    fprintf (stderr, "  %-20s %15lu\n", counter_name (Counter (c)), (unsigned long) counters[c].load());
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_PROFILE_HH
+#define AUDIOWMARK_PROFILE_HH
+
+#include <string>
+#include <chrono>
+
+#include <stdint.h>
+
+#include "utils.hh"
+
+/*
+ * Per-stage timers and counters for audiowmark get --profile
+ *
+ * If profiling is disabled (default), timers and counters cost one branch.
+ * Stage times are wall clock times measured by the thread that runs the
+ * stage, so nested stages are contained in their parent stage (for instance
+ * sync_fft in sync_search); stages which run as ThreadPool jobs (decode) are
+ * summed over all jobs. Timers and counters can be used from any thread.
+ *
+ * With tracing (--trace), each timer and each Span is also recorded as an
+ * event of the thread that executed it, and written in Chrome trace format
+ * (which can be loaded in Perfetto or chrome://tracing), so load imbalance
+ * between ThreadPool jobs and idle threads become visible.
+ */
+class Profile
+{
+public:
+  enum class Stage {
+    INPUT,          // reading (and decoding) the input stream
+    RESAMPLE,       // resampling to the watermark sample rate (also for speed correction)
+    SPEED,          // speed detection
+    BLOCK_DECODER,
+    CLIP_DECODER,
+    CLIP_PADDING,   // clip decoder: creating the zero padded input
+    SYNC_SEARCH,
+    SYNC_FFT,       // sync search: spectrum of all frames
+    SEARCH_REFINE,  // sync search: refine the best candidates
+    DECODE,         // convolutional / short code decoding of the soft bits
+    COUNT
+  };
+  enum class Counter {
+    FRAMES_FFT,         // frames analyzed with fft (all channels of one frame count as one)
+    CANDIDATES_REFINED, // sync candidates passed to search_refine
+    DECODES,            // decode attempts
+    BYTES_READ,         // input audio data (n_frames * n_channels * bit_depth / 8)
+    MEMORY_BUDGET,      // --max-memory in bytes (0: unlimited)
+    MEMORY_CHUNK,       // peak: samples and spectrum cache of one input chunk (bytes)
+    MEMORY_SPEED,       // peak: speed correction copy of a chunk or active speed search units (bytes)
+    MEMORY_THREADS,     // worker threads * estimated scratch per thread (bytes)
+    COUNT
+  };
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  /* measure the time of one stage (until the end of the scope or stop()) */
+  class Timer
+  {
+    Stage     m_stage;
+    bool      m_active = false;
+    TimePoint m_start;
+  public:
+    Timer (Stage stage) :
+      m_stage (stage)
+    {
+      if (s_active)
+        {
+          m_active = true;
+          m_start = std::chrono::steady_clock::now();
+        }
+    }
+    ~Timer()
+    {
+      stop();
+    }
+    /* stop before the end of the scope */
+    void
+    stop()
+    {
+      if (m_active)
+        {
+          finish (m_stage, m_start);
+          m_active = false;
+        }
+    }
+  };
+  /* trace only: record one event, name must be a string literal */
+  class Span
+  {
+    const char *m_name;
+    bool        m_active = false;
+    TimePoint   m_start;
+  public:
+    Span (const char *name) :
+      m_name (name)
+    {
+      if (s_tracing)
+        {
+          m_active = true;
+          m_start = std::chrono::steady_clock::now();
+        }
+    }
+    ~Span()
+    {
+      if (m_active)
+        trace (m_name, m_start, std::chrono::steady_clock::now());
+    }
+  };
+
+  static void
+  count (Counter counter, uint64_t n = 1)
+  {
+    if (s_enabled)
+      add_count (counter, n);
+  }
+  /* for counters which track a maximum (MEMORY_*) */
+  static void
+  peak (Counter counter, uint64_t n)
+  {
+    if (s_enabled)
+      add_peak (counter, n);
+  }
+  static bool
+  enabled()
+  {
+    return s_enabled;
+  }
+  static bool
+  tracing()
+  {
+    return s_tracing;
+  }
+  static void        set_enabled (bool enabled);
+  static std::string json();  // "stats" object for --json output
+  static void        print(); // human readable, to stderr
+
+  static void        start_trace();
+  static Error       write_trace (const std::string& filename);
+private:
+  static bool s_active;   // profiling or tracing
+  static bool s_enabled;
+  static bool s_tracing;
+
+  static void finish (Stage stage, TimePoint start);
+  static void trace (const char *name, TimePoint start, TimePoint end);
+  static void add_count (Counter counter, uint64_t n);
+  static void add_peak (Counter counter, uint64_t n);
+};
+
+#endif /* AUDIOWMARK_PROFILE_HH */
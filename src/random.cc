@@ -19,6 +19,7 @@
 #include "utils.hh"
 
 #include <regex>
+#include <mutex>
 
 #include <assert.h>
 
@@ -27,6 +28,17 @@ using std::vector;
 using std::regex;
 using std::regex_match;
 
+static std::mutex gcrypt_error_mutex;
+static string     gcrypt_error;
+
+static void
+set_gcrypt_error (const string& message)
+{
+  std::lock_guard<std::mutex> lg (gcrypt_error_mutex);
+  if (gcrypt_error.empty())
+    gcrypt_error = message;
+}
+
 static void
 gcrypt_init()
 {
@@ -37,8 +49,8 @@ gcrypt_init()
       /* version check: start libgcrypt initialization */
       if (!gcry_check_version (GCRYPT_VERSION))
         {
-          error ("audiowmark: libgcrypt version mismatch\n");
-          exit (1);
+          set_gcrypt_error ("libgcrypt version mismatch");
+          return;
         }
 
       /* disable secure memory (assume we run in a controlled environment) */
@@ -99,40 +111,111 @@ Random::Random (const Key& key, uint64_t start_seed, Stream stream)
   gcrypt_init();
 
   gcry_error_t gcry_ret = gcry_cipher_open (&aes_ctr_cipher, GCRY_CIPHER, GCRY_CIPHER_MODE_CTR, 0);
-  die_on_error ("gcry_cipher_open", gcry_ret);
+  check_error ("gcry_cipher_open", gcry_ret);
 
-  gcry_ret = gcry_cipher_setkey (aes_ctr_cipher, key.aes_key(), Key::SIZE);
-  die_on_error ("gcry_cipher_setkey", gcry_ret);
+  gcry_error_t gcry_ret2 = gcry_cipher_open (&seed_cipher, GCRY_CIPHER, GCRY_CIPHER_MODE_ECB, 0);
+  check_error ("gcry_cipher_open", gcry_ret2);
 
-  gcry_ret = gcry_cipher_open (&seed_cipher, GCRY_CIPHER, GCRY_CIPHER_MODE_ECB, 0);
-  die_on_error ("gcry_cipher_open", gcry_ret);
+  /* on error, the random numbers are all zero (see check_errors()) */
+  if (gcry_ret || gcry_ret2)
+    {
+      gcry_cipher_close (aes_ctr_cipher);
+      gcry_cipher_close (seed_cipher);
+      aes_ctr_cipher = seed_cipher = nullptr;
+      return;
+    }
+
+  gcry_ret = gcry_cipher_setkey (aes_ctr_cipher, key.aes_key(), Key::SIZE);
+  check_error ("gcry_cipher_setkey", gcry_ret);
 
   gcry_ret = gcry_cipher_setkey (seed_cipher, key.aes_key(), Key::SIZE);
-  die_on_error ("gcry_cipher_setkey", gcry_ret);
+  check_error ("gcry_cipher_setkey", gcry_ret);
 
   seed (start_seed, stream);
 }
 
+static void
+seed_block (uint64_t seed, Random::Stream stream, unsigned char *block)
+{
+  memset (block, 0, Key::SIZE);
+  uint64_to_buffer (seed, &block[0]);
+
+  block[8] = uint8_t (stream);
+}
+
 void
 Random::seed (uint64_t seed, Stream stream)
 {
   buffer_pos = 0;
   buffer.clear();
 
+  if (!seed_cipher)
+    return;
+
   unsigned char plain_text[Key::SIZE];
   unsigned char cipher_text[Key::SIZE];
 
-  memset (plain_text, 0, sizeof (plain_text));
-  uint64_to_buffer (seed, &plain_text[0]);
-
-  plain_text[8] = uint8_t (stream);
+  seed_block (seed, stream, plain_text);
 
   gcry_error_t gcry_ret = gcry_cipher_encrypt (seed_cipher, &cipher_text[0], Key::SIZE,
                                                             &plain_text[0],  Key::SIZE);
-  die_on_error ("gcry_cipher_encrypt", gcry_ret);
+  check_error ("gcry_cipher_encrypt", gcry_ret);
 
   gcry_ret = gcry_cipher_setctr (aes_ctr_cipher, &cipher_text[0], Key::SIZE);
-  die_on_error ("gcry_cipher_setctr", gcry_ret);
+  check_error ("gcry_cipher_setctr", gcry_ret);
+}
+
+/*
+ * Bulk generation for many seeds: values[s * n_values + i] is the i-th random
+ * number of Random (key, first_seed + s, stream), for s < n_seeds.
+ *
+ * This is equivalent to calling seed() and n_values times operator() for each
+ * seed, but the counter blocks of the AES-CTR keystream for all seeds are
+ * computed here, so all seeds and all counter blocks are each encrypted with
+ * one gcrypt call (ECB), which is a lot faster than reseeding the CTR cipher
+ * for each seed, as many blocks can be encrypted in parallel (AES-NI).
+ */
+void
+Random::seed_values (uint64_t first_seed, size_t n_seeds, Stream stream, size_t n_values, vector<uint64_t>& values)
+{
+  if (!seed_cipher)
+    {
+      values.assign (n_seeds * n_values, 0);
+      return;
+    }
+
+  /* initial counter for each seed */
+  vector<unsigned char> counters (n_seeds * Key::SIZE);
+  for (size_t s = 0; s < n_seeds; s++)
+    seed_block (first_seed + s, stream, &counters[s * Key::SIZE]);
+
+  gcry_error_t gcry_ret = gcry_cipher_encrypt (seed_cipher, counters.data(), counters.size(), nullptr, 0);
+  check_error ("gcry_cipher_encrypt", gcry_ret);
+
+  /* CTR mode: the keystream is the encryption of the counter, incremented as 128 bit big endian number for each block */
+  const size_t blocks_per_seed = (n_values * 8 + Key::SIZE - 1) / Key::SIZE;
+  vector<unsigned char> keystream (n_seeds * blocks_per_seed * Key::SIZE);
+  for (size_t s = 0; s < n_seeds; s++)
+    {
+      unsigned char counter[Key::SIZE];
+      memcpy (counter, &counters[s * Key::SIZE], Key::SIZE);
+      for (size_t b = 0; b < blocks_per_seed; b++)
+        {
+          memcpy (&keystream[(s * blocks_per_seed + b) * Key::SIZE], counter, Key::SIZE);
+          for (int i = Key::SIZE - 1; i >= 0; i--)
+            {
+              if (++counter[i] != 0)
+                break;
+            }
+        }
+    }
+  gcry_ret = gcry_cipher_encrypt (seed_cipher, keystream.data(), keystream.size(), nullptr, 0);
+  check_error ("gcry_cipher_encrypt", gcry_ret);
+
+  values.resize (n_seeds * n_values);
+  for (size_t s = 0; s < n_seeds; s++)
+    for (size_t i = 0; i < n_values; i++)
+      values[s * n_values + i] = uint64_from_buffer (&keystream[s * blocks_per_seed * Key::SIZE + i * 8]);
 }
 
 Random::~Random()
@@ -144,31 +227,51 @@ Random::~Random()
 void
 Random::refill_buffer()
 {
-  const size_t block_size = 256;
+  /* larger blocks allow gcrypt to encrypt more counter blocks in parallel (AES-NI) */
+  const size_t block_size = 1024;
   static unsigned char zeros[block_size] = { 0, };
-  unsigned char cipher_text[block_size];
+  unsigned char cipher_text[block_size] = { 0, };
+
+  if (!aes_ctr_cipher)
+    {
+      buffer.assign (block_size / 8, 0);
+      buffer_pos = 0;
+      return;
+    }
 
   gcry_error_t gcry_ret = gcry_cipher_encrypt (aes_ctr_cipher, cipher_text, block_size, zeros, block_size);
-  die_on_error ("gcry_cipher_encrypt", gcry_ret);
+  check_error ("gcry_cipher_encrypt", gcry_ret);
 
   // print ("AES OUT", {cipher_text, cipher_text + block_size});
 
-  buffer.clear();
-  for (size_t i = 0; i < block_size; i += 8)
-    buffer.push_back (uint64_from_buffer (cipher_text + i));
+  buffer.resize (block_size / 8);
+  for (size_t i = 0; i < buffer.size(); i++)
+    buffer[i] = uint64_from_buffer (cipher_text + i * 8);
 
   buffer_pos = 0;
 }
 
 void
-Random::die_on_error (const char *func, gcry_error_t err)
+Random::check_error (const char *func, gcry_error_t err)
 {
   if (err)
-    {
-      error ("%s failed: %s/%s\n", func, gcry_strsource (err), gcry_strerror (err));
+    set_gcrypt_error (string_printf ("%s failed: %s/%s", func, gcry_strsource (err), gcry_strerror (err)));
+}
 
-      exit (1); /* can't recover here */
-    }
+Error
+Random::init()
+{
+  gcrypt_init();
+  return check_errors();
+}
+
+Error
+Random::check_errors()
+{
+  std::lock_guard<std::mutex> lg (gcrypt_error_mutex);
+  if (gcrypt_error.empty())
+    return Error::Code::NONE;
+  return Error (gcrypt_error);
 }
 
 string
@@ -189,6 +292,16 @@ Random::seed_from_hash (const vector<float>& floats)
   return uint64_from_buffer (hash);
 }
 
+string
+Random::sha256_hex (const vector<unsigned char>& data)
+{
+  gcrypt_init();
+
+  vector<unsigned char> hash (32);
+  gcry_md_hash_buffer (GCRY_MD_SHA256, hash.data(), data.data(), data.size());
+  return vec_to_hex_str (hash);
+}
+
 Key::Key() :
   m_aes_key (SIZE)
 {
@@ -206,101 +319,20 @@ Key::set_test_key (uint64_t key)
   m_name = string_printf ("test-key-%" PRId64, key);
 }
 
-static bool
-string_chars (char ch)
-{
-  if ((ch >= 'A' && ch <= 'Z')
-  ||  (ch >= '0' && ch <= '9')
-  ||  (ch >= 'a' && ch <= 'z')
-  ||  (ch == '.')
-  ||  (ch == ':')
-  ||  (ch == '=')
-  ||  (ch == '/')
-  ||  (ch == '-')
-  ||  (ch == '_'))
-    return true;
-
-  return false;
-}
-
-static bool
-white_space (char ch)
+/* only the name, for results without key (audiowmark merge-results) */
+void
+Key::set_name (const string& name)
 {
-  return (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r');
+  m_name = name;
 }
 
-static bool
-tokenize (const string& line, vector<string>& tokens)
-{
-  enum { BLANK, STRING, QUOTED_STRING, QUOTED_STRING_ESCAPED, COMMENT } state = BLANK;
-  string s;
-
-  string xline = line + '\n';
-  tokens.clear();
-  for (string::const_iterator i = xline.begin(); i != xline.end(); i++)
-    {
-      if (state == BLANK && string_chars (*i))
-        {
-          state = STRING;
-          s += *i;
-        }
-      else if (state == BLANK && *i == '"')
-        {
-          state = QUOTED_STRING;
-        }
-      else if (state == BLANK && white_space (*i))
-        {
-          // ignore more whitespaces if we've already seen one
-        }
-      else if (state == STRING && string_chars (*i))
-        {
-          s += *i;
-        }
-      else if ((state == STRING && white_space (*i))
-           ||  (state == QUOTED_STRING && *i == '"'))
-        {
-          tokens.push_back (s);
-          s = "";
-          state = BLANK;
-        }
-      else if (state == QUOTED_STRING && *i == '\\')
-        {
-          state = QUOTED_STRING_ESCAPED;
-        }
-      else if (state == QUOTED_STRING)
-        {
-          s += *i;
-        }
-      else if (state == QUOTED_STRING_ESCAPED)
-        {
-          s += *i;
-          state = QUOTED_STRING;
-        }
-      else if (*i == '#')
-        {
-          state = COMMENT;
-        }
-      else if (state == COMMENT)
-        {
-          // ignore comments
-        }
-      else
-        {
-          return false;
-        }
-    }
-  return state == BLANK || state == COMMENT;
-}
-
-void
-Key::load_key (const string& key_file)
+Error
+Key::load_key_file (const string& key_file)
 {
   FILE *f = fopen (key_file.c_str(), "r");
   if (!f)
-    {
-      error ("audiowmark: error opening key file: '%s'\n", key_file.c_str());
-      exit (1);
-    }
+    return Error (string_printf ("error opening key file: '%s'", key_file.c_str()));
+
   m_name = key_file;
   // basename
   size_t sep = m_name.find_last_of ("\\/");
@@ -321,8 +353,8 @@ Key::load_key (const string& key_file)
               vector<unsigned char> key = hex_str_to_vec (tokens[1]);
               if (key.size() != Key::SIZE)
                 {
-                  error ("audiowmark: wrong key length in key file '%s', line %d\n => required key length is %zd bits\n", key_file.c_str(), line, Key::SIZE * 8);
-                  exit (1);
+                  fclose (f);
+                  return Error (string_printf ("wrong key length in key file '%s', line %d\n => required key length is %zd bits", key_file.c_str(), line, Key::SIZE * 8));
                 }
               m_aes_key = key;
               keys++;
@@ -340,23 +372,19 @@ Key::load_key (const string& key_file)
         }
       if (!parse_ok)
         {
-          error ("audiowmark: parse error in key file '%s', line %d\n", key_file.c_str(), line);
-          exit (1);
+          fclose (f);
+          return Error (string_printf ("parse error in key file '%s', line %d", key_file.c_str(), line));
         }
       line++;
     }
   fclose (f);
 
   if (keys > 1)
-    {
-      error ("audiowmark: key file '%s' contains more than one key\n", key_file.c_str());
-      exit (1);
-    }
+    return Error (string_printf ("key file '%s' contains more than one key", key_file.c_str()));
   if (keys == 0)
-    {
-      error ("audiowmark: key file '%s' contains no key\n", key_file.c_str());
-      exit (1);
-    }
+    return Error (string_printf ("key file '%s' contains no key", key_file.c_str()));
+
+  return Error::Code::NONE;
 }
 
 const unsigned char *
@@ -25,6 +25,8 @@
 #include <string>
 #include <random>
 
+#include "utils.hh"
+
 class Key
 {
   std::vector<unsigned char> m_aes_key;
@@ -42,7 +44,8 @@ public:
   }
 
   void set_test_key (uint64_t key);
-  void load_key (const std::string& filename);
+  void set_name (const std::string& name);
+  Error load_key_file (const std::string& filename);
   const unsigned char *aes_key() const;
   const std::string& name() const;
 };
@@ -56,7 +59,8 @@ public:
     speed_clip = 3,
     mix = 4,
     bit_order = 5,
-    frame_position = 6
+    frame_position = 6,
+    key_tables = 7
   };
 private:
   gcry_cipher_hd_t           aes_ctr_cipher = nullptr;
@@ -66,7 +70,7 @@ private:
 
   std::uniform_real_distribution<double> double_dist;
 
-  void die_on_error (const char *func, gcry_error_t error);
+  static void check_error (const char *func, gcry_error_t error);
 public:
   Random (const Key& key, uint64_t seed, Stream stream);
   ~Random();
@@ -98,6 +102,7 @@ public:
   }
   void refill_buffer();
   void seed (uint64_t seed, Stream stream);
+  void seed_values (uint64_t first_seed, size_t n_seeds, Stream stream, size_t n_values, std::vector<uint64_t>& values);
 
   template<class T> void
   shuffle (std::vector<T>& result)
@@ -111,9 +116,26 @@ public:
         std::swap (result[i], result[j]);
       }
   }
+  /* same as shuffle(), using result.size() precomputed random numbers (see seed_values) */
+  template<class T> static void
+  shuffle (std::vector<T>& result, const uint64_t *random_numbers)
+  {
+    for (size_t i = 0; i < result.size(); i++)
+      {
+        size_t j = i + random_numbers[i] % (result.size() - i);
+        std::swap (result[i], result[j]);
+      }
+  }
+
+  /* gcrypt errors can't be returned from the Random functions, so the first
+   * error is kept and reported by check_errors()
+   */
+  static Error       init();
+  static Error       check_errors();
 
   static std::string gen_key();
   static uint64_t    seed_from_hash (const std::vector<float>& floats);
+  static std::string sha256_hex (const std::vector<unsigned char>& data);
 };
 
 #endif /* AUDIOWMARK_RANDOM_HH */
@@ -16,6 +16,7 @@
  */
 
 #include "rawconverter.hh"
+#include "wmcommon.hh"
 #include "config.h"
 
 #include <array>
@@ -34,8 +35,8 @@ template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
 class RawConverterImpl final : public RawConverter
 {
 public:
-  void to_raw (const float *samples, unsigned char *bytes, size_t n_samples) override AUDIOWMARK_EXTRA_OPT;
-  void from_raw (const unsigned char *bytes, float *samples, size_t n_samples) override AUDIOWMARK_EXTRA_OPT;
+  void to_raw (const float *samples, unsigned char *bytes, size_t n_samples) override;
+  void from_raw (const unsigned char *bytes, float *samples, size_t n_samples) override;
 };
 
 template<int BIT_DEPTH, RawFormat::Endian ENDIAN>
@@ -152,12 +153,32 @@ to_endian (uint64_t i)
     return i;
 }
 
+template<RawFormat::Endian ENDIAN>
+static uint16_t
+to_endian (uint16_t i)
+{
+#ifdef WORDS_BIGENDDIAN
+  constexpr bool native_endian = ENDIAN == RawFormat::BIG;
+#else
+  constexpr bool native_endian = ENDIAN == RawFormat::LITTLE;
+#endif
+  if (!native_endian)
+    return bswap16 (i);
+  else
+    return i;
+}
+
+/*
+ * The conversion loops are written without branches in the loop body, and 16
+ * and 32 bit samples are accessed as 16 and 32 bit words (byte swapped for
+ * the other endianness), so the compiler can vectorize them; they are
+ * compiled twice, generic and with avx2 (selected at runtime)
+ */
 template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
-void
-RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::to_raw (const float *samples, unsigned char *output_bytes, size_t n_samples)
+static inline void
+to_raw_loop (const float *samples, unsigned char *output_bytes, size_t n_samples)
 {
   constexpr int sample_width = BIT_DEPTH / 8;
-  assert ((uintptr_t (output_bytes) & (sample_width - 1)) == 0); // ensure alignment for native access (16-bit, 32-bit and 64-bit version)
 
   if (ENCODING == Encoding::FLOAT)
     {
@@ -198,31 +219,37 @@ RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::to_raw (const float *samples, uns
             ((int16_t *)ptr)[i] = float_to_int_clip<16> (samples[i]);
           else
             {
-              int sample = float_to_int_clip<32> (samples[i]);
+              uint32_t sample = float_to_int_clip<32> (samples[i]);
               if (ENCODING == Encoding::UNSIGNED)
                 sample ^= 0x80000000;
 
-              if (eshift[0] >= 0)
-                ptr[0] = sample >> eshift[0];
-              if (eshift[1] >= 0)
-                ptr[1] = sample >> eshift[1];
-              if (eshift[2] >= 0)
-                ptr[2] = sample >> eshift[2];
-              if (eshift[3] >= 0)
-                ptr[3] = sample >> eshift[3];
+              if (BIT_DEPTH == 32)
+                ((uint32_t *)ptr)[i] = to_endian<ENDIAN> (sample);
+              else if (BIT_DEPTH == 16)
+                ((uint16_t *)ptr)[i] = to_endian<ENDIAN> (uint16_t (sample >> 16));
+              else
+                {
+                  unsigned char *sptr = ptr + i * sample_width;
 
-              ptr += sample_width;
+                  if (eshift[0] >= 0)
+                    sptr[0] = sample >> eshift[0];
+                  if (eshift[1] >= 0)
+                    sptr[1] = sample >> eshift[1];
+                  if (eshift[2] >= 0)
+                    sptr[2] = sample >> eshift[2];
+                  if (eshift[3] >= 0)
+                    sptr[3] = sample >> eshift[3];
+                }
             }
         }
     }
 }
 
 template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
-void
-RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::from_raw (const unsigned char *input_bytes, float *samples, size_t n_samples)
+static inline void
+from_raw_loop (const unsigned char *input_bytes, float *samples, size_t n_samples)
 {
   constexpr int sample_width = BIT_DEPTH / 8;
-  assert ((uintptr_t (input_bytes) & (sample_width - 1)) == 0); // ensure alignment for native access (16-bit, 32-bit and 64-bit version)
 
   if (ENCODING == Encoding::FLOAT)
     {
@@ -263,24 +290,95 @@ RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::from_raw (const unsigned char *in
             samples[i] = ((int16_t *)ptr)[i] * float (1.0 / 0x8000);
           else
             {
-              int s32 = 0;
+              uint32_t u32 = 0;
 
-              if (eshift[0] >= 0)
-                s32 += ptr[0] << eshift[0];
-              if (eshift[1] >= 0)
-                s32 += ptr[1] << eshift[1];
-              if (eshift[2] >= 0)
-                s32 += ptr[2] << eshift[2];
-              if (eshift[3] >= 0)
-                s32 += ptr[3] << eshift[3];
+              if (BIT_DEPTH == 32)
+                u32 = to_endian<ENDIAN> (((uint32_t *)ptr)[i]);
+              else if (BIT_DEPTH == 16)
+                u32 = uint32_t (to_endian<ENDIAN> (((uint16_t *)ptr)[i])) << 16;
+              else
+                {
+                  const unsigned char *sptr = ptr + i * sample_width;
 
-              if (ENCODING == Encoding::UNSIGNED)
-                s32 ^= 0x80000000;
+                  if (eshift[0] >= 0)
+                    u32 += sptr[0] << eshift[0];
+                  if (eshift[1] >= 0)
+                    u32 += sptr[1] << eshift[1];
+                  if (eshift[2] >= 0)
+                    u32 += sptr[2] << eshift[2];
+                  if (eshift[3] >= 0)
+                    u32 += sptr[3] << eshift[3];
+                }
 
-              samples[i] = s32 * norm;
+              if (ENCODING == Encoding::UNSIGNED)
+                u32 ^= 0x80000000;
 
-              ptr += sample_width;
+              samples[i] = int32_t (u32) * norm;
             }
         }
     }
 }
+
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
+static void AUDIOWMARK_EXTRA_OPT
+to_raw_generic (const float *samples, unsigned char *output_bytes, size_t n_samples)
+{
+  to_raw_loop<BIT_DEPTH, ENDIAN, ENCODING> (samples, output_bytes, n_samples);
+}
+
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
+static void AUDIOWMARK_EXTRA_OPT
+from_raw_generic (const unsigned char *input_bytes, float *samples, size_t n_samples)
+{
+  from_raw_loop<BIT_DEPTH, ENDIAN, ENCODING> (input_bytes, samples, n_samples);
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
+static void AUDIOWMARK_EXTRA_OPT __attribute__((target ("avx2")))
+to_raw_avx2 (const float *samples, unsigned char *output_bytes, size_t n_samples)
+{
+  to_raw_loop<BIT_DEPTH, ENDIAN, ENCODING> (samples, output_bytes, n_samples);
+}
+
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
+static void AUDIOWMARK_EXTRA_OPT __attribute__((target ("avx2")))
+from_raw_avx2 (const unsigned char *input_bytes, float *samples, size_t n_samples)
+{
+  from_raw_loop<BIT_DEPTH, ENDIAN, ENCODING> (input_bytes, samples, n_samples);
+}
+#endif
+
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
+void
+RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::to_raw (const float *samples, unsigned char *output_bytes, size_t n_samples)
+{
+  constexpr int sample_width = BIT_DEPTH / 8;
+  assert ((uintptr_t (output_bytes) & (sample_width - 1)) == 0); // ensure alignment for native access (16-bit, 32-bit and 64-bit version)
+
+#if defined (__x86_64__) || defined (__i386__)
+  if (have_avx2())
+    {
+      to_raw_avx2<BIT_DEPTH, ENDIAN, ENCODING> (samples, output_bytes, n_samples);
+      return;
+    }
+#endif
+  to_raw_generic<BIT_DEPTH, ENDIAN, ENCODING> (samples, output_bytes, n_samples);
+}
+
+template<int BIT_DEPTH, RawFormat::Endian ENDIAN, Encoding ENCODING>
+void
+RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::from_raw (const unsigned char *input_bytes, float *samples, size_t n_samples)
+{
+  constexpr int sample_width = BIT_DEPTH / 8;
+  assert ((uintptr_t (input_bytes) & (sample_width - 1)) == 0); // ensure alignment for native access (16-bit, 32-bit and 64-bit version)
+
+#if defined (__x86_64__) || defined (__i386__)
+  if (have_avx2())
+    {
+      from_raw_avx2<BIT_DEPTH, ENDIAN, ENCODING> (input_bytes, samples, n_samples);
+      return;
+    }
+#endif
+  from_raw_generic<BIT_DEPTH, ENDIAN, ENCODING> (input_bytes, samples, n_samples);
+}
@@ -20,6 +20,8 @@
 
 #include "rawinputstream.hh"
 
+#include <algorithm>
+
 class RawConverter
 {
 public:
@@ -41,12 +43,13 @@ float_to_int_clip (float f)
   const float norm      =  inorm;
   const float snorm     = f * norm;
 
-  if (snorm >= max_value)
-    return inorm - 1;
-  else if (snorm <= min_value)
-    return -inorm;
-  else
-    return snorm;
+  /* branch free, so that loops using this can be vectorized; for BITS > 24,
+   * max_value is rounded up to inorm, so clip to the largest float below inorm
+   * and return inorm - 1 for snorm >= max_value
+   */
+  const float max_trunc = BITS > 24 ? float (inorm - (inorm >> 24)) : max_value;
+  const int   i         = std::min (std::max (snorm, min_value), max_trunc);
+  return snorm >= max_value ? int (inorm - 1) : i;
 }
 
 static inline float
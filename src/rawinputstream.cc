@@ -18,12 +18,142 @@
 #include "rawinputstream.hh"
 #include "rawconverter.hh"
 
+#include <algorithm>
+
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using std::string;
 using std::vector;
+using std::min;
+
+size_t InputBuffer::s_buffer_size = 1024 * 1024;
+
+void
+InputBuffer::set_buffer_size (size_t bytes)
+{
+  s_buffer_size = bytes;
+}
+
+InputBuffer::~InputBuffer()
+{
+  close();
+}
+
+Error
+InputBuffer::open (const string& filename)
+{
+  if (filename == "-")
+    {
+      m_fd = STDIN_FILENO;
+      m_close_fd = false;
+    }
+  else
+    {
+      m_fd = ::open (filename.c_str(), O_RDONLY);
+      if (m_fd == -1)
+        return Error (strerror (errno));
+
+      m_close_fd = true;
+    }
+  m_buffer.resize (s_buffer_size);
+  return Error::Code::NONE;
+}
+
+/* make sure that at least min_bytes are available, unless the end of the input is reached */
+Error
+InputBuffer::fill (size_t min_bytes)
+{
+  if (available() >= min_bytes || m_eof)
+    return Error::Code::NONE;
+
+  /* move the remaining bytes to the start of the buffer */
+  if (m_start)
+    {
+      memmove (m_buffer.data(), m_buffer.data() + m_start, available());
+      m_end -= m_start;
+      m_start = 0;
+    }
+  if (m_buffer.size() < min_bytes)
+    m_buffer.resize (min_bytes);
+
+  while (m_end < min_bytes)
+    {
+      ssize_t r = ::read (m_fd, m_buffer.data() + m_end, m_buffer.size() - m_end);
+      if (r < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return Error (strerror (errno));
+        }
+      if (r == 0)
+        {
+          m_eof = true;
+          break;
+        }
+      m_end += r;
+    }
+  return Error::Code::NONE;
+}
+
+Error
+InputBuffer::read (unsigned char *dest, size_t n_bytes, size_t& bytes_read)
+{
+  bytes_read = 0;
+  while (bytes_read < n_bytes)
+    {
+      Error err = fill (min (n_bytes - bytes_read, m_buffer.size()));
+      if (err)
+        return err;
+      if (!available())
+        break;
+
+      size_t n = min (n_bytes - bytes_read, available());
+      memcpy (dest + bytes_read, data(), n);
+      consume (n);
+      bytes_read += n;
+    }
+  return Error::Code::NONE;
+}
+
+/* read count frames (less only at the end of the input), converting directly from the buffer */
+Error
+InputBuffer::read_frames (RawConverter& converter, int n_channels, int sample_width, float *samples, size_t count, size_t& frames_read)
+{
+  const size_t frame_bytes = n_channels * sample_width;
+
+  frames_read = 0;
+  while (frames_read < count)
+    {
+      Error err = fill (frame_bytes);
+      if (err)
+        return err;
+
+      size_t n = min (count - frames_read, available() / frame_bytes);
+      if (!n)
+        break;
+
+      converter.from_raw (data(), samples + frames_read * n_channels, n * n_channels);
+      consume (n * frame_bytes);
+      frames_read += n;
+    }
+  return Error::Code::NONE;
+}
+
+void
+InputBuffer::close()
+{
+  if (m_close_fd && m_fd != -1)
+    ::close (m_fd);
+
+  m_fd = -1;
+  m_close_fd = false;
+  m_buffer = vector<unsigned char>();
+  m_start = m_end = 0;
+}
 
 RawFormat::RawFormat()
 {
@@ -88,19 +218,9 @@ RawInputStream::open (const string& filename, const RawFormat& format)
   if (err)
     return err;
 
-  if (filename == "-")
-    {
-      m_input_file = stdin;
-      m_close_file = false;
-    }
-  else
-    {
-      m_input_file = fopen (filename.c_str(), "r");
-      if (!m_input_file)
-        return Error (strerror (errno));
-
-      m_close_file = true;
-    }
+  err = m_input.open (filename);
+  if (err)
+    return err;
 
   m_format = format;
   m_state  = State::OPEN;
@@ -140,19 +260,23 @@ RawInputStream::encoding() const
 Error
 RawInputStream::read_frames (vector<float>& samples, size_t count)
 {
-  assert (m_state == State::OPEN);
+  size_t frames_read = 0;
 
-  const int n_channels   = m_format.n_channels();
-  const int sample_width = m_format.bit_depth() / 8;
+  samples.resize (count * m_format.n_channels());
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * m_format.n_channels());
 
-  vector<unsigned char> input_bytes (count * n_channels * sample_width);
-  size_t r_count = fread (input_bytes.data(), n_channels * sample_width, count, m_input_file);
-  if (ferror (m_input_file))
-    return Error ("error reading sample data");
+  return err;
+}
 
-  samples.resize (r_count * n_channels);
+Error
+RawInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  assert (m_state == State::OPEN);
 
-  m_raw_converter->from_raw (input_bytes.data(), samples.data(), r_count * n_channels);
+  Error err = m_input.read_frames (*m_raw_converter, m_format.n_channels(), m_format.bit_depth() / 8, samples, count, frames_read);
+  if (err)
+    return Error (string_printf ("error reading sample data: %s", err.message()));
 
   return Error::Code::NONE;
 }
@@ -162,13 +286,7 @@ RawInputStream::close()
 {
   if (m_state == State::OPEN)
     {
-      if (m_close_file && m_input_file)
-        {
-          fclose (m_input_file);
-          m_input_file = nullptr;
-          m_close_file = false;
-        }
-
+      m_input.close();
       m_state = State::CLOSED;
     }
 }
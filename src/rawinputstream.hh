@@ -20,6 +20,7 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <sndfile.h>
 
@@ -57,6 +58,54 @@ public:
 
 class RawConverter;
 
+/*
+ * Reads an input file (or stdin) with large read() calls into a buffer, so
+ * that the sample data can be converted directly from the buffer.
+ *
+ * Unlike stdio, a read() from a pipe returns the data that is available (up to
+ * the buffer size) in one call, so few system calls are required if the
+ * program writing into the pipe is fast, without delaying the data otherwise.
+ * The buffer size can be changed using set_buffer_size().
+ */
+class InputBuffer
+{
+  static size_t s_buffer_size;
+
+  int                        m_fd = -1;
+  bool                       m_close_fd = false;
+  bool                       m_eof = false;
+  std::vector<unsigned char> m_buffer;
+  size_t                     m_start = 0;    // first byte in m_buffer that was not consumed
+  size_t                     m_end = 0;      // end of the data in m_buffer
+
+public:
+  static void set_buffer_size (size_t bytes);
+
+  ~InputBuffer();
+
+  Error   open (const std::string& filename);
+  Error   fill (size_t min_bytes);
+  Error   read (unsigned char *dest, size_t n_bytes, size_t& bytes_read);
+  Error   read_frames (RawConverter& converter, int n_channels, int sample_width, float *samples, size_t count, size_t& frames_read);
+  void    close();
+
+  const unsigned char *
+  data() const
+  {
+    return m_buffer.data() + m_start;
+  }
+  size_t
+  available() const
+  {
+    return m_end - m_start;
+  }
+  void
+  consume (size_t n_bytes)
+  {
+    m_start += n_bytes;
+  }
+};
+
 class RawInputStream : public AudioInputStream
 {
   enum class State {
@@ -66,8 +115,7 @@ class RawInputStream : public AudioInputStream
   };
   State       m_state = State::NEW;
   RawFormat   m_format;
-  FILE       *m_input_file = nullptr;
-  bool        m_close_file = false;
+  InputBuffer m_input;
 
   std::unique_ptr<RawConverter> m_raw_converter;
 
@@ -76,6 +124,7 @@ public:
 
   Error   open (const std::string& filename, const RawFormat& format);
   Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
   void    close();
 
   int     bit_depth() const override;
@@ -85,22 +85,40 @@ RawOutputStream::n_channels() const
 
 Error
 RawOutputStream::write_frames (const vector<float>& samples)
+{
+  return write_frames (samples.data(), samples.size() / m_format.n_channels());
+}
+
+Error
+RawOutputStream::write_frames (const float *samples, size_t count)
 {
   assert (m_state == State::OPEN);
 
-  if (samples.empty())
+  if (!count)
     return Error::Code::NONE;
 
-  vector<unsigned char> bytes (samples.size() * m_format.bit_depth() / 8);
-  m_raw_converter->to_raw (samples.data(), bytes.data(), samples.size());
+  const size_t n_values = count * m_format.n_channels();
+  m_output_bytes.resize (n_values * m_format.bit_depth() / 8);
+  m_raw_converter->to_raw (samples, m_output_bytes.data(), n_values);
 
-  fwrite (&bytes[0], 1, bytes.size(), m_output_file);
+  fwrite (m_output_bytes.data(), 1, m_output_bytes.size(), m_output_file);
   if (ferror (m_output_file))
     return Error ("write sample data failed");
 
   return Error::Code::NONE;
 }
 
+Error
+RawOutputStream::flush()
+{
+  assert (m_state == State::OPEN);
+
+  fflush (m_output_file);
+  if (ferror (m_output_file))
+    return Error ("error during flush");
+  return Error::Code::NONE;
+}
+
 Error
 RawOutputStream::close()
 {
@@ -35,6 +35,7 @@ class RawOutputStream : public AudioOutputStream
   FILE       *m_output_file = nullptr;
   bool        m_close_file = false;
 
+  std::vector<unsigned char>    m_output_bytes;
   std::unique_ptr<RawConverter> m_raw_converter;
 public:
   ~RawOutputStream();
@@ -45,6 +46,8 @@ public:
 
   Error open (const std::string& filename, const RawFormat& format);
   Error write_frames (const std::vector<float>& frames) override;
+  Error write_frames (const float *frames, size_t count) override;
+  Error flush() override;
   Error close() override;
 };
 
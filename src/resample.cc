@@ -17,6 +17,7 @@
 
 #include "resample.hh"
 #include "wmcommon.hh"
+#include "audiobuffer.hh"
 
 #include <assert.h>
 #include <math.h>
@@ -27,6 +28,18 @@
 using std::vector;
 using std::min;
 
+/* filter half length (in samples at the lower rate) for the zita resamplers */
+static int
+resampler_hlen()
+{
+  switch (Params::resample_quality)
+    {
+      case ResampleQuality::FAST: return 8;
+      case ResampleQuality::BEST: return 32;
+      default:                    return 16;
+    }
+}
+
 template<class R>
 static void
 process_resampler (R& resampler, const float *in, size_t in_size, float *out, size_t out_size)
@@ -49,20 +62,20 @@ process_resampler (R& resampler, const float *in, size_t in_size, float *out, si
   resampler.process();
 }
 
-WavData
-resample (const WavData& wav_data, int rate)
+Error
+resample (const WavData& wav_data, int rate, WavData& wav_data_out)
 {
   /* in our application, resampling should only be called if it is necessary
    * since using the resampler with input rate == output rate would be slow
    */
   assert (rate != wav_data.sample_rate());
 
-  const int hlen = 16;
+  const int hlen = resampler_hlen();
   const double ratio = double (rate) / wav_data.sample_rate();
 
   const vector<float>& in = wav_data.samples();
 
-  WavData wav_data_out ({}, wav_data.n_channels(), rate, wav_data.bit_depth());
+  wav_data_out = WavData ({}, wav_data.n_channels(), rate, wav_data.bit_depth());
   vector<float>& out_ref = wav_data_out.mutable_samples();
   out_ref.resize (lrint (in.size() / wav_data.n_channels() * ratio) * wav_data.n_channels());
 
@@ -81,48 +94,44 @@ resample (const WavData& wav_data, int rate)
   if (resampler.setup (wav_data.sample_rate(), rate, wav_data.n_channels(), hlen) == 0)
     {
       process_resampler (resampler, in.data(), in.size(), out_ref.data(), out_ref.size());
-      return wav_data_out;
+      return Error::Code::NONE;
     }
 
   VResampler vresampler;
   if (vresampler.setup (ratio, wav_data.n_channels(), hlen) == 0)
     {
       process_resampler (vresampler, in.data(), in.size(), out_ref.data(), out_ref.size());
-      return wav_data_out;
+      return Error::Code::NONE;
     }
-  error ("audiowmark: resampling from rate %d to rate %d not supported.\n", wav_data.sample_rate(), rate);
-  exit (1);
+  return Error (string_printf ("resampling from rate %d to rate %d not supported", wav_data.sample_rate(), rate));
 }
 
-WavData
-resample_ratio_truncate (const WavData& wav_data, double ratio, int new_rate, double max_in_seconds)
+Error
+resample_ratio_truncate (const WavData& wav_data, double ratio, int new_rate, double max_in_seconds, WavData& wav_data_out)
 {
-  const int hlen = 16;
+  const int hlen = resampler_hlen();
   const vector<float>& in = wav_data.samples();
   size_t in_size_truncate = in.size();
   if (max_in_seconds > 0)
     in_size_truncate = min<size_t> (in_size_truncate, wav_data.n_channels() * lrint (wav_data.sample_rate() * max_in_seconds));
 
-  WavData wav_data_out ({}, wav_data.n_channels(), new_rate, wav_data.bit_depth());
+  wav_data_out = WavData ({}, wav_data.n_channels(), new_rate, wav_data.bit_depth());
 
   vector<float>& out_ref = wav_data_out.mutable_samples();
   out_ref.resize (lrint (in_size_truncate / wav_data.n_channels() * ratio) * wav_data.n_channels());
 
   VResampler vresampler;
   if (vresampler.setup (ratio, wav_data.n_channels(), hlen) != 0)
-    {
-      error ("audiowmark: failed to setup vresampler with ratio=%f\n", ratio);
-      exit (1);
-    }
+    return Error (string_printf ("failed to setup vresampler with ratio=%f", ratio));
 
   process_resampler (vresampler, in.data(), in_size_truncate, out_ref.data(), out_ref.size());
-  return wav_data_out;
+  return Error::Code::NONE;
 }
 
-WavData
-resample_ratio (const WavData& wav_data, double ratio, int new_rate)
+Error
+resample_ratio (const WavData& wav_data, double ratio, int new_rate, WavData& out)
 {
-  return resample_ratio_truncate (wav_data, ratio, new_rate, /* no truncation */ -1);
+  return resample_ratio_truncate (wav_data, ratio, new_rate, /* no truncation */ -1, out);
 }
 
 template<class Resampler>
@@ -134,12 +143,13 @@ class BufferedResamplerImpl : public ResamplerImpl
   bool          first_write = true;
   Resampler     m_resampler;
 
-  vector<float> buffer;
+  AudioBuffer   buffer;
 public:
   BufferedResamplerImpl (int n_channels, int old_rate, int new_rate) :
     n_channels (n_channels),
     old_rate (old_rate),
-    new_rate (new_rate)
+    new_rate (new_rate),
+    buffer (n_channels)
   {
   }
   Resampler&
@@ -167,6 +177,11 @@ public:
   }
   void
   write_frames (const vector<float>& frames)
+  {
+    write_frames (frames.data(), frames.size() / n_channels);
+  }
+  void
+  write_frames (const float *frames, size_t n_frames)
   {
     if (first_write)
       {
@@ -182,7 +197,7 @@ public:
       }
 
     uint start = 0;
-    while (start != frames.size() / n_channels)
+    while (start != n_frames)
       {
         const int out_count = Params::frame_size;
         float out[out_count * n_channels];
@@ -190,14 +205,14 @@ public:
         m_resampler.out_count = out_count;
         m_resampler.out_data  = out;
 
-        m_resampler.inp_count = frames.size() / n_channels - start;
+        m_resampler.inp_count = n_frames - start;
         m_resampler.inp_data  = const_cast<float *> (&frames[start * n_channels]);
         m_resampler.process();
 
         size_t count = out_count - m_resampler.out_count;
-        buffer.insert (buffer.end(), out, out + count * n_channels);
+        buffer.write_frames (out, count);
 
-        start = frames.size() / n_channels - m_resampler.inp_count;
+        start = n_frames - m_resampler.inp_count;
       }
   }
   void
@@ -210,17 +225,17 @@ public:
   vector<float>
   read_frames (size_t frames)
   {
-    assert (frames * n_channels <= buffer.size());
-    const auto begin = buffer.begin();
-    const auto end   = begin + frames * n_channels;
-    vector<float> result (begin, end);
-    buffer.erase (begin, end);
-    return result;
+    return buffer.read_frames (frames);
+  }
+  void
+  read_frames (float *out, size_t frames)
+  {
+    buffer.read_frames (out, frames);
   }
   size_t
   can_read_frames() const
   {
-    return buffer.size() / n_channels;
+    return buffer.can_read_frames();
   }
 };
 
@@ -244,7 +259,7 @@ ResamplerImpl::create (int n_channels, int old_rate, int new_rate)
        *
        * so we try using Resampler, and if that fails fall back to VResampler
        */
-      const int hlen = 16;
+      const int hlen = resampler_hlen();
 
       auto resampler = new BufferedResamplerImpl<Resampler> (n_channels, old_rate, new_rate);
       if (resampler->resampler().setup (old_rate, new_rate, n_channels, hlen) == 0)
@@ -20,9 +20,9 @@
 
 #include "wavdata.hh"
 
-WavData resample (const WavData& wav_data, int rate);
-WavData resample_ratio (const WavData& wav_data, double ratio, int new_rate);
-WavData resample_ratio_truncate (const WavData& wav_data, double ratio, int new_rate, double max_seconds);
+Error resample (const WavData& wav_data, int rate, WavData& out);
+Error resample_ratio (const WavData& wav_data, double ratio, int new_rate, WavData& out);
+Error resample_ratio_truncate (const WavData& wav_data, double ratio, int new_rate, double max_seconds, WavData& out);
 
 class ResamplerImpl
 {
@@ -34,8 +34,10 @@ public:
 
   virtual size_t             skip (size_t zeros) = 0;
   virtual void               write_frames (const std::vector<float>& frames) = 0;
+  virtual void               write_frames (const float *frames, size_t n_frames) = 0;
   virtual void               write_trailing_frames() = 0;
   virtual std::vector<float> read_frames (size_t frames) = 0;
+  virtual void               read_frames (float *out, size_t frames) = 0;
   virtual size_t             can_read_frames() const = 0;
 
   static ResamplerImpl *create (int n_channels, int old_rate, int new_rate);
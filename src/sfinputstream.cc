@@ -33,7 +33,7 @@ SFInputStream::~SFInputStream()
 Error
 SFInputStream::open (const string& filename)
 {
-  return open ([&] (SF_INFO *sfinfo) {
+  Error err = open ([&] (SF_INFO *sfinfo) {
     if (filename == "-")
       {
         m_is_stdin = true;
@@ -44,6 +44,56 @@ SFInputStream::open (const string& filename)
         return sf_open (filename.c_str(), SFM_READ, sfinfo);
       }
   });
+  if (err)
+    return err;
+
+  /* flac decoding is slow compared to reading other libsndfile formats, but flac
+   * supports sample accurate seeking and its frames can be decoded independently,
+   * so long files can be decoded in parallel
+   */
+  if (!m_is_stdin && (m_format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC)
+    {
+      const size_t n_workers = ParallelDecoder::n_workers (m_n_frames);
+      if (n_workers > 1)
+        {
+          auto new_decoder = [this, filename] () { return new_segment_decoder (filename); };
+          m_parallel_decoder.reset (new ParallelDecoder (new_decoder, m_n_frames, m_n_channels, n_workers));
+        }
+    }
+  return Error::Code::NONE;
+}
+
+/* decoder for one worker of the parallel decoder, with its own SNDFILE */
+ParallelDecoder::DecodeFunc
+SFInputStream::new_segment_decoder (const string& filename)
+{
+  auto stream = std::make_shared<SFInputStream>();
+
+  Error open_err = stream->open ([&] (SF_INFO *sfinfo) { return sf_open (filename.c_str(), SFM_READ, sfinfo); });
+  if (!open_err && (stream->n_channels() != m_n_channels || stream->n_frames() != m_n_frames))
+    open_err = Error ("flac format changed during parallel decoding");
+
+  return [stream, open_err] (size_t start_frame, size_t n_frames, float *out, size_t& frames_decoded) mutable -> Error
+    {
+      if (open_err)
+        return open_err;
+
+      if (sf_seek (stream->m_sndfile, start_frame, SEEK_SET) < 0)
+        return Error (sf_strerror (stream->m_sndfile));
+
+      frames_decoded = 0;
+      while (frames_decoded < n_frames)
+        {
+          size_t frames_read;
+          Error err = stream->read_frames (out + frames_decoded * stream->m_n_channels, n_frames - frames_decoded, frames_read);
+          if (err)
+            return err;
+          if (!frames_read)
+            break;
+          frames_decoded += frames_read;
+        }
+      return Error::Code::NONE;
+    };
 }
 
 
@@ -71,6 +121,7 @@ SFInputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func)
   m_n_channels  = sfinfo.channels;
   m_n_frames    = (sfinfo.frames == SF_COUNT_MAX) ? N_FRAMES_UNKNOWN : sfinfo.frames;
   m_sample_rate = sfinfo.samplerate;
+  m_format      = sfinfo.format;
 
   switch (sfinfo.format & SF_FORMAT_SUBMASK)
     {
@@ -172,25 +223,39 @@ SFInputStream::encoding() const
 
 Error
 SFInputStream::read_frames (vector<float>& samples, size_t count)
+{
+  size_t frames_read = 0;
+
+  samples.resize (count * m_n_channels);
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * m_n_channels);
+
+  return err;
+}
+
+Error
+SFInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
 {
   assert (m_state == State::OPEN);
 
+  if (m_parallel_decoder)
+    return m_parallel_decoder->read_frames (samples, count, frames_read);
+
+  frames_read = 0;
   if (m_encoding == Encoding::FLOAT) /* float or double input */
     {
-      samples.resize (count * m_n_channels);
-
-      sf_count_t r_count = sf_readf_float (m_sndfile, &samples[0], count);
+      sf_count_t r_count = sf_readf_float (m_sndfile, samples, count);
 
       if (sf_error (m_sndfile))
         return Error (sf_strerror (m_sndfile));
 
-      samples.resize (r_count * m_n_channels);
+      frames_read = r_count;
     }
   else /* integer input */
     {
-      vector<int> isamples (count * m_n_channels);
+      m_isamples.resize (count * m_n_channels);
 
-      sf_count_t r_count = sf_readf_int (m_sndfile, &isamples[0], count);
+      sf_count_t r_count = sf_readf_int (m_sndfile, m_isamples.data(), count);
 
       if (sf_error (m_sndfile))
         return Error (sf_strerror (m_sndfile));
@@ -203,20 +268,41 @@ SFInputStream::read_frames (vector<float>& samples, size_t count)
        * and float manually - the important part is that the normalization factors
        * used during read and write are identical
        */
-      samples.resize (r_count * m_n_channels);
       const float norm = 1.0 / 0x80000000LL;
-      for (size_t i = 0; i < samples.size(); i++)
-        samples[i] = isamples[i] * norm;
+      for (size_t i = 0; i < size_t (r_count * m_n_channels); i++)
+        samples[i] = m_isamples[i] * norm;
+
+      frames_read = r_count;
     }
 
   return Error::Code::NONE;
 }
 
+Error
+SFInputStream::seek (size_t frame)
+{
+  assert (m_state == State::OPEN);
+
+  if (m_is_stdin || m_n_frames == N_FRAMES_UNKNOWN)
+    return Error ("input stream does not support seeking");
+
+  /* the parallel decoder only reads the file from start to end, after seeking the file is decoded serially */
+  m_parallel_decoder.reset();
+
+  if (sf_seek (m_sndfile, std::min (frame, m_n_frames), SEEK_SET) < 0)
+    return Error (sf_strerror (m_sndfile));
+
+  return Error::Code::NONE;
+}
+
 void
 SFInputStream::close()
 {
   if (m_state == State::OPEN)
     {
+      /* stop the worker threads before closing */
+      m_parallel_decoder.reset();
+
       assert (m_sndfile);
       sf_close (m_sndfile);
 
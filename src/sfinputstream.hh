@@ -20,10 +20,12 @@
 
 #include <string>
 #include <functional>
+#include <memory>
 
 #include <sndfile.h>
 
 #include "audiostream.hh"
+#include "paralleldecoder.hh"
 
 /* to support virtual io read/write from/to memory */
 struct SFVirtualData
@@ -45,8 +47,10 @@ private:
   size_t      m_n_frames = 0;
   int         m_bit_depth = 0;
   int         m_sample_rate = 0;
+  int         m_format = 0;
   Encoding    m_encoding = Encoding::SIGNED;
   bool        m_is_stdin = false;
+  std::vector<int> m_isamples;
 
   enum class State {
     NEW,
@@ -55,13 +59,18 @@ private:
   };
   State       m_state = State::NEW;
 
+  std::unique_ptr<ParallelDecoder> m_parallel_decoder;
+
   Error open (std::function<SNDFILE* (SF_INFO *)> open_func);
+  ParallelDecoder::DecodeFunc new_segment_decoder (const std::string& filename);
 public:
   ~SFInputStream();
 
   Error               open (const std::string& filename);
   Error               open (const std::vector<unsigned char> *data);
-  Error               read_frames (std::vector<float>& samples, size_t count) override AUDIOWMARK_EXTRA_OPT;
+  Error               read_frames (std::vector<float>& samples, size_t count) override;
+  Error               read_frames (float *samples, size_t count, size_t& frames_read) override AUDIOWMARK_EXTRA_OPT;
+  Error               seek (size_t frame) override;
   void                close();
 
   int
@@ -134,24 +134,31 @@ SFOutputStream::close()
 Error
 SFOutputStream::write_frames (const vector<float>& samples)
 {
-  sf_count_t frames = samples.size() / m_n_channels;
+  return write_frames (samples.data(), samples.size() / m_n_channels);
+}
+
+Error
+SFOutputStream::write_frames (const float *samples, size_t n_frames)
+{
+  const size_t n_values = n_frames * m_n_channels;
+  const sf_count_t frames = n_frames;
   sf_count_t count;
 
   if (m_write_float_data)
     {
-      vector<float> fsamples (samples.size());
-      for (size_t i = 0; i < samples.size(); i++)
-        fsamples[i] = float_clip (samples[i]);
+      m_fsamples.resize (n_values);
+      for (size_t i = 0; i < n_values; i++)
+        m_fsamples[i] = float_clip (samples[i]);
 
-      count = sf_writef_float (m_sndfile, fsamples.data(), frames);
+      count = sf_writef_float (m_sndfile, m_fsamples.data(), frames);
     }
   else
     {
-      vector<int> isamples (samples.size());
-      for (size_t i = 0; i < samples.size(); i++)
-        isamples[i] = float_to_int_clip<32> (samples[i]);
+      m_isamples.resize (n_values);
+      for (size_t i = 0; i < n_values; i++)
+        m_isamples[i] = float_to_int_clip<32> (samples[i]);
 
-      count = sf_writef_int (m_sndfile, isamples.data(), frames);
+      count = sf_writef_int (m_sndfile, m_isamples.data(), frames);
     }
 
 
@@ -39,6 +39,8 @@ private:
   int         m_sample_rate = 0;
   int         m_n_channels = 0;
   bool        m_write_float_data = false;
+  std::vector<float> m_fsamples;
+  std::vector<int>   m_isamples;
 
   enum class State {
     NEW,
@@ -53,7 +55,8 @@ public:
 
   Error  open (const std::string& filename, int n_channels, int sample_rate, int bit_depth, Encoding encoding, OutFormat out_format = OutFormat::WAV);
   Error  open (std::vector<unsigned char> *data, int n_channels, int sample_rate, int bit_depth, Encoding encoding, OutFormat out_format = OutFormat::WAV);
-  Error  write_frames (const std::vector<float>& frames) override AUDIOWMARK_EXTRA_OPT;
+  Error  write_frames (const std::vector<float>& frames) override;
+  Error  write_frames (const float *frames, size_t count) override AUDIOWMARK_EXTRA_OPT;
   Error  close() override;
   int    bit_depth() const override;
   int    sample_rate() const override;
@@ -18,6 +18,10 @@
 #include "utils.hh"
 #include "shortcode.hh"
 #include "wmcommon.hh"
+#include "profile.hh"
+
+#include <algorithm>
+#include <functional>
 
 #include <assert.h>
 
@@ -82,35 +86,177 @@ static vector<vector<int>> block_56_12_22 = {
   { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1 },
 };
 
+/* codeword bits packed into two 64 bit words (bit j of the codeword: w[j / 64] bit j % 64) */
+struct PackedCode
+{
+  uint64_t w[2] = { 0, 0 };
+
+  void
+  set (size_t bit)
+  {
+    w[bit / 64] |= uint64_t (1) << (bit % 64);
+  }
+  bool
+  get (size_t bit) const
+  {
+    return (w[bit / 64] >> (bit % 64)) & 1;
+  }
+  void
+  operator^= (const PackedCode& other)
+  {
+    w[0] ^= other.w[0];
+    w[1] ^= other.w[1];
+  }
+  bool
+  operator== (const PackedCode& other) const
+  {
+    return w[0] == other.w[0] && w[1] == other.w[1];
+  }
+  int
+  distance (const PackedCode& other) const
+  {
+    return __builtin_popcountll (w[0] ^ other.w[0]) + __builtin_popcountll (w[1] ^ other.w[1]);
+  }
+};
+
 static vector<vector<int>> gen_matrix;
 static size_t              gen_in_count = 0;
 static size_t              gen_out_count = 0;
+static int                 gen_min_distance = 0;
+
+/* precomputed decoder tables */
+static vector<PackedCode>  gen_rows;      // gen_rows[bit]: codeword of the message with only this bit set
+static vector<size_t>      info_columns;  // gen_in_count codeword positions which determine the message
+static vector<uint32_t>    info_inverse;  // info_inverse[i]: message bits toggled by codeword bit info_columns[i]
+
+static PackedCode
+pack_code (const vector<int>& bits)
+{
+  PackedCode code;
+  for (size_t j = 0; j < bits.size(); j++)
+    if (bits[j])
+      code.set (j);
+  return code;
+}
+
+static PackedCode
+encode_packed (uint32_t msg)
+{
+  PackedCode code;
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    if (msg & (1 << bit))
+      code ^= gen_rows[bit];
+  return code;
+}
+
+/*
+ * Find an information set, that is gen_in_count columns of the generator
+ * matrix which are linearly independent, and invert the generator matrix
+ * restricted to these columns. Then the message of a codeword can be
+ * computed from the codeword bits at these positions alone (like for a
+ * systematic code), and short_decode_blk() only needs to re-encode the
+ * message to check if the input is a codeword.
+ */
+static void
+init_decoder_tables()
+{
+  gen_rows.clear();
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    gen_rows.push_back (pack_code (gen_matrix[bit]));
+
+  /* columns as bit masks over message bits */
+  auto column = [] (size_t j) {
+    uint32_t col = 0;
+    for (size_t bit = 0; bit < gen_in_count; bit++)
+      if (gen_matrix[bit][j])
+        col |= 1 << bit;
+    return col;
+  };
+
+  /* greedily select independent columns (gaussian elimination on columns) */
+  info_columns.clear();
+  vector<uint32_t> basis;
+  for (size_t j = 0; j < gen_out_count && info_columns.size() < gen_in_count; j++)
+    {
+      uint32_t col = column (j);
+      for (auto b : basis)
+        col = std::min (col, col ^ b);
+      if (col)
+        {
+          basis.push_back (col);
+          std::sort (basis.begin(), basis.end(), std::greater<uint32_t>());
+          info_columns.push_back (j);
+        }
+    }
+  assert (info_columns.size() == gen_in_count);
+
+  /*
+   * invert the square matrix S with S[bit][i] = gen_matrix[bit][info_columns[i]]
+   *
+   * the codeword bits c at info_columns are c = m S for message m, so m = c S^-1,
+   * which is the xor of the rows i of S^-1 for all set bits c[i]
+   */
+  vector<uint32_t> rows (gen_in_count), inv (gen_in_count);
+  for (size_t i = 0; i < gen_in_count; i++)
+    {
+      /* rows of S^T, as bit masks over message bits, and identity */
+      rows[i] = column (info_columns[i]);
+      inv[i] = 1 << i;
+    }
+  /* gauss-jordan on S^T: afterwards inv = (S^T)^-1 = (S^-1)^T */
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    {
+      size_t pivot = bit;
+      while (!(rows[pivot] & (1 << bit)))
+        pivot++;
+      std::swap (rows[bit], rows[pivot]);
+      std::swap (inv[bit], inv[pivot]);
+      for (size_t r = 0; r < gen_in_count; r++)
+        {
+          if (r != bit && (rows[r] & (1 << bit)))
+            {
+              rows[r] ^= rows[bit];
+              inv[r] ^= inv[bit];
+            }
+        }
+    }
+  /* transpose: info_inverse[i] = row i of S^-1 */
+  info_inverse.assign (gen_in_count, 0);
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    for (size_t i = 0; i < gen_in_count; i++)
+      if (inv[bit] & (1 << i))
+        info_inverse[i] |= 1 << bit;
+}
 
 size_t
 short_code_init (size_t k)
 {
   if (k == 12)
     {
-      gen_matrix    = block_56_12_22;
-      gen_in_count  = 12;
-      gen_out_count = 56;
+      gen_matrix       = block_56_12_22;
+      gen_in_count     = 12;
+      gen_out_count    = 56;
+      gen_min_distance = 22;
     }
   else if (k == 16)
     {
-      gen_matrix    = block_61_16_21;
-      gen_in_count  = 16;
-      gen_out_count = 61;
+      gen_matrix       = block_61_16_21;
+      gen_in_count     = 16;
+      gen_out_count    = 61;
+      gen_min_distance = 21;
     }
   else if (k == 20)
     {
-      gen_matrix    = block_65_20_20;
-      gen_in_count  = 20;
-      gen_out_count = 65;
+      gen_matrix       = block_65_20_20;
+      gen_in_count     = 20;
+      gen_out_count    = 65;
+      gen_min_distance = 20;
     }
   else /* unsupported k */
     {
       return 0;
     }
+  init_decoder_tables();
   return gen_out_count;
 }
 
@@ -129,6 +275,9 @@ code_size (ConvBlockType block_type, size_t msg_size)
 vector<int>
 code_decode_soft (ConvBlockType block_type, const std::vector<float>& coded_bits, float *error_out)
 {
+  Profile::Timer timer (Profile::Stage::DECODE);
+  Profile::count (Profile::Counter::DECODES);
+
   return Params::payload_short ? short_decode_soft (block_type, coded_bits, error_out) : conv_decode_soft (block_type, coded_bits, error_out);
 }
 
@@ -169,47 +318,62 @@ short_code_size (ConvBlockType block_type, size_t msg_size)
   return conv_code_size (block_type, gen_out_count);
 }
 
-vector<int>
-short_decode_blk (const vector<int>& coded_bits)
+static vector<int>
+unpack_msg (uint32_t msg)
 {
   vector<int> out_bits;
-  for (size_t c = 0; c < size_t (1 << gen_in_count); c++)
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    out_bits.push_back ((msg >> bit) & 1);
+  return out_bits;
+}
+
+/*
+ * nearest codeword decoding: enumerate all codewords in gray code order (one
+ * xor per codeword) and return the message of the codeword within the error
+ * correction capability of the code; there is at most one such codeword
+ */
+static vector<int>
+short_decode_blk_nearest (const PackedCode& coded)
+{
+  const int max_errors = (gen_min_distance - 1) / 2;
+
+  PackedCode code;
+  uint32_t   msg = 0;
+  if (coded.distance (code) <= max_errors)
+    return unpack_msg (msg);
+
+  for (uint32_t i = 1; i < (uint32_t (1) << gen_in_count); i++)
     {
-      bool match = true;
-      for (size_t j = 0; j < gen_out_count; j++)
-        {
-          int x = 0;
-          for (size_t bit = 0; bit < gen_in_count; bit++)
-            {
-              if (c & (1 << bit))
-                {
-                  x ^= gen_matrix[bit][j];
-                }
-            }
-          if (coded_bits[j] != x)
-            {
-              match = false;
-              break;
-            }
-        }
-      if (match)
-        {
-          for (size_t bit = 0; bit < gen_in_count; bit++)
-            {
-              if (c & (1 << bit))
-                {
-                  out_bits.push_back (1);
-                }
-              else
-                {
-                  out_bits.push_back (0);
-                }
-            }
-          return out_bits;
-        }
+      const int bit = __builtin_ctz (i);
+      code ^= gen_rows[bit];
+      msg ^= 1 << bit;
+
+      if (coded.distance (code) <= max_errors)
+        return unpack_msg (msg);
     }
+  return {};
+}
 
-  return out_bits;
+vector<int>
+short_decode_blk (const vector<int>& coded_bits)
+{
+  assert (coded_bits.size() == gen_out_count);
+
+  const PackedCode coded = pack_code (coded_bits);
+
+  /* message from the information set, which is correct if coded_bits is a codeword */
+  uint32_t msg = 0;
+  for (size_t i = 0; i < gen_in_count; i++)
+    if (coded.get (info_columns[i]))
+      msg ^= info_inverse[i];
+
+  if (encode_packed (msg) == coded)
+    return unpack_msg (msg);
+
+  if (Params::short_nearest)
+    return short_decode_blk_nearest (coded);
+
+  return {};
 }
 
 vector<int>
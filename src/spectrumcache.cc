@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "spectrumcache.hh"
+#include "spectrumindex.hh"
+#include "profile.hh"
+
+using std::vector;
+using std::complex;
+
+SpectrumCache::SpectrumCache (const WavView& wav_data) :
+  m_wav_data (wav_data),
+  m_frame_values (wav_data.n_channels() * n_bands),
+  m_silence_map (wav_data),
+  m_silent_frame (m_frame_values, min_db)
+{
+}
+
+SpectrumCache::SpectrumCache (const WavView& wav_data, SpectrumCache& parent, size_t parent_start, size_t data_start, size_t data_end) :
+  m_wav_data (wav_data),
+  m_frame_values (wav_data.n_channels() * n_bands),
+  m_silence_map (wav_data),
+  m_silent_frame (m_frame_values, min_db),
+  m_parent (&parent),
+  m_parent_start (parent_start),
+  m_data_start (data_start),
+  m_data_end (data_end)
+{
+  assert (parent.m_wav_data.n_channels() == wav_data.n_channels());
+}
+
+SpectrumCache::SpectrumCache (const WavView& wav_data, const SpectrumIndex& index, size_t index_offset) :
+  m_wav_data (wav_data),
+  m_frame_values (wav_data.n_channels() * n_bands),
+  m_silence_map (wav_data),
+  m_silent_frame (m_frame_values, min_db),
+  m_index (&index),
+  m_index_offset (index_offset)
+{
+  /* the view has no samples, so the silence map would be wrong */
+  assert (!SilenceMap::enabled());
+  assert (index.n_channels() == wav_data.n_channels());
+}
+
+/* hop of the spectrum index (frames between the hop positions are not exact), 0 if the cache is not using an index */
+size_t
+SpectrumCache::index_hop() const
+{
+  return m_index ? m_index->hop() : 0;
+}
+
+bool
+SpectrumCache::use_parent (size_t index) const
+{
+  return m_parent && index >= m_data_start && index + Params::frame_size <= m_data_end;
+}
+
+void
+SpectrumCache::compute (FFTAnalyzer& fft_analyzer, size_t index, float *out)
+{
+  if (m_index)
+    {
+      m_index->frame (index + m_index_offset, out);
+      return;
+    }
+
+  alignas (AlignedArray<float>::alignment) complex<float> bins[Params::frame_size / 2 + 1];
+
+  Profile::count (Profile::Counter::FRAMES_FFT);
+  for (int ch = 0; ch < m_wav_data.n_channels(); ch++)
+    {
+      fft_analyzer.run_fft (m_wav_data, index, ch, bins);
+      db_from_complex (&bins[Params::min_band], out + ch * n_bands, n_bands, min_db);
+    }
+}
+
+const float *
+SpectrumCache::find (size_t index)
+{
+  std::lock_guard<std::mutex> lg (m_mutex);
+
+  auto it = m_frames.find (index);
+  if (it != m_frames.end())
+    return it->second;
+  return nullptr;
+}
+
+const float *
+SpectrumCache::insert (size_t index, const float *values)
+{
+  std::lock_guard<std::mutex> lg (m_mutex);
+
+  /* another thread may have computed the same frame in the meantime */
+  auto it = m_frames.find (index);
+  if (it != m_frames.end())
+    return it->second;
+
+  /* frame data is allocated in pages, so pointers remain valid while the cache grows */
+  if (m_page_used == frames_per_page)
+    {
+      m_pages.emplace_back (new float[frames_per_page * m_frame_values]);
+      m_page_used = 0;
+    }
+  float *frame = m_pages.back().get() + m_page_used * m_frame_values;
+  m_page_used++;
+
+  std::copy (values, values + m_frame_values, frame);
+  m_frames[index] = frame;
+  return frame;
+}
+
+/*
+ * get dB values for the frame starting at index, compute and store them if
+ * they are not in the cache yet
+ *
+ * the returned pointer remains valid for the lifetime of the cache
+ */
+const float *
+SpectrumCache::get (FFTAnalyzer& fft_analyzer, size_t index)
+{
+  if (use_parent (index))
+    return m_parent->get (fft_analyzer, index - m_data_start + m_parent_start);
+  if (silent (index))
+    return m_silent_frame.data();
+
+  const float *values = find (index);
+  if (values)
+    return values;
+
+  vector<float> frame (m_frame_values);
+  compute (fft_analyzer, index, frame.data());
+  return insert (index, frame.data());
+}
+
+/*
+ * like get, but this doesn't store the frame if it is not in the cache yet,
+ * instead it is computed in scratch (with frame_values() floats)
+ *
+ * this is useful for frames which will most likely not be used again
+ */
+const float *
+SpectrumCache::lookup (FFTAnalyzer& fft_analyzer, size_t index, float *scratch)
+{
+  if (use_parent (index))
+    return m_parent->lookup (fft_analyzer, index - m_data_start + m_parent_start, scratch);
+  if (silent (index))
+    return m_silent_frame.data();
+
+  const float *values = find (index);
+  if (values)
+    return values;
+
+  compute (fft_analyzer, index, scratch);
+  return scratch;
+}
+
+/*
+ * batched version of get() or lookup() for frame_count consecutive frames:
+ * frames[f] is set to the values of the frame starting at index + f * Params::frame_size
+ *
+ * if want is not null, only frames with want[f] set are returned (the others
+ * are nullptr); if scratch is not null, frames which are not in the cache yet
+ * are computed in scratch (frame_values() floats per frame) without storing
+ * them, like lookup()
+ */
+void
+SpectrumCache::get_frames (FFTAnalyzer& fft_analyzer, size_t index, size_t frame_count, const char *want,
+                           const float **frames, float *scratch)
+{
+  const size_t n_bins = Params::frame_size / 2 + 1;
+  const int    n_channels = m_wav_data.n_channels();
+
+  size_t batch_f[FFTAnalyzer::max_batch_frames];
+  size_t batch_index[FFTAnalyzer::max_batch_frames];
+  size_t batch_size = 0;
+  vector<float> values;
+
+  auto compute_batch = [&]()
+    {
+      const complex<float> *bins = fft_analyzer.run_fft_batch (m_wav_data, batch_index, batch_size);
+      Profile::count (Profile::Counter::FRAMES_FFT, batch_size);
+
+      for (size_t b = 0; b < batch_size; b++)
+        {
+          float *out;
+          if (scratch)
+            {
+              out = scratch + batch_f[b] * m_frame_values;
+            }
+          else
+            {
+              values.resize (m_frame_values);
+              out = values.data();
+            }
+          for (int ch = 0; ch < n_channels; ch++)
+            db_from_complex (bins + (b * n_channels + ch) * n_bins + Params::min_band, out + ch * n_bands, n_bands, min_db);
+
+          frames[batch_f[b]] = scratch ? out : insert (batch_index[b], out);
+        }
+      batch_size = 0;
+    };
+
+  size_t f = 0;
+  while (f < frame_count)
+    {
+      const size_t frame_index = index + f * Params::frame_size;
+
+      frames[f] = nullptr;
+      if (want && !want[f])
+        {
+          f++;
+        }
+      else if (use_parent (frame_index))
+        {
+          /* pass frames which use the parent cache on as one range */
+          size_t end = f + 1;
+          while (end < frame_count && use_parent (index + end * Params::frame_size) && !(want && !want[end]))
+            end++;
+
+          m_parent->get_frames (fft_analyzer, frame_index - m_data_start + m_parent_start, end - f, nullptr,
+                                frames + f, scratch ? scratch + f * m_frame_values : nullptr);
+          f = end;
+        }
+      else if (silent (frame_index))
+        {
+          frames[f] = m_silent_frame.data();
+          f++;
+        }
+      else
+        {
+          frames[f] = find (frame_index);
+          if (!frames[f] && m_index)
+            {
+              /* nothing to batch: index frames are only converted */
+              values.resize (m_frame_values);
+              float *out = scratch ? scratch + f * m_frame_values : values.data();
+
+              compute (fft_analyzer, frame_index, out);
+              frames[f] = scratch ? out : insert (frame_index, out);
+            }
+          else if (!frames[f])
+            {
+              batch_f[batch_size] = f;
+              batch_index[batch_size] = frame_index;
+              batch_size++;
+
+              if (batch_size == FFTAnalyzer::max_batch_frames)
+                compute_batch();
+            }
+          f++;
+        }
+    }
+  if (batch_size)
+    compute_batch();
+}
+
+void
+SpectrumCache::store (size_t index, const float *values)
+{
+  if (use_parent (index))
+    m_parent->store (index - m_data_start + m_parent_start, values);
+  else
+    insert (index, values);
+}
+
+/*
+ * get dB values for frame_count consecutive frames starting at index
+ *
+ * the values are not copied: frames[f] points to the frame_values() values of
+ * frame f stored in the cache, which stay valid as long as the cache exists
+ *
+ * if there are not enough samples for frame_count frames, this returns false
+ */
+bool
+SpectrumCache::get_range (FFTAnalyzer& fft_analyzer, size_t index, size_t frame_count, vector<const float *>& frames)
+{
+  frames.clear();
+
+  if (m_wav_data.n_values() < (index + frame_count * Params::frame_size) * m_wav_data.n_channels())
+    return false;
+
+  frames.resize (frame_count);
+  get_frames (fft_analyzer, index, frame_count, nullptr, frames.data(), nullptr);
+  return true;
+}
+
+/*
+ * take over the frames of the cache of the previous chunk which are also
+ * part of this chunk, where this chunk starts frame_offset frames after the
+ * start of the previous chunk
+ *
+ * prev is only used to look up its stored frames (its wav data may already
+ * have been replaced by the data of this chunk)
+ */
+void
+SpectrumCache::take_frames (SpectrumCache& prev, size_t frame_offset)
+{
+  assert (prev.m_frame_values == m_frame_values);
+
+  std::lock_guard<std::mutex> lg (prev.m_mutex);
+
+  vector<size_t> indices;
+  for (const auto& frame : prev.m_frames)
+    if (frame.first >= frame_offset)
+      indices.push_back (frame.first);
+
+  /* sorted, so frames from the same page are stored next to each other */
+  std::sort (indices.begin(), indices.end());
+  for (auto index : indices)
+    insert (index - frame_offset, prev.m_frames[index]);
+}
+
+/* memory used by the cache (pages and hash table), for --profile */
+size_t
+SpectrumCache::memory_bytes()
+{
+  std::lock_guard<std::mutex> lg (m_mutex);
+
+  const size_t page_bytes = frames_per_page * m_frame_values * sizeof (float);
+  const size_t entry_bytes = sizeof (size_t) + sizeof (const float *) + sizeof (void *);
+  return m_pages.size() * page_bytes + m_frames.size() * entry_bytes + m_frames.bucket_count() * sizeof (void *);
+}
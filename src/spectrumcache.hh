@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_SPECTRUM_CACHE_HH
+#define AUDIOWMARK_SPECTRUM_CACHE_HH
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "wmcommon.hh"
+
+class SpectrumIndex;
+
+/*
+ * The SpectrumCache stores the dB magnitudes of the watermark bands
+ * (min_band..max_band) of analysis frames, keyed by the sample index where
+ * the frame starts. It is filled lazily: the first request for a frame
+ * performs the fft, later requests (from the SyncFinder, BlockDecoder or
+ * ClipDecoder) reuse the result.
+ *
+ * The values of one frame are stored as n_channels * n_bands floats, all
+ * bands of channel 0 first, then all bands of channel 1, and so on. Each
+ * value is db_from_complex (fft_out[ch][band], min_db), computed with the
+ * vectorized version of db_from_complex.
+ *
+ * A cache is meant to live for one chunk of input data (one decode() call).
+ * Since consecutive chunks overlap, frames of the overlap region can be
+ * taken from the cache of the previous chunk using take_frames().
+ *
+ * The ClipDecoder works on a zero padded view (WavView) of the input data. To
+ * avoid recomputing the frames that are identical to frames of the original
+ * data, a cache for padded data can be constructed with a parent cache:
+ * frames that are entirely inside the non-padded region are taken from the
+ * parent, only frames that overlap the padding are computed/stored locally.
+ *
+ * Missing frames of a range (get_frames/get_range) are computed with batched
+ * ffts, which is faster than computing them one by one.
+ *
+ * If silence skipping is enabled (Params::silence_threshold), frames that are
+ * silent according to the SilenceMap of the wav data are never analyzed: they
+ * are returned as min_db for all bands, which is also the result of the fft
+ * for a frame which contains only zeros. The SyncFinder uses silent() to
+ * leave such frames out of the sync score entirely.
+ *
+ * A cache can also be constructed for a spectrum index (audiowmark get
+ * --from-index): frames are then converted from the index instead of being
+ * computed, the wav data is only a (zero) padded view which determines the
+ * length. Only frames on the hop grid of the index are exact, see
+ * SpectrumIndex.
+ *
+ * All public functions are safe to call from any thread, however each
+ * thread needs to pass its own FFTAnalyzer.
+ */
+class SpectrumCache
+{
+public:
+  static constexpr size_t n_bands = Params::max_band - Params::min_band + 1;
+  static constexpr float  min_db  = -96;
+private:
+  static constexpr size_t frames_per_page = 256;
+
+  const WavView                           m_wav_data;
+  const size_t                            m_frame_values = 0;
+  const SilenceMap                        m_silence_map;
+  const std::vector<float>                m_silent_frame;
+
+  // parent cache: frames in [m_data_start, m_data_end) map to parent frames at m_parent_start
+  SpectrumCache                          *m_parent = nullptr;
+  size_t                                  m_parent_start = 0;
+  size_t                                  m_data_start = 0;
+  size_t                                  m_data_end = 0;
+
+  // spectrum index: frame index of the view is frame index + m_index_offset of the index
+  const SpectrumIndex                    *m_index = nullptr;
+  size_t                                  m_index_offset = 0;
+
+  std::mutex                              m_mutex;
+  std::unordered_map<size_t, const float *> m_frames;
+  std::vector<std::unique_ptr<float[]>>   m_pages;
+  size_t                                  m_page_used = frames_per_page;
+
+  void         compute (FFTAnalyzer& fft_analyzer, size_t index, float *out);
+  const float *find (size_t index);
+  const float *insert (size_t index, const float *values);
+  bool         use_parent (size_t index) const;
+public:
+  SpectrumCache (const WavView& wav_data);
+  SpectrumCache (const WavView& wav_data, SpectrumCache& parent, size_t parent_start, size_t data_start, size_t data_end);
+  SpectrumCache (const WavView& wav_data, const SpectrumIndex& index, size_t index_offset);
+
+  const float *get (FFTAnalyzer& fft_analyzer, size_t index);
+  const float *lookup (FFTAnalyzer& fft_analyzer, size_t index, float *scratch);
+  void         get_frames (FFTAnalyzer& fft_analyzer, size_t index, size_t frame_count, const char *want,
+                           const float **frames, float *scratch);
+  void         store (size_t index, const float *values);
+  bool         get_range (FFTAnalyzer& fft_analyzer, size_t index, size_t frame_count, std::vector<const float *>& frames);
+  void         take_frames (SpectrumCache& prev, size_t frame_offset);
+  size_t       memory_bytes();
+
+  size_t       frame_values() const { return m_frame_values; }
+  bool         silent (size_t index) const { return m_silence_map.silent (index); }
+  size_t       index_hop() const;
+};
+
+#endif /* AUDIOWMARK_SPECTRUM_CACHE_HH */
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <memory>
+
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <assert.h>
+
+#include "spectrumindex.hh"
+#include "spectrumcache.hh"
+#include "wavchunkloader.hh"
+#include "threadpool.hh"
+
+using std::string;
+using std::vector;
+using std::min;
+
+namespace
+{
+
+const char   index_magic[8] = { 'A', 'W', 'M', 'I', 'N', 'D', 'E', 'X' };
+const size_t header_size = 8 + 7 * 4 + 2 * 8;
+
+void
+put_u32 (vector<unsigned char>& out, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    out.push_back (value >> (i * 8));
+}
+
+void
+put_u64 (vector<unsigned char>& out, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+    out.push_back (value >> (i * 8));
+}
+
+uint32_t
+get_u32 (const unsigned char *in)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++)
+    value |= uint32_t (in[i]) << (i * 8);
+  return value;
+}
+
+uint64_t
+get_u64 (const unsigned char *in)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value |= uint64_t (in[i]) << (i * 8);
+  return value;
+}
+
+vector<unsigned char>
+header_bytes (int n_channels, int hop, size_t n_frames, size_t n_index_frames)
+{
+  vector<unsigned char> header (index_magic, index_magic + 8);
+  put_u32 (header, SpectrumIndex::version);
+  put_u32 (header, n_channels);
+  put_u32 (header, Params::mark_sample_rate);
+  put_u32 (header, Params::frame_size);
+  put_u32 (header, Params::min_band);
+  put_u32 (header, Params::max_band);
+  put_u32 (header, hop);
+  put_u64 (header, n_frames);
+  put_u64 (header, n_index_frames);
+  assert (header.size() == header_size);
+  return header;
+}
+
+bool
+valid_hop (size_t hop)
+{
+  return hop > 0 && Params::sync_search_step % hop == 0 && hop % Params::sync_search_fine == 0;
+}
+
+/* compute count index frames of wav_data, starting at frame first, quantized into values */
+void
+compute_index_frames (const WavData& wav_data, size_t first, size_t hop, size_t count, vector<int16_t>& values)
+{
+  SpectrumCache spectrum_cache (wav_data);
+  ThreadPool    thread_pool;
+
+  const size_t frame_values = spectrum_cache.frame_values();
+  const size_t n_phases = Params::frame_size / hop;
+  const size_t n_rows = (count + n_phases - 1) / n_phases;
+  const size_t rows_per_job = 64;
+
+  values.resize (count * frame_values);
+
+  /* index frame i = row * n_phases + phase: the frames of one phase are frame_size apart, so they can be computed as a batch */
+  for (size_t row = 0; row < n_rows; row += rows_per_job)
+    {
+      thread_pool.add_job ([&, row]()
+        {
+          const size_t job_rows = min (rows_per_job, n_rows - row);
+
+          FFTAnalyzer           fft_analyzer (wav_data.n_channels());
+          vector<const float *> frames (job_rows);
+          vector<float>         scratch (job_rows * frame_values);
+
+          for (size_t phase = 0; phase < n_phases; phase++)
+            {
+              size_t n = 0;
+              while (n < job_rows && (row + n) * n_phases + phase < count)
+                n++;
+              if (!n)
+                break;
+
+              spectrum_cache.get_frames (fft_analyzer, first + (row * n_phases + phase) * hop, n, nullptr, frames.data(), scratch.data());
+              for (size_t f = 0; f < n; f++)
+                {
+                  int16_t *out = &values[((row + f) * n_phases + phase) * frame_values];
+                  for (size_t i = 0; i < frame_values; i++)
+                    out[i] = std::max (std::min (lrint (frames[f][i] * SpectrumIndex::db_scale), 32767L), -32768L);
+                }
+            }
+        });
+    }
+  thread_pool.wait_all();
+}
+
+}
+
+Error
+SpectrumIndex::load (const string& filename)
+{
+  std::unique_ptr<FILE, decltype (&fclose)> file (fopen (filename.c_str(), "rb"), fclose);
+  if (!file)
+    return Error (string_printf ("%s: %s", filename.c_str(), strerror (errno)));
+
+  unsigned char header[header_size];
+  if (fread (header, 1, header_size, file.get()) != header_size || memcmp (header, index_magic, 8) != 0)
+    return Error (string_printf ("%s: not a spectrum index file", filename.c_str()));
+
+  const uint32_t file_version = get_u32 (header + 8);
+  if (file_version != version)
+    return Error (string_printf ("%s: unsupported spectrum index version %u", filename.c_str(), file_version));
+
+  m_n_channels     = get_u32 (header + 12);
+  m_hop            = get_u32 (header + 32);
+  m_n_frames       = get_u64 (header + 36);
+  m_n_index_frames = get_u64 (header + 44);
+
+  if (int (get_u32 (header + 16)) != Params::mark_sample_rate || get_u32 (header + 20) != Params::frame_size ||
+      int (get_u32 (header + 24)) != Params::min_band || int (get_u32 (header + 28)) != Params::max_band)
+    return Error (string_printf ("%s: spectrum index was created with incompatible watermark parameters", filename.c_str()));
+
+  /* an index with zero channels was not completely written */
+  if (m_n_channels < 1 || !valid_hop (m_hop))
+    return Error (string_printf ("%s: bad spectrum index header", filename.c_str()));
+
+  /* one index frame per hop for all complete frames of the input (see index_file) */
+  const size_t expect_index_frames = m_n_frames >= Params::frame_size ? (m_n_frames - Params::frame_size) / m_hop + 1 : 0;
+  if (m_n_index_frames != expect_index_frames)
+    return Error (string_printf ("%s: bad spectrum index header", filename.c_str()));
+
+  /* check the size of the data before allocating memory for it (the division avoids overflows) */
+  const long data_start = ftell (file.get());
+  if (data_start < 0 || fseek (file.get(), 0, SEEK_END) != 0)
+    return Error (string_printf ("%s: %s", filename.c_str(), strerror (errno)));
+  const long file_size = ftell (file.get());
+  if (file_size < data_start || fseek (file.get(), data_start, SEEK_SET) != 0)
+    return Error (string_printf ("%s: %s", filename.c_str(), strerror (errno)));
+
+  const size_t data_bytes = file_size - data_start;
+  const size_t frame_bytes = size_t (m_n_channels) * SpectrumCache::n_bands * 2;
+  if (data_bytes / frame_bytes < m_n_index_frames)
+    return Error (string_printf ("%s: spectrum index file is truncated", filename.c_str()));
+  if (data_bytes != m_n_index_frames * frame_bytes)
+    return Error (string_printf ("%s: bad spectrum index header", filename.c_str()));
+
+  /* values are converted from little endian in blocks, to avoid storing the file data twice */
+  const size_t n_values = m_n_index_frames * m_n_channels * SpectrumCache::n_bands;
+  m_values.resize (n_values);
+
+  vector<unsigned char> buffer (65536);
+  size_t pos = 0;
+  while (pos < n_values)
+    {
+      const size_t block = min (buffer.size() / 2, n_values - pos);
+      if (fread (buffer.data(), 2, block, file.get()) != block)
+        return Error (string_printf ("%s: spectrum index file is truncated", filename.c_str()));
+
+      for (size_t i = 0; i < block; i++)
+        m_values[pos + i] = int16_t (buffer[i * 2] | (buffer[i * 2 + 1] << 8));
+      pos += block;
+    }
+  return Error::Code::NONE;
+}
+
+/* get the values of the frame starting at index (or of the nearest indexed frame), frame_values() floats of SpectrumCache */
+void
+SpectrumIndex::frame (size_t index, float *out) const
+{
+  const size_t frame_values = m_n_channels * SpectrumCache::n_bands;
+  if (!m_n_index_frames)
+    {
+      std::fill (out, out + frame_values, float (SpectrumCache::min_db));
+      return;
+    }
+
+  const size_t   i = min ((index + m_hop / 2) / m_hop, m_n_index_frames - 1);
+  const int16_t *values = &m_values[i * frame_values];
+  for (size_t v = 0; v < frame_values; v++)
+    out[v] = values[v] / db_scale;
+}
+
+int
+create_spectrum_index (const string& infile, const string& index_file, int hop)
+{
+  if (!valid_hop (hop))
+    {
+      error ("audiowmark: index hop must be a divisor of %d and a multiple of %d\n", Params::sync_search_step, Params::sync_search_fine);
+      return 1;
+    }
+
+  std::unique_ptr<FILE, decltype (&fclose)> file (fopen (index_file.c_str(), "wb"), fclose);
+  if (!file)
+    {
+      error ("audiowmark: failed to open output file '%s': %s\n", index_file.c_str(), strerror (errno));
+      return 1;
+    }
+
+  /* the header is written again with the final values at the end */
+  vector<unsigned char> header = header_bytes (0, hop, 0, 0);
+  bool write_ok = fwrite (header.data(), 1, header.size(), file.get()) == header.size();
+
+  WavChunkLoader wav_chunk_loader (infile);
+
+  int    n_channels = 0;
+  size_t n_frames = 0;
+  size_t n_index_frames = 0;
+  size_t next_frame = 0;     // start of the next index frame
+  while (!wav_chunk_loader.done() && write_ok)
+    {
+      Error err = wav_chunk_loader.load_next_chunk();
+      if (err)
+        {
+          error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+          return 1;
+        }
+      if (wav_chunk_loader.done())
+        break;
+
+      const WavData& wav_data = wav_chunk_loader.wav_data();
+      const size_t   offset = wav_chunk_loader.frame_offset();
+
+      n_channels = wav_data.n_channels();
+      n_frames   = offset + wav_data.n_frames();
+      if (next_frame + Params::frame_size > n_frames)
+        continue;
+
+      /* chunks overlap by much more than one frame, so the next frame is always part of this chunk */
+      assert (next_frame >= offset);
+
+      const size_t count = (n_frames - Params::frame_size - next_frame) / hop + 1;
+      vector<int16_t> values;
+      compute_index_frames (wav_data, next_frame - offset, hop, count, values);
+
+      vector<unsigned char> bytes (values.size() * 2);
+      for (size_t i = 0; i < values.size(); i++)
+        {
+          bytes[i * 2]     = uint16_t (values[i]);
+          bytes[i * 2 + 1] = uint16_t (values[i]) >> 8;
+        }
+      write_ok = fwrite (bytes.data(), 1, bytes.size(), file.get()) == bytes.size();
+
+      n_index_frames += count;
+      next_frame += count * hop;
+    }
+  if (!n_channels)
+    {
+      error ("audiowmark: error loading %s: no audio data\n", infile.c_str());
+      return 1;
+    }
+  header = header_bytes (n_channels, hop, n_frames, n_index_frames);
+  if (write_ok)
+    write_ok = fseek (file.get(), 0, SEEK_SET) == 0 && fwrite (header.data(), 1, header.size(), file.get()) == header.size();
+  if (write_ok)
+    write_ok = fclose (file.release()) == 0;
+
+  if (!write_ok)
+    {
+      error ("audiowmark: error writing index file '%s': %s\n", index_file.c_str(), strerror (errno));
+      return 1;
+    }
+  info ("Index Frames: %zd (hop %d)\n", n_index_frames, hop);
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_SPECTRUM_INDEX_HH
+#define AUDIOWMARK_SPECTRUM_INDEX_HH
+
+#include <string>
+#include <vector>
+
+#include "utils.hh"
+
+/*
+ * A spectrum index stores the values a SpectrumCache would compute for an
+ * input file (the dB magnitudes of bands min_band..max_band of each channel),
+ * for the frames starting at every hop samples of the input, resampled to
+ * mark_sample_rate. Since the values don't depend on the key, an input file
+ * can be indexed once (audiowmark index) and then be searched with any key
+ * (audiowmark get --from-index) without decoding, resampling and fft.
+ *
+ * The hop is a divisor of sync_search_step, so the index contains all frames
+ * of the sync search and of the data blocks. Frames between the hop positions
+ * are not available: frame() returns the nearest indexed frame instead.
+ *
+ * File format (all values little endian):
+ *
+ *   char[8]  magic "AWMINDEX"
+ *   uint32   version
+ *   uint32   n_channels, sample_rate, frame_size, min_band, max_band, hop
+ *   uint64   n_frames (length of the resampled input in sample frames)
+ *   uint64   n_index_frames
+ *   int16    values[n_index_frames][n_channels][n_bands] (dB * db_scale)
+ */
+class SpectrumIndex
+{
+public:
+  static constexpr int   version = 1;
+  static constexpr float db_scale = 64;
+
+private:
+  int                  m_n_channels = 0;
+  size_t               m_n_frames = 0;
+  size_t               m_hop = 0;
+  size_t               m_n_index_frames = 0;
+  std::vector<int16_t> m_values;
+
+public:
+  Error load (const std::string& filename);
+
+  int
+  n_channels() const
+  {
+    return m_n_channels;
+  }
+  size_t
+  n_frames() const
+  {
+    return m_n_frames;
+  }
+  size_t
+  hop() const
+  {
+    return m_hop;
+  }
+  void frame (size_t index, float *out) const;
+};
+
+int create_spectrum_index (const std::string& infile, const std::string& index_file, int hop);
+
+#endif /* AUDIOWMARK_SPECTRUM_INDEX_HH */
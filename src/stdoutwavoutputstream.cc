@@ -149,18 +149,25 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, Enc
 Error
 StdoutWavOutputStream::write_frames (const vector<float>& samples)
 {
-  if (samples.empty())
+  return write_frames (samples.data(), samples.size() / m_n_channels);
+}
+
+Error
+StdoutWavOutputStream::write_frames (const float *samples, size_t count)
+{
+  if (!count)
     return Error::Code::NONE;
 
   const size_t block_size = 8192 * m_n_channels;
+  const size_t n_values = count * m_n_channels;
   const int sample_width = m_bit_depth / 8;
 
   m_output_bytes.resize (sample_width * block_size);
   size_t pos = 0;
 
-  while (size_t todo = min (block_size, samples.size() - pos))
+  while (size_t todo = min (block_size, n_values - pos))
     {
-      m_raw_converter->to_raw (samples.data() + pos, m_output_bytes.data(), todo);
+      m_raw_converter->to_raw (samples + pos, m_output_bytes.data(), todo);
 
       fwrite (m_output_bytes.data(), 1, todo * sample_width, stdout);
       if (ferror (stdout))
@@ -171,6 +178,15 @@ StdoutWavOutputStream::write_frames (const vector<float>& samples)
   return Error::Code::NONE;
 }
 
+Error
+StdoutWavOutputStream::flush()
+{
+  fflush (stdout);
+  if (ferror (stdout))
+    return Error ("error during flush");
+  return Error::Code::NONE;
+}
+
 Error
 StdoutWavOutputStream::close()
 {
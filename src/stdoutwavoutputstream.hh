@@ -45,6 +45,8 @@ public:
 
   Error open (int n_channels, int sample_rate, int bit_depth, Encoding encoding, size_t n_frames, bool wav_pipe);
   Error write_frames (const std::vector<float>& frames) override;
+  Error write_frames (const float *frames, size_t count) override;
+  Error flush() override;
   Error close() override;
   int  sample_rate() const override;
   int  bit_depth() const override;
@@ -17,12 +17,14 @@
 
 #include <vector>
 #include <algorithm>
+#include <memory>
 
 #include "syncfinder.hh"
 #include "threadpool.hh"
 #include "wmcommon.hh"
+#include "keytables.hh"
+#include "profile.hh"
 
-using std::complex;
 using std::vector;
 using std::string;
 using std::min;
@@ -37,20 +39,19 @@ SyncFinder::get_sync_bits (const Key& key, Mode mode)
   const int first_block_end = mark_sync_frame_count() + mark_data_frame_count();
   const int block_count = mode == Mode::CLIP ? 2 : 1;
 
-  UpDownGen up_down_gen (key, Random::Stream::sync_up_down);
-  BitPosGen bit_pos_gen (key);
+  const KeyTables& key_tables = KeyTables::get (key);
   for (int bit = 0; bit < Params::sync_bits; bit++)
     {
       vector<FrameBit> frame_bits;
       for (int f = 0; f < Params::sync_frames_per_bit; f++)
         {
-          UpDownArray frame_up, frame_down;
-          up_down_gen.get (f + bit * Params::sync_frames_per_bit, frame_up, frame_down);
+          const UpDownArray& frame_up   = key_tables.sync_up (f + bit * Params::sync_frames_per_bit);
+          const UpDownArray& frame_down = key_tables.sync_down (f + bit * Params::sync_frames_per_bit);
 
           for (int block = 0; block < block_count; block++)
             {
               FrameBit frame_bit;
-              frame_bit.frame = bit_pos_gen.sync_frame (f + bit * Params::sync_frames_per_bit) + block * first_block_end;
+              frame_bit.frame = key_tables.sync_frame (f + bit * Params::sync_frames_per_bit) + block * first_block_end;
               if (block == 0)
                 {
                   for (auto u : frame_up)
@@ -113,110 +114,390 @@ SyncFinder::bit_quality (float umag, float dmag, int bit)
   return expect_data_bit ? raw_bit : -raw_bit;
 }
 
-double
-SyncFinder::sync_decode (const vector<vector<FrameBit>>& sync_bits,
-                         const size_t start_frame,
-                         const vector<float>& fft_out_db,
-                         const vector<char>&  have_frames)
+/*
+ * with frame_step > 1, only every frame_step-th FrameBit of each sync bit is
+ * used, which gives a table for a cheaper (but less accurate) sync_decode
+ */
+SyncFinder::SyncTable
+SyncFinder::make_sync_table (const vector<Key>& key_list, Mode mode, int frame_step)
 {
-  double sync_quality = 0;
+  SyncTable sync_table;
 
-  size_t n_bands = Params::max_band - Params::min_band + 1;
-  int bit_count = 0;
-  for (size_t bit = 0; bit < sync_bits.size(); bit++)
+  const int n_bands = Params::max_band - Params::min_band + 1;
+  sync_table.n_keys = key_list.size();
+  for (const auto& key : key_list)
+    {
+      for (const auto& frame_bits : get_sync_bits (key, mode))
+        {
+          sync_table.bit_start.push_back (sync_table.frame.size());
+          for (size_t i = 0; i < frame_bits.size(); i += frame_step)
+            {
+              const FrameBit& frame_bit = frame_bits[i];
+              assert (frame_bit.up.size() == Params::bands_per_frame && frame_bit.down.size() == Params::bands_per_frame);
+
+              sync_table.frame.push_back (frame_bit.frame);
+              for (auto u : frame_bit.up)
+                sync_table.offset.push_back (frame_bit.frame * n_bands + u);
+              for (auto d : frame_bit.down)
+                sync_table.offset.push_back (frame_bit.frame * n_bands + d);
+            }
+        }
+    }
+  sync_table.bit_start.push_back (sync_table.frame.size());
+  return sync_table;
+}
+
+/*
+ * compute the sync quality for N consecutive start frames [start_frame, start_frame + N)
+ *
+ * the spectra of the start frames are n_bands floats apart in fft_out_db, so
+ * for each offset of the sync table, the values for all N start frames are
+ * accumulated in one pass (which the compiler can vectorize)
+ */
+template<int N> void
+SyncFinder::sync_decode_n (const SyncTable& sync_table,
+                           size_t k,
+                           const size_t start_frame,
+                           const SyncSpectrum&  fft_out_db,
+                           const vector<char>&  have_frames,
+                           double *quality)
+{
+  double sync_quality[N] = { 0, };
+  int    bit_count[N] = { 0, };
+
+  const size_t n_bands = Params::max_band - Params::min_band + 1;
+  const float *db = fft_out_db.data() + start_frame * n_bands;
+  const int   *bit_start = &sync_table.bit_start[k * Params::sync_bits];
+  for (int bit = 0; bit < Params::sync_bits; bit++)
     {
-      const vector<FrameBit>& frame_bits = sync_bits[bit];
-      float umag = 0, dmag = 0;
+      float umag[N] = { 0, }, dmag[N] = { 0, };
+      int   frame_bit_count[N] = { 0, };
 
-      int frame_bit_count = 0;
-      for (const auto& frame_bit : frame_bits)
+      for (int e = bit_start[bit]; e < bit_start[bit + 1]; e++)
         {
-          if (have_frames[start_frame + frame_bit.frame])
+          const size_t frame = start_frame + sync_table.frame[e];
+          const int   *up    = &sync_table.offset[e * 2 * Params::bands_per_frame];
+          const int   *down  = up + Params::bands_per_frame;
+
+          bool have[N];
+          bool have_all = true;
+          for (int j = 0; j < N; j++)
             {
-              const int index = (start_frame + frame_bit.frame) * n_bands;
-              for (size_t i = 0; i < frame_bit.up.size(); i++)
+              have[j] = have_frames[frame + j];
+              have_all = have_all && have[j];
+              frame_bit_count[j] += have[j];
+            }
+          if (have_all)
+            {
+              for (size_t i = 0; i < Params::bands_per_frame; i++)
+                {
+                  for (int j = 0; j < N; j++)
+                    {
+                      umag[j] += db[up[i] + j * n_bands];
+                      dmag[j] += db[down[i] + j * n_bands];
+                    }
+                }
+            }
+          else
+            {
+              for (int j = 0; j < N; j++)
                 {
-                  umag += fft_out_db[index + frame_bit.up[i]];
-                  dmag += fft_out_db[index + frame_bit.down[i]];
+                  if (have[j])
+                    {
+                      for (size_t i = 0; i < Params::bands_per_frame; i++)
+                        {
+                          umag[j] += db[up[i] + j * n_bands];
+                          dmag[j] += db[down[i] + j * n_bands];
+                        }
+                    }
                 }
-              frame_bit_count++;
             }
         }
-      sync_quality += bit_quality (umag, dmag, bit) * frame_bit_count;
-      bit_count += frame_bit_count;
+      for (int j = 0; j < N; j++)
+        {
+          sync_quality[j] += bit_quality (umag[j], dmag[j], bit) * frame_bit_count[j];
+          bit_count[j] += frame_bit_count[j];
+        }
     }
-  if (bit_count)
-    sync_quality /= bit_count;
-  sync_quality = normalize_sync_quality (sync_quality);
+  for (int j = 0; j < N; j++)
+    {
+      if (bit_count[j])
+        sync_quality[j] /= bit_count[j];
+      quality[j] = normalize_sync_quality (sync_quality[j]);
+    }
+}
 
+double
+SyncFinder::sync_decode (const SyncTable& sync_table,
+                         size_t k,
+                         const size_t start_frame,
+                         const SyncSpectrum&  fft_out_db,
+                         const vector<char>&  have_frames)
+{
+  double sync_quality;
+
+  sync_decode_n<1> (sync_table, k, start_frame, fft_out_db, have_frames, &sync_quality);
   return sync_quality;
 }
 
 void
-SyncFinder::scan_silence (const WavData& wav_data)
+SyncFinder::scan_silence (const WavView& wav_data)
 {
-  const vector<float>& samples = wav_data.samples();
+  const size_t n_values = wav_data.n_values();
+
+  /* padding of the view is zero, so we only need to scan the data range */
+  const size_t data_first = wav_data.data_start() * wav_data.n_channels();
+  const size_t data_last  = wav_data.data_end() * wav_data.n_channels();
 
   // find first non-zero sample
-  wav_data_first = 0;
-  while (wav_data_first < samples.size() && samples[wav_data_first] == 0)
+  wav_data_first = data_first;
+  while (wav_data_first < data_last && wav_data.value (wav_data_first) == 0)
     wav_data_first++;
 
+  if (wav_data_first == data_last) // all zero
+    {
+      wav_data_first = n_values;
+      wav_data_last  = n_values;
+      return;
+    }
+
   // search wav_data_last to get [wav_data_first, wav_data_last) range
-  wav_data_last = samples.size();
-  while (wav_data_last > wav_data_first && samples[wav_data_last - 1] == 0)
+  wav_data_last = data_last;
+  while (wav_data_last > wav_data_first && wav_data.value (wav_data_last - 1) == 0)
     wav_data_last--;
 }
 
+/*
+ * average quality of the scores around score i, raw_quality (idx) returns the quality of score idx
+ *
+ * with stride > 1, only every stride-th score is used (an approximation which needs fewer scores)
+ */
+template<class QualityFunc> double
+SyncFinder::local_mean (int i, int n_scores, int stride, QualityFunc raw_quality)
+{
+  double avg = 0;
+  int n = 0;
+  for (int j = -local_mean_distance; j <= local_mean_distance; j += stride)
+    {
+      if (std::abs (j) >= 4)
+        {
+          int idx = i + j;
+          if (idx >= 0 && idx < n_scores)
+            {
+              avg += raw_quality (idx);
+              n++;
+            }
+        }
+    }
+  if (n > 0)
+    avg /= n;
+  return avg;
+}
+
+/*
+ * compute the full sync quality for the most promising scores of search_approx,
+ * which have been scored with the coarse sync table
+ *
+ * all other scores keep their coarse quality: they can still be selected as
+ * one of the n_best matches, but search_refine recomputes the quality anyway
+ */
 void
-SyncFinder::search_approx (vector<SearchKeyResult>& key_results, const vector<vector<vector<FrameBit>>>& sync_bits, const WavData& wav_data, Mode mode)
+SyncFinder::search_approx_full (ThreadPool& thread_pool, SearchKeyResult& key_result, const SyncTable& sync_table, size_t k,
+                                const ShiftFFT& shift_fft)
+{
+  vector<SearchScore>& scores = key_result.scores;
+
+  /* candidates are the local maxima of the coarse quality */
+  vector<int> peaks;
+  for (int i = 0; i < int (scores.size()); i++)
+    {
+      const double q = scores[i].abs_quality();
+      if ((i == 0 || q >= scores[i - 1].abs_quality()) && (i + 1 == int (scores.size()) || q >= scores[i + 1].abs_quality()))
+        peaks.push_back (i);
+    }
+  std::sort (peaks.begin(), peaks.end(), [&] (int a, int b) { return scores[a].abs_quality() > scores[b].abs_quality(); });
+
+  /* early rejection: keep peaks which may reach threshold1, and enough peaks for the n_best selection */
+  const double coarse_threshold = Params::sync_threshold2 * 0.75;
+  const size_t coarse_n_best = std::max (Params::get_n_best, 1) * coarse_n_best_factor;
+
+  vector<char> rescore (scores.size());
+  for (size_t p = 0; p < peaks.size(); p++)
+    {
+      if (p >= coarse_n_best && scores[peaks[p]].abs_quality() < coarse_threshold)
+        break;
+
+      /* the full quality peak may be next to the coarse quality peak */
+      for (int i = std::max (peaks[p] - 1, 0); i <= std::min (peaks[p] + 1, int (scores.size()) - 1); i++)
+        rescore[i] = 1;
+    }
+  /* the local mean of the rescored scores needs the full quality of the surrounding scores */
+  vector<char> need_full (scores.size());
+  for (int i = 0; i < int (scores.size()); i++)
+    {
+      if (rescore[i])
+        {
+          need_full[i] = 1;
+          for (int j = -local_mean_distance; j <= local_mean_distance; j += coarse_local_mean_stride)
+            {
+              int idx = i + j;
+              if (idx >= 0 && idx < int (scores.size()) && std::abs (j) >= 4)
+                need_full[idx] = 1;
+            }
+        }
+    }
+  vector<int> full_indices;
+  for (int i = 0; i < int (scores.size()); i++)
+    if (need_full[i])
+      full_indices.push_back (i);
+
+  vector<double> full_quality (scores.size());
+  for (auto split_indices : split_vector (full_indices, job_size (full_indices.size(), 64, 1)))
+    {
+      thread_pool.add_job ([this, split_indices, k,
+                            &sync_table, &shift_fft, &scores, &full_quality]()
+        {
+          for (auto i : split_indices)
+            {
+              const size_t start_frame = scores[i].index / Params::frame_size;
+              const auto&  fft = shift_fft[scores[i].index % Params::frame_size / Params::sync_search_step];
+
+              full_quality[i] = sync_decode (sync_table, k, start_frame, fft.fft_db, fft.have_frames);
+            }
+        });
+    }
+  thread_pool.wait_all();
+
+  for (int i = 0; i < int (scores.size()); i++)
+    {
+      if (rescore[i])
+        {
+          scores[i].raw_quality = full_quality[i];
+          scores[i].local_mean  = local_mean (i, scores.size(), coarse_local_mean_stride, [&] (int idx) { return full_quality[idx]; });
+          scores[i].coarse      = false;
+        }
+    }
+}
+
+/*
+ * if coarse_sync_table is not null, it is used to score all candidate
+ * positions, and the full sync_table is only used for the scores selected by
+ * search_approx_full
+ */
+void
+SyncFinder::search_approx (vector<SearchKeyResult>& key_results, const SyncTable& sync_table, const SyncTable *coarse_sync_table,
+                           const WavView& wav_data, Mode mode)
 {
   ThreadPool    thread_pool;
-  vector<float> fft_db;
-  vector<char>  have_frames;
+  ShiftFFT      shift_fft (Params::frame_size / Params::sync_search_step);
 
-  std::mutex result_mutex;
   // compute multiple time-shifted fft vectors
   size_t n_bands = Params::max_band - Params::min_band + 1;
   int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
   if (mode == Mode::CLIP)
     total_frame_count *= 2;
-  for (size_t sync_shift = 0; sync_shift < Params::frame_size; sync_shift += Params::sync_search_step)
+  /* get --screen: only the best match is needed, search_refine still covers all positions around a candidate */
+  const size_t shift_step = Params::get_screen ? Params::sync_search_step * screen_shift_factor : Params::sync_search_step;
+  for (size_t sync_shift = 0; sync_shift < Params::frame_size; sync_shift += shift_step)
     {
-      sync_fft_parallel (thread_pool, wav_data, sync_shift, fft_db, have_frames);
-
-      vector<int> start_frames;
-      for (int start_frame = 0; start_frame < frame_count (wav_data); start_frame++)
+      /* get --time-budget: the remaining shifts are not searched, refining and decoding only use the scores found so far */
+      if (TimeBudget::expired())
+        break;
+
+      /* fft vectors are only needed after this step if the full quality is computed later */
+      const size_t s = coarse_sync_table ? sync_shift / Params::sync_search_step : 0;
+      SyncSpectrum& fft_db      = shift_fft[s].fft_db;
+      vector<char>& have_frames = shift_fft[s].have_frames;
+
+      {
+        Profile::Timer timer (Profile::Stage::SYNC_FFT);
+        sync_fft_parallel (thread_pool, wav_data, sync_shift, fft_db, have_frames);
+      }
+
+      /* silence skipping: have_count[f] is the number of frames before f that are not silent */
+      vector<int> have_count;
+      if (SilenceMap::enabled())
         {
-          if ((start_frame + total_frame_count) * n_bands < fft_db.size())
-            start_frames.push_back (start_frame);
+          have_count.resize (have_frames.size() + 1);
+          for (size_t f = 0; f < have_frames.size(); f++)
+            have_count[f + 1] = have_count[f] + have_frames[f];
         }
 
-      for (size_t k = 0; k < key_results.size(); k++)
+      /* start frames [0, n_start_frames) have enough frames for one block */
+      int n_start_frames = 0;
+      while (n_start_frames < frame_count (wav_data) && (n_start_frames + total_frame_count) * n_bands < fft_db.size())
+        n_start_frames++;
+
+      /* jobs write the scores of their start frames directly into shift_scores */
+      vector<vector<SearchScore>> shift_scores (key_results.size());
+      for (auto& scores : shift_scores)
+        scores.resize (n_start_frames);
+
+      /* each job scores all keys for a range of start frames, so the fft_db data it needs stays in the cache */
+      const SyncTable& approx_sync_table = coarse_sync_table ? *coarse_sync_table : sync_table;
+      const int frames_per_job = job_size (n_start_frames, 256, sync_decode_batch);
+      for (int first_frame = 0; first_frame < n_start_frames; first_frame += frames_per_job)
         {
-          for (auto split_start_frames : split_vector (start_frames, 256))
+          const int last_frame = std::min (first_frame + frames_per_job, n_start_frames);
+
+          thread_pool.add_job ([this, sync_shift, first_frame, last_frame, coarse_sync_table, total_frame_count,
+                                &approx_sync_table, &fft_db, &have_frames, &have_count, &shift_scores]()
             {
-              thread_pool.add_job ([this, k, sync_shift, split_start_frames,
-                                    &sync_bits, &fft_db, &have_frames, &key_results, &result_mutex]()
+              Profile::Span span ("search_approx_job");
+
+              /* no sync frame of the start frames [start_frame, start_frame + n) is available: quality is 0 */
+              auto silent = [&] (int start_frame, int n)
+                {
+                  if (have_count.empty())
+                    return false;
+
+                  const size_t end = std::min<size_t> (start_frame + n - 1 + total_frame_count, have_frames.size());
+                  return have_count[end] == have_count[start_frame];
+                };
+              for (size_t k = 0; k < shift_scores.size(); k++)
                 {
-                  for (auto start_frame : split_start_frames)
+                  int start_frame = first_frame;
+                  while (start_frame < last_frame)
                     {
-                      double quality = sync_decode (sync_bits[k], start_frame, fft_db, have_frames);
-                      // printf ("%zd %f\n", sync_index, quality);
-                      const size_t sync_index = start_frame * Params::frame_size + sync_shift;
-                      {
-                        std::lock_guard<std::mutex> lg (result_mutex);
-                        SearchScore search_score;
-                        search_score.index       = sync_index;
-                        search_score.raw_quality = quality;
-                        search_score.local_mean  = 0; // fill this after all search scores are ready
-                        key_results[k].scores.push_back (search_score);
-                      }
+                      /* score sync_decode_batch consecutive start frames at once if possible */
+                      double    quality[sync_decode_batch];
+                      int       n = 1;
+                      if (start_frame + sync_decode_batch <= last_frame)
+                        {
+                          n = sync_decode_batch;
+                          if (silent (start_frame, n))
+                            std::fill (quality, quality + n, normalize_sync_quality (0));
+                          else
+                            sync_decode_n<sync_decode_batch> (approx_sync_table, k, start_frame, fft_db, have_frames, quality);
+                        }
+                      else if (silent (start_frame, 1))
+                        {
+                          quality[0] = normalize_sync_quality (0);
+                        }
+                      else
+                        {
+                          quality[0] = sync_decode (approx_sync_table, k, start_frame, fft_db, have_frames);
+                        }
+                      for (int j = 0; j < n; j++)
+                        {
+                          // printf ("%zd %f\n", sync_index, quality[j]);
+                          const size_t sync_index = (start_frame + j) * Params::frame_size + sync_shift;
+
+                          SearchScore& search_score = shift_scores[k][start_frame + j];
+                          search_score.index       = sync_index;
+                          search_score.raw_quality = quality[j];
+                          search_score.local_mean  = 0; // fill this after all search scores are ready
+                          search_score.coarse      = coarse_sync_table != nullptr;
+                        }
+                      start_frame += n;
                     }
-                });
-            }
+                }
+            }, frame_worker (thread_pool, first_frame, have_frames.size()));
         }
       thread_pool.wait_all();
+
+      for (size_t k = 0; k < key_results.size(); k++)
+        key_results[k].scores.insert (key_results[k].scores.end(), shift_scores[k].begin(), shift_scores[k].end());
     }
   for (auto& key_result : key_results)
     {
@@ -232,26 +513,14 @@ SyncFinder::search_approx (vector<SearchKeyResult>& key_results, const vector<ve
        */
 
       /* compute local mean for all scores */
-      for (int i = 0; i < int (key_result.scores.size()); i++)
-        {
-          double avg = 0;
-          int n = 0;
-          for (int j = -local_mean_distance; j <= local_mean_distance; j++)
-            {
-              if (std::abs (j) >= 4)
-                {
-                  int idx = i + j;
-                  if (idx >= 0 && idx < int (key_result.scores.size()))
-                    {
-                      avg += key_result.scores[idx].raw_quality;
-                      n++;
-                    }
-                }
-            }
-          if (n > 0)
-            avg /= n;
-          key_result.scores[i].local_mean = avg;
-        }
+      const auto& scores = key_result.scores;
+      for (int i = 0; i < int (scores.size()); i++)
+        key_result.scores[i].local_mean = local_mean (i, scores.size(), 1, [&] (int idx) { return scores[idx].raw_quality; });
+    }
+  if (coarse_sync_table)
+    {
+      for (size_t k = 0; k < key_results.size(); k++)
+        search_approx_full (thread_pool, key_results[k], sync_table, k, shift_fft);
     }
 }
 
@@ -391,12 +660,15 @@ SyncFinder::sync_select_truncate_n (vector<SearchScore>& sync_scores, size_t n)
 }
 
 void
-SyncFinder::search_refine (const WavData& wav_data, Mode mode, SearchKeyResult& key_result, const vector<vector<FrameBit>>& sync_bits)
+SyncFinder::search_refine (const WavView& wav_data, Mode mode, SearchKeyResult& key_result, const SyncTable& sync_table, size_t k)
 {
   ThreadPool          thread_pool;
   std::mutex          result_mutex;
   vector<SearchScore> result_scores;
-  BitPosGen           bit_pos_gen (key_result.key);
+  const KeyTables&    key_tables = KeyTables::get (key_result.key);
+
+  /* get --time-budget: scores which are not refined before the deadline are dropped */
+  thread_pool.set_deadline (TimeBudget::deadline());
 
   int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
   const int first_block_end = total_frame_count;
@@ -406,39 +678,77 @@ SyncFinder::search_refine (const WavData& wav_data, Mode mode, SearchKeyResult&
   vector<char> want_frames (total_frame_count);
   for (size_t f = 0; f < mark_sync_frame_count(); f++)
     {
-      want_frames[bit_pos_gen.sync_frame (f)] = 1;
+      want_frames[key_tables.sync_frame (f)] = 1;
       if (mode == Mode::CLIP)
-        want_frames[first_block_end + bit_pos_gen.sync_frame (f)] = 1;
+        want_frames[first_block_end + key_tables.sync_frame (f)] = 1;
     }
 
+  /* with a spectrum index, only frames on the hop grid of the index can be used */
+  const int fine_step = std::max (int (Params::sync_search_fine), int (spectrum_cache->index_hop()));
+
+  /* in block mode, first search with a larger step, then refine around the best match */
+  int refine_step = mode == Mode::BLOCK ? Params::sync_search_fine * refine_coarse_factor : Params::sync_search_fine;
+  refine_step = std::max (refine_step, fine_step);
+
   for (const auto& score : key_result.scores)
     {
-      thread_pool.add_job ([this, score, total_frame_count,
-                            &wav_data, &want_frames, &sync_bits, &result_scores, &result_mutex] ()
+      thread_pool.add_job ([this, score, total_frame_count, k, refine_step, fine_step,
+                            &wav_data, &want_frames, &sync_table, &result_scores, &result_mutex] ()
         {
-          vector<float> fft_db;
+          Profile::Span span ("search_refine_job");
+
+          SyncSpectrum  fft_db;
           vector<char>  have_frames;
           //printf ("%zd %s %f", score.index, find_closest_sync (score.index).c_str(), score.quality);
 
-          // refine match
-          double best_quality       = score.raw_quality;
+          // refine match (a coarse quality is always replaced by the full quality)
+          double best_quality       = score.coarse ? score.local_mean : score.raw_quality;
           size_t best_index         = score.index;
 
-          int start = std::max (int (score.index) - Params::sync_search_step, 0);
-          int end   = score.index + Params::sync_search_step;
-          for (int fine_index = start; fine_index <= end; fine_index += Params::sync_search_fine)
+          /* keep the spectrum of the best match: it will be needed again for decoding */
+          vector<float> frames_db;
+          vector<float> best_frames_db;
+          vector<char>  best_have_frames;
+
+          auto try_index = [&] (int fine_index)
             {
-              sync_fft (wav_data, fine_index, total_frame_count, fft_db, have_frames, want_frames);
+              sync_fft (wav_data, fine_index, total_frame_count, fft_db, have_frames, want_frames, &frames_db);
               if (fft_db.size())
                 {
-                  double q = sync_decode (sync_bits, 0, fft_db, have_frames);
+                  double q = sync_decode (sync_table, k, 0, fft_db, have_frames);
 
                   if (fabs (q - score.local_mean) > fabs (best_quality - score.local_mean))
                     {
                       best_quality = q;
                       best_index   = fine_index;
+
+                      best_frames_db.swap (frames_db);
+                      best_have_frames.swap (have_frames);
                     }
                 }
+            };
+          int start = std::max (int (score.index) - Params::sync_search_step, 0);
+          int end   = score.index + Params::sync_search_step;
+          for (int fine_index = start; fine_index <= end; fine_index += refine_step)
+            try_index (fine_index);
+
+          /* coarse to fine: search with sync_search_fine stepping around the best coarse match */
+          if (refine_step > fine_step)
+            {
+              const int center = best_index;
+              for (int d = fine_step - refine_step; d < refine_step; d += fine_step)
+                {
+                  const int fine_index = center + d;
+                  if (d != 0 && fine_index >= start && fine_index <= end)
+                    try_index (fine_index);
+                }
+            }
+          if (best_have_frames.size())
+            {
+              const size_t frame_values = spectrum_cache->frame_values();
+              for (int f = 0; f < total_frame_count; f++)
+                if (best_have_frames[f])
+                  spectrum_cache->store (best_index + f * Params::frame_size, &best_frames_db[f * frame_values]);
             }
           //printf (" => refined: %zd %s %f\n", best_index, find_closest_sync (best_index).c_str(), best_quality);
           {
@@ -458,7 +768,7 @@ SyncFinder::search_refine (const WavData& wav_data, Mode mode, SearchKeyResult&
 }
 
 vector<SyncFinder::KeyResult>
-SyncFinder::fake_sync (const vector<Key>& key_list, const WavData& wav_data, Mode mode)
+SyncFinder::fake_sync (const vector<Key>& key_list, const WavView& wav_data, Mode mode)
 {
   vector<Score> result_scores;
 
@@ -485,11 +795,14 @@ SyncFinder::fake_sync (const vector<Key>& key_list, const WavData& wav_data, Mod
 }
 
 vector<SyncFinder::KeyResult>
-SyncFinder::search (const vector<Key>& key_list, const WavData& wav_data, Mode mode)
+SyncFinder::search (const vector<Key>& key_list, const WavView& wav_data, SpectrumCache& cache, Mode mode)
 {
   if (Params::test_no_sync)
     return fake_sync (key_list, wav_data, mode);
 
+  Profile::Timer timer (Profile::Stage::SYNC_SEARCH);
+  spectrum_cache = &cache;
+
   if (mode == Mode::CLIP)
     {
       /* in clip mode we optimize handling large areas of padding which is silent */
@@ -499,21 +812,25 @@ SyncFinder::search (const vector<Key>& key_list, const WavData& wav_data, Mode m
     {
       /* in block mode we don't do anything special for silence at beginning/end */
       wav_data_first = 0;
-      wav_data_last  = wav_data.samples().size();
+      wav_data_last  = wav_data.n_values();
     }
 
-  vector<SearchKeyResult>           search_key_results;
-  vector<vector<vector<FrameBit>>>  sync_bits;
+  vector<SearchKeyResult> search_key_results;
 
   for (const auto& key : key_list)
     {
       SearchKeyResult search_key_result;
       search_key_result.key = key;
       search_key_results.push_back (search_key_result);
-      sync_bits.push_back (get_sync_bits (key, mode));
     }
+  const SyncTable sync_table = make_sync_table (key_list, mode);
 
-  search_approx (search_key_results, sync_bits, wav_data, mode);
+  /* block mode: score all positions with the coarse sync table first (clip mode is usually fast due to zero padding) */
+  std::unique_ptr<SyncTable> coarse_sync_table;
+  if (mode == Mode::BLOCK)
+    coarse_sync_table.reset (new SyncTable (make_sync_table (key_list, mode, coarse_frame_step)));
+
+  search_approx (search_key_results, sync_table, coarse_sync_table.get(), wav_data, mode);
   vector<SyncFinder::KeyResult> key_results;
   for (size_t k = 0; k < search_key_results.size(); k++)
     {
@@ -532,7 +849,11 @@ SyncFinder::search (const vector<Key>& key_list, const WavData& wav_data, Mode m
           sync_select_truncate_n (search_scores, n_max);
         }
 
-      search_refine (wav_data, mode, search_key_results[k], sync_bits[k]);
+      {
+        Profile::Timer timer (Profile::Stage::SEARCH_REFINE);
+        Profile::count (Profile::Counter::CANDIDATES_REFINED, search_scores.size());
+        search_refine (wav_data, mode, search_key_results[k], sync_table, k);
+      }
 
       /* select: threshold2 & at least n_best */
       sync_select_threshold_and_n_best (search_scores, Params::sync_threshold2);
@@ -557,103 +878,151 @@ SyncFinder::search (const vector<Key>& key_list, const WavData& wav_data, Mode m
   return key_results;
 }
 
+/*
+ * if frames_db is not null, the frames are not stored in the spectrum cache, but
+ * the per channel dB values of the frames are returned in frames_db instead
+ */
 void
-SyncFinder::sync_fft (const WavData& wav_data, size_t index, size_t frame_count, vector<float>& fft_out_db, vector<char>& have_frames, const vector<char>& want_frames)
+SyncFinder::sync_fft (const WavView& wav_data, size_t index, size_t frame_count, SyncSpectrum& fft_out_db, vector<char>& have_frames, const vector<char>& want_frames,
+                      vector<float> *frames_db)
 {
-  fft_out_db.clear();
-  have_frames.clear();
+  const size_t n_bands = Params::max_band - Params::min_band + 1;
+
+  fft_out_db.resize (n_bands * frame_count);
+  have_frames.resize (frame_count);
+  if (frames_db)
+    frames_db->resize (spectrum_cache->frame_values() * frame_count);
+
+  if (!sync_fft (wav_data, index, frame_count, fft_out_db.data(), have_frames.data(), want_frames.size() ? want_frames.data() : nullptr,
+                 frames_db ? frames_db->data() : nullptr))
+    {
+      fft_out_db.clear();
+      have_frames.clear();
+    }
+}
 
+/*
+ * compute frame_count frames into fft_out_db (n_bands * frame_count values) and
+ * have_frames (frame_count values), returns false if the frames are not available
+ */
+bool
+SyncFinder::sync_fft (const WavView& wav_data, size_t index, size_t frame_count, float *fft_out_db, char *have_frames, const char *want_frames,
+                      float *frames_db)
+{
   /* read past end? -> fail */
   if (wav_data.n_values() < (index + frame_count * Params::frame_size) * wav_data.n_channels())
-    return;
+    return false;
 
   FFTAnalyzer fft_analyzer (wav_data.n_channels());
-  const vector<float>& samples = wav_data.samples();
   const size_t n_bands = Params::max_band - Params::min_band + 1;
-  int out_pos = 0;
+  const size_t frame_values = spectrum_cache->frame_values();
 
-  fft_out_db.resize (n_bands * frame_count);
-  have_frames.resize (frame_count);
+  std::fill (fft_out_db, fft_out_db + n_bands * frame_count, 0);
+  std::fill (have_frames, have_frames + frame_count, 0);
 
   for (size_t f = 0; f < frame_count; f++)
     {
       const size_t f_first = (index + f * Params::frame_size) * wav_data.n_channels();
       const size_t f_last  = (index + (f + 1) * Params::frame_size) * wav_data.n_channels();
 
-      if ((want_frames.size() && !want_frames[f])   // frame not wanted?
+      if ((want_frames && !want_frames[f])          // frame not wanted?
       ||  (f_last < wav_data_first)                 // frame in silence before input?
-      ||  (f_first > wav_data_last))                // frame in silence after input?
-        {
-          out_pos += n_bands;
-        }
-      else
-        {
-          constexpr double min_db = -96;
+      ||  (f_first > wav_data_last)                 // frame in silence after input?
+      ||  spectrum_cache->silent (index + f * Params::frame_size)) // frame in silence inside input?
+        continue;
 
-          vector<vector<complex<float>>> frame_result = fft_analyzer.run_fft (samples, index + f * Params::frame_size);
+      have_frames[f] = 1;
+    }
 
-          /* computing db-magnitude is expensive, so we better do it here */
-          for (int ch = 0; ch < wav_data.n_channels(); ch++)
-            for (int i = Params::min_band; i <= Params::max_band; i++)
-              fft_out_db[out_pos + i - Params::min_band] += db_from_complex (frame_result[ch][i], min_db);
+  /* compute all missing frames using batched ffts */
+  vector<const float *> frames (frame_count);
+  spectrum_cache->get_frames (fft_analyzer, index, frame_count, have_frames, frames.data(), frames_db);
 
-          out_pos += n_bands;
+  for (size_t f = 0; f < frame_count; f++)
+    {
+      if (have_frames[f])
+        {
+          const float *frame_db = frames[f];
+          if (frames_db)
+            {
+              float *scratch = frames_db + f * frame_values;
+              if (frame_db != scratch)
+                std::copy (frame_db, frame_db + frame_values, scratch);
+            }
 
-          have_frames[f] = 1;
+          float *out = fft_out_db + f * n_bands;
+          for (int ch = 0; ch < wav_data.n_channels(); ch++)
+            for (size_t i = 0; i < n_bands; i++)
+              out[i] += frame_db[ch * n_bands + i];
         }
     }
+  return true;
+}
+
+/*
+ * worker hint for a job processing frames starting at frame: jobs for the
+ * same frames (fft and scoring) are queued for the same worker, so with NUMA
+ * affinity they mostly read memory of their own node
+ */
+size_t
+SyncFinder::frame_worker (ThreadPool& thread_pool, size_t frame, size_t n_frames)
+{
+  return frame * thread_pool.n_threads() / std::max<size_t> (n_frames, 1);
 }
 
+/*
+ * number of items per job for splitting n_items into jobs: a few jobs per
+ * thread, so that uneven jobs (silence, cache hits) can be balanced, but
+ * not less than min_size items, to keep the job overhead small; the result
+ * is a multiple of align
+ */
+size_t
+SyncFinder::job_size (size_t n_items, size_t min_size, size_t align)
+{
+  const size_t jobs_per_thread = 4;
+  const size_t n_jobs = std::max<size_t> (ThreadPool().n_threads() * jobs_per_thread, 1);
+
+  size_t size = std::max ((n_items + n_jobs - 1) / n_jobs, min_size);
+  return (size + align - 1) / align * align;
+}
+
+/* compute the spectrum of all frames (starting at index): each job writes its frames directly into the output */
 void
 SyncFinder::sync_fft_parallel (ThreadPool& thread_pool,
-                               const WavData& wav_data,
+                               const WavView& wav_data,
                                size_t index,
-                               std::vector<float>& fft_out_db,
+                               SyncSpectrum& fft_out_db,
                                std::vector<char>& have_frames)
 {
-  std::mutex result_mutex;
+  const size_t n_bands = Params::max_band - Params::min_band + 1;
+  const int    n_frames = frame_count (wav_data) - 1;
 
   fft_out_db.clear();
   have_frames.clear();
+  if (n_frames <= 0)
+    return;
 
-  struct PartialFFTResult
-  {
-    int           start_frame = 0;
-    vector<char>  have_frames;
-    vector<float> fft_db;
-  };
-  vector<PartialFFTResult> partial_fft_results;
-  const int frames_per_job = 256;
-  for (int start_frame = 0; start_frame < frame_count (wav_data); start_frame += frames_per_job)
+  fft_out_db.resize (n_frames * n_bands);
+  have_frames.resize (n_frames);
+
+  const int frames_per_job = job_size (n_frames, 64, FFTAnalyzer::max_batch_frames);
+  for (int start_frame = 0; start_frame < n_frames; start_frame += frames_per_job)
     {
-      thread_pool.add_job ([this, start_frame, index, frames_per_job,
-                            &wav_data, &partial_fft_results, &result_mutex]
+      thread_pool.add_job ([this, start_frame, index, frames_per_job, n_frames, n_bands,
+                            &wav_data, &fft_out_db, &have_frames]
         {
-          const int remaining_frames = frame_count (wav_data) - 1 - start_frame;
-          const int frames = std::min (remaining_frames, frames_per_job);
-          if (frames > 0)
+          Profile::Span span ("sync_fft_job");
+
+          const int frames = std::min (n_frames - start_frame, frames_per_job);
+          if (!sync_fft (wav_data, index + start_frame * Params::frame_size, frames,
+                         &fft_out_db[start_frame * n_bands], &have_frames[start_frame], /* want all frames */ nullptr, nullptr))
             {
-              PartialFFTResult result;
-              result.start_frame = start_frame;
-              sync_fft (wav_data, index + start_frame * Params::frame_size, frames, result.fft_db, result.have_frames, /* want all frames */ {});
-              if (!result.fft_db.size())
-                warning ("SyncFinder: sync_fft_parallel expected %d fft frames, but result was empty\n", frames);
-              {
-                std::lock_guard<std::mutex> lg (result_mutex);
-                partial_fft_results.push_back (result);
-              }
+              /* should not happen: the frames of this job are treated as missing */
+              warning ("SyncFinder: sync_fft_parallel expected %d fft frames, but result was empty\n", frames);
             }
-        });
+        }, frame_worker (thread_pool, start_frame, n_frames));
     }
   thread_pool.wait_all();
-  std::sort (partial_fft_results.begin(), partial_fft_results.end(),
-             [] (const auto& r1, const auto& r2) { return r1.start_frame < r2.start_frame; });
-
-  for (const auto& partial_fft_result : partial_fft_results)
-    {
-      fft_out_db.insert (fft_out_db.end(), partial_fft_result.fft_db.begin(), partial_fft_result.fft_db.end());
-      have_frames.insert (have_frames.end(), partial_fft_result.have_frames.begin(), partial_fft_result.have_frames.end());
-    }
 }
 
 string
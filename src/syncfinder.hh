@@ -18,13 +18,43 @@
 #ifndef AUDIOWMARK_SYNC_FINDER_HH
 #define AUDIOWMARK_SYNC_FINDER_HH
 
+#include <memory>
+#include <vector>
+
 #include "convcode.hh"
 #include "wavdata.hh"
 #include "random.hh"
 #include "threadpool.hh"
+#include "spectrumcache.hh"
+
+/*
+ * allocator for vectors which are resized without initializing the new
+ * values: the values are first written by the ThreadPool jobs that compute
+ * them, so with NUMA affinity, the memory pages are allocated on the node of
+ * the worker that uses them
+ */
+template<class T>
+struct NoInitAllocator : std::allocator<T>
+{
+  template<class U> struct rebind { typedef NoInitAllocator<U> other; };
+
+  NoInitAllocator() = default;
+  template<class U> NoInitAllocator (const NoInitAllocator<U>&) {}
+
+  template<class U> void
+  construct (U *p)
+  {
+    ::new (static_cast<void *> (p)) U;
+  }
+  template<class U, class... Args> void
+  construct (U *p, Args&&... args)
+  {
+    ::new (static_cast<void *> (p)) U (std::forward<Args> (args)...);
+  }
+};
 
 /*
- * The SyncFinder class searches for sync bits in an input WavData. It is used
+ * The SyncFinder class searches for sync bits in an input WavView. It is used
  * by both, the BlockDecoder and ClipDecoder to find a time index where
  * decoding should start.
  *
@@ -34,6 +64,12 @@
  * locations are later refined with search_refine using sync_search_fine=8 as
  * stepping.
  *
+ * In block mode, the search works coarse to fine: search_approx scores all
+ * locations with a coarse sync table (only some of the sync frames), and only
+ * the most promising ones (search_approx_full) are scored using all sync
+ * frames. Similarly, search_refine first uses a larger step and then
+ * sync_search_fine around the best match.
+ *
  * BlockDecoder and ClipDecoder have similar but not identical needs, so
  * both use this class, using either Mode::BLOCK or Mode::CLIP.
  *
@@ -48,6 +84,10 @@
  *  - zero samples at beginning/end don't affect the score returned by sync_decode
  *  - zero samples at beginning/end don't cost much cpu time (no fft performed)
  *
+ * The spectra of the frames are taken from a SpectrumCache, so frames that
+ * have been analyzed before (by the other decoder or for another search
+ * step) don't need another fft.
+ *
  * The ClipDecoder will always use a big amount of zero padding at the beginning
  * and end to be able to find "partial" AB blocks, where most of the data is
  * matched with zeros.
@@ -86,10 +126,18 @@ public:
   };
 private:
   static constexpr int local_mean_distance = 20;
+
+  /* coarse to fine search (block mode) */
+  static constexpr int    coarse_frame_step     = 4;    // coarse sync table: use every 4th FrameBit
+  static constexpr int    coarse_n_best_factor  = 4;    // keep at least n_best * factor coarse peaks
+  static constexpr int    coarse_local_mean_stride = 4; // local mean of the full quality: use every 4th score
+  static constexpr int    refine_coarse_factor  = 4;    // refine stepping before the final sync_search_fine step
+  static constexpr int    screen_shift_factor   = 2;    // get --screen: search_approx stepping is sync_search_step * factor
   struct SearchScore {
     size_t index;
     double raw_quality;
     double local_mean;
+    bool   coarse = false;  // raw_quality computed with the coarse sync table
 
     double abs_quality() const
     {
@@ -100,41 +148,92 @@ private:
     Key                      key;
     std::vector<SearchScore> scores;
   };
-  double  sync_decode (const std::vector<std::vector<FrameBit>>& sync_bits,
+  /* sync spectrum: n_bands values per frame */
+  typedef std::vector<float, NoInitAllocator<float>> SyncSpectrum;
+
+  /* result of sync_fft_parallel for one sync_shift */
+  struct ShiftFFTResult {
+    SyncSpectrum       fft_db;
+    std::vector<char>  have_frames;
+  };
+  typedef std::vector<ShiftFFTResult> ShiftFFT;
+  /*
+   * The sync bits of all keys in one flat table (structure of arrays), so
+   * that all keys can be scored in one pass over the fft_out_db data.
+   *
+   * Each entry corresponds to one FrameBit, the entries for key k and sync
+   * bit b are [bit_start[k * sync_bits + b], bit_start[k * sync_bits + b + 1]).
+   * Each entry has 2 * bands_per_frame contiguous offsets into fft_out_db,
+   * relative to the start frame (frame * n_bands + band): first the up
+   * bands, then the down bands.
+   */
+  struct SyncTable {
+    size_t           n_keys = 0;
+    std::vector<int> bit_start;
+    std::vector<int> frame;
+    std::vector<int> offset;
+  };
+  static constexpr int sync_decode_batch = 16; // search_approx: number of start frames scored in one pass
+  template<class QualityFunc> static double local_mean (int i, int n_scores, int stride, QualityFunc raw_quality);
+  static SyncTable make_sync_table (const std::vector<Key>& key_list, Mode mode, int frame_step = 1);
+  double  sync_decode (const SyncTable& sync_table,
+                       size_t k,
                        const size_t start_frame,
-                       const std::vector<float>& fft_out_db,
+                       const SyncSpectrum&       fft_out_db,
                        const std::vector<char>&  have_frames);
-  void scan_silence (const WavData& wav_data);
-  void search_approx (std::vector<SearchKeyResult>& key_results, const std::vector<std::vector<std::vector<FrameBit>>>& sync_bits, const WavData& wav_data, Mode mode);
+  template<int N>
+  void    sync_decode_n (const SyncTable& sync_table,
+                         size_t k,
+                         const size_t start_frame,
+                         const SyncSpectrum&       fft_out_db,
+                         const std::vector<char>&  have_frames,
+                         double *quality);
+  void scan_silence (const WavView& wav_data);
+  void search_approx (std::vector<SearchKeyResult>& key_results, const SyncTable& sync_table, const SyncTable *coarse_sync_table,
+                      const WavView& wav_data, Mode mode);
+  void search_approx_full (ThreadPool& thread_pool, SearchKeyResult& key_result, const SyncTable& sync_table, size_t k,
+                           const ShiftFFT& shift_fft);
   void sync_select_local_maxima (std::vector<SearchScore>& sync_scores);
   void sync_mask_avg_false_positives (std::vector<SearchScore>& sync_scores);
   void sync_select_by_threshold (std::vector<SearchScore>& sync_scores);
   void sync_select_threshold_and_n_best (std::vector<SearchScore>& sync_scores, double threshold);
   void sync_select_truncate_n (std::vector<SearchScore>& sync_scores, size_t n);
-  void search_refine (const WavData& wav_data, Mode mode, SearchKeyResult& key_result, const std::vector<std::vector<FrameBit>>& sync_bits);
-  std::vector<KeyResult> fake_sync (const std::vector<Key>& key_list, const WavData& wav_data, Mode mode);
+  void search_refine (const WavView& wav_data, Mode mode, SearchKeyResult& key_result, const SyncTable& sync_table, size_t k);
+  std::vector<KeyResult> fake_sync (const std::vector<Key>& key_list, const WavView& wav_data, Mode mode);
 
   // non-zero sample range: [wav_data_first, wav_data_last)
   size_t wav_data_first = 0;
   size_t wav_data_last = 0;
+
+  SpectrumCache *spectrum_cache = nullptr;
 public:
-  std::vector<KeyResult> search (const std::vector<Key>& key_list, const WavData& wav_data, Mode mode);
+  std::vector<KeyResult> search (const std::vector<Key>& key_list, const WavView& wav_data, SpectrumCache& spectrum_cache, Mode mode);
   static std::vector<std::vector<FrameBit>> get_sync_bits (const Key& key, Mode mode);
 
   static double bit_quality (float umag, float dmag, int bit);
   static double normalize_sync_quality (double raw_quality);
 private:
   void sync_fft_parallel (ThreadPool& thread_pool,
-                          const WavData& wav_data,
+                          const WavView& wav_data,
                           size_t index,
-                          std::vector<float>& fft_out_db,
+                          SyncSpectrum& fft_out_db,
                           std::vector<char>& have_frames);
-  void sync_fft (const WavData& wav_data,
+  void sync_fft (const WavView& wav_data,
                  size_t index,
                  size_t frame_count,
-                 std::vector<float>& fft_out_db,
+                 SyncSpectrum& fft_out_db,
                  std::vector<char>& have_frames,
-                 const std::vector<char>& want_frames);
+                 const std::vector<char>& want_frames,
+                 std::vector<float> *frames_db = nullptr);
+  bool sync_fft (const WavView& wav_data,
+                 size_t index,
+                 size_t frame_count,
+                 float *fft_out_db,
+                 char *have_frames,
+                 const char *want_frames,
+                 float *frames_db);
+  static size_t job_size (size_t n_items, size_t min_size, size_t align);
+  static size_t frame_worker (ThreadPool& thread_pool, size_t frame, size_t n_frames);
   std::string find_closest_sync (size_t index);
   std::vector<std::vector<int>> split_vector (std::vector<int>& in_vector, size_t max_size);
 };
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <random>
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "audiobuffer.hh"
+
+using std::vector;
+
+int
+main (int argc, char **argv)
+{
+  const int n_channels = 2;
+
+  /* compare ring buffer against a simple queue, with random read/write sizes to test wrap around */
+  std::mt19937 rng (42);
+  std::uniform_int_distribution<size_t> size_dist (0, 3000);
+
+  AudioBuffer audio_buffer (n_channels);
+  vector<float> ref;
+  size_t ref_pos = 0;
+  float next_value = 0;
+  size_t errors = 0;
+  for (int i = 0; i < 10000; i++)
+    {
+      vector<float> in (size_dist (rng) * n_channels);
+      for (auto& value : in)
+        value = next_value++;
+      audio_buffer.write_frames (in);
+      ref.insert (ref.end(), in.begin(), in.end());
+
+      assert (audio_buffer.can_read_frames() == (ref.size() - ref_pos) / n_channels);
+
+      size_t frames = std::min (size_dist (rng), audio_buffer.can_read_frames());
+      vector<float> out (frames * n_channels);
+      audio_buffer.read_frames (out.data(), frames);
+      for (auto value : out)
+        if (value != ref[ref_pos++])
+          errors++;
+    }
+  vector<float> rest = audio_buffer.read_frames (audio_buffer.can_read_frames());
+  for (auto value : rest)
+    if (value != ref[ref_pos++])
+      errors++;
+
+  printf ("audio buffer: %zd errors, %zd values [ should be 0 errors ]\n", errors, ref.size());
+  assert (errors == 0);
+  assert (ref_pos == ref.size());
+  assert (audio_buffer.can_read_frames() == 0);
+}
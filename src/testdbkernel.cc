@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <random>
+
+#include <assert.h>
+#include <string.h>
+
+#include "wmcommon.hh"
+#include "utils.hh"
+
+using std::vector;
+using std::complex;
+
+int
+main (int argc, char **argv)
+{
+  const float min_db = -96;
+  const size_t N = 1000000;
+
+  std::mt19937 rng (42);
+  std::uniform_real_distribution<float> exp_dist (-80, 20);
+  std::uniform_real_distribution<float> sign_dist (-1, 1);
+
+  vector<complex<float>> in (N);
+  for (size_t i = 0; i < N; i++)
+    {
+      /* cover a large dynamic range, including denormals and zero */
+      float re = copysign (exp2f (exp_dist (rng)), sign_dist (rng));
+      float im = copysign (exp2f (exp_dist (rng)), sign_dist (rng));
+      if (i % 1000 == 0)
+        re = im = 0;
+      if (i % 1000 == 1)
+        re = im = 1e-30;
+      in[i] = complex<float> (re, im);
+    }
+  vector<float> out (N);
+
+  if (argc == 2 && strcmp (argv[1], "perf") == 0)
+    {
+      /* typical fft output values (no denormals, which are slow) */
+      std::uniform_real_distribution<float> value_dist (-1, 1);
+      for (auto& c : in)
+        c = complex<float> (value_dist (rng), value_dist (rng));
+
+      const int runs = 20;
+      double t0 = get_time();
+      for (int r = 0; r < runs; r++)
+        db_from_complex (in.data(), out.data(), N, min_db);
+      double t1 = get_time();
+      float sum = 0;
+      for (int r = 0; r < runs; r++)
+        for (size_t i = 0; i < N; i++)
+          sum += db_from_complex (in[i], min_db);
+      double t2 = get_time();
+      printf ("vectorized: %f ns/value\n", (t1 - t0) / runs / N * 1e9);
+      printf ("scalar:     %f ns/value (%f)\n", (t2 - t1) / runs / N * 1e9, sum);
+      return 0;
+    }
+
+  /* odd offset and size to test unaligned access and loop tail */
+  db_from_complex (in.data() + 1, out.data() + 1, N - 2, min_db);
+
+  double max_err = 0;
+  for (size_t i = 1; i < N - 1; i++)
+    {
+      const double ref = db_from_complex (in[i], min_db);
+      const double err = fabs (double (out[i]) - ref);
+
+      /* error is relative to the magnitude of the result (a few float ulps) */
+      max_err = std::max (max_err, err / std::max (fabs (ref), 1.0));
+    }
+  printf ("db_from_complex: max relative error = %g [ should be less than 1e-6 ]\n", max_err);
+  assert (max_err < 1e-6);
+  assert (out[1000] == min_db);
+}
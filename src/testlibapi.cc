@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <random>
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "libaudiowmark.hh"
+
+using std::vector;
+using std::string;
+
+using AudioWmark::Status;
+using AudioWmark::Embedder;
+using AudioWmark::Detector;
+
+static size_t
+count_matches (const Detector::Result& result, const string& bits)
+{
+  size_t n = 0;
+  for (const auto& match : result.matches)
+    if (match.bits == bits)
+      n++;
+  return n;
+}
+
+int
+main (int argc, char **argv)
+{
+  const int n_channels = 2;
+  const int sample_rate = 48000;
+  const string bits = "c0de";
+
+  /* noise input, not a multiple of the frame size */
+  std::mt19937 rng (42);
+  std::normal_distribution<float> dist (0, 0.1);
+  vector<float> samples (sample_rate * 30 * n_channels + 3 * n_channels);
+  for (auto& s : samples)
+    s = dist (rng);
+
+  Embedder::Settings embed_settings;
+  embed_settings.key.test_key = 1;
+  embed_settings.short_payload = 16;
+
+  Status status;
+  auto embedder = Embedder::create (embed_settings, status);
+  assert (status.ok && embedder);
+
+  vector<float> out;
+  status = embedder->embed (bits, samples, n_channels, sample_rate, out);
+  printf ("embed: %s\n", status.ok ? "ok" : status.message.c_str());
+  assert (status.ok);
+  assert (out.size() == samples.size());
+
+  /* errors are returned, not printed */
+  vector<float> bad_out;
+  status = embedder->embed ("xyz", samples, n_channels, sample_rate, bad_out);
+  printf ("embed invalid bits: %s\n", status.message.c_str());
+  assert (!status.ok && !status.message.empty() && bad_out.empty());
+
+  Detector::Settings detect_settings;
+  detect_settings.keys.resize (1);
+  detect_settings.keys[0].test_key = 1;
+  detect_settings.short_payload = 16;
+
+  auto detector = Detector::create (detect_settings, status);
+  assert (status.ok && detector);
+
+  Detector::Result result;
+  status = detector->detect (out, n_channels, sample_rate, result);
+  assert (status.ok);
+  for (const auto& match : result.matches)
+    printf ("match: %s %.2f %s %.5f %.6f %s\n", match.key_name.c_str(), match.time, match.bits.c_str(), match.quality, match.error, match.type.c_str());
+  printf ("length: %.2f\n", result.length);
+  assert (count_matches (result, bits) > 0);
+  assert (result.length > 29.9 && result.length < 30.1);
+
+  /* unmarked input and wrong key */
+  status = detector->detect (samples, n_channels, sample_rate, result);
+  assert (status.ok && count_matches (result, bits) == 0);
+
+  detect_settings.keys[0].test_key = 2;
+  auto wrong_key_detector = Detector::create (detect_settings, status);
+  assert (status.ok && wrong_key_detector);
+  status = wrong_key_detector->detect (out, n_channels, sample_rate, result);
+  assert (status.ok && count_matches (result, bits) == 0);
+
+  /* invalid settings */
+  detect_settings.keys[0].key_file = "/nonexistent/key";
+  assert (!Detector::create (detect_settings, status));
+  printf ("missing key file: %s\n", status.message.c_str());
+  assert (!status.ok);
+
+  embed_settings.short_payload = 7;
+  assert (!Embedder::create (embed_settings, status));
+  printf ("unsupported short payload: %s\n", status.message.c_str());
+  assert (!status.ok);
+
+  /* invalid formats are rejected (the resampler would fail for these sample rates) */
+  status = embedder->embed (bits, samples.data(), 10, 2000, sample_rate, bad_out);
+  printf ("too many channels: %s\n", status.message.c_str());
+  assert (!status.ok);
+  status = embedder->embed (bits, samples, n_channels, 1000, bad_out);
+  printf ("sample rate too low: %s\n", status.message.c_str());
+  assert (!status.ok);
+  status = detector->detect (out, n_channels, 10000000, result);
+  printf ("sample rate too high: %s\n", status.message.c_str());
+  assert (!status.ok);
+}
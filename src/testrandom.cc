@@ -17,14 +17,80 @@
 
 #include "utils.hh"
 #include "random.hh"
+#include "wmcommon.hh"
 
 using std::vector;
 using std::string;
 
+/* bulk generation must produce the same values as reseeding for each seed */
+static bool
+check_seed_values (const Key& key)
+{
+  const size_t n_seeds = 100, n_values = 77;
+  Random bulk_rng (key, 0, Random::Stream::data_up_down);
+  vector<uint64_t> bulk_values;
+  bulk_rng.seed_values (1000, n_seeds, Random::Stream::data_up_down, n_values, bulk_values);
+  for (size_t s = 0; s < n_seeds; s++)
+    {
+      bulk_rng.seed (1000 + s, Random::Stream::data_up_down);
+      for (size_t i = 0; i < n_values; i++)
+        {
+          if (bulk_rng() != bulk_values[s * n_values + i])
+            {
+              printf ("seed_values mismatch: seed %zd, value %zd\n", 1000 + s, i);
+              return false;
+            }
+        }
+    }
+  printf ("seed_values ok\n");
+  return true;
+}
+
+/* UpDownGen::get_all must produce the same bands as seeding and shuffling for each frame */
+static bool
+check_up_down_gen (const Key& key)
+{
+  const size_t n_frames = 100;
+  Random random (key, 0, Random::Stream::data_up_down);
+  UpDownGen up_down_gen (random, Random::Stream::data_up_down);
+  vector<UpDownArray> up, down;
+  up_down_gen.get_all (n_frames, up, down);
+
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      vector<int> bands_reorder;
+      for (int band = Params::min_band; band <= Params::max_band; band++)
+        bands_reorder.push_back (band);
+
+      random.seed (f, Random::Stream::data_up_down);
+      random.shuffle (bands_reorder);
+      for (size_t i = 0; i < Params::bands_per_frame; i++)
+        {
+          if (up[f][i] != bands_reorder[i] || down[f][i] != bands_reorder[Params::bands_per_frame + i])
+            {
+              printf ("get_all mismatch: frame %zd, band %zd\n", f, i);
+              return false;
+            }
+        }
+    }
+  printf ("get_all ok\n");
+  return true;
+}
+
 int
 main (int argc, char **argv)
 {
   Key key;
+
+  /* only the checks, without the benchmark */
+  if (argc == 2 && string (argv[1]) == "check")
+    {
+      if (!check_seed_values (key) || !check_up_down_gen (key))
+        return 1;
+      printf ("check ok\n");
+      return 0;
+    }
+
   Random rng (key, 0xf00f1234b00b5678U, Random::Stream::bit_order);
   for (size_t i = 0; i < 20; i++)
     {
@@ -34,6 +100,9 @@ main (int argc, char **argv)
   for (size_t i = 0; i < 20; i++)
     printf ("%f\n", rng.random_double());
 
+  if (!check_seed_values (key) || !check_up_down_gen (key))
+    return 1;
+
   uint64_t s = 0;
   double t_start = get_time();
   size_t runs = 25000000;
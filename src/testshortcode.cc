@@ -24,6 +24,7 @@
 #include <stdint.h>
 
 #include "shortcode.hh"
+#include "wmcommon.hh"
 
 using std::vector;
 using std::string;
@@ -139,6 +140,40 @@ main (int argc, char **argv)
         }
       printf ("%.1f ms/block\n", (gettime() - start_t) / runs * 1000.0);
     }
+  if (argc == 3 && string (argv[2]) == "check")
+    {
+      /* all codewords must decode, codewords with one bit error must be rejected */
+      for (size_t i = 0; i < size_t (1 << K); i++)
+        {
+          vector<int> in;
+          for (size_t bit = 0; bit < K; bit++)
+            in.push_back ((i >> bit) & 1);
+
+          vector<int> coded_bits = short_encode_blk (in);
+          assert (short_decode_blk (coded_bits) == in);
+
+          coded_bits[rand() % N] ^= 1;
+          assert (short_decode_blk (coded_bits).empty());
+        }
+      /* nearest decoding must correct up to (d - 1) / 2 errors */
+      Params::short_nearest = true;
+      const int max_errors = K == 20 ? 9 : 10;
+      for (size_t i = 0; i < 20; i++)
+        {
+          vector<int> in;
+          while (in.size() != K)
+            in.push_back (rand() & 1);
+
+          vector<int> coded_bits = short_encode_blk (in);
+          vector<int> ev = generate_error_vector (N, max_errors);
+          for (size_t j = 0; j < N; j++)
+            coded_bits[j] ^= ev[j];
+
+          assert (short_decode_blk (coded_bits) == in);
+        }
+      Params::short_nearest = false;
+      printf ("check ok\n");
+    }
   if (argc == 3 && string (argv[2]) == "table")
     {
       map<vector<int>, vector<int>> table;
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <assert.h>
 
 #include "threadpool.hh"
 
@@ -33,4 +34,20 @@ main()
   tp.wait_all();
   printf ("===\n");
   printf ("results: %d, %d\n", result1, result2);
+
+  /* nested parallelism: jobs which use a ThreadPool themselves */
+  std::atomic<int> nested_sum { 0 };
+  for (int i = 0; i < 64; i++)
+    {
+      tp.add_job ([&nested_sum]()
+        {
+          ThreadPool inner_tp;
+          for (int j = 0; j < 16; j++)
+            inner_tp.add_job ([&nested_sum]() { nested_sum++; });
+          inner_tp.wait_all();
+        });
+    }
+  tp.wait_all();
+  printf ("nested: %d\n", int (nested_sum));
+  assert (nested_sum == 64 * 16);
 }
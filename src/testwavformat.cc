@@ -18,6 +18,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <sndfile.h>
 #include <assert.h>
 #include <math.h>
@@ -85,13 +86,22 @@ main (int argc, char **argv)
       sfinfo.channels   = in.n_channels();
 
 
-      sfinfo.format = formats[out_format];
-      if (!sfinfo.format)
+      /* flac is not part of the list, which contains the wav subformats only */
+      const bool flac = out_format == "flac";
+      if (flac)
         {
-          fprintf (stderr, "testwavformat: unsupported output format %s\n", out_format.c_str());
-          return 1;
+          sfinfo.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+        }
+      else
+        {
+          sfinfo.format = formats[out_format];
+          if (!sfinfo.format)
+            {
+              fprintf (stderr, "testwavformat: unsupported output format %s\n", out_format.c_str());
+              return 1;
+            }
+          sfinfo.format |= SF_FORMAT_WAV;
         }
-      sfinfo.format |= SF_FORMAT_WAV;
 
       auto sndfile = sf_open (out_filename.c_str(), SFM_WRITE, &sfinfo);
       int error = sf_error (sndfile);
@@ -101,10 +111,24 @@ main (int argc, char **argv)
           return 1;
         }
       vector<float> samples;
+      vector<int>   isamples;
       do
         {
           in.read_frames (samples, 1024);
-          sf_count_t count = sf_write_float (sndfile, samples.data(), samples.size());
+
+          sf_count_t count;
+          if (flac)
+            {
+              /* int API with the normalization of SFInputStream, so 16 bit input is converted without loss */
+              isamples.resize (samples.size());
+              for (size_t i = 0; i < samples.size(); i++)
+                isamples[i] = lrint (std::max (std::min (samples[i] * 2147483648.0, 2147483647.0), -2147483648.0));
+              count = sf_write_int (sndfile, isamples.data(), isamples.size());
+            }
+          else
+            {
+              count = sf_write_float (sndfile, samples.data(), samples.size());
+            }
           assert ((uint64_t) count == samples.size());
         }
       while (samples.size());
@@ -113,7 +137,7 @@ main (int argc, char **argv)
     }
   else
     {
-      fprintf (stderr, "usage: testwavformat convert <in_filename> <out_filename> <format>\n");
+      fprintf (stderr, "usage: testwavformat convert <in_filename> <out_filename> <format>  (format from list, or flac)\n");
       fprintf (stderr, "or     testwavformat detect <in_filename>\n");
       fprintf (stderr, "or     testwavformat list\n");
       return 1;
@@ -15,100 +15,377 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
 #include "threadpool.hh"
 #include "utils.hh"
+#include "profile.hh"
 
-bool
-ThreadPool::worker_next_job (Job& job)
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static size_t max_threads = 0;      // 0: one worker per cpu
+static bool   numa_affinity = false;
+static bool   scheduler_started = false;
+
+class Scheduler
 {
-  std::unique_lock<std::mutex> lck (mutex);
+  struct Job
+  {
+    std::function<void()> fun;
+    ThreadPool           *group = nullptr;
+  };
+  struct Queue
+  {
+    std::mutex            mutex;
+    std::deque<Job>       jobs;
+  };
 
-  if (stop_workers)
-    return false;
+  /* one queue per worker, the last queue is used for jobs added by other threads */
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread>  threads;
+
+  std::mutex                sleep_mutex;
+  std::condition_variable   sleep_cond;
+  std::atomic<size_t>       jobs_queued { 0 };
+  std::atomic<size_t>       n_sleeping { 0 };
+
+  static thread_local int   worker_index;
+
+  Scheduler();
+
+  size_t own_queue() const;
+  bool take_job (Job& job);
+  void run_job (Job& job);
+  void wake (bool all);
+  void worker_run (int index);
+public:
+  static Scheduler& the();
+
+  void add_job (ThreadPool *group, std::function<void()> fun, int queue_index = -1);
+  void wait (ThreadPool *group);
+
+  size_t n_threads() const { return threads.size(); }
+};
+
+thread_local int Scheduler::worker_index = -1;
+
+Scheduler&
+Scheduler::the()
+{
+  /* never deleted: worker threads keep running until the process exits */
+  static Scheduler *scheduler = new Scheduler();
+  return *scheduler;
+}
+
+#ifdef __linux__
+/* cpus of each NUMA node, from sysfs */
+static std::vector<std::vector<int>>
+numa_node_cpus()
+{
+  std::vector<std::vector<int>> nodes;
+  for (int node = 0; ; node++)
+    {
+      FILE *file = fopen (string_printf ("/sys/devices/system/node/node%d/cpulist", node).c_str(), "r");
+      if (!file)
+        break;
+
+      /* format: "0-7,16-23" */
+      std::vector<int> cpus;
+      int first, last;
+      while (fscanf (file, "%d", &first) == 1)
+        {
+          last = first;
+          int c = fgetc (file);
+          if (c == '-')
+            {
+              if (fscanf (file, "%d", &last) != 1)
+                break;
+              c = fgetc (file);
+            }
+          for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back (cpu);
+          if (c != ',')
+            break;
+        }
+      fclose (file);
+
+      if (!cpus.empty())
+        nodes.push_back (cpus);
+    }
+  return nodes;
+}
+
+static void
+bind_workers_to_numa_nodes (std::vector<std::thread>& threads)
+{
+  auto nodes = numa_node_cpus();
+  if (nodes.size() < 2)
+    return;
+
+  for (size_t i = 0; i < threads.size(); i++)
+    {
+      const auto& cpus = nodes[i * nodes.size() / threads.size()];
 
-  if (jobs.empty())
-    cond.wait (lck);
+      cpu_set_t cpu_set;
+      CPU_ZERO (&cpu_set);
+      for (auto cpu : cpus)
+        if (cpu < CPU_SETSIZE)
+          CPU_SET (cpu, &cpu_set);
 
-  if (jobs.empty())
+      if (pthread_setaffinity_np (threads[i].native_handle(), sizeof (cpu_set), &cpu_set) != 0)
+        warning ("audiowmark: failed to set NUMA affinity for worker thread %zd\n", i);
+    }
+}
+#else
+static void
+bind_workers_to_numa_nodes (std::vector<std::thread>& threads)
+{
+  warning ("audiowmark: NUMA affinity is not supported on this platform\n");
+}
+#endif
+
+Scheduler::Scheduler()
+{
+  scheduler_started = true;
+
+  size_t n_workers = std::max (std::thread::hardware_concurrency(), 1u);
+  if (max_threads)
+    n_workers = max_threads;
+
+  for (size_t i = 0; i < n_workers + 1; i++)
+    queues.emplace_back (new Queue());
+
+  for (size_t i = 0; i < n_workers; i++)
+    threads.push_back (std::thread (&Scheduler::worker_run, this, i));
+
+  if (numa_affinity)
+    bind_workers_to_numa_nodes (threads);
+
+  for (auto& thread : threads)
+    thread.detach();
+}
+
+size_t
+Scheduler::own_queue() const
+{
+  return worker_index >= 0 ? worker_index : queues.size() - 1;
+}
+
+bool
+Scheduler::take_job (Job& job)
+{
+  if (jobs_queued == 0)
     return false;
 
-  job = jobs.front();
-  jobs.erase (jobs.begin());
-  return true;
+  /* newest job from our own queue, or oldest job from another queue */
+  const size_t self = own_queue();
+  for (size_t i = 0; i < queues.size(); i++)
+    {
+      Queue& queue = *queues[(self + i) % queues.size()];
+
+      std::lock_guard<std::mutex> lg (queue.mutex);
+      if (!queue.jobs.empty())
+        {
+          if (i == 0 && worker_index >= 0)
+            {
+              job = std::move (queue.jobs.back());
+              queue.jobs.pop_back();
+            }
+          else
+            {
+              job = std::move (queue.jobs.front());
+              queue.jobs.pop_front();
+            }
+          jobs_queued--;
+          return true;
+        }
+    }
+  return false;
 }
 
+/*
+ * sleeping threads increment n_sleeping before checking their wakeup
+ * condition, so the other side only needs to take the mutex if somebody
+ * could be sleeping
+ */
 void
-ThreadPool::worker_run()
+Scheduler::wake (bool all)
 {
-  while (!stop_workers)
+  if (n_sleeping == 0)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lg (sleep_mutex);
+  }
+  if (all)
+    sleep_cond.notify_all();
+  else
+    sleep_cond.notify_one();
+}
+
+void
+Scheduler::run_job (Job& job)
+{
+  ThreadPool *group = job.group;
+
+  if (group->deadline > 0 && get_time() > group->deadline)
+    {
+      group->jobs_skipped++;
+    }
+  else
+    {
+      Profile::Span span ("job");
+      job.fun();
+    }
+  job.fun = nullptr;
+
+  /* after the last job is done, the group may be deleted by the waiting thread */
+  if (--group->jobs_open == 0)
+    wake (true);
+}
+
+void
+Scheduler::worker_run (int index)
+{
+  worker_index = index;
+
+  for (;;)
     {
       Job job;
-      if (worker_next_job (job))
+      if (take_job (job))
         {
-          job.fun();
+          run_job (job);
+        }
+      else
+        {
+          std::unique_lock<std::mutex> lck (sleep_mutex);
+          n_sleeping++;
+          while (jobs_queued == 0)
+            sleep_cond.wait (lck);
+          n_sleeping--;
+        }
+    }
+}
 
-          std::lock_guard<std::mutex> lg (mutex);
-          jobs_done++;
+void
+Scheduler::add_job (ThreadPool *group, std::function<void()> fun, int queue_index)
+{
+  group->jobs_open++;
 
-          main_cond.notify_one();
+  Queue& queue = *queues[queue_index >= 0 ? queue_index : own_queue()];
+  {
+    std::lock_guard<std::mutex> lg (queue.mutex);
+
+    Job job;
+    job.fun = std::move (fun);
+    job.group = group;
+    queue.jobs.push_back (std::move (job));
+    jobs_queued++;
+  }
+  wake (false);
+}
+
+void
+Scheduler::wait (ThreadPool *group)
+{
+  /* help executing jobs (of any group) until all jobs of this group are done */
+  while (group->jobs_open > 0)
+    {
+      Job job;
+      if (take_job (job))
+        {
+          run_job (job);
+        }
+      else
+        {
+          std::unique_lock<std::mutex> lck (sleep_mutex);
+          n_sleeping++;
+          while (group->jobs_open > 0 && jobs_queued == 0)
+            sleep_cond.wait (lck);
+          n_sleeping--;
         }
     }
+  /* we may have consumed a wakeup which was meant for a job */
+  if (jobs_queued > 0)
+    wake (false);
 }
 
 ThreadPool::ThreadPool()
 {
-  for (unsigned int i = 0; i < std::thread::hardware_concurrency(); i++)
-    {
-      threads.push_back (std::thread (&ThreadPool::worker_run, this));
-    }
 }
 
 void
 ThreadPool::add_job (std::function<void()> fun)
 {
-  std::lock_guard<std::mutex> lg (mutex);
-  Job job;
-  job.fun = fun;
-  jobs.push_back (job);
-  jobs_added++;
+  Scheduler::the().add_job (this, fun);
+}
 
-  cond.notify_one();
+/* queue job for worker (worker_hint % n_threads()), idle workers may still steal it */
+void
+ThreadPool::add_job (std::function<void()> fun, size_t worker_hint)
+{
+  Scheduler& scheduler = Scheduler::the();
+
+  scheduler.add_job (this, fun, worker_hint % scheduler.n_threads());
 }
 
 void
 ThreadPool::wait_all()
 {
-  for (;;)
-    {
-      std::unique_lock<std::mutex> lck (mutex);
+  Scheduler::the().wait (this);
+}
 
-      if (jobs_added == jobs_done)
-        return;
+/* skip the jobs which are not started before the deadline (0: no deadline), must be set before adding jobs */
+void
+ThreadPool::set_deadline (double new_deadline)
+{
+  deadline = new_deadline;
+}
 
-      main_cond.wait (lck);
-    }
+/* number of jobs that were skipped because the deadline was reached */
+size_t
+ThreadPool::n_skipped() const
+{
+  return jobs_skipped;
 }
 
 size_t
 ThreadPool::n_threads()
 {
-  return threads.size();
+  return Scheduler::the().n_threads();
 }
 
-ThreadPool::~ThreadPool()
+void
+ThreadPool::set_max_threads (size_t n_threads)
 {
-  {
-    std::lock_guard<std::mutex> lg (mutex);
-    stop_workers = true;
-    cond.notify_all();
-  }
+  if (scheduler_started)
+    warning ("audiowmark: ThreadPool::set_max_threads() called after the first ThreadPool was used\n");
+  max_threads = n_threads;
+}
 
-  for (auto& t : threads)
-    t.join();
+void
+ThreadPool::set_numa_affinity (bool numa)
+{
+  if (scheduler_started)
+    warning ("audiowmark: ThreadPool::set_numa_affinity() called after the first ThreadPool was used\n");
+  numa_affinity = numa;
+}
 
-  if (jobs_added != jobs_done)
+ThreadPool::~ThreadPool()
+{
+  if (jobs_open != 0)
     {
       // user must wait before deleting the ThreadPool
-      error ("audiowmark: open jobs in ThreadPool::~ThreadPool() [added=%zd, done=%zd] - this should not happen\n", jobs_added, jobs_done);
+      error ("audiowmark: open jobs in ThreadPool::~ThreadPool() [open=%zd] - this should not happen\n", size_t (jobs_open));
+      wait_all();
     }
 }
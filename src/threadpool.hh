@@ -18,41 +18,56 @@
 #ifndef AUDIOWMARK_THREAD_POOL_HH
 #define AUDIOWMARK_THREAD_POOL_HH
 
-#include <vector>
-#include <thread>
 #include <functional>
-#include <set>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
 
+/*
+ * A ThreadPool is a group of jobs which can be waited for. It doesn't own
+ * any threads, jobs are executed by one process wide scheduler which starts
+ * its worker threads on first use and keeps them until the program exits,
+ * so creating a ThreadPool is cheap.
+ *
+ * Each worker has its own job deque: jobs added from within a job go to the
+ * deque of the current worker, idle workers steal jobs from other workers.
+ * While wait_all() waits for the jobs of the group, it executes pending jobs
+ * itself, so using a ThreadPool from within a job (nested parallelism) can
+ * not deadlock.
+ *
+ * A job can be added with a worker hint: it is queued for this worker, so
+ * jobs which process the same data (for instance the same range of frames)
+ * can be kept on the same worker. Other workers still steal the job if they
+ * are idle. With NUMA affinity, the workers are bound to the NUMA nodes in
+ * contiguous blocks (workers 0..k-1 on the first node, ...), so data which
+ * is first written by a worker is usually read by workers of the same node.
+ *
+ * Jobs can be cancelled cooperatively with a deadline: jobs of the group which
+ * have not been started when the deadline (see get_time()) is reached are
+ * skipped, so the code which adds the jobs must be able to deal with jobs that
+ * never run. Jobs which are already running are not interrupted.
+ */
 class ThreadPool
 {
-  std::vector<std::thread> threads;
-
-  struct Job
-  {
-    std::function<void()> fun;
-  };
-
-  std::mutex                mutex;
-  std::condition_variable   cond;
-  std::condition_variable   main_cond;
-  std::vector<Job>          jobs;
-  size_t                    jobs_added = 0;
-  size_t                    jobs_done = 0;
-  bool                      stop_workers = false;
-
-  bool worker_next_job (Job& job);
-  void worker_run();
+  std::atomic<size_t> jobs_open { 0 };
+  std::atomic<size_t> jobs_skipped { 0 };
+  double              deadline = 0;
 
+  friend class Scheduler;
 public:
   ThreadPool();
   ~ThreadPool();
 
   void add_job (std::function<void()> fun);
+  void add_job (std::function<void()> fun, size_t worker_hint);
   void wait_all();
 
+  void   set_deadline (double deadline);
+  size_t n_skipped() const;
+
   size_t n_threads();
+
+  /* global settings, must be set before the first ThreadPool is used */
+  static void set_max_threads (size_t n_threads);
+  static void set_numa_affinity (bool numa_affinity);
 };
 
 #endif /* AUDIOWMARK_THREAD_POOL_HH */
@@ -163,6 +163,92 @@ vec_to_hex_str (const vector<unsigned char>& vec)
   return s;
 }
 
+static bool
+string_chars (char ch)
+{
+  if ((ch >= 'A' && ch <= 'Z')
+  ||  (ch >= '0' && ch <= '9')
+  ||  (ch >= 'a' && ch <= 'z')
+  ||  (ch == '.')
+  ||  (ch == ':')
+  ||  (ch == '=')
+  ||  (ch == '/')
+  ||  (ch == '-')
+  ||  (ch == '_'))
+    return true;
+
+  return false;
+}
+
+static bool
+white_space (char ch)
+{
+  return (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r');
+}
+
+bool
+tokenize (const string& line, vector<string>& tokens)
+{
+  enum { BLANK, STRING, QUOTED_STRING, QUOTED_STRING_ESCAPED, COMMENT } state = BLANK;
+  string s;
+
+  string xline = line + '\n';
+  tokens.clear();
+  for (string::const_iterator i = xline.begin(); i != xline.end(); i++)
+    {
+      if (state == BLANK && string_chars (*i))
+        {
+          state = STRING;
+          s += *i;
+        }
+      else if (state == BLANK && *i == '"')
+        {
+          state = QUOTED_STRING;
+        }
+      else if (state == BLANK && white_space (*i))
+        {
+          // ignore more whitespaces if we've already seen one
+        }
+      else if (state == STRING && string_chars (*i))
+        {
+          s += *i;
+        }
+      else if ((state == STRING && white_space (*i))
+           ||  (state == QUOTED_STRING && *i == '"'))
+        {
+          tokens.push_back (s);
+          s = "";
+          state = BLANK;
+        }
+      else if (state == QUOTED_STRING && *i == '\\')
+        {
+          state = QUOTED_STRING_ESCAPED;
+        }
+      else if (state == QUOTED_STRING)
+        {
+          s += *i;
+        }
+      else if (state == QUOTED_STRING_ESCAPED)
+        {
+          s += *i;
+          state = QUOTED_STRING;
+        }
+      else if (*i == '#')
+        {
+          state = COMMENT;
+        }
+      else if (state == COMMENT)
+        {
+          // ignore comments
+        }
+      else
+        {
+          return false;
+        }
+    }
+  return state == BLANK || state == COMMENT;
+}
+
 static string
 string_vprintf (const char *format, va_list vargs)
 {
@@ -192,7 +278,31 @@ string_printf (const char *format, ...)
   return s;
 }
 
+string
+json_escape (const string& s)
+{
+  string result;
+  for (unsigned char ch : s)
+    {
+      if (ch == '"' || ch == '\\')
+        {
+          result += '\\';
+          result += ch;
+        }
+      else if (ch < 32)
+        {
+          result += string_printf ("\\u%04x", ch);
+        }
+      else
+        {
+          result += ch;
+        }
+    }
+  return result;
+}
+
 static Log log_level = Log::INFO;
+static std::function<void (Log, const string&)> log_function;
 
 void
 set_log_level (Log level)
@@ -200,6 +310,19 @@ set_log_level (Log level)
   log_level = level;
 }
 
+Log
+get_log_level()
+{
+  return log_level;
+}
+
+/* redirect log messages (for instance libaudiowmark collects error messages), nullptr: print to stderr */
+void
+set_log_function (std::function<void (Log, const string&)> function)
+{
+  log_function = function;
+}
+
 static void
 logv (Log log, const char *format, va_list vargs)
 {
@@ -207,9 +330,15 @@ logv (Log log, const char *format, va_list vargs)
     {
       string s = string_vprintf (format, vargs);
 
-      /* could support custom log function here */
-      fprintf (stderr, "%s", s.c_str());
-      fflush (stderr);
+      if (log_function)
+        {
+          log_function (log, s);
+        }
+      else
+        {
+          fprintf (stderr, "%s", s.c_str());
+          fflush (stderr);
+        }
     }
 }
 
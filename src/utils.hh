@@ -20,6 +20,7 @@
 
 #include <vector>
 #include <string>
+#include <functional>
 
 #ifndef __STDC_FORMAT_MACROS
 // some compilers/platforms (i.e. very old macOS) need this for macros like PRId64 (#61)
@@ -33,6 +34,9 @@ std::string      bit_vec_to_str (const std::vector<int>& bit_vec);
 std::vector<unsigned char> hex_str_to_vec (const std::string& str);
 std::string                vec_to_hex_str (const std::vector<unsigned char>& vec);
 
+/* split line into whitespace separated (or "quoted") tokens, ignoring # comments */
+bool tokenize (const std::string& line, std::vector<std::string>& tokens);
+
 double get_time();
 void print_memory_usage (const std::string& where);
 
@@ -61,6 +65,12 @@ bound (const T& min_value, const T& value, const T& max_value)
 #endif
 
 /* bswap for g++ / clang++ - may need different implementation for other compilers */
+static inline uint16_t
+bswap16 (uint16_t i)
+{
+  return __builtin_bswap16 (i);
+}
+
 static inline uint32_t
 bswap32 (uint32_t i)
 {
@@ -81,8 +91,11 @@ void debug (const char *format, ...) AUDIOWMARK_PRINTF (1, 2);
 enum class Log { ERROR = 3, WARNING = 2, INFO = 1, DEBUG = 0 };
 
 void set_log_level (Log level);
+Log  get_log_level();
+void set_log_function (std::function<void (Log, const std::string&)> function);
 
 std::string string_printf (const char *fmt, ...) AUDIOWMARK_PRINTF (1, 2);
+std::string json_escape (const std::string& s);
 
 class Error
 {
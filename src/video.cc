@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "utils.hh"
+#include "wmcommon.hh"
+#include "video.hh"
+
+#include "config.h"
+
+using std::string;
+using std::vector;
+
+#if !HAVE_FFMPEG
+int
+video_add (const Key& key, const string& infile, const string& outfile, const string& bits)
+{
+  error ("audiowmark: video support is not available in this build of audiowmark\n");
+  return 1;
+}
+
+int
+video_get (const vector<Key>& key_list, const string& infile)
+{
+  error ("audiowmark: video support is not available in this build of audiowmark\n");
+  return 1;
+}
+#else
+
+#include "ffdecoder.hh"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+/*
+ * video-add: the audio stream of the input file is decoded while the input
+ * is demuxed (FFAudioInputStream), watermarked by add_stream_watermark and
+ * encoded again with the same codec by VideoOutputStream. The packets of
+ * all other streams (video, subtitles) are copied to the output file without
+ * decoding them, so the video quality is not affected.
+ *
+ * This replaces extracting the audio to a temporary wav file, watermarking it
+ * and merging the result with the video (which is what the videowmark script
+ * does using ffmpeg), so the input is only read once and nothing is written
+ * to disk except for the output file.
+ */
+class VideoOutputStream : public AudioOutputStream
+{
+  AVFormatContext *m_fmt_ctx = nullptr;
+  AVCodecContext  *m_enc = nullptr;
+  AVFrame         *m_frame = nullptr;
+  SwrContext      *m_swr_ctx = nullptr;
+  AVPacket        *m_pkt = nullptr;
+  AVStream        *m_audio_st = nullptr;
+
+  const AVFormatContext *m_in_fmt_ctx = nullptr;
+  vector<int>      m_stream_map;           // input stream index -> output stream index, -1: not copied
+  vector<float>    m_buffer;               // interleaved samples of the incomplete next frame
+  int              m_frame_size = 0;
+  bool             m_small_last_frame = false;
+  int64_t          m_next_pts = 0;         // in 1 / sample_rate
+  int              m_n_channels = 0;
+  int              m_sample_rate = 0;
+  bool             m_header_written = false;
+  bool             m_closed = false;
+
+  Error open_encoder (const AVStream *in_st);
+  Error encode_frame (const float *samples, int n_frames);
+  Error write_audio_packets();
+public:
+  VideoOutputStream (int n_channels, int sample_rate);
+  ~VideoOutputStream();
+
+  Error open (const string& filename, const AVFormatContext *in_fmt_ctx, int audio_stream_index);
+  Error copy_packet (AVPacket *pkt);
+  string codec_name() const;
+
+  int   bit_depth() const override;
+  int   sample_rate() const override;
+  int   n_channels() const override;
+  Error write_frames (const vector<float>& frames) override;
+  Error write_frames (const float *frames, size_t count) override;
+  Error close() override;
+};
+
+VideoOutputStream::VideoOutputStream (int n_channels, int sample_rate) :
+  m_n_channels (n_channels),
+  m_sample_rate (sample_rate)
+{
+}
+
+VideoOutputStream::~VideoOutputStream()
+{
+  if (m_fmt_ctx)
+    {
+      if (m_fmt_ctx->pb)
+        avio_closep (&m_fmt_ctx->pb);
+      avformat_free_context (m_fmt_ctx);
+    }
+  avcodec_free_context (&m_enc);
+  av_frame_free (&m_frame);
+  swr_free (&m_swr_ctx);
+  av_packet_free (&m_pkt);
+}
+
+/* encoder for the same codec, bit rate and channel layout as the input audio stream */
+Error
+VideoOutputStream::open_encoder (const AVStream *in_st)
+{
+  const AVCodecParameters *in_par = in_st->codecpar;
+
+  /* the native opus encoder is experimental, ffmpeg recommends libopus for encoding */
+  const AVCodec *codec = nullptr;
+  if (in_par->codec_id == AV_CODEC_ID_OPUS)
+    codec = avcodec_find_encoder_by_name ("libopus");
+  if (!codec)
+    codec = avcodec_find_encoder (in_par->codec_id);
+  if (!codec)
+    return Error (string_printf ("could not find encoder for '%s'", avcodec_get_name (in_par->codec_id)));
+
+  m_enc = avcodec_alloc_context3 (codec);
+  if (!m_enc)
+    return Error ("could not alloc an encoding context");
+
+  m_enc->sample_fmt  = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+  m_enc->sample_rate = m_sample_rate;
+  m_enc->bit_rate    = in_par->bit_rate;
+  m_enc->time_base   = (AVRational) { 1, m_sample_rate };
+  if (in_par->ch_layout.nb_channels == m_n_channels)
+    av_channel_layout_copy (&m_enc->ch_layout, &in_par->ch_layout);
+  else
+    av_channel_layout_default (&m_enc->ch_layout, m_n_channels);
+
+  if (m_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    m_enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  int ret = avcodec_open2 (m_enc, codec, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("could not open audio codec: %s", av_err2str (ret)));
+
+  /* codecs without fixed frame size (like pcm) accept frames of any size */
+  m_frame_size = m_enc->frame_size > 0 ? m_enc->frame_size : 4096;
+  m_small_last_frame = m_enc->frame_size <= 0 || (codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE));
+
+  m_frame = av_frame_alloc();
+  if (!m_frame)
+    return Error ("error allocating an audio frame");
+
+  m_frame->format = m_enc->sample_fmt;
+  av_channel_layout_copy (&m_frame->ch_layout, &m_enc->ch_layout);
+  m_frame->sample_rate = m_sample_rate;
+  m_frame->nb_samples = m_frame_size;
+  if (av_frame_get_buffer (m_frame, 0) < 0)
+    return Error ("error allocating an audio buffer");
+
+  ret = swr_alloc_set_opts2 (&m_swr_ctx,
+                             &m_enc->ch_layout, m_enc->sample_fmt, m_sample_rate,
+                             &m_enc->ch_layout, AV_SAMPLE_FMT_FLT, m_sample_rate,
+                             0, nullptr);
+  if (ret < 0 || swr_init (m_swr_ctx) < 0)
+    return Error ("failed to initialize the sample format conversion");
+
+  m_pkt = av_packet_alloc();
+  if (!m_pkt)
+    return Error ("could not allocate AVPacket");
+
+  /* keep the start time of the audio stream, so audio and video stay in sync */
+  if (in_st->start_time != AV_NOPTS_VALUE)
+    m_next_pts = av_rescale_q (in_st->start_time, in_st->time_base, m_enc->time_base);
+
+  return Error::Code::NONE;
+}
+
+Error
+VideoOutputStream::open (const string& filename, const AVFormatContext *in_fmt_ctx, int audio_stream_index)
+{
+  /* the output format is chosen by the extension of the filename */
+  avformat_alloc_output_context2 (&m_fmt_ctx, nullptr, nullptr, filename.c_str());
+  if (!m_fmt_ctx)
+    return Error ("could not deduce output format from file extension");
+
+  m_in_fmt_ctx = in_fmt_ctx;
+  for (unsigned int i = 0; i < in_fmt_ctx->nb_streams; i++)
+    {
+      const AVStream *in_st = in_fmt_ctx->streams[i];
+      const AVMediaType type = in_st->codecpar->codec_type;
+
+      m_stream_map.push_back (-1);
+      if (type != AVMEDIA_TYPE_AUDIO && type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_SUBTITLE)
+        continue;
+
+      AVStream *out_st = avformat_new_stream (m_fmt_ctx, nullptr);
+      if (!out_st)
+        return Error ("could not allocate stream");
+
+      m_stream_map[i] = out_st->index;
+      if (int (i) == audio_stream_index)
+        {
+          m_audio_st = out_st;
+
+          Error err = open_encoder (in_st);
+          if (err)
+            return err;
+
+          out_st->time_base = m_enc->time_base;
+          if (avcodec_parameters_from_context (out_st->codecpar, m_enc) < 0)
+            return Error ("could not copy the stream parameters");
+        }
+      else
+        {
+          if (avcodec_parameters_copy (out_st->codecpar, in_st->codecpar) < 0)
+            return Error ("could not copy the stream parameters");
+
+          /* the codec tag of the input container may not be valid for the output container */
+          out_st->codecpar->codec_tag = 0;
+          out_st->time_base = in_st->time_base;
+        }
+    }
+
+  if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+      int ret = avio_open (&m_fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE);
+      if (ret < 0)
+        return Error (string_printf ("%s: %s", filename.c_str(), av_err2str (ret)));
+    }
+  int ret = avformat_write_header (m_fmt_ctx, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("error writing output header: %s", av_err2str (ret)));
+
+  m_header_written = true;
+  return Error::Code::NONE;
+}
+
+string
+VideoOutputStream::codec_name() const
+{
+  return m_enc->codec->name;
+}
+
+/* copy one packet of a stream that is not watermarked (FFAudioInputStream packet function) */
+Error
+VideoOutputStream::copy_packet (AVPacket *pkt)
+{
+  const int out_index = m_stream_map[pkt->stream_index];
+  if (out_index < 0)
+    return Error::Code::NONE;
+
+  av_packet_rescale_ts (pkt, m_in_fmt_ctx->streams[pkt->stream_index]->time_base, m_fmt_ctx->streams[out_index]->time_base);
+  pkt->stream_index = out_index;
+  pkt->pos = -1;
+
+  /* the muxer takes the packet data, and buffers the video until the corresponding audio is written */
+  int ret = av_interleaved_write_frame (m_fmt_ctx, pkt);
+  if (ret < 0)
+    return Error (string_printf ("error writing packet: %s", av_err2str (ret)));
+
+  return Error::Code::NONE;
+}
+
+Error
+VideoOutputStream::write_audio_packets()
+{
+  int ret;
+  while ((ret = avcodec_receive_packet (m_enc, m_pkt)) >= 0)
+    {
+      av_packet_rescale_ts (m_pkt, m_enc->time_base, m_audio_st->time_base);
+      m_pkt->stream_index = m_audio_st->index;
+
+      ret = av_interleaved_write_frame (m_fmt_ctx, m_pkt);
+      if (ret < 0)
+        return Error (string_printf ("error writing audio packet: %s", av_err2str (ret)));
+    }
+  if (ret != AVERROR (EAGAIN) && ret != AVERROR_EOF)
+    return Error (string_printf ("error encoding audio frame: %s", av_err2str (ret)));
+
+  return Error::Code::NONE;
+}
+
+/* encode n_frames interleaved sample frames (nullptr: flush encoder) */
+Error
+VideoOutputStream::encode_frame (const float *samples, int n_frames)
+{
+  AVFrame *frame = nullptr;
+  if (samples)
+    {
+      int ret = av_frame_make_writable (m_frame);
+      if (ret < 0)
+        return Error ("error making frame writable");
+
+      const uint8_t *in_data = reinterpret_cast<const uint8_t *> (samples);
+      ret = swr_convert (m_swr_ctx, m_frame->data, n_frames, &in_data, n_frames);
+      if (ret < 0)
+        return Error ("error while converting");
+
+      m_frame->nb_samples = n_frames;
+      m_frame->pts = m_next_pts;
+      m_next_pts += n_frames;
+      frame = m_frame;
+    }
+  int ret = avcodec_send_frame (m_enc, frame);
+  if (ret < 0)
+    return Error (string_printf ("error encoding audio frame: %s", av_err2str (ret)));
+
+  return write_audio_packets();
+}
+
+Error
+VideoOutputStream::write_frames (const float *frames, size_t count)
+{
+  m_buffer.insert (m_buffer.end(), frames, frames + count * m_n_channels);
+
+  const size_t frame_values = size_t (m_frame_size) * m_n_channels;
+  size_t pos = 0;
+  while (m_buffer.size() - pos >= frame_values)
+    {
+      Error err = encode_frame (&m_buffer[pos], m_frame_size);
+      if (err)
+        return err;
+      pos += frame_values;
+    }
+  m_buffer.erase (m_buffer.begin(), m_buffer.begin() + pos);
+  return Error::Code::NONE;
+}
+
+Error
+VideoOutputStream::write_frames (const vector<float>& frames)
+{
+  return write_frames (frames.data(), frames.size() / m_n_channels);
+}
+
+Error
+VideoOutputStream::close()
+{
+  if (m_closed || !m_header_written)
+    return Error::Code::NONE;
+
+  m_closed = true;
+
+  /* the encoder may need a complete last frame: pad with zeros */
+  Error err;
+  if (!m_buffer.empty())
+    {
+      int n_frames = m_buffer.size() / m_n_channels;
+      if (!m_small_last_frame)
+        {
+          m_buffer.resize (size_t (m_frame_size) * m_n_channels);
+          n_frames = m_frame_size;
+        }
+      err = encode_frame (m_buffer.data(), n_frames);
+      m_buffer.clear();
+    }
+  if (!err)
+    err = encode_frame (nullptr, 0);
+  if (err)
+    return err;
+
+  int ret = av_write_trailer (m_fmt_ctx);
+  if (ret < 0)
+    return Error (string_printf ("error writing output trailer: %s", av_err2str (ret)));
+
+  if (!(m_fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    avio_closep (&m_fmt_ctx->pb);
+
+  return Error::Code::NONE;
+}
+
+int
+VideoOutputStream::bit_depth() const
+{
+  return 16;
+}
+
+int
+VideoOutputStream::sample_rate() const
+{
+  return m_sample_rate;
+}
+
+int
+VideoOutputStream::n_channels() const
+{
+  return m_n_channels;
+}
+
+int
+video_add (const Key& key, const string& infile, const string& outfile, const string& bits)
+{
+  av_log_set_level (AV_LOG_ERROR);
+
+  FFAudioInputStream in_stream;
+  Error err = in_stream.open (infile);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+
+  VideoOutputStream out_stream (in_stream.n_channels(), in_stream.sample_rate());
+  err = out_stream.open (outfile, in_stream.format_context(), in_stream.audio_stream_index());
+  if (err)
+    {
+      error ("audiowmark: error writing to %s: %s\n", outfile.c_str(), err.message());
+      return 1;
+    }
+  in_stream.set_packet_func ([&] (AVPacket *pkt) { return out_stream.copy_packet (pkt); });
+
+  info ("Input:        %s\n", Params::input_label.size() ? Params::input_label.c_str() : infile.c_str());
+  info ("Output:       %s\n", Params::output_label.size() ? Params::output_label.c_str() : outfile.c_str());
+  info ("Audio Codec:  %s\n", out_stream.codec_name().c_str());
+
+  return add_stream_watermark (key, &in_stream, &out_stream, bits, 0);
+}
+
+int
+video_get (const vector<Key>& key_list, const string& infile)
+{
+  av_log_set_level (AV_LOG_ERROR);
+
+  std::unique_ptr<FFAudioInputStream> in_stream (new FFAudioInputStream());
+  Error err = in_stream->open (infile);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  return get_watermark (key_list, std::move (in_stream), infile, "");
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_VIDEO_HH
+#define AUDIOWMARK_VIDEO_HH
+
+#include <string>
+#include <vector>
+
+int video_add (const Key& key, const std::string& infile, const std::string& outfile, const std::string& bits);
+int video_get (const std::vector<Key>& key_list, const std::string& infile);
+
+#endif /* AUDIOWMARK_VIDEO_HH */
@@ -17,6 +17,10 @@
 
 #include "wavchunkloader.hh"
 #include "wmcommon.hh"
+#include "profile.hh"
+#include "threadpool.hh"
+
+#include <algorithm>
 
 #include <math.h>
 #include <assert.h>
@@ -45,35 +49,83 @@ using std::vector;
  * input stream (C). Since EOF was reached, we're done at this point.
  *
  * Overlap should be larger than one AB block to get all BlockDecoder results.
+ *
+ * While a chunk is analyzed, the new samples of the next chunk are read (and
+ * resampled) by a background thread, so that decoding compressed input (mp3,
+ * flac) and resampling overlap with the detection. The samples are appended
+ * to the overlap samples by the next load_next_chunk() call. This needs memory
+ * for one more chunk (without overlap).
+ *
+ * With Params::compact_samples, the chunks (and the prefetched samples) use
+ * compact storage (see WavData), which halves the memory usage. Speed
+ * detection needs float samples, so compact storage is not used for it.
+ *
+ * With get --range, the input stream is seeked to the start of the range, and
+ * reading stops at the end of the range plus the overlap, so matches at the end
+ * of the range are complete. The time offsets and the length include the start
+ * of the range, so times are always relative to the start of the input.
  */
 WavChunkLoader::WavChunkLoader (const std::string& filename) :
   m_filename (filename)
 {
 }
 
+/* read from an already opened input stream (for instance libaudiowmark memory input) */
+WavChunkLoader::WavChunkLoader (std::unique_ptr<AudioInputStream> in_stream) :
+  m_in_stream (std::move (in_stream))
+{
+}
+
+WavChunkLoader::~WavChunkLoader()
+{
+  /* the prefetch thread uses the input stream, so it must be done before the stream is closed */
+  cancel_prefetch();
+}
+
+/*
+ * stop reading the next chunk in the background, for callers that don't need
+ * the rest of the input (early exit); the prefetch thread stops after the
+ * current block, so this doesn't wait for the whole chunk to be read / decoded
+ *
+ * no more chunks can be loaded after cancel_prefetch()
+ */
+void
+WavChunkLoader::cancel_prefetch()
+{
+  if (m_prefetch_thread.joinable())
+    {
+      m_prefetch_cancel = true;
+      m_prefetch_thread.join();
+
+      m_state = State::DONE;
+    }
+}
+
 Error
 WavChunkLoader::open()
 {
   assert (m_state == State::NEW);
 
-  Error err;
-  m_in_stream = AudioInputStream::create (m_filename, err);
-  if (err)
+  if (!m_in_stream)
     {
-      m_state = State::ERROR;
-      return err;
+      Error err;
+      m_in_stream = AudioInputStream::create (m_filename, err);
+      if (err)
+        {
+          m_state = State::ERROR;
+          return err;
+        }
     }
   m_state = State::OPEN;
 
   m_wav_data = WavData ({}, m_in_stream->n_channels(), Params::mark_sample_rate, m_in_stream->bit_depth());
+  if (Params::compact_samples && !Params::detect_speed && !Params::detect_speed_patient && Params::try_speed <= 0)
+    m_wav_data.compact();
 
   /* initialize resampler if input sample rate != watermark rate */
   if (m_in_stream->sample_rate() != m_wav_data.sample_rate())
     m_resampler.reset (ResamplerImpl::create (m_in_stream->n_channels(), m_in_stream->sample_rate(), m_wav_data.sample_rate()));
 
-  /* maximum length of the m_wav_data samples (chunk size) */
-  m_wav_data_max_size = lrint (Params::get_chunk_size * 60 * m_wav_data.sample_rate()) * m_wav_data.n_channels();
-
   /* overlap size:
    *  - should be large enough for BlockDecoder overlap (1 AB block == 2 blocks)
    *  - take speed factor into account for speed detection
@@ -81,7 +133,63 @@ WavChunkLoader::open()
   const int overlap_blocks = 2;
   const double speed_factor = 1.3;
   const double block_seconds = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size / double (Params::mark_sample_rate);
-  m_n_overlap_samples = lrint (overlap_blocks * block_seconds * speed_factor * m_wav_data.sample_rate()) * m_wav_data.n_channels();
+  const double overlap_seconds = overlap_blocks * block_seconds * speed_factor;
+  m_n_overlap_samples = lrint (overlap_seconds * m_wav_data.sample_rate()) * m_wav_data.n_channels();
+
+  if (Params::get_range_start >= 0)
+    {
+      const size_t start_frame = lrint (Params::get_range_start * m_in_stream->sample_rate());
+      if (start_frame > 0)
+        {
+          Error err = m_in_stream->seek (start_frame);
+          if (err)
+            {
+              m_state = State::ERROR;
+              return err;
+            }
+        }
+      m_range_start = start_frame / double (m_in_stream->sample_rate());
+      m_time_offset = m_range_start;
+      if (std::isfinite (Params::get_range_end))
+        m_range_frames_left = lrint ((Params::get_range_end + overlap_seconds) * m_in_stream->sample_rate()) - start_frame;
+    }
+
+  /* maximum length of the m_wav_data samples (chunk size) */
+  if (Params::get_stream || Params::get_live || !Params::ndjson_output.empty() || Params::get_min_matches > 0)
+    {
+      /* streaming: each chunk only contains a few new blocks after the overlap, so
+       * memory usage doesn't depend on the chunk size and results are available early
+       * (which also allows get --min-matches to stop early)
+       */
+      const int stream_blocks = Params::get_live ? 1 : 2;
+      m_n_stream_samples = lrint (stream_blocks * block_seconds * m_wav_data.sample_rate()) * m_wav_data.n_channels();
+      m_wav_data_max_size = m_n_overlap_samples + m_n_stream_samples;
+    }
+  else
+    {
+      m_wav_data_max_size = lrint (Params::get_chunk_size * 60 * m_wav_data.sample_rate()) * m_wav_data.n_channels();
+    }
+
+  /* --max-memory: smaller chunks, but each chunk needs at least one block after the overlap */
+  if (MemoryBudget::enabled())
+    {
+      const int    n_channels = m_wav_data.n_channels();
+      const bool   compact = m_wav_data.is_compact();
+      const size_t min_size = m_n_overlap_samples + lrint (block_seconds * m_wav_data.sample_rate()) * n_channels;
+      const size_t max_size = MemoryBudget::max_chunk_frames (n_channels, compact) * n_channels;
+      if (max_size < min_size)
+        {
+          m_state = State::ERROR;
+          const size_t min_mb = (MemoryBudget::min_memory (min_size / n_channels, n_channels, compact) + (1 << 20) - 1) >> 20;
+          return Error (string_printf ("--max-memory is too small for this input, at least %zd MB are needed", min_mb));
+        }
+      m_wav_data_max_size = std::min (m_wav_data_max_size, max_size);
+    }
+  if (Profile::enabled())
+    {
+      Profile::peak (Profile::Counter::MEMORY_BUDGET, Params::max_memory);
+      Profile::peak (Profile::Counter::MEMORY_THREADS, ThreadPool().n_threads() * MemoryBudget::thread_bytes);
+    }
 
   if (m_in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
     {
@@ -93,7 +201,11 @@ WavChunkLoader::open()
       n_reserve_frames *= 1.001;
       n_reserve_frames += 100;
 
-      m_wav_data.mutable_samples().reserve (std::min (m_wav_data_max_size, n_reserve_frames * m_wav_data.n_channels()));
+      const size_t n_reserve_values = std::min (m_wav_data_max_size, n_reserve_frames * m_wav_data.n_channels());
+      if (m_wav_data.is_compact())
+        m_wav_data.mutable_compact_samples().reserve (n_reserve_values);
+      else
+        m_wav_data.mutable_samples().reserve (n_reserve_values);
     }
   return Error::Code::NONE;
 }
@@ -118,18 +230,42 @@ WavChunkLoader::load_next_chunk()
         return err;
     }
 
-  vector<float>& ref_samples = m_wav_data.mutable_samples();
+  Error err;
+  if (m_wav_data.is_compact())
+    err = load_samples (m_wav_data.mutable_compact_samples(), m_prefetch_compact_samples);
+  else
+    err = load_samples (m_wav_data.mutable_samples(), m_prefetch_samples);
+  if (err)
+    return err;
+
+  if (m_state == State::OPEN)
+    start_prefetch();
+
+  return Error::Code::NONE;
+}
+
+/* keep the overlap of the previous chunk and append the new samples (float or compact storage) */
+template<class Sample> Error
+WavChunkLoader::load_samples (vector<Sample>& ref_samples, vector<Sample>& prefetch_samples)
+{
+  size_t n_keep_samples, max_size;
+  next_chunk_size (n_keep_samples, max_size);
+
   if (!ref_samples.empty()) /* second block or later */
     {
-      /* overlap samples with last block */
-      assert (ref_samples.size() >= m_n_overlap_samples);
+      assert (ref_samples.size() >= n_keep_samples);
 
-      m_time_offset += ((ref_samples.size() - m_n_overlap_samples) / m_wav_data.n_channels()) / double (m_wav_data.sample_rate());
-      ref_samples.erase (ref_samples.begin(), ref_samples.end() - m_n_overlap_samples);
+      m_frame_offset += (ref_samples.size() - n_keep_samples) / m_wav_data.n_channels();
+      m_time_offset = m_range_start + m_frame_offset / double (m_wav_data.sample_rate());
+      ref_samples.erase (ref_samples.begin(), ref_samples.end() - n_keep_samples);
     }
 
   bool eof = false;
-  Error err = refill (ref_samples, m_wav_data_max_size, &eof);
+  Error err;
+  if (m_prefetch_thread.joinable())
+    err = finish_prefetch (ref_samples, prefetch_samples, &eof);
+  else
+    err = refill (ref_samples, max_size, &eof);
   if (err)
     {
       m_state = State::ERROR;
@@ -158,12 +294,66 @@ WavChunkLoader::load_next_chunk()
       else
         m_state = State::DONE;
     }
-
   return Error::Code::NONE;
 }
 
+/*
+ * number of samples of the current chunk that will be kept as overlap for the
+ * next chunk, and maximum size of the next chunk
+ */
 void
-WavChunkLoader::update_capacity (vector<float>& samples, size_t need_space, size_t max_size)
+WavChunkLoader::next_chunk_size (size_t& n_keep_samples, size_t& max_size)
+{
+  const size_t n_samples = m_wav_data.n_values();
+
+  /* overlap samples with last block (in live mode, the first chunks can be smaller than the overlap) */
+  n_keep_samples = n_samples ? m_n_overlap_samples : 0;
+  if (Params::get_live)
+    n_keep_samples = std::min (n_keep_samples, n_samples);
+
+  /* live mode: read at most one block of new samples per chunk, for low latency */
+  max_size = m_wav_data_max_size;
+  if (Params::get_live)
+    max_size = std::min (max_size, n_keep_samples + m_n_stream_samples);
+}
+
+/* start reading the new samples of the next chunk in a background thread */
+void
+WavChunkLoader::start_prefetch()
+{
+  assert (!m_prefetch_thread.joinable());
+
+  size_t n_keep_samples, max_size;
+  next_chunk_size (n_keep_samples, max_size);
+
+  m_prefetch_samples.clear();
+  m_prefetch_compact_samples.clear();
+  m_prefetch_eof = false;
+  m_prefetch_thread = std::thread ([this, n_new_samples = max_size - n_keep_samples]()
+    {
+      Profile::Span span ("chunk_prefetch");
+      if (m_wav_data.is_compact())
+        m_prefetch_error = refill (m_prefetch_compact_samples, n_new_samples, &m_prefetch_eof);
+      else
+        m_prefetch_error = refill (m_prefetch_samples, n_new_samples, &m_prefetch_eof);
+    });
+}
+
+/* wait for the prefetch thread and append the samples it has read */
+template<class Sample> Error
+WavChunkLoader::finish_prefetch (vector<Sample>& samples, vector<Sample>& prefetch_samples, bool *eof)
+{
+  m_prefetch_thread.join();
+
+  update_capacity (samples, samples.size() + prefetch_samples.size(), m_wav_data_max_size);
+  samples.insert (samples.end(), prefetch_samples.begin(), prefetch_samples.end());
+
+  *eof = m_prefetch_eof;
+  return m_prefetch_error;
+}
+
+template<class Sample> void
+WavChunkLoader::update_capacity (vector<Sample>& samples, size_t need_space, size_t max_size)
 {
   assert (need_space <= max_size);
 
@@ -196,16 +386,17 @@ WavChunkLoader::refill (std::vector<float>& samples, size_t max_size, bool *eof)
   constexpr size_t block_size = 4096;
 
   vector<float> buffer;
-  while (samples.size() < max_size)
+  while (samples.size() < max_size && !m_prefetch_cancel)
     {
       if (m_resampler)
         {
           if (m_resampler->can_read_frames() < block_size && !m_resampler_in_eof)
             {
-              Error err = m_in_stream->read_frames (buffer, block_size * double (m_in_stream->sample_rate()) / m_wav_data.sample_rate());
+              Error err = read_input (buffer, block_size * double (m_in_stream->sample_rate()) / m_wav_data.sample_rate());
               if (err)
                 return err;
 
+              Profile::Timer timer (Profile::Stage::RESAMPLE);
               m_resampler->write_frames (buffer);
               if (!buffer.size())
                 {
@@ -215,13 +406,38 @@ WavChunkLoader::refill (std::vector<float>& samples, size_t max_size, bool *eof)
                 }
             }
 
+          Profile::Timer timer (Profile::Stage::RESAMPLE);
           buffer = m_resampler->read_frames (std::min<size_t> (m_resampler->can_read_frames(), (max_size - samples.size()) / m_wav_data.n_channels()));
         }
       else
         {
-          Error err = m_in_stream->read_frames (buffer, std::min<size_t> (block_size, (max_size - samples.size()) / m_wav_data.n_channels()));
+          /* read directly into samples, without a temporary buffer */
+          const size_t old_size = samples.size();
+          const size_t n_frames = std::min<size_t> ({ block_size, (max_size - old_size) / m_wav_data.n_channels(), m_range_frames_left });
+
+          update_capacity (samples, old_size + n_frames * m_wav_data.n_channels(), max_size);
+          samples.resize (old_size + n_frames * m_wav_data.n_channels());
+
+          size_t frames_read = 0;
+          Error err;
+          {
+            Profile::Timer timer (Profile::Stage::INPUT);
+            err = m_in_stream->read_frames (samples.data() + old_size, n_frames, frames_read);
+          }
+          Profile::count (Profile::Counter::BYTES_READ, frames_read * m_wav_data.n_channels() * m_in_stream->bit_depth() / 8);
+          samples.resize (old_size + frames_read * m_wav_data.n_channels());
           if (err)
             return err;
+
+          if (!frames_read)
+            {
+              /* reached eof (or end of range) */
+              *eof = true;
+              return Error::Code::NONE;
+            }
+          m_n_total_samples += frames_read * m_wav_data.n_channels();
+          m_range_frames_left -= frames_read;
+          continue;
         }
 
       if (!buffer.size())
@@ -238,18 +454,65 @@ WavChunkLoader::refill (std::vector<float>& samples, size_t max_size, bool *eof)
   return Error::Code::NONE;
 }
 
+/* like refill() above, but for compact storage: the samples are read as floats in blocks and converted */
+Error
+WavChunkLoader::refill (vector<int16_t>& samples, size_t max_size, bool *eof)
+{
+  *eof = false;
+
+  const size_t block_values = 65536 * m_wav_data.n_channels();
+
+  vector<float> buffer;
+  while (samples.size() < max_size && !*eof && !m_prefetch_cancel)
+    {
+      buffer.clear();
+      Error err = refill (buffer, std::min (block_values, max_size - samples.size()), eof);
+      if (err)
+        return err;
+
+      update_capacity (samples, samples.size() + buffer.size(), max_size);
+      for (auto value : buffer)
+        samples.push_back (WavData::to_compact (value));
+    }
+  return Error::Code::NONE;
+}
+
+Error
+WavChunkLoader::read_input (vector<float>& buffer, size_t n_frames)
+{
+  Profile::Timer timer (Profile::Stage::INPUT);
+
+  n_frames = std::min (n_frames, m_range_frames_left);
+  if (!n_frames)
+    {
+      /* end of range */
+      buffer.clear();
+      return Error::Code::NONE;
+    }
+  Error err = m_in_stream->read_frames (buffer, n_frames);
+  Profile::count (Profile::Counter::BYTES_READ, buffer.size() * m_in_stream->bit_depth() / 8);
+  m_range_frames_left -= buffer.size() / m_in_stream->n_channels();
+  return err;
+}
+
 bool
 WavChunkLoader::done()
 {
   return m_state == State::DONE;
 }
 
+bool
+WavChunkLoader::last_chunk()
+{
+  return m_state == State::LAST_CHUNK;
+}
+
 double
 WavChunkLoader::length()
 {
   assert (m_state == State::DONE);
 
-  return m_n_total_samples / double (m_wav_data.sample_rate() * m_wav_data.n_channels());
+  return m_range_start + m_n_total_samples / double (m_wav_data.sample_rate() * m_wav_data.n_channels());
 }
 
 const WavData&
@@ -263,3 +526,9 @@ WavChunkLoader::time_offset()
 {
   return m_time_offset;
 }
+
+size_t
+WavChunkLoader::frame_offset()
+{
+  return m_frame_offset;
+}
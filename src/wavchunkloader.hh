@@ -19,6 +19,8 @@
 #define AUDIOWMARK_WAV_CHUNK_LOADER_HH
 
 #include <string>
+#include <thread>
+#include <atomic>
 
 #include "utils.hh"
 #include "wavdata.hh"
@@ -28,13 +30,17 @@ class WavChunkLoader
 {
   std::string                       m_filename;
   double                            m_time_offset = 0;
+  size_t                            m_frame_offset = 0;
   std::unique_ptr<AudioInputStream> m_in_stream;
   std::unique_ptr<ResamplerImpl>    m_resampler;
   bool                              m_resampler_in_eof = false;
   WavData                           m_wav_data;
   size_t                            m_wav_data_max_size = 0;
   size_t                            m_n_overlap_samples = 0;
+  size_t                            m_n_stream_samples = 0;
   size_t                            m_n_total_samples = 0;
+  double                            m_range_start = 0;             // get --range: time of the first frame
+  size_t                            m_range_frames_left = ~size_t (0); // get --range: input frames left to read
 
   enum class State
   {
@@ -46,16 +52,38 @@ class WavChunkLoader
   };
   State                             m_state = State::NEW;
 
+  /* prefetch: new samples of the next chunk, read by a background thread */
+  std::thread                       m_prefetch_thread;
+  std::vector<float>                m_prefetch_samples;
+  std::vector<int16_t>              m_prefetch_compact_samples;
+  Error                             m_prefetch_error;
+  bool                              m_prefetch_eof = false;
+  std::atomic<bool>                 m_prefetch_cancel { false };
+
   Error           open();
-  void            update_capacity (std::vector<float>& samples, size_t need_space, size_t max_size);
+  void            next_chunk_size (size_t& n_keep_samples, size_t& max_size);
+  void            start_prefetch();
+  template<class Sample>
+  Error           load_samples (std::vector<Sample>& samples, std::vector<Sample>& prefetch_samples);
+  template<class Sample>
+  Error           finish_prefetch (std::vector<Sample>& samples, std::vector<Sample>& prefetch_samples, bool *eof);
+  template<class Sample>
+  void            update_capacity (std::vector<Sample>& samples, size_t need_space, size_t max_size);
   Error           refill (std::vector<float>& samples, size_t max_size, bool *eof);
+  Error           refill (std::vector<int16_t>& samples, size_t max_size, bool *eof);
+  Error           read_input (std::vector<float>& buffer, size_t n_frames);
 public:
   WavChunkLoader (const std::string& filename);
+  WavChunkLoader (std::unique_ptr<AudioInputStream> in_stream);
+  ~WavChunkLoader();
 
   Error           load_next_chunk();
+  void            cancel_prefetch();
   bool            done();
+  bool            last_chunk();
   const WavData&  wav_data();
   double          time_offset();
+  size_t          frame_offset();
   double          length();
 };
 
@@ -22,8 +22,10 @@
 #include "sfoutputstream.hh"
 #include "mp3inputstream.hh"
 
+#include <algorithm>
 #include <memory>
 #include <math.h>
+#include <assert.h>
 
 using std::string;
 using std::vector;
@@ -60,20 +62,27 @@ WavData::load (AudioInputStream *in_stream)
   if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
     m_samples.reserve (in_stream->n_frames() * in_stream->n_channels());
 
-  vector<float> m_buffer;
+  /* read directly into m_samples, without a temporary buffer */
+  const int    n_channels = in_stream->n_channels();
+  const size_t block_frames = 16384;
+  size_t       n_frames = 0;
   while (true)
     {
-      Error err = in_stream->read_frames (m_buffer, 1024);
+      m_samples.resize ((n_frames + block_frames) * n_channels);
+
+      size_t frames_read = 0;
+      Error err = in_stream->read_frames (m_samples.data() + n_frames * n_channels, block_frames, frames_read);
       if (err)
         return err;
 
-      if (!m_buffer.size())
+      if (!frames_read)
         {
           /* reached eof */
           break;
         }
-      m_samples.insert (m_samples.end(), m_buffer.begin(), m_buffer.end());
+      n_frames += frames_read;
     }
+  m_samples.resize (n_frames * n_channels);
   m_sample_rate = in_stream->sample_rate();
   m_n_channels  = in_stream->n_channels();
   m_bit_depth   = in_stream->bit_depth();
@@ -84,6 +93,8 @@ WavData::load (AudioInputStream *in_stream)
 Error
 WavData::save (const string& filename) const
 {
+  assert (!m_compact);
+
   std::unique_ptr<AudioOutputStream> out_stream;
   Error err;
 
@@ -114,5 +125,100 @@ WavData::bit_depth() const
 void
 WavData::set_samples (const vector<float>& samples)
 {
+  assert (!m_compact);
+
   m_samples = samples;
 }
+
+/* switch to compact storage (this can't be undone), samples outside [-2, 2) are clipped */
+void
+WavData::compact()
+{
+  if (m_compact)
+    return;
+
+  m_compact_samples.resize (m_samples.size());
+  for (size_t i = 0; i < m_samples.size(); i++)
+    m_compact_samples[i] = to_compact (m_samples[i]);
+
+  m_samples = vector<float>(); // free memory
+  m_compact = true;
+}
+
+WavView::WavView (const WavData& wav_data) :
+  m_wav_data (&wav_data)
+{
+}
+
+WavView::WavView (const WavData& wav_data, size_t pad_start, size_t data_first, size_t data_frames, size_t pad_end) :
+  m_wav_data (&wav_data),
+  m_padded (true),
+  m_pad_start (pad_start),
+  m_data_first (data_first),
+  m_data_frames (data_frames),
+  m_pad_end (pad_end)
+{
+  assert (data_first + data_frames <= wav_data.n_frames());
+}
+
+/*
+ * interleaved samples of the frames [start, start + count)
+ *
+ * if the range contains no padding, this returns a pointer into the samples
+ * of the WavData, otherwise the samples are copied into scratch (which needs
+ * space for count * n_channels() values) and the padding is filled with zeros;
+ * compact samples are always converted into scratch
+ */
+const float *
+WavView::frames (size_t start, size_t count, float *scratch) const
+{
+  const int n_channels = m_wav_data->n_channels();
+
+  if (m_wav_data->is_compact())
+    {
+      /* convert the part of the range which overlaps with the data, zeros elsewhere */
+      const size_t first = std::min (std::max (start, data_start()), data_end());
+      const size_t last  = std::min (std::max (start + count, data_start()), data_end());
+      const vector<int16_t>& compact_samples = m_wav_data->compact_samples();
+
+      std::fill (scratch, scratch + count * n_channels, 0);
+      for (size_t i = first * n_channels; i < last * n_channels; i++)
+        scratch[i - start * n_channels] = compact_samples[i + (m_data_first - m_pad_start) * n_channels] * WavData::compact_scale;
+      return scratch;
+    }
+
+  const float *samples = m_wav_data->samples().data();
+
+  if (!m_padded)
+    return samples + start * n_channels;
+
+  const size_t data_end = m_pad_start + m_data_frames;
+  if (start >= m_pad_start && start + count <= data_end)
+    return samples + (start - m_pad_start + m_data_first) * n_channels;
+
+  /* copy the part of the range which overlaps with the data, zeros elsewhere */
+  const size_t first = std::min (std::max (start, m_pad_start), data_end);
+  const size_t last  = std::min (std::max (start + count, m_pad_start), data_end);
+
+  std::fill (scratch, scratch + count * n_channels, 0);
+  if (first < last)
+    std::copy (samples + (first - m_pad_start + m_data_first) * n_channels,
+               samples + (last - m_pad_start + m_data_first) * n_channels,
+               scratch + (first - start) * n_channels);
+  return scratch;
+}
+
+/*
+ * compact samples of the frames [start, start + count) without conversion
+ *
+ * returns nullptr if the WavData doesn't use compact storage or if the range
+ * contains padding, frames() can be used in this case
+ */
+const int16_t *
+WavView::compact_frames (size_t start, size_t count) const
+{
+  if (!m_wav_data->is_compact() || start < data_start() || start + count > data_end())
+    return nullptr;
+
+  return m_wav_data->compact_samples().data() + (start - m_pad_start + m_data_first) * n_channels();
+}
@@ -18,20 +18,35 @@
 #ifndef AUDIOWMARK_WAV_DATA_HH
 #define AUDIOWMARK_WAV_DATA_HH
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include <math.h>
+
 #include "utils.hh"
 #include "audiostream.hh"
 
+/*
+ * The samples of a WavData are normally stored as floats. For detection, a
+ * WavData can also use compact storage (see compact()): the samples are then
+ * stored as 16 bit values, with 6 dB headroom above full scale, which uses
+ * half of the memory. The samples of a compact WavData can only be accessed
+ * through a WavView (or compact_samples()), samples() is empty.
+ */
 class WavData
 {
-  std::vector<float> m_samples;
-  int                m_sample_rate = 0;
-  int                m_n_channels  = 0;
-  int                m_bit_depth   = 0;
+  std::vector<float>   m_samples;
+  std::vector<int16_t> m_compact_samples;
+  bool                 m_compact     = false;
+  int                  m_sample_rate = 0;
+  int                  m_n_channels  = 0;
+  int                  m_bit_depth   = 0;
 
 public:
+  /* compact storage: sample value = compact value * compact_scale */
+  static constexpr float compact_scale = 1.0f / 16384;
+
   WavData();
   WavData (const std::vector<float>& samples, int n_channels, int sample_rate, int bit_depth);
 
@@ -50,12 +65,12 @@ public:
   size_t
   n_values() const
   {
-    return m_samples.size();
+    return m_compact ? m_compact_samples.size() : m_samples.size();
   }
   size_t
   n_frames() const
   {
-    return m_samples.size() / m_n_channels;
+    return n_values() / m_n_channels;
   }
   const std::vector<float>&
   samples() const
@@ -71,6 +86,115 @@ public:
     /* allow direct access to samples vector to optimize for performance and low memory usage */
     return m_samples;
   }
+
+  void compact();
+
+  bool
+  is_compact() const
+  {
+    return m_compact;
+  }
+  const std::vector<int16_t>&
+  compact_samples() const
+  {
+    return m_compact_samples;
+  }
+  std::vector<int16_t>&
+  mutable_compact_samples()
+  {
+    return m_compact_samples;
+  }
+  static int16_t
+  to_compact (float sample)
+  {
+    const int value = lrintf (sample * (1 / compact_scale));
+    return std::max (std::min (value, 32767), -32768);
+  }
+};
+
+/*
+ * A WavView is a read-only view of a range of the samples of a WavData, with
+ * virtual zero padding before and after the range. The ClipDecoder uses this
+ * to analyze short clips as if they were part of a longer input, without
+ * copying the samples or storing the zeros.
+ *
+ * Positions are sample frames (one value per channel) relative to the start
+ * of the view, so frame pad_start of the view is frame data_first of the
+ * WavData. A view of a whole WavData (without padding) always refers to the
+ * current samples of the WavData, even if they are replaced later.
+ */
+class WavView
+{
+  const WavData *m_wav_data = nullptr;
+  bool           m_padded = false;
+  size_t         m_pad_start = 0;
+  size_t         m_data_first = 0;
+  size_t         m_data_frames = 0;
+  size_t         m_pad_end = 0;
+
+public:
+  WavView (const WavData& wav_data);
+  WavView (const WavData& wav_data, size_t pad_start, size_t data_first, size_t data_frames, size_t pad_end);
+
+  int
+  n_channels() const
+  {
+    return m_wav_data->n_channels();
+  }
+  int
+  sample_rate() const
+  {
+    return m_wav_data->sample_rate();
+  }
+  size_t
+  n_frames() const
+  {
+    return m_padded ? m_pad_start + m_data_frames + m_pad_end : m_wav_data->n_frames();
+  }
+  size_t
+  n_values() const
+  {
+    return m_padded ? n_frames() * n_channels() : m_wav_data->n_values();
+  }
+  bool
+  padded() const
+  {
+    return m_padded;
+  }
+  /* frames() always needs scratch space for padded or compact data */
+  bool
+  need_scratch() const
+  {
+    return m_padded || m_wav_data->is_compact();
+  }
+  /* range of frames of the view which are not padding: [data_start(), data_end()) */
+  size_t
+  data_start() const
+  {
+    return m_pad_start;
+  }
+  size_t
+  data_end() const
+  {
+    return m_padded ? m_pad_start + m_data_frames : m_wav_data->n_frames();
+  }
+  /* value i of the interleaved samples, like WavData::samples()[i] */
+  float
+  value (size_t i) const
+  {
+    if (m_padded)
+      {
+        const size_t frame = i / n_channels();
+        if (frame < m_pad_start || frame >= m_pad_start + m_data_frames)
+          return 0;
+        i += (m_data_first - m_pad_start) * n_channels();
+      }
+    if (m_wav_data->is_compact())
+      return m_wav_data->compact_samples()[i] * WavData::compact_scale;
+    return m_wav_data->samples()[i];
+  }
+  const float   *frames (size_t start, size_t count, float *scratch) const;
+  const int16_t *compact_frames (size_t start, size_t count) const;
 };
 
 #endif /* AUDIOWMARK_WAV_DATA_HH */
@@ -58,12 +58,16 @@ header_get_u32 (unsigned char *bytes)
 }
 
 Error
-WavPipeInputStream::read_error (const std::string& message)
+WavPipeInputStream::read_header (unsigned char *dest, size_t n_bytes, const std::string& message)
 {
-  if (ferror (m_input_file))
-    return Error (string_printf ("wav input read error: %s", strerror (errno)));
-  else
+  size_t bytes_read;
+  Error err = m_input.read (dest, n_bytes, bytes_read);
+  if (err)
+    return Error (string_printf ("wav input read error: %s", err.message()));
+  if (bytes_read != n_bytes)
     return Error (message);
+
+  return Error::Code::NONE;
 }
 
 Error
@@ -75,40 +79,35 @@ WavPipeInputStream::open (const string& filename)
   if (err)
     return err;
 
-  if (filename == "-")
-    {
-      m_input_file = stdin;
-      m_close_file = false;
-    }
-  else
-    {
-      m_input_file = fopen (filename.c_str(), "r");
-      if (!m_input_file)
-        return Error (strerror (errno));
+  err = m_input.open (filename);
+  if (err)
+    return err;
 
-      m_close_file = true;
-    }
   RawFormat format;
   unsigned char riff_buffer[12];
-  bool riff_ok = fread (riff_buffer, sizeof (riff_buffer), 1, m_input_file);
-  if (!riff_ok || (header_get_4cc (riff_buffer) != "RIFF" && header_get_4cc (riff_buffer) != "RF64") ||
+  err = read_header (riff_buffer, sizeof (riff_buffer), "input file is not a valid wav file");
+  if (err)
+    return err;
+  if ((header_get_4cc (riff_buffer) != "RIFF" && header_get_4cc (riff_buffer) != "RF64") ||
       header_get_4cc (riff_buffer + 8) != "WAVE")
-    return read_error ("input file is not a valid wav file");
+    return Error ("input file is not a valid wav file");
 
   bool in_data_chunk = false;
   bool have_fmt_chunk = false;
   do
     {
       unsigned char chunk[8];
-      if (!fread (chunk, sizeof (chunk), 1, m_input_file))
-        return read_error ("wav input is incomplete (no data chunk found)");
+      err = read_header (chunk, sizeof (chunk), "wav input is incomplete (no data chunk found)");
+      if (err)
+        return err;
 
       uint32_t chunk_size = header_get_u32 (chunk + 4);
       if (header_get_4cc (chunk) == "fmt " && chunk_size >= 16 && chunk_size <= 64 * 1024 && !have_fmt_chunk)
         {
           vector<unsigned char> buffer (chunk_size);
-          if (!fread (buffer.data(), buffer.size(), 1, m_input_file))
-            return read_error ("wav input is incomplete (error reading fmt chunk)");
+          err = read_header (buffer.data(), buffer.size(), "wav input is incomplete (error reading fmt chunk)");
+          if (err)
+            return err;
 
           int format_type = header_get_u16 (&buffer[0]);
           if (format_type == 3) // float encoding
@@ -149,12 +148,13 @@ WavPipeInputStream::open (const string& filename)
         }
       else // skip unknown chunk
         {
-          char junk[1024];
+          unsigned char junk[1024];
           while (chunk_size)
             {
               uint32_t todo = min<uint32_t> (chunk_size, sizeof (junk));
-              if (!fread (junk, todo, 1, m_input_file))
-                return read_error ("wav input is incomplete (error skipping unknown chunk)");
+              err = read_header (junk, todo, "wav input is incomplete (error skipping unknown chunk)");
+              if (err)
+                return err;
               chunk_size -= todo;
             }
         }
@@ -205,32 +205,24 @@ WavPipeInputStream::encoding() const
 Error
 WavPipeInputStream::read_frames (vector<float>& samples, size_t count)
 {
-  assert (m_state == State::OPEN);
+  size_t frames_read = 0;
 
-  const size_t block_size = 8192;
-  const int n_channels   = m_format.n_channels();
-  const int sample_width = m_format.bit_depth() / 8;
+  samples.resize (count * m_format.n_channels());
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * m_format.n_channels());
 
-  m_input_bytes.resize (block_size * n_channels * sample_width);
-  size_t pos = 0;
-
-  while (size_t todo = min (count, block_size))
-    {
-      size_t r_count = fread (m_input_bytes.data(), n_channels * sample_width, todo, m_input_file);
-      if (ferror (m_input_file))
-        return Error (string_printf ("error reading wav input sample data: %s", strerror (errno)));
-
-      if (!r_count)
-        break;
+  return err;
+}
 
-      samples.resize (max (samples.size(), (pos + r_count) * n_channels));
+Error
+WavPipeInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  assert (m_state == State::OPEN);
 
-      m_raw_converter->from_raw (m_input_bytes.data(), samples.data() + pos * n_channels, r_count * n_channels);
+  Error err = m_input.read_frames (*m_raw_converter, m_format.n_channels(), m_format.bit_depth() / 8, samples, count, frames_read);
+  if (err)
+    return Error (string_printf ("error reading wav input sample data: %s", err.message()));
 
-      pos += r_count;
-      count -= r_count;
-    }
-  samples.resize (pos * n_channels);
   return Error::Code::NONE;
 }
 
@@ -239,13 +231,7 @@ WavPipeInputStream::close()
 {
   if (m_state == State::OPEN)
     {
-      if (m_close_file && m_input_file)
-        {
-          fclose (m_input_file);
-          m_input_file = nullptr;
-          m_close_file = false;
-        }
-
+      m_input.close();
       m_state = State::CLOSED;
     }
 }
@@ -35,19 +35,18 @@ class WavPipeInputStream : public AudioInputStream
   };
   State       m_state = State::NEW;
   RawFormat   m_format;
-  FILE       *m_input_file = nullptr;
-  bool        m_close_file = false;
+  InputBuffer m_input;
 
-  std::vector<unsigned char>    m_input_bytes;
   std::unique_ptr<RawConverter> m_raw_converter;
 
-  Error read_error (const std::string& message);
+  Error read_header (unsigned char *dest, size_t n_bytes, const std::string& message);
 
 public:
   ~WavPipeInputStream();
 
   Error   open (const std::string& filename);
   Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
   void    close();
 
   int     bit_depth() const override;
@@ -16,6 +16,11 @@
  */
 
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <deque>
 
 #include <zita-resampler/resampler.h>
 #include <zita-resampler/vresampler.h>
@@ -30,9 +35,12 @@
 #include "rawinputstream.hh"
 #include "rawoutputstream.hh"
 #include "stdoutwavoutputstream.hh"
+#include "asyncoutputstream.hh"
 #include "shortcode.hh"
 #include "audiobuffer.hh"
 #include "resample.hh"
+#include "keytables.hh"
+#include "threadpool.hh"
 
 using std::string;
 using std::vector;
@@ -47,10 +55,8 @@ enum class FrameMod : uint8_t {
 };
 
 static void
-prepare_frame_mod (UpDownGen& up_down_gen, int f, vector<FrameMod>& frame_mod, int data_bit)
+prepare_frame_mod (const UpDownArray& up, const UpDownArray& down, vector<FrameMod>& frame_mod, int data_bit)
 {
-  UpDownArray up, down;
-  up_down_gen.get (f, up, down);
   for (auto u : up)
     frame_mod[u] = data_bit ? FrameMod::UP : FrameMod::DOWN;
 
@@ -58,9 +64,16 @@ prepare_frame_mod (UpDownGen& up_down_gen, int f, vector<FrameMod>& frame_mod, i
     frame_mod[d] = data_bit ? FrameMod::DOWN : FrameMod::UP;
 }
 
-static void
-apply_frame_mod (const vector<FrameMod>& frame_mod, const vector<complex<float>>& fft_out, vector<complex<float>>& fft_delta_spect)
+/*
+ * apply frame_mod to n_spectra spectra (for instance one per channel), stored one after another
+ *
+ * N_SPECTRA != 0 fixes the number of spectra at compile time (see apply_frame_mod)
+ */
+template<int N_SPECTRA> static void
+apply_frame_mod_n (const vector<FrameMod>& frame_mod, const complex<float> *fft_out, complex<float> *fft_delta_spect, int runtime_n_spectra)
 {
+  const int     n_spectra = N_SPECTRA ? N_SPECTRA : runtime_n_spectra;
+  const size_t  n_bins = Params::frame_size / 2 + 1;
   const float   min_mag = 1e-7;   // avoid computing pow (0.0, -water_delta) which would be inf
   for (size_t i = 0; i < frame_mod.size(); i++)
     {
@@ -73,16 +86,32 @@ apply_frame_mod (const vector<FrameMod>& frame_mod, const vector<complex<float>>
        *
        * this actually increases the amount of energy because mag is less than 1.0
        */
-      const float mag = abs (fft_out[i]);
-      if (mag > min_mag)
+      const float exponent = -Params::water_delta * data_bit_sign;
+      for (int s = 0; s < n_spectra; s++)
         {
-          const float mag_factor = powf (mag, -Params::water_delta * data_bit_sign);
+          const complex<float> value = fft_out[s * n_bins + i];
+          const float mag = abs (value);
+          if (mag > min_mag)
+            {
+              const float mag_factor = powf (mag, exponent);
 
-          fft_delta_spect[i] = fft_out[i] * (mag_factor - 1);
+              fft_delta_spect[s * n_bins + i] = value * (mag_factor - 1);
+            }
         }
     }
 }
 
+static void
+apply_frame_mod (const vector<FrameMod>& frame_mod, const complex<float> *fft_out, complex<float> *fft_delta_spect, int n_spectra = 1)
+{
+  if (n_spectra == 1)
+    apply_frame_mod_n<1> (frame_mod, fft_out, fft_delta_spect, n_spectra);
+  else if (n_spectra == 2)
+    apply_frame_mod_n<2> (frame_mod, fft_out, fft_delta_spect, n_spectra);
+  else
+    apply_frame_mod_n<0> (frame_mod, fft_out, fft_delta_spect, n_spectra);
+}
+
 static void
 mark_data (const Key& key, vector<vector<FrameMod>>& frame_mod, const vector<int>& bitvec)
 {
@@ -90,10 +119,11 @@ mark_data (const Key& key, vector<vector<FrameMod>>& frame_mod, const vector<int
   assert (frame_mod.size() >= mark_data_frame_count());
 
   const int frame_count = mark_data_frame_count();
+  const KeyTables& key_tables = KeyTables::get (key);
 
   if (Params::mix)
     {
-      vector<MixEntry> mix_entries = gen_mix_entries (key);
+      const vector<MixEntry>& mix_entries = key_tables.mix_entries();
 
       for (int f = 0; f < frame_count; f++)
         {
@@ -114,14 +144,11 @@ mark_data (const Key& key, vector<vector<FrameMod>>& frame_mod, const vector<int
     }
   else
     {
-      UpDownGen up_down_gen (key, Random::Stream::data_up_down);
-      BitPosGen bit_pos_gen (key);
-
       for (int f = 0; f < frame_count; f++)
         {
-          size_t index = bit_pos_gen.data_frame (f);
+          size_t index = key_tables.data_frame (f);
 
-          prepare_frame_mod (up_down_gen, f, frame_mod[index], bitvec[f / Params::frames_per_bit]);
+          prepare_frame_mod (key_tables.data_up (f), key_tables.data_down (f), frame_mod[index], bitvec[f / Params::frames_per_bit]);
         }
     }
 }
@@ -132,16 +159,15 @@ mark_sync (const Key& key, vector<vector<FrameMod>>& frame_mod, int ab)
   const int frame_count = mark_sync_frame_count();
   assert (frame_mod.size() >= mark_sync_frame_count());
 
-  UpDownGen up_down_gen (key, Random::Stream::sync_up_down);
-  BitPosGen bit_pos_gen (key);
+  const KeyTables& key_tables = KeyTables::get (key);
 
   // sync block always written in linear order (no mix)
   for (int f = 0; f < frame_count; f++)
     {
-      size_t index = bit_pos_gen.sync_frame (f);
+      size_t index = key_tables.sync_frame (f);
       int    data_bit = (f / Params::sync_frames_per_bit + ab) & 1; /* write 010101 for a block, 101010 for b block */
 
-      prepare_frame_mod (up_down_gen, f, frame_mod[index], data_bit);
+      prepare_frame_mod (key_tables.sync_up (f), key_tables.sync_down (f), frame_mod[index], data_bit);
     }
 }
 
@@ -161,59 +187,165 @@ init_frame_mod_vec (const Key& key, vector<vector<FrameMod>>& frame_mod_vec, int
   mark_data (key, frame_mod_vec, bitvec_fec);
 }
 
-/* synthesizes a watermark stream (overlap add with synthesis window)
+/* the channels that get a watermark (add --mark-channels and --mark-downmix)
  *
- * input:  per-channel fft delta values (always one frame)
- * output: samples
+ * the watermark is generated for n_mark() mark channels, which are computed
+ * from the input by project(): either the selected channels, or with downmix a
+ * single channel containing the mean of the selected channels; expand() maps
+ * the watermark signal back, with downmix each selected channel gets the same
+ * (coherent) watermark signal
+ *
+ * since analysis, synthesis and resampling are done for the mark channels only,
+ * embedding a subset or a downmix of a many channel input is a lot faster
  */
-class WatermarkSynth
+class MarkChannels
 {
-  const int     n_channels = 0;
-  vector<float> window;
-  vector<float> synth_samples;
-  bool          first_frame = true;
-  FFTProcessor  fft_processor;
-
-  void
-  generate_window()
+  const int   n_channels = 0;
+  vector<int> selected;
+  const bool  downmix = false;
+public:
+  MarkChannels (int n_channels) :
+    n_channels (n_channels),
+    selected (Params::mark_channels),
+    downmix (Params::mark_downmix)
   {
-    window.resize (Params::frame_size * 3);
-    for (size_t i = 0; i < window.size(); i++)
+    if (selected.empty())
       {
-        const double overlap = 0.1;
-
-        // triangular basic window
-        double tri;
-        double norm_pos = (double (i) - Params::frame_size) / Params::frame_size;
+        for (int ch = 0; ch < n_channels; ch++)
+          selected.push_back (ch);
+      }
+  }
+  static Error
+  check (int n_channels)
+  {
+    for (auto ch : Params::mark_channels)
+      {
+        if (ch >= n_channels)
+          return Error (string_printf ("can not watermark channel %d, input has %d channels", ch, n_channels));
+      }
+    return Error::Code::NONE;
+  }
+  int
+  n_mark() const
+  {
+    return downmix ? 1 : selected.size();
+  }
+  /* true if the mark channels are the input channels (project() and expand() are not needed) */
+  bool
+  identity() const
+  {
+    return !downmix && int (selected.size()) == n_channels;
+  }
+  void
+  project (const vector<float>& samples, vector<float>& mark_samples) const
+  {
+    const size_t n_frames = samples.size() / n_channels;
+    const int    n_selected = selected.size();
 
-        if (norm_pos > 0.5) /* symmetric window */
-          norm_pos = 1 - norm_pos;
-        if (norm_pos < -overlap)
-          {
-            tri = 0;
-          }
-        else if (norm_pos < overlap)
+    mark_samples.resize (n_frames * n_mark());
+    for (size_t f = 0; f < n_frames; f++)
+      {
+        const float *in = &samples[f * n_channels];
+        if (downmix)
           {
-            tri = 0.5 + norm_pos / (2 * overlap);
+            float sum = 0;
+            for (auto ch : selected)
+              sum += in[ch];
+            mark_samples[f] = sum / n_selected;
           }
         else
           {
-            tri = 1;
+            for (int i = 0; i < n_selected; i++)
+              mark_samples[f * n_selected + i] = in[selected[i]];
           }
-        // cosine
-        window[i] = (cos (tri*M_PI+M_PI)+1) * 0.5;
       }
   }
+  void
+  expand (const vector<float>& mark_samples, vector<float>& samples) const
+  {
+    const size_t n_frames = mark_samples.size() / n_mark();
+    const int    n_selected = selected.size();
+
+    samples.assign (n_frames * n_channels, 0);
+    for (size_t f = 0; f < n_frames; f++)
+      {
+        float *out = &samples[f * n_channels];
+        for (int i = 0; i < n_selected; i++)
+          out[selected[i]] = downmix ? mark_samples[f] : mark_samples[f * n_selected + i];
+      }
+  }
+};
+
+/* synthesis window for three frames of frame_size samples: the frame itself with short fades to the previous and next frame */
+static vector<float>
+gen_synth_window (size_t frame_size)
+{
+  vector<float> window (frame_size * 3);
+  for (size_t i = 0; i < window.size(); i++)
+    {
+      const double overlap = 0.1;
+
+      // triangular basic window
+      double tri;
+      double norm_pos = (double (i) - frame_size) / frame_size;
+
+      if (norm_pos > 0.5) /* symmetric window */
+        norm_pos = 1 - norm_pos;
+      if (norm_pos < -overlap)
+        {
+          tri = 0;
+        }
+      else if (norm_pos < overlap)
+        {
+          tri = 0.5 + norm_pos / (2 * overlap);
+        }
+      else
+        {
+          tri = 1;
+        }
+      // cosine
+      window[i] = (cos (tri*M_PI+M_PI)+1) * 0.5;
+    }
+  return window;
+}
+
+/* synthesizes a watermark stream (overlap add with synthesis window)
+ *
+ * input:  per-channel fft delta values (always one frame)
+ * output: samples
+ */
+class WatermarkSynth
+{
+  const int           n_channels = 0;
+  vector<float>       window;
+  vector<float>       synth_samples;
+  bool                first_frame = true;
+  FFTBatchProcessor   ifft_batch;
 public:
   WatermarkSynth (int n_channels) :
     n_channels (n_channels),
-    fft_processor (Params::frame_size)
+    window (gen_synth_window (Params::frame_size)),
+    ifft_batch (Params::frame_size, n_channels)
   {
-    generate_window();
     synth_samples.resize (window.size() * n_channels);
   }
-  vector<float>
-  run (const vector<vector<complex<float>>>& fft_delta_spect)
+  /* appends the samples of one frame (if any) to out_samples */
+  void
+  run (const vector<AlignedArray<complex<float>>>& fft_delta_spect, vector<float>& out_samples)
+  {
+    /* one batched ifft for all channels (like WatermarkGen, so the results are identical) */
+    const size_t n_bins = Params::frame_size / 2 + 1;
+    for (int ch = 0; ch < n_channels; ch++)
+      std::copy_n (fft_delta_spect[ch].data(), n_bins, ifft_batch.out() + ch * n_bins);
+    ifft_batch.ifft (n_channels);
+
+    overlap_add (ifft_batch.in(), out_samples);
+  }
+  /* like run(), but with the ifft of the fft delta values already computed
+   * (Params::frame_size values for each channel, channel 0 first)
+   */
+  void
+  overlap_add (const float *fft_delta_out, vector<float>& out_samples)
   {
     const size_t synth_frame_sz = Params::frame_size * n_channels;
     /* move frame 1 and frame 2 to frame 0 and frame 1 */
@@ -223,30 +355,24 @@ public:
     for (int ch = 0; ch < n_channels; ch++)
       {
         /* mix watermark signal to output frame */
-        vector<float> fft_delta_out = fft_processor.ifft (fft_delta_spect[ch]);
-
         for (int dframe = 0; dframe <= 2; dframe++)
           {
             const int wstart = dframe * Params::frame_size;
 
+            const float *delta = fft_delta_out + ch * Params::frame_size;
+
             int pos = dframe * Params::frame_size * n_channels + ch;
             for (size_t x = 0; x < Params::frame_size; x++)
               {
-                synth_samples[pos] += fft_delta_out[x] * window[wstart + x];
+                synth_samples[pos] += delta[x] * window[wstart + x];
                 pos += n_channels;
               }
           }
       }
     if (first_frame)
-      {
-        first_frame = false;
-        return {};
-      }
+      first_frame = false;
     else
-      {
-        vector<float> out_samples (synth_samples.begin(), synth_samples.begin() + Params::frame_size * n_channels);
-        return out_samples;
-      }
+      out_samples.insert (out_samples.end(), synth_samples.begin(), synth_samples.begin() + Params::frame_size * n_channels);
   }
   size_t
   skip (size_t zeros)
@@ -263,68 +389,31 @@ public:
   }
 };
 
-/* generates a watermark signal
+/* frame modifications of one payload for the frames of an A block and a B block
  *
- * input:  original signal samples (always for one complete frame)
- * output: watermark signal (to be mixed to the original sample)
+ * frame_number is counted in frames from the start of an A block
  */
-class WatermarkGen
+class PayloadFrameMod
 {
-  const int                 n_channels = 0;
   const size_t              frames_per_block = 0;
-  size_t                    frame_number = 0;
-  int                       m_data_blocks = 0;
-
-  FFTAnalyzer               fft_analyzer;
-  WatermarkSynth            wm_synth;
-
   vector<int>               bitvec;
   vector<vector<FrameMod>>  frame_mod_vec_a;
   vector<vector<FrameMod>>  frame_mod_vec_b;
 public:
-  WatermarkGen (int n_channels, const vector<int>& bitvec) :
-    n_channels (n_channels),
+  PayloadFrameMod (const vector<int>& bitvec) :
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
-    fft_analyzer (n_channels),
-    wm_synth (n_channels),
     bitvec (bitvec)
   {
-
-    /* start writing a partial B-block as padding */
-    assert (frames_per_block > Params::frames_pad_start);
-    frame_number = 2 * frames_per_block - Params::frames_pad_start;
-  }
-  vector<float>
-  run (const Key& key, const vector<float>& samples)
-  {
-    assert (samples.size() == Params::frame_size * n_channels);
-
-    vector<vector<complex<float>>> fft_out = fft_analyzer.run_fft (samples, 0);
-
-    vector<vector<complex<float>>> fft_delta_spect;
-    for (int ch = 0; ch < n_channels; ch++)
-      fft_delta_spect.push_back (vector<complex<float>> (fft_out.back().size()));
-
-    const vector<FrameMod>& frame_mod = get_frame_mod (key);
-    for (int ch = 0; ch < n_channels; ch++)
-      apply_frame_mod (frame_mod, fft_out[ch], fft_delta_spect[ch]);
-
-    frame_number++;
-    if (frame_number % frames_per_block == 0)
-      m_data_blocks++;
-
-    return wm_synth.run (fft_delta_spect);
   }
-  size_t
-  skip (size_t zeros)
+  /* compute frame modifications now, so that get() can be used from more than one thread */
+  void
+  init (const Key& key)
   {
-    assert (zeros % Params::frame_size == 0);
-
-    frame_number += zeros / Params::frame_size;
-    return wm_synth.skip (zeros);
+    get (key, 0);
+    get (key, frames_per_block);
   }
   const vector<FrameMod>&
-  get_frame_mod (const Key& key)
+  get (const Key& key, size_t frame_number)
   {
     const size_t f = frame_number % (frames_per_block * 2);
     if (f >= frames_per_block) /* B block */
@@ -342,118 +431,648 @@ public:
         return frame_mod_vec_a[f];
       }
   }
-  int
-  data_blocks() const
+};
+
+/* signal to noise ratio of the watermark (add --snr, bench-add) */
+class SNRMeter
+{
+  double delta_power = 0;
+  double signal_power = 0;
+public:
+  void
+  add (const float *orig_samples, const float *wm_samples, size_t n_samples)
   {
-    // first block is padding - a partial B block
-    return max (m_data_blocks - 1, 0);
+    for (size_t i = 0; i < n_samples; i++)
+      {
+        const double orig  = orig_samples[i]; // original sample
+        const double delta = wm_samples[i];   // watermark
+
+        delta_power += delta * delta;
+        signal_power += orig * orig;
+      }
+  }
+  double
+  db() const
+  {
+    return 10 * log10 (signal_power / delta_power);
   }
 };
 
-/* generate a watermark at Params::mark_sample_rate and resample to whatever the original signal has
- *
- * input:  samples from original signal (always one frame)
- * output: watermark signal resampled to original signal sample rate
- */
-class WatermarkResampler
+/* sorted, non overlapping ranges of frames [start, end) */
+class FrameRanges
 {
-  std::unique_ptr<ResamplerImpl> in_resampler;
-  std::unique_ptr<ResamplerImpl> out_resampler;
-  WatermarkGen                   wm_gen;
-  const bool                     need_resampler = false;
+  vector<std::pair<size_t, size_t>> ranges;
 public:
-  WatermarkResampler (int n_channels, int input_rate, const vector<int>& bitvec) :
-    wm_gen (n_channels, bitvec),
-    need_resampler (input_rate != Params::mark_sample_rate)
+  /* ranges can be added in any order, overlapping or adjacent ranges are merged */
+  void
+  add (size_t start, size_t end)
   {
-    if (need_resampler)
+    if (start >= end)
+      return;
+
+    ranges.emplace_back (start, end);
+    std::sort (ranges.begin(), ranges.end());
+
+    vector<std::pair<size_t, size_t>> merged;
+    for (auto r : ranges)
       {
-        in_resampler.reset (ResamplerImpl::create (n_channels, input_rate, Params::mark_sample_rate));
-        out_resampler.reset (ResamplerImpl::create (n_channels, Params::mark_sample_rate, input_rate));
+        if (!merged.empty() && r.first <= merged.back().second)
+          merged.back().second = max (merged.back().second, r.second);
+        else
+          merged.push_back (r);
       }
+    ranges = merged;
   }
   bool
-  init_ok()
+  contains (size_t frame) const
   {
-    if (need_resampler)
-      return (in_resampler && out_resampler);
-    else
-      return true;
+    auto it = std::upper_bound (ranges.begin(), ranges.end(), std::make_pair (frame, ~size_t (0)));
+    return it != ranges.begin() && frame < (it - 1)->second;
   }
-  vector<float>
-  run (const Key& key, const vector<float>& samples)
+  size_t
+  n_frames() const
   {
-    if (!need_resampler)
+    size_t n = 0;
+    for (auto r : ranges)
+      n += r.second - r.first;
+    return n;
+  }
+  const vector<std::pair<size_t, size_t>>&
+  get() const
+  {
+    return ranges;
+  }
+};
+
+/* generates a watermark signal
+ *
+ * input:  original signal samples (one or more complete frames)
+ * output: watermark signal (to be mixed to the original sample)
+ *
+ * the fft analysis and the ifft of the frames is done in parallel, only the
+ * overlap add (which needs the frames in order) is done sequentially
+ */
+class WatermarkGen
+{
+  struct Worker
+  {
+    FFTAnalyzer                  fft_analyzer;
+    FFTBatchProcessor            ifft_batch;
+
+    Worker (int n_channels) :
+      fft_analyzer (n_channels),
+      ifft_batch (Params::frame_size, n_channels)
+    {
+    }
+  };
+  const int                 n_channels = 0;
+  const size_t              frames_per_block = 0;
+  size_t                    frame_number = 0;
+  size_t                    stream_frame = 0;       // frames since the start of the stream
+  int                       m_data_blocks = 0;
+  const FrameRanges        *compute_frames = nullptr;
+
+  ThreadPool&               thread_pool;
+  vector<std::unique_ptr<Worker>> workers;
+  WatermarkSynth            wm_synth;
+  PayloadFrameMod           frame_mod;
+
+  /* ifft of the fft delta values: Params::frame_size values per channel and frame */
+  AlignedArray<float>       fft_delta_out;
+
+  /* all channels of a frame are processed together: one batched fft, one batched ifft */
+  void
+  gen_frame (Worker& worker, const Key& key, const vector<float>& samples, size_t frame)
+  {
+    const size_t frame_values = Params::frame_size * n_channels;
+    if (compute_frames && !compute_frames->contains (stream_frame + frame))
       {
-        /* cheap case: if no resampling is necessary, just generate the watermark signal */
-        return wm_gen.run (key, samples);
+        /* add --reuse: the output near this frame is copied, so its watermark is not needed */
+        std::fill_n (fft_delta_out.data() + frame * frame_values, frame_values, 0);
+        return;
       }
+    const vector<FrameMod>& mod = frame_mod.get (key, frame_number + frame);
+    const size_t n_bins = Params::frame_size / 2 + 1;
+    const size_t start_index = frame * Params::frame_size;
 
-    /* resample to the watermark sample rate */
-    in_resampler->write_frames (samples);
-    while (in_resampler->can_read_frames() >= Params::frame_size)
-      {
-        vector<float> r_samples = in_resampler->read_frames (Params::frame_size);
+    const complex<float> *fft_out = worker.fft_analyzer.run_fft_batch (samples, &start_index, 1);
 
-        /* generate watermark at normalized sample rate */
-        vector<float> wm_samples = wm_gen.run (key, r_samples);
+    complex<float> *fft_delta_spect = worker.ifft_batch.out();
+    std::fill_n (fft_delta_spect, n_bins * n_channels, 0);
+    apply_frame_mod (mod, fft_out, fft_delta_spect, n_channels);
 
-        /* resample back to the original sample rate of the audio file */
-        out_resampler->write_frames (wm_samples);
-      }
+    worker.ifft_batch.ifft (n_channels);
 
-    size_t to_read = out_resampler->can_read_frames();
-    return out_resampler->read_frames (to_read);
+    std::copy_n (worker.ifft_batch.in(), frame_values, fft_delta_out.data() + frame * frame_values);
   }
-  size_t
-  skip (size_t zeros)
+public:
+  WatermarkGen (int n_channels, const vector<int>& bitvec, ThreadPool& thread_pool) :
+    n_channels (n_channels),
+    frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
+    thread_pool (thread_pool),
+    wm_synth (n_channels),
+    frame_mod (bitvec)
   {
-    assert (zeros % Params::frame_size == 0);
-    if (!need_resampler)
+
+    /* start writing a partial B-block as padding */
+    assert (frames_per_block > Params::frames_pad_start);
+    frame_number = 2 * frames_per_block - Params::frames_pad_start;
+  }
+  void
+  run (const Key& key, const vector<float>& samples, vector<float>& out_samples)
+  {
+    assert (samples.size() % (Params::frame_size * n_channels) == 0);
+
+    out_samples.clear();
+
+    const size_t n_frames = samples.size() / (Params::frame_size * n_channels);
+    const size_t n_jobs = min (n_frames, thread_pool.n_threads());
+    if (n_jobs == 0)
+      return;
+
+    frame_mod.init (key);
+    while (workers.size() < n_jobs)
+      workers.emplace_back (new Worker (n_channels));
+
+    /* each job processes a contiguous range of frames */
+    fft_delta_out.resize (n_frames * n_channels * Params::frame_size);
+    for (size_t j = 0; j < n_jobs; j++)
       {
-        return wm_gen.skip (zeros); /* cheap case */
+        auto job = [&, j]() {
+          for (size_t f = j * n_frames / n_jobs; f < (j + 1) * n_frames / n_jobs; f++)
+            gen_frame (*workers[j], key, samples, f);
+        };
+        if (n_jobs == 1)
+          job();
+        else
+          thread_pool.add_job (job);
       }
-    else
-      {
-        /* resample to the watermark sample rate */
-        size_t out = in_resampler->skip (zeros);
+    thread_pool.wait_all();
 
-        out = wm_gen.skip (out);
+    for (size_t f = 0; f < n_frames; f++)
+      {
+        wm_synth.overlap_add (fft_delta_out.data() + f * n_channels * Params::frame_size, out_samples);
 
-        return out_resampler->skip (out);
+        frame_number++;
+        stream_frame++;
+        if (frame_number % frames_per_block == 0)
+          m_data_blocks++;
       }
   }
+  size_t
+  skip (size_t zeros)
+  {
+    assert (zeros % Params::frame_size == 0);
+
+    frame_number += zeros / Params::frame_size;
+    stream_frame += zeros / Params::frame_size;
+    return wm_synth.skip (zeros);
+  }
+  /* only generate the watermark for these frames (counted from the start of the stream), silence for all others */
+  void
+  set_compute_frames (const FrameRanges *ranges)
+  {
+    compute_frames = ranges;
+  }
   int
   data_blocks() const
   {
-    return wm_gen.data_blocks();
+    // first block is padding - a partial B block
+    return max (m_data_blocks - 1, 0);
   }
 };
 
-void
-info_format (const string& label, const RawFormat& format)
+/* generates a watermark signal directly at the sample rate of the input (add --native-rate)
+ *
+ * input:  original signal samples (any number of frames)
+ * output: watermark signal, with the same timing as the input
+ *
+ * The frames have the same timing as the WatermarkGen frames at
+ * Params::mark_sample_rate, so frame f starts at f * frame_len samples (rounded,
+ * since frame_len is not an integer) and has native_frame_size samples. The fft
+ * bin k of such a frame has almost the same frequency as bin k at the watermark
+ * sample rate (for 48000 Hz the difference is 0.04%), so the frame modifications
+ * are applied to the same bins, and the watermark is detected as usual. This
+ * avoids resampling the input to Params::mark_sample_rate and the watermark
+ * signal back to the input sample rate.
+ */
+class NativeWatermarkGen
 {
-  string e = "*unknown encoding*";
-  switch (format.encoding())
+  struct Worker
   {
-    case Encoding::SIGNED:    e = "signed";   break;
-    case Encoding::UNSIGNED:  e = "unsigned"; break;
-    case Encoding::FLOAT:     e = "float";    break;
-  }
-  info ("%-13s %d Hz, %d Channels, %d Bit (%s %s-endian)\n", (label + ":").c_str(),
-      format.sample_rate(), format.n_channels(), format.bit_depth(), e.c_str(),
-      format.endian() == RawFormat::Endian::LITTLE ? "little" : "big");
-}
-
-int
-add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames)
-{
-  auto bitvec = parse_payload (bits);
-  if (bitvec.empty())
-    return 1;
-
-  /* sanity checks */
-  if (in_stream->sample_rate() != out_stream->sample_rate())
+    FFTProcessor                 fft_processor;
+    AlignedArray<float>          frame;
+    AlignedArray<complex<float>> fft_out;
+    AlignedArray<complex<float>> fft_delta_spect;
+
+    Worker (size_t frame_size) :
+      fft_processor (frame_size),
+      frame (frame_size),
+      fft_out (frame_size / 2 + 1),
+      fft_delta_spect (frame_size / 2 + 1)
+    {
+    }
+  };
+  const int                 n_channels = 0;
+  const double              frame_len = 0;          // distance of two frames in samples
+  const size_t              native_frame_size = 0;
+  const size_t              frames_per_block = 0;
+  const vector<float>       analysis_window;
+  const vector<float>       synth_window;
+  size_t                    synth_first = 0;        // synth_window is zero outside [synth_first, synth_last)
+  size_t                    synth_last = 0;
+  size_t                    frame_number = 0;
+  size_t                    stream_frame = 0;       // frames since the start of the stream
+  int                       m_data_blocks = 0;
+  const FrameRanges        *compute_frames = nullptr;
+
+  ThreadPool&               thread_pool;
+  vector<std::unique_ptr<Worker>> workers;
+  PayloadFrameMod           frame_mod;
+
+  vector<float>             in_samples;             // input, starting at stream position in_start
+  size_t                    in_start = 0;
+  vector<float>             synth_samples;          // watermark signal which is not complete yet, starting at synth_start
+  size_t                    synth_start = 0;
+  vector<float>             fft_delta_out;          // ifft of the fft delta values: native_frame_size values per channel and frame
+
+  size_t
+  frame_start (size_t f) const
+  {
+    return llrint (f * frame_len);
+  }
+  void
+  gen_frame (Worker& worker, const Key *key, size_t frame)
+  {
+    const size_t frame_values = native_frame_size * n_channels;
+    float       *delta_out = &fft_delta_out[frame * frame_values];
+
+    /* without key the input is silence, so the watermark is silence as well */
+    if (!key || (compute_frames && !compute_frames->contains (stream_frame + frame)))
+      {
+        std::fill_n (delta_out, frame_values, 0);
+        return;
+      }
+    const vector<FrameMod>& mod = frame_mod.get (*key, frame_number + frame);
+    const float *samples = &in_samples[(frame_start (stream_frame + frame) - in_start) * n_channels];
+    for (int ch = 0; ch < n_channels; ch++)
+      {
+        for (size_t x = 0; x < native_frame_size; x++)
+          worker.frame[x] = samples[x * n_channels + ch] * analysis_window[x];
+        worker.fft_processor.fft (worker.frame.data(), worker.fft_out.data());
+
+        std::fill_n (worker.fft_delta_spect.data(), native_frame_size / 2 + 1, 0);
+        apply_frame_mod (mod, worker.fft_out.data(), worker.fft_delta_spect.data());
+
+        worker.fft_processor.ifft (worker.fft_delta_spect.data(), worker.frame.data());
+        std::copy_n (worker.frame.data(), native_frame_size, delta_out + ch * native_frame_size);
+      }
+  }
+  void
+  overlap_add (const float *delta, size_t start)
+  {
+    /* the synthesis window starts one frame before the frame start */
+    const size_t end = start + 2 * native_frame_size;
+    if (synth_samples.size() < (end - synth_start) * n_channels)
+      synth_samples.resize ((end - synth_start) * n_channels);
+
+    for (size_t i = synth_first; i < synth_last; i++)
+      {
+        if (start + i < native_frame_size)  /* before the start of the stream */
+          continue;
+
+        const size_t pos = start + i - native_frame_size;
+        assert (pos >= synth_start);
+
+        float *out = &synth_samples[(pos - synth_start) * n_channels];
+        const size_t x = i % native_frame_size;
+        for (int ch = 0; ch < n_channels; ch++)
+          out[ch] += delta[ch * native_frame_size + x] * synth_window[i];
+      }
+  }
+  void
+  process (const Key *key, vector<float>& out_samples)
+  {
+    out_samples.clear();
+
+    const size_t in_end = in_start + in_samples.size() / n_channels;
+    size_t n_frames = 0;
+    while (frame_start (stream_frame + n_frames) + native_frame_size <= in_end)
+      n_frames++;
+
+    if (n_frames)
+      {
+        const size_t n_jobs = min (n_frames, thread_pool.n_threads());
+        if (key)
+          frame_mod.init (*key);
+        while (workers.size() < n_jobs)
+          workers.emplace_back (new Worker (native_frame_size));
+
+        fft_delta_out.resize (n_frames * n_channels * native_frame_size);
+        for (size_t j = 0; j < n_jobs; j++)
+          {
+            auto job = [&, j]() {
+              for (size_t f = j * n_frames / n_jobs; f < (j + 1) * n_frames / n_jobs; f++)
+                gen_frame (*workers[j], key, f);
+            };
+            if (n_jobs == 1)
+              job();
+            else
+              thread_pool.add_job (job);
+          }
+        thread_pool.wait_all();
+      }
+    for (size_t f = 0; f < n_frames; f++)
+      {
+        overlap_add (&fft_delta_out[f * n_channels * native_frame_size], frame_start (stream_frame));
+
+        frame_number++;
+        stream_frame++;
+        if (frame_number % frames_per_block == 0)
+          m_data_blocks++;
+      }
+
+    /* the watermark signal is complete up to the synthesis window start of the next frame */
+    const size_t next_start = frame_start (stream_frame);
+    const size_t done = next_start > native_frame_size ? next_start - native_frame_size : 0;
+    if (done > synth_start)
+      {
+        const size_t n_values = (done - synth_start) * n_channels;
+        synth_samples.resize (max (synth_samples.size(), n_values));
+        out_samples.assign (synth_samples.begin(), synth_samples.begin() + n_values);
+        synth_samples.erase (synth_samples.begin(), synth_samples.begin() + n_values);
+        synth_start = done;
+      }
+
+    /* input before the next frame is no longer needed */
+    in_samples.erase (in_samples.begin(), in_samples.begin() + (next_start - in_start) * n_channels);
+    in_start = next_start;
+  }
+public:
+  static size_t
+  native_frame_size_for (int sample_rate)
+  {
+    return lrint (Params::frame_size * double (sample_rate) / Params::mark_sample_rate);
+  }
+  NativeWatermarkGen (int n_channels, int sample_rate, const vector<int>& bitvec, ThreadPool& thread_pool) :
+    n_channels (n_channels),
+    frame_len (Params::frame_size * double (sample_rate) / Params::mark_sample_rate),
+    native_frame_size (native_frame_size_for (sample_rate)),
+    frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
+    analysis_window (FFTAnalyzer::gen_normalized_window (native_frame_size)),
+    synth_window (gen_synth_window (native_frame_size)),
+    thread_pool (thread_pool),
+    frame_mod (bitvec)
+  {
+    /* the frame modifications are applied to bins up to Params::max_band */
+    assert (native_frame_size / 2 > size_t (Params::max_band));
+
+    while (synth_first < synth_window.size() && synth_window[synth_first] == 0)
+      synth_first++;
+    synth_last = synth_window.size();
+    while (synth_last > synth_first && synth_window[synth_last - 1] == 0)
+      synth_last--;
+
+    /* start writing a partial B-block as padding (like WatermarkGen) */
+    frame_number = 2 * frames_per_block - Params::frames_pad_start;
+  }
+  void
+  run (const Key& key, const vector<float>& samples, vector<float>& out_samples)
+  {
+    in_samples.insert (in_samples.end(), samples.begin(), samples.end());
+    process (&key, out_samples);
+  }
+  /* zeros at the start of the stream, returns the number of (silent) output samples which are skipped */
+  size_t
+  skip (size_t zeros)
+  {
+    /* frames that only contain zeros can be skipped without analysis */
+    in_samples.resize (in_samples.size() + zeros * n_channels);
+    vector<float> out_samples;
+    process (nullptr, out_samples);
+    return out_samples.size() / n_channels;
+  }
+  void
+  set_compute_frames (const FrameRanges *ranges)
+  {
+    compute_frames = ranges;
+  }
+  int
+  data_blocks() const
+  {
+    // first block is padding - a partial B block
+    return max (m_data_blocks - 1, 0);
+  }
+};
+
+/* generate a watermark at Params::mark_sample_rate and resample to whatever the original signal has
+ *
+ * input:  samples from original signal (always one frame)
+ * output: watermark signal resampled to original signal sample rate
+ *
+ * the watermark is only generated (and resampled) for the mark channels
+ *
+ * with add --native-rate, the watermark is generated at the input sample rate
+ * instead (see NativeWatermarkGen), so no resampling is necessary
+ */
+class WatermarkResampler
+{
+  const MarkChannels             mark_channels;
+  const int                      n_channels = 0;
+  std::unique_ptr<ResamplerImpl> in_resampler;
+  std::unique_ptr<ResamplerImpl> out_resampler;
+  std::unique_ptr<NativeWatermarkGen> native_gen;
+  WatermarkGen                   wm_gen;
+  const bool                     need_resampler = false;
+  vector<float>                  r_samples;
+  vector<float>                  wm_samples;
+  vector<float>                  mark_samples;
+  vector<float>                  mark_out_samples;
+
+  void
+  run_mark (const Key& key, const vector<float>& samples, vector<float>& out_samples)
+  {
+    if (native_gen)
+      {
+        native_gen->run (key, samples, out_samples);
+        return;
+      }
+    if (!need_resampler)
+      {
+        /* cheap case: if no resampling is necessary, just generate the watermark signal */
+        wm_gen.run (key, samples, out_samples);
+        return;
+      }
+
+    /* resample to the watermark sample rate */
+    in_resampler->write_frames (samples);
+    const size_t r_frames = in_resampler->can_read_frames() - in_resampler->can_read_frames() % Params::frame_size;
+    if (r_frames > 0)
+      {
+        r_samples.resize (r_frames * n_channels);
+        in_resampler->read_frames (r_samples.data(), r_frames);
+
+        /* generate watermark at normalized sample rate */
+        wm_gen.run (key, r_samples, wm_samples);
+
+        /* resample back to the original sample rate of the audio file */
+        out_resampler->write_frames (wm_samples);
+      }
+
+    size_t to_read = out_resampler->can_read_frames();
+    out_samples.resize (to_read * n_channels);
+    out_resampler->read_frames (out_samples.data(), to_read);
+  }
+public:
+  WatermarkResampler (int n_in_channels, int input_rate, const vector<int>& bitvec, ThreadPool& thread_pool) :
+    mark_channels (n_in_channels),
+    n_channels (mark_channels.n_mark()),
+    wm_gen (n_channels, bitvec, thread_pool),
+    need_resampler (input_rate != Params::mark_sample_rate)
+  {
+    /* very low sample rates don't have enough fft bins for the watermark bands, these are always resampled */
+    if (need_resampler && Params::mark_native_rate && NativeWatermarkGen::native_frame_size_for (input_rate) / 2 > size_t (Params::max_band))
+      native_gen.reset (new NativeWatermarkGen (n_channels, input_rate, bitvec, thread_pool));
+    else if (need_resampler)
+      {
+        in_resampler.reset (ResamplerImpl::create (n_channels, input_rate, Params::mark_sample_rate));
+        out_resampler.reset (ResamplerImpl::create (n_channels, Params::mark_sample_rate, input_rate));
+      }
+  }
+  bool
+  init_ok()
+  {
+    if (native_gen)
+      return true;
+    if (need_resampler)
+      return (in_resampler && out_resampler);
+    else
+      return true;
+  }
+  void
+  run (const Key& key, const vector<float>& samples, vector<float>& out_samples)
+  {
+    if (mark_channels.identity())
+      {
+        run_mark (key, samples, out_samples);
+        return;
+      }
+    mark_channels.project (samples, mark_samples);
+    run_mark (key, mark_samples, mark_out_samples);
+    mark_channels.expand (mark_out_samples, out_samples);
+  }
+  size_t
+  skip (size_t zeros)
+  {
+    assert (zeros % Params::frame_size == 0);
+    if (native_gen)
+      {
+        return native_gen->skip (zeros);
+      }
+    if (!need_resampler)
+      {
+        return wm_gen.skip (zeros); /* cheap case */
+      }
+    else
+      {
+        /* resample to the watermark sample rate */
+        size_t out = in_resampler->skip (zeros);
+
+        out = wm_gen.skip (out);
+
+        return out_resampler->skip (out);
+      }
+  }
+  /* frames are counted at Params::mark_sample_rate */
+  void
+  set_compute_frames (const FrameRanges *ranges)
+  {
+    if (native_gen)
+      native_gen->set_compute_frames (ranges);
+    wm_gen.set_compute_frames (ranges);
+  }
+  int
+  data_blocks() const
+  {
+    if (native_gen)
+      return native_gen->data_blocks();
+    return wm_gen.data_blocks();
+  }
+  /* maximum delay of the watermark signal relative to the input in input frames (add --low-latency)
+   *
+   * the synthesis outputs a frame when the next frame is complete; if the input is not read in
+   * whole frames (resampling, --native-rate), up to one more frame waits to be complete; the
+   * filters of both resamplers are much shorter than a frame, so another frame covers them
+   */
+  double
+  delay_frames (int input_rate) const
+  {
+    const double frame_frames = Params::frame_size * double (input_rate) / Params::mark_sample_rate;
+    if (!need_resampler)
+      return frame_frames;
+    if (native_gen)
+      return ceil (2 * frame_frames) + 1; /* frame starts are rounded */
+    return ceil (3 * frame_frames);
+  }
+};
+
+void
+info_format (const string& label, const RawFormat& format)
+{
+  string e = "*unknown encoding*";
+  switch (format.encoding())
+  {
+    case Encoding::SIGNED:    e = "signed";   break;
+    case Encoding::UNSIGNED:  e = "unsigned"; break;
+    case Encoding::FLOAT:     e = "float";    break;
+  }
+  info ("%-13s %d Hz, %d Channels, %d Bit (%s %s-endian)\n", (label + ":").c_str(),
+      format.sample_rate(), format.n_channels(), format.bit_depth(), e.c_str(),
+      format.endian() == RawFormat::Endian::LITTLE ? "little" : "big");
+}
+
+/* add --reuse: only the frames near the changes of the input are watermarked again, all others are copied from the previous output */
+struct ReuseOutput
+{
+  AudioInputStream *stream = nullptr;   // previous output of the add command
+  FrameRanges       write_frames;       // output frames which are watermarked again
+  FrameRanges       compute_frames;     // watermark frames (at Params::mark_sample_rate) which write_frames depend on
+  vector<float>     samples;
+  size_t            copied_frames = 0;
+
+  /* replace the new output samples for frames pos..pos+count-1 by the previous output where possible */
+  Error
+  merge (size_t pos, const float *new_samples, size_t count, int n_channels)
+  {
+    size_t frames_read = 0;
+    samples.resize (count * n_channels);
+    Error err = stream->read_frames (samples.data(), count, frames_read);
+    if (err)
+      return err;
+    if (frames_read != count)
+      return Error ("previous output is too short");
+
+    for (size_t f = 0; f < count; f++)
+      {
+        if (write_frames.contains (pos + f))
+          std::copy_n (new_samples + f * n_channels, n_channels, &samples[f * n_channels]);
+        else
+          copied_frames++;
+      }
+    return Error::Code::NONE;
+  }
+};
+
+static int
+add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames,
+                      ReuseOutput *reuse, double *snr)
+{
+  auto bitvec = parse_payload (bits);
+  if (bitvec.empty())
+    return 1;
+
+  /* sanity checks */
+  if (in_stream->sample_rate() != out_stream->sample_rate())
     {
       error ("audiowmark: input sample rate (%d) and output sample rate (%d) don't match\n", in_stream->sample_rate(), out_stream->sample_rate());
       return 1;
@@ -463,6 +1082,12 @@ add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputSt
       error ("audiowmark: input channels (%d) and output channels (%d) don't match\n", in_stream->n_channels(), out_stream->n_channels());
       return 1;
     }
+  Error mark_err = MarkChannels::check (in_stream->n_channels());
+  if (mark_err)
+    {
+      error ("audiowmark: %s\n", mark_err.message());
+      return 1;
+    }
 
   /* write some informational messages */
   info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
@@ -480,24 +1105,61 @@ add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputSt
   info ("Sample Rate:  %d\n", in_stream->sample_rate());
   info ("Channels:     %d\n", in_stream->n_channels());
 
-  vector<float> samples;
-
   const int n_channels = in_stream->n_channels();
+
+  /* frames read per loop iteration: the watermark for these is generated in parallel; with
+   * many threads, the chunk is limited to about 4 seconds, so that the buffers and the delay
+   * of streamed output don't grow with the number of threads
+   */
+  ThreadPool thread_pool;
+  const size_t max_chunk_frames = max<size_t> (1, in_stream->sample_rate() * 4 / Params::frame_size) * Params::frame_size;
+  size_t chunk_frames = min<size_t> (Params::frame_size * 16 * thread_pool.n_threads(), max_chunk_frames);
+
   AudioBuffer audio_buffer (n_channels);
-  WatermarkResampler wm_resampler (n_channels, in_stream->sample_rate(), bitvec);
+  WatermarkResampler wm_resampler (n_channels, in_stream->sample_rate(), bitvec, thread_pool);
   if (!wm_resampler.init_ok())
     return 1;
+  if (reuse)
+    wm_resampler.set_compute_frames (&reuse->compute_frames);
+
+  /* add --low-latency: read one frame per loop iteration, and choose the limiter block size so
+   * that the delay (input frames that have been read, but not written) stays below the bound;
+   * the limiter holds back less than two blocks
+   */
+  int limiter_block_ms = Params::limiter_block_size_ms;
+  if (Params::add_low_latency > 0)
+    {
+      const int    min_limiter_block_ms = 5;
+      const double rate_ms = in_stream->sample_rate() / 1000.;
 
+      chunk_frames = Params::frame_size;
+      const double fixed_ms = (chunk_frames + wm_resampler.delay_frames (in_stream->sample_rate())) / rate_ms;
+
+      limiter_block_ms = std::min<int> ((Params::add_low_latency - fixed_ms) / 2, Params::limiter_block_size_ms);
+      if (limiter_block_ms < min_limiter_block_ms)
+        {
+          error ("audiowmark: --low-latency needs at least %d ms for this input\n", int (ceil (fixed_ms + 2 * min_limiter_block_ms)));
+          return 1;
+        }
+      info ("Max Latency:  %.1f ms (limiter block: %d ms)\n", fixed_ms + 2 * limiter_block_ms, limiter_block_ms);
+    }
   Limiter limiter (n_channels, in_stream->sample_rate());
-  limiter.set_block_size_ms (Params::limiter_block_size_ms);
+  limiter.set_block_size_ms (limiter_block_ms);
   limiter.set_ceiling (Params::limiter_ceiling);
 
+  /* buffers are reused for all iterations, so the loop doesn't need to allocate memory */
+  vector<float> samples (chunk_frames * n_channels);
+  vector<float> wm_samples;
+  vector<float> orig_samples;
+  vector<float> limiter_samples;
+
   /* for signal to noise ratio */
-  double snr_delta_power = 0;
-  double snr_signal_power = 0;
+  SNRMeter snr_meter;
+  size_t   snr_frame = 0; // input frame of the first wm_samples frame
 
   size_t total_input_frames = 0;
   size_t total_output_frames = 0;
+  size_t max_delay_frames = 0;
   size_t zero_frames_in  = zero_frames;
   size_t zero_frames_out = zero_frames;
   Error err;
@@ -519,79 +1181,104 @@ add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputSt
     }
   while (true)
     {
-      if (zero_frames_in > 0)
-        {
-          err = in_stream->read_frames (samples, Params::frame_size - zero_frames_in);
-          samples.insert (samples.begin(), zero_frames_in * n_channels, 0);
-          zero_frames_in = 0;
-        }
-      else
-        {
-          err = in_stream->read_frames (samples, Params::frame_size);
-        }
+      /* zero_frames_in is only non-zero for the first read */
+      size_t frames_read = 0;
+      std::fill (samples.begin(), samples.begin() + zero_frames_in * n_channels, 0);
+      err = in_stream->read_frames (&samples[zero_frames_in * n_channels], chunk_frames - zero_frames_in, frames_read);
       if (err)
         {
           error ("audiowmark: input stream read failed: %s\n", err.message());
           return 1;
         }
-      total_input_frames += samples.size() / n_channels;
+      frames_read += zero_frames_in;
+      zero_frames_in = 0;
+      total_input_frames += frames_read;
+
+      /* the oldest frame which was read, but not written yet, was read max_delay_frames ago */
+      max_delay_frames = max (max_delay_frames, total_input_frames - total_output_frames);
 
-      if (samples.size() < Params::frame_size * n_channels)
+      if (frames_read < chunk_frames)
         {
           if (total_input_frames == total_output_frames)
             break;
 
           /* zero sample padding after the actual input */
-          samples.resize (Params::frame_size * n_channels);
+          std::fill (samples.begin() + frames_read * n_channels, samples.end(), 0);
         }
       audio_buffer.write_frames (samples);
-      samples = wm_resampler.run (key, samples);
-      size_t to_read = samples.size() / n_channels;
-      vector<float> orig_samples  = audio_buffer.read_frames (to_read);
-      assert (samples.size() == orig_samples.size());
+      wm_resampler.run (key, samples, wm_samples);
+      size_t to_read = wm_samples.size() / n_channels;
+      orig_samples.resize (to_read * n_channels);
+      audio_buffer.read_frames (orig_samples.data(), to_read);
 
-      if (Params::snr)
+      if (Params::snr || snr)
         {
-          for (size_t i = 0; i < samples.size(); i++)
+          if (reuse)
             {
-              const double orig  = orig_samples[i]; // original sample
-              const double delta = samples[i];      // watermark
-
-              snr_delta_power += delta * delta;
-              snr_signal_power += orig * orig;
+              /* add --reuse: the watermark is only computed for the frames which are watermarked again */
+              for (size_t f = 0; f < to_read; f++)
+                if (reuse->write_frames.contains (snr_frame + f))
+                  snr_meter.add (&orig_samples[f * n_channels], &wm_samples[f * n_channels], n_channels);
+            }
+          else
+            {
+              snr_meter.add (orig_samples.data(), wm_samples.data(), wm_samples.size());
             }
+          snr_frame += to_read;
         }
-      for (size_t i = 0; i < samples.size(); i++)
-        samples[i] += orig_samples[i];
+      for (size_t i = 0; i < wm_samples.size(); i++)
+        wm_samples[i] += orig_samples[i];
 
+      const vector<float> *out_samples = &wm_samples;
       if (!Params::test_no_limiter)
-        samples = limiter.process (samples);
+        {
+          limiter.process (wm_samples, limiter_samples);
+          out_samples = &limiter_samples;
+        }
 
       size_t max_write_frames = total_input_frames - total_output_frames;
-      if (samples.size() > max_write_frames * n_channels)
-        samples.resize (max_write_frames * n_channels);
+      size_t write_frames = min (out_samples->size() / n_channels, max_write_frames);
 
-      const size_t cut_frames = min (samples.size() / n_channels, zero_frames_out);
+      const size_t cut_frames = min (write_frames, zero_frames_out);
       if (cut_frames > 0)
         {
-          samples.erase (samples.begin(), samples.begin() + cut_frames * n_channels);
+          write_frames -= cut_frames;
           total_output_frames += cut_frames;
           zero_frames_out -= cut_frames;
         }
 
-      err = out_stream->write_frames (samples);
+      const float *write_samples = out_samples->data() + cut_frames * n_channels;
+      if (reuse)
+        {
+          err = reuse->merge (total_output_frames, write_samples, write_frames, n_channels);
+          if (err)
+            {
+              error ("audiowmark: error reading previous output: %s\n", err.message());
+              return 1;
+            }
+          write_samples = reuse->samples.data();
+        }
+      err = out_stream->write_frames (write_samples, write_frames);
+      if (!err && write_frames && Params::add_low_latency > 0)
+        err = out_stream->flush();
       if (err)
         {
           error ("audiowmark output write failed: %s\n", err.message());
           return 1;
         }
-      total_output_frames += samples.size() / n_channels;
+      total_output_frames += write_frames;
     }
 
   if (Params::snr)
-    info ("SNR:          %f dB\n", 10 * log10 (snr_signal_power / snr_delta_power));
+    info ("SNR:          %f dB\n", snr_meter.db());
+  if (snr)
+    *snr = snr_meter.db();
 
   info ("Data Blocks:  %d\n", wm_resampler.data_blocks());
+  if (Params::add_low_latency > 0)
+    info ("Latency:      %.1f ms\n", max_delay_frames * 1000.0 / in_stream->sample_rate());
+  if (reuse && total_output_frames)
+    info ("Reused:       %.1f%% of the output\n", reuse->copied_frames * 100.0 / total_output_frames);
 
   if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
     {
@@ -617,6 +1304,36 @@ add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputSt
   return 0;
 }
 
+int
+add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames,
+                      double *snr)
+{
+  return add_stream_watermark (key, in_stream, out_stream, bits, zero_frames, nullptr, snr);
+}
+
+static std::unique_ptr<AudioOutputStream>
+create_output_stream (AudioInputStream *in_stream, const string& outfile, Error& err)
+{
+  int out_bit_depth = in_stream->bit_depth();
+  Encoding out_encoding = in_stream->encoding();
+  if (in_stream->bit_depth() < 16)
+    {
+      out_bit_depth = 16;
+      out_encoding = Encoding::SIGNED;
+    }
+  std::unique_ptr<AudioOutputStream> out_stream =
+    AudioOutputStream::create (outfile, in_stream->n_channels(), in_stream->sample_rate(), out_bit_depth, out_encoding, in_stream->n_frames(), err);
+  if (!out_stream)
+    return nullptr;
+
+  /* add --low-latency: each write is flushed immediately, so a writer thread would only add delay */
+  if (Params::add_low_latency > 0)
+    return out_stream;
+
+  /* write the output from a separate thread, so slow disks / pipes don't block the watermark generation */
+  return std::unique_ptr<AudioOutputStream> (new AsyncOutputStream (std::move (out_stream)));
+}
+
 int
 add_watermark (const Key& key, const string& infile, const string& outfile, const string& bits)
 {
@@ -630,15 +1347,7 @@ add_watermark (const Key& key, const string& infile, const string& outfile, cons
     }
 
   /* open output stream */
-  int out_bit_depth = in_stream->bit_depth();
-  Encoding out_encoding = in_stream->encoding();
-  if (in_stream->bit_depth() < 16)
-    {
-      out_bit_depth = 16;
-      out_encoding = Encoding::SIGNED;
-    }
-  std::unique_ptr<AudioOutputStream> out_stream;
-  out_stream = AudioOutputStream::create (outfile, in_stream->n_channels(), in_stream->sample_rate(), out_bit_depth, out_encoding, in_stream->n_frames(), err);
+  std::unique_ptr<AudioOutputStream> out_stream = create_output_stream (in_stream.get(), outfile, err);
   if (err)
     {
       error ("audiowmark: error writing to %s: %s\n", outfile.c_str(), err.message());
@@ -656,4 +1365,907 @@ add_watermark (const Key& key, const string& infile, const string& outfile, cons
   return add_stream_watermark (key, in_stream.get(), out_stream.get(), bits, 0);
 }
 
+static Error
+open_reuse_stream (const string& filename, const AudioInputStream *in_stream, std::unique_ptr<AudioInputStream>& stream)
+{
+  Error err;
+  stream = AudioInputStream::create (filename, err);
+  if (err)
+    return Error (string_printf ("%s: %s", filename.c_str(), err.message()));
+
+  if (stream->sample_rate() != in_stream->sample_rate() || stream->n_channels() != in_stream->n_channels())
+    return Error (string_printf ("%s: sample rate or number of channels differ from the input", filename.c_str()));
+  if (stream->n_frames() != in_stream->n_frames())
+    return Error (string_printf ("%s: length differs from the input (a full add is needed if the length was edited)", filename.c_str()));
+
+  return Error::Code::NONE;
+}
+
+/* compare the input with the unwatermarked old master, frame by frame */
+static Error
+diff_frames (AudioInputStream *in_stream, AudioInputStream *old_stream, FrameRanges& changed)
+{
+  const int    n_channels = in_stream->n_channels();
+  const size_t block_frames = 64 * 1024;
+
+  vector<float> new_samples (block_frames * n_channels);
+  vector<float> old_samples (block_frames * n_channels);
 
+  size_t pos = 0;
+  size_t change_start = 0;
+  bool   in_change = false;
+  for (;;)
+    {
+      size_t new_read = 0, old_read = 0;
+      Error err = in_stream->read_frames (new_samples.data(), block_frames, new_read);
+      if (err)
+        return err;
+      err = old_stream->read_frames (old_samples.data(), block_frames, old_read);
+      if (err)
+        return err;
+      if (new_read != old_read)
+        return Error ("length of the old master differs from the input");
+
+      for (size_t f = 0; f < new_read; f++)
+        {
+          const bool equal = std::equal (&new_samples[f * n_channels], &new_samples[(f + 1) * n_channels], &old_samples[f * n_channels]);
+          if (!equal && !in_change)
+            {
+              change_start = pos + f;
+              in_change = true;
+            }
+          else if (equal && in_change)
+            {
+              changed.add (change_start, pos + f);
+              in_change = false;
+            }
+        }
+      pos += new_read;
+      if (new_read < block_frames)
+        break;
+    }
+  if (in_change)
+    changed.add (change_start, pos);
+  return Error::Code::NONE;
+}
+
+/*
+ * add --reuse: watermark an edited input, only the changed frames are watermarked again
+ *
+ * Each output sample depends on the input in its neighbourhood: the watermark
+ * frames around it (overlap add, resampling) and the limiter blocks before and
+ * after it. So only the output near a change can differ from the previous
+ * output. This part (aligned to watermark blocks) is written from the new
+ * watermark signal, which is only generated for the frames it depends on. All
+ * other frames are copied from the previous output, so the result is identical
+ * to a full add of the new input.
+ *
+ * The previous output must be the result of add with the same key, message
+ * and options for an input of the same length.
+ */
+int
+add_watermark_reuse (const Key& key, const string& infile, const string& outfile, const string& bits, const string& reuse_file,
+                     const vector<std::pair<double, double>>& regions, const string& diff_file)
+{
+  Error err;
+  std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (infile, err);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  const size_t n_frames = in_stream->n_frames();
+  const int    rate = in_stream->sample_rate();
+  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
+    {
+      error ("audiowmark: --reuse needs an input with known length\n");
+      return 1;
+    }
+
+  FrameRanges changed;
+  for (auto r : regions)
+    changed.add (min<size_t> (lrint (r.first * rate), n_frames), min<size_t> (lrint (r.second * rate), n_frames));
+  if (diff_file != "")
+    {
+      std::unique_ptr<AudioInputStream> old_stream;
+      err = open_reuse_stream (diff_file, in_stream.get(), old_stream);
+      if (!err)
+        err = diff_frames (in_stream.get(), old_stream.get(), changed);
+      if (err)
+        {
+          error ("audiowmark: error comparing input with old master: %s\n", err.message());
+          return 1;
+        }
+      /* the input was read for the comparison */
+      in_stream = AudioInputStream::create (infile, err);
+      if (err)
+        {
+          error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+          return 1;
+        }
+    }
+
+  ReuseOutput reuse;
+  std::unique_ptr<AudioInputStream> reuse_stream;
+  err = open_reuse_stream (reuse_file, in_stream.get(), reuse_stream);
+  if (err)
+    {
+      error ("audiowmark: error opening previous output: %s\n", err.message());
+      return 1;
+    }
+  reuse.stream = reuse_stream.get();
+
+  /* context of each output frame: limiter blocks before / after it, watermark frames (overlap add and resampler) */
+  const double mark_frame_len = double (Params::frame_size) * rate / Params::mark_sample_rate;
+  const size_t limiter_block = rate * Params::limiter_block_size_ms / 1000;
+  const size_t context = 2 * limiter_block + 4 * ceil (mark_frame_len);
+
+  /* watermark blocks start after frames_pad_start, see WatermarkGen */
+  const double block_len = (mark_sync_frame_count() + mark_data_frame_count()) * mark_frame_len;
+  const double block_offset = Params::frames_pad_start * mark_frame_len;
+  auto align_down = [&] (double frame) { return frame <= block_offset ? 0 : block_offset + floor ((frame - block_offset) / block_len) * block_len; };
+  auto align_up   = [&] (double frame) { return block_offset + ceil ((frame - block_offset) / block_len) * block_len; };
+
+  for (auto r : changed.get())
+    {
+      const double start = align_down (r.first > context ? r.first - context : 0);
+      const double end   = align_up (r.second + context);
+      reuse.write_frames.add (start, min<double> (end, n_frames));
+    }
+  for (auto r : reuse.write_frames.get())
+    {
+      const size_t start = r.first > context ? r.first - context : 0;
+      const size_t end   = r.second + context;
+      reuse.compute_frames.add (floor (start / mark_frame_len), ceil (end / mark_frame_len));
+    }
+
+  std::unique_ptr<AudioOutputStream> out_stream = create_output_stream (in_stream.get(), outfile, err);
+  if (err)
+    {
+      error ("audiowmark: error writing to %s: %s\n", outfile.c_str(), err.message());
+      return 1;
+    }
+  if (reuse_stream->bit_depth() != out_stream->bit_depth())
+    {
+      error ("audiowmark: previous output has %d bits, but the output needs %d bits\n", reuse_stream->bit_depth(), out_stream->bit_depth());
+      return 1;
+    }
+
+  info ("Input:        %s\n", Params::input_label.size() ? Params::input_label.c_str() : infile.c_str());
+  info ("Reuse:        %s\n", reuse_file.c_str());
+  info ("Output:       %s\n", Params::output_label.size() ? Params::output_label.c_str() : outfile.c_str());
+  info ("Changed:      %.3f seconds\n", double (changed.n_frames()) / rate);
+  info ("Re-embed:     %.3f seconds\n", double (reuse.write_frames.n_frames()) / rate);
+
+  return add_stream_watermark (key, in_stream.get(), out_stream.get(), bits, 0, &reuse, nullptr);
+}
+
+
+
+/*
+ * Batch mode: watermark one input with many payloads
+ *
+ * Everything that doesn't depend on the payload (reading the input, resampling
+ * it to Params::mark_sample_rate and the fft analysis) is done only once by the
+ * BatchAnalyzer. Since only the sign of the modification of each band depends
+ * on the payload, the analysis stores the fft delta for both signs. Then each
+ * BatchOutput picks the deltas for its payload and only needs to do the
+ * synthesis, resampling back to the original rate, limiter and writing.
+ *
+ * The steps of the analysis are replayed exactly as the add_stream_watermark()
+ * loop would perform them, so each output is identical to the output of a
+ * normal add command with the same payload.
+ */
+struct BatchFrame
+{
+  size_t                         frame_number = 0;
+  vector<vector<complex<float>>> up_delta;    // per channel fft delta for FrameMod::UP
+  vector<vector<complex<float>>> down_delta;  // per channel fft delta for FrameMod::DOWN
+};
+
+/* one iteration of the add loop: the input samples and the frames analyzed for them */
+struct BatchStep
+{
+  vector<float>      samples;
+  size_t             total_input_frames = 0;
+  bool               short_read = false;
+  vector<BatchFrame> frames;
+};
+
+class BatchAnalyzer
+{
+  AudioInputStream              *in_stream = nullptr;
+  const int                      n_channels = 0;
+  const MarkChannels             mark_channels;
+  vector<float>                  mark_samples;
+  const size_t                   frames_per_block = 0;
+  size_t                         frame_number = 0;
+  int                            m_data_blocks = 0;
+  size_t                         total_input_frames = 0;
+  size_t                         zero_frames_in = 0;
+  size_t                         m_skip_frames = 0;
+  size_t                         m_skip_mark_frames = 0;
+  bool                           eof = false;
+
+  FFTAnalyzer                    fft_analyzer;
+  std::unique_ptr<ResamplerImpl> in_resampler;
+
+  /* modified bands for each frame of a block with all bands set to UP (or DOWN) */
+  vector<vector<FrameMod>>       frame_mod_up;
+  vector<vector<FrameMod>>       frame_mod_down;
+
+  BatchFrame
+  analyze_frame (const vector<float>& samples)
+  {
+    BatchFrame frame;
+    frame.frame_number = frame_number;
+
+    /* same batched fft as WatermarkGen, so the results are identical */
+    const size_t f = frame_number % frames_per_block;
+    const size_t n_bins = Params::frame_size / 2 + 1;
+    const size_t start_index = 0;
+    const complex<float> *fft_out = fft_analyzer.run_fft_batch (samples, &start_index, 1);
+    for (int ch = 0; ch < mark_channels.n_mark(); ch++)
+      {
+        frame.up_delta.emplace_back (Params::max_band + 1);
+        frame.down_delta.emplace_back (Params::max_band + 1);
+
+        apply_frame_mod (frame_mod_up[f], fft_out + ch * n_bins, frame.up_delta[ch].data());
+        apply_frame_mod (frame_mod_down[f], fft_out + ch * n_bins, frame.down_delta[ch].data());
+      }
+
+    frame_number++;
+    if (frame_number % frames_per_block == 0)
+      m_data_blocks++;
+
+    return frame;
+  }
+public:
+  BatchAnalyzer (const Key& key, AudioInputStream *in_stream, size_t zero_frames = 0) :
+    in_stream (in_stream),
+    n_channels (in_stream->n_channels()),
+    mark_channels (n_channels),
+    frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
+    fft_analyzer (mark_channels.n_mark())
+  {
+    /* start writing a partial B-block as padding (like WatermarkGen) */
+    assert (frames_per_block > Params::frames_pad_start);
+    frame_number = 2 * frames_per_block - Params::frames_pad_start;
+
+    if (in_stream->sample_rate() != Params::mark_sample_rate)
+      in_resampler.reset (ResamplerImpl::create (mark_channels.n_mark(), in_stream->sample_rate(), Params::mark_sample_rate));
+
+    /* whole frames of zeros before the input are skipped without analysis (like add_stream_watermark) */
+    if (zero_frames >= Params::frame_size && init_ok())
+      {
+        m_skip_frames = zero_frames - zero_frames % Params::frame_size;
+        m_skip_mark_frames = in_resampler ? in_resampler->skip (m_skip_frames) : m_skip_frames;
+
+        total_input_frames += m_skip_frames;
+        frame_number += m_skip_mark_frames / Params::frame_size;
+      }
+    zero_frames_in = zero_frames - m_skip_frames;
+
+    /* the set of modified bands doesn't depend on the payload or A/B block */
+    init_frame_mod_vec (key, frame_mod_up, 0, vector<int> (Params::payload_size));
+    frame_mod_down = frame_mod_up;
+    for (size_t f = 0; f < frame_mod_up.size(); f++)
+      {
+        for (auto& mod : frame_mod_up[f])
+          if (mod != FrameMod::KEEP)
+            mod = FrameMod::UP;
+        for (auto& mod : frame_mod_down[f])
+          if (mod != FrameMod::KEEP)
+            mod = FrameMod::DOWN;
+      }
+  }
+  bool
+  init_ok()
+  {
+    return in_stream->sample_rate() == Params::mark_sample_rate || in_resampler;
+  }
+  Error
+  run (BatchStep& step)
+  {
+    step.samples.clear();
+    step.frames.clear();
+    if (!eof)
+      {
+        Error err = in_stream->read_frames (step.samples, Params::frame_size - zero_frames_in);
+        if (err)
+          return err;
+
+        /* zero_frames_in is only non-zero for the first step */
+        step.samples.insert (step.samples.begin(), zero_frames_in * n_channels, 0);
+        zero_frames_in = 0;
+      }
+    total_input_frames += step.samples.size() / n_channels;
+
+    step.total_input_frames = total_input_frames;
+    step.short_read = step.samples.size() < Params::frame_size * n_channels;
+    if (step.short_read)
+      {
+        /* zero sample padding after the actual input */
+        step.samples.resize (Params::frame_size * n_channels);
+        eof = true;
+      }
+    /* only the mark channels are analyzed */
+    const vector<float> *samples = &step.samples;
+    if (!mark_channels.identity())
+      {
+        mark_channels.project (step.samples, mark_samples);
+        samples = &mark_samples;
+      }
+    if (!in_resampler)
+      {
+        step.frames.push_back (analyze_frame (*samples));
+      }
+    else
+      {
+        in_resampler->write_frames (*samples);
+        while (in_resampler->can_read_frames() >= Params::frame_size)
+          step.frames.push_back (analyze_frame (in_resampler->read_frames (Params::frame_size)));
+      }
+    return Error::Code::NONE;
+  }
+  int
+  data_blocks() const
+  {
+    // first block is padding - a partial B block
+    return max (m_data_blocks - 1, 0);
+  }
+  /* number of input frames skipped in the constructor */
+  size_t
+  skip_frames() const
+  {
+    return m_skip_frames;
+  }
+  /* number of frames at Params::mark_sample_rate skipped in the constructor */
+  size_t
+  skip_mark_frames() const
+  {
+    return m_skip_mark_frames;
+  }
+};
+
+class BatchOutput
+{
+  const int                          n_channels = 0;
+  const MarkChannels                 mark_channels;
+  AudioBuffer                        audio_buffer;
+  WatermarkSynth                     wm_synth;
+  PayloadFrameMod                    frame_mod;
+  std::unique_ptr<ResamplerImpl>     out_resampler;
+  Limiter                            limiter;
+  size_t                             total_output_frames = 0;
+  size_t                             zero_frames_out = 0;
+  SNRMeter                           snr_meter;
+
+  vector<AlignedArray<complex<float>>> fft_delta_spect;
+  vector<float>                      synth_samples;
+  vector<float>                      mark_samples;
+
+  /* appends the watermark samples for one frame to out_samples */
+  void
+  synth (const Key& key, const BatchFrame& frame, vector<float>& out_samples)
+  {
+    const vector<FrameMod>& mod = frame_mod.get (key, frame.frame_number);
+
+    for (int ch = 0; ch < mark_channels.n_mark(); ch++)
+      {
+        complex<float> *delta = fft_delta_spect[ch].data();
+        std::fill_n (delta, fft_delta_spect[ch].size(), 0);
+        for (size_t i = 0; i < mod.size(); i++)
+          {
+            if (mod[i] == FrameMod::UP)
+              delta[i] = frame.up_delta[ch][i];
+            else if (mod[i] == FrameMod::DOWN)
+              delta[i] = frame.down_delta[ch][i];
+          }
+      }
+    wm_synth.run (fft_delta_spect, out_samples);
+  }
+public:
+  string                             filename;
+  string                             bits;
+  AudioOutputStream                 *out_stream = nullptr; // nullptr: only count output frames
+  std::unique_ptr<AudioOutputStream> out_stream_owner;
+  bool                               done = false;
+  bool                               failed = false;
+  Error                              write_error;
+
+  BatchOutput (const Key& key, int n_channels, int sample_rate, const vector<int>& bitvec) :
+    n_channels (n_channels),
+    mark_channels (n_channels),
+    audio_buffer (n_channels),
+    wm_synth (mark_channels.n_mark()),
+    frame_mod (bitvec),
+    limiter (n_channels, sample_rate)
+  {
+    if (sample_rate != Params::mark_sample_rate)
+      out_resampler.reset (ResamplerImpl::create (mark_channels.n_mark(), Params::mark_sample_rate, sample_rate));
+
+    limiter.set_block_size_ms (Params::limiter_block_size_ms);
+    limiter.set_ceiling (Params::limiter_ceiling);
+
+    for (int ch = 0; ch < mark_channels.n_mark(); ch++)
+      fft_delta_spect.emplace_back (Params::frame_size / 2 + 1);
+
+    frame_mod.init (key);
+  }
+  bool
+  init_ok (int sample_rate)
+  {
+    return sample_rate == Params::mark_sample_rate || out_resampler;
+  }
+  /* skip the output for the zero frames skipped by the BatchAnalyzer (and remove all zero frames from the output) */
+  void
+  skip (size_t zero_frames, size_t skip_frames, size_t skip_mark_frames)
+  {
+    zero_frames_out = zero_frames;
+    if (!skip_frames)
+      return;
+
+    size_t out = wm_synth.skip (skip_mark_frames);
+    if (out_resampler)
+      out = out_resampler->skip (out);
+
+    audio_buffer.write_frames (vector<float> ((skip_frames - out) * n_channels));
+
+    out = limiter.skip (out);
+    assert (out < zero_frames_out);
+
+    zero_frames_out -= out;
+    total_output_frames += out;
+  }
+  void
+  process (const Key& key, const BatchStep& step)
+  {
+    if (done)
+      return;
+
+    if (step.short_read && step.total_input_frames == total_output_frames)
+      {
+        done = true;
+        return;
+      }
+    audio_buffer.write_frames (step.samples);
+
+    vector<float> samples;
+    if (!out_resampler)
+      {
+        assert (step.frames.size() == 1);
+        synth (key, step.frames[0], samples);
+      }
+    else
+      {
+        for (const auto& frame : step.frames)
+          {
+            synth_samples.clear();
+            synth (key, frame, synth_samples);
+            out_resampler->write_frames (synth_samples);
+          }
+
+        samples = out_resampler->read_frames (out_resampler->can_read_frames());
+      }
+    if (!mark_channels.identity())
+      {
+        mark_samples.swap (samples);
+        mark_channels.expand (mark_samples, samples);
+      }
+    vector<float> orig_samples = audio_buffer.read_frames (samples.size() / n_channels);
+
+    if (Params::snr)
+      snr_meter.add (orig_samples.data(), samples.data(), samples.size());
+    for (size_t i = 0; i < samples.size(); i++)
+      samples[i] += orig_samples[i];
+
+    if (!Params::test_no_limiter)
+      samples = limiter.process (samples);
+
+    size_t max_write_frames = step.total_input_frames - total_output_frames;
+    size_t write_frames = min (samples.size() / n_channels, max_write_frames);
+
+    const size_t cut_frames = min (write_frames, zero_frames_out);
+    if (cut_frames > 0)
+      {
+        write_frames -= cut_frames;
+        total_output_frames += cut_frames;
+        zero_frames_out -= cut_frames;
+      }
+    if (out_stream)
+      {
+        Error err = out_stream->write_frames (samples.data() + cut_frames * n_channels, write_frames);
+        if (err)
+          {
+            write_error = err;
+            done = failed = true;
+            return;
+          }
+      }
+    total_output_frames += write_frames;
+  }
+  size_t
+  n_output_frames() const
+  {
+    return total_output_frames;
+  }
+  double
+  snr() const
+  {
+    return snr_meter.db();
+  }
+};
+
+struct BatchEntry
+{
+  string      filename;
+  string      bits;
+  vector<int> bitvec;
+};
+
+/* error: close an output that was not written completely and remove it, so no partial file is left */
+static void
+discard_batch_output (BatchOutput& output)
+{
+  if (output.out_stream)
+    output.out_stream->close();
+  output.out_stream_owner.reset();
+  output.out_stream = nullptr;
+  if (output.filename != "-")
+    unlink (output.filename.c_str());
+}
+
+static bool
+parse_batch_file (const string& batch_file, vector<BatchEntry>& entries)
+{
+  FILE *f = fopen (batch_file.c_str(), "r");
+  ScopedFile f_s (f);
+  if (!f)
+    {
+      error ("audiowmark: error opening batch file: '%s'\n", batch_file.c_str());
+      return false;
+    }
+
+  char buffer[1024];
+  int line = 1;
+  while (fgets (buffer, 1024, f))
+    {
+      vector<string> tokens;
+      if (!tokenize (buffer, tokens) || (tokens.size() != 0 && tokens.size() != 2))
+        {
+          error ("audiowmark: parse error in batch file '%s', line %d\n => expected: <watermarked_wav> <message_hex>\n", batch_file.c_str(), line);
+          return false;
+        }
+      if (tokens.size() == 2)
+        {
+          BatchEntry entry;
+          entry.filename = tokens[0];
+          entry.bits     = tokens[1];
+          entry.bitvec   = parse_payload (entry.bits);
+          if (entry.bitvec.empty())
+            return false;
+
+          entries.push_back (entry);
+        }
+      line++;
+    }
+  if (entries.empty())
+    {
+      error ("audiowmark: batch file '%s' contains no payloads\n", batch_file.c_str());
+      return false;
+    }
+  return true;
+}
+
+int
+add_watermark_batch (const Key& key, const string& infile, const string& batch_file)
+{
+  /* at most this many output files are written at the same time */
+  const size_t max_open_outputs = 64;
+  /* number of analysis steps processed by one output job */
+  const size_t steps_per_job    = 64;
+
+  vector<BatchEntry> entries;
+  if (!parse_batch_file (batch_file, entries))
+    return 1;
+
+  Error err;
+  std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (infile, err);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  const int n_channels  = in_stream->n_channels();
+  const int sample_rate = in_stream->sample_rate();
+
+  info ("Input:        %s\n", Params::input_label.size() ? Params::input_label.c_str() : infile.c_str());
+  if (Params::input_format == Format::RAW)
+    info_format ("Raw Input", Params::raw_input_format);
+  info ("Batch:        %s (%zd outputs)\n", batch_file.c_str(), entries.size());
+  if (Params::output_format == Format::RAW)
+    info_format ("Raw Output", Params::raw_output_format);
+  info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
+
+  if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
+    {
+      info ("Time:         unknown\n");
+    }
+  else
+    {
+      size_t orig_seconds = in_stream->n_frames() / sample_rate;
+      info ("Time:         %zd:%02zd\n", orig_seconds / 60, orig_seconds % 60);
+    }
+  info ("Sample Rate:  %d\n", sample_rate);
+  info ("Channels:     %d\n", n_channels);
+
+  err = MarkChannels::check (n_channels);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+  std::unique_ptr<BatchAnalyzer> analyzer (new BatchAnalyzer (key, in_stream.get()));
+  if (!analyzer->init_ok())
+    return 1;
+
+  /* If all outputs are written in one pass, analysis steps can be discarded
+   * after use. Otherwise, if the input is a regular file, it is read and
+   * analyzed again for each group of outputs, so the memory usage doesn't
+   * depend on the input length. Only for other inputs (pipes), the analysis
+   * of the whole input is kept in memory for the later groups.
+   */
+  struct stat st;
+  const bool reanalyze = entries.size() > max_open_outputs && infile != "-" && stat (infile.c_str(), &st) == 0 && S_ISREG (st.st_mode);
+  const bool keep_steps = entries.size() > max_open_outputs && !reanalyze;
+
+  std::deque<BatchStep> steps;
+  size_t steps_start = 0;
+  ThreadPool thread_pool;
+  int ret = 0;
+  for (size_t group_start = 0; group_start < entries.size(); group_start += max_open_outputs)
+    {
+      const size_t group_end = min (group_start + max_open_outputs, entries.size());
+
+      if (reanalyze && group_start > 0)
+        {
+          in_stream = AudioInputStream::create (infile, err);
+          if (err)
+            {
+              error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+              return 1;
+            }
+          analyzer.reset (new BatchAnalyzer (key, in_stream.get()));
+          if (!analyzer->init_ok())
+            return 1;
+          steps.clear();
+          steps_start = 0;
+        }
+
+      vector<std::unique_ptr<BatchOutput>> outputs;
+      auto discard_outputs = [&]() {
+        for (auto& output : outputs)
+          discard_batch_output (*output);
+      };
+      for (size_t e = group_start; e < group_end; e++)
+        {
+          std::unique_ptr<BatchOutput> output (new BatchOutput (key, n_channels, sample_rate, entries[e].bitvec));
+          if (!output->init_ok (sample_rate))
+            {
+              discard_outputs();
+              return 1;
+            }
+
+          output->filename   = entries[e].filename;
+          output->bits       = bit_vec_to_str (entries[e].bitvec);
+          output->out_stream_owner = create_output_stream (in_stream.get(), output->filename, err);
+          output->out_stream = output->out_stream_owner.get();
+          if (err)
+            {
+              error ("audiowmark: error writing to %s: %s\n", output->filename.c_str(), err.message());
+              discard_outputs();
+              return 1;
+            }
+          outputs.push_back (std::move (output));
+        }
+
+      size_t pos = 0;
+      auto all_done = [&]() {
+        for (auto& output : outputs)
+          if (!output->done)
+            return false;
+        return true;
+      };
+      while (!all_done())
+        {
+          /* with keep_steps, analysis is done only once, for the first group of outputs */
+          while (steps_start + steps.size() < pos + steps_per_job)
+            {
+              steps.emplace_back();
+              err = analyzer->run (steps.back());
+              if (err)
+                {
+                  error ("audiowmark: input stream read failed: %s\n", err.message());
+                  discard_outputs();
+                  return 1;
+                }
+            }
+          for (auto& output : outputs)
+            {
+              thread_pool.add_job ([&, output = output.get()]() {
+                for (size_t s = pos; s < pos + steps_per_job; s++)
+                  output->process (key, steps[s - steps_start]);
+              });
+            }
+          thread_pool.wait_all();
+          pos += steps_per_job;
+
+          if (!keep_steps)
+            {
+              steps.clear();
+              steps_start = pos;
+            }
+        }
+
+      for (auto& output : outputs)
+        {
+          if (output->failed)
+            {
+              error ("audiowmark: output write failed for %s: %s\n", output->filename.c_str(), output->write_error.message());
+              discard_batch_output (*output);
+              ret = 1;
+              continue;
+            }
+          info ("Output:       %s (message %s)\n", output->filename.c_str(), output->bits.c_str());
+          if (Params::snr)
+            info ("SNR:          %f dB\n", output->snr());
+
+          if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN && output->n_output_frames() != in_stream->n_frames())
+            {
+              auto msg = string_printf ("unexpected EOF; input frames (%zd) != output frames (%zd)", in_stream->n_frames(), output->n_output_frames());
+              if (Params::strict)
+                {
+                  error ("audiowmark: error: %s\n", msg.c_str());
+                  discard_batch_output (*output);
+                  ret = 1;
+                  continue;
+                }
+              warning ("audiowmark: warning: %s\n", msg.c_str());
+            }
+
+          err = output->out_stream->close();
+          if (err)
+            {
+              error ("audiowmark: closing output stream %s failed: %s\n", output->filename.c_str(), err.message());
+              discard_batch_output (*output);
+              ret = 1;
+            }
+        }
+    }
+  info ("Data Blocks:  %d\n", analyzer->data_blocks());
+  return ret;
+}
+
+/*
+ * Analyzed input: the BatchAnalyzer steps for a complete input stream, kept in
+ * memory, so that the input can be watermarked with one payload at a time
+ * later, without repeating the analysis (used by hls-serve).
+ */
+class WatermarkAnalysis
+{
+public:
+  int               n_channels = 0;
+  int               sample_rate = 0;
+  size_t            n_frames = 0;
+  size_t            zero_frames = 0;
+  size_t            skip_frames = 0;
+  size_t            skip_mark_frames = 0;
+  int               data_blocks = 0;
+  vector<BatchStep> steps;
+};
+
+Error
+analyze_watermark_input (const Key& key, AudioInputStream *in_stream, size_t zero_frames, std::shared_ptr<const WatermarkAnalysis>& out_analysis)
+{
+  if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
+    return Error ("input stream length needs to be known for analysis");
+
+  Error err = MarkChannels::check (in_stream->n_channels());
+  if (err)
+    return err;
+
+  auto analysis = std::make_shared<WatermarkAnalysis>();
+  analysis->n_channels  = in_stream->n_channels();
+  analysis->sample_rate = in_stream->sample_rate();
+  analysis->n_frames    = in_stream->n_frames();
+  analysis->zero_frames = zero_frames;
+
+  BatchAnalyzer analyzer (key, in_stream, zero_frames);
+  if (!analyzer.init_ok())
+    return Error ("failed to initialize resampler");
+
+  analysis->skip_frames      = analyzer.skip_frames();
+  analysis->skip_mark_frames = analyzer.skip_mark_frames();
+
+  /* the number of steps needed for the complete output doesn't depend on the payload,
+   * so it is determined using an output for an arbitrary payload which is not written */
+  BatchOutput output (key, analysis->n_channels, analysis->sample_rate, vector<int> (Params::payload_size));
+  if (!output.init_ok (analysis->sample_rate))
+    return Error ("failed to initialize resampler");
+
+  output.skip (analysis->zero_frames, analysis->skip_frames, analysis->skip_mark_frames);
+  while (!output.done)
+    {
+      analysis->steps.emplace_back();
+      Error err = analyzer.run (analysis->steps.back());
+      if (err)
+        return err;
+
+      output.process (key, analysis->steps.back());
+    }
+  analysis->data_blocks = analyzer.data_blocks();
+
+  out_analysis = analysis;
+  return Error::Code::NONE;
+}
+
+int
+add_analyzed_watermark (const Key& key, const WatermarkAnalysis& analysis, AudioOutputStream *out_stream, const string& bits)
+{
+  auto bitvec = parse_payload (bits);
+  if (bitvec.empty())
+    return 1;
+
+  if (analysis.sample_rate != out_stream->sample_rate() || analysis.n_channels != out_stream->n_channels())
+    {
+      error ("audiowmark: input and output format don't match\n");
+      return 1;
+    }
+  info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
+  info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
+
+  size_t orig_seconds = analysis.n_frames / analysis.sample_rate;
+  info ("Time:         %zd:%02zd\n", orig_seconds / 60, orig_seconds % 60);
+  info ("Sample Rate:  %d\n", analysis.sample_rate);
+  info ("Channels:     %d\n", analysis.n_channels);
+
+  BatchOutput output (key, analysis.n_channels, analysis.sample_rate, bitvec);
+  if (!output.init_ok (analysis.sample_rate))
+    return 1;
+
+  output.out_stream = out_stream;
+  output.skip (analysis.zero_frames, analysis.skip_frames, analysis.skip_mark_frames);
+  for (const auto& step : analysis.steps)
+    output.process (key, step);
+
+  if (output.failed)
+    {
+      error ("audiowmark output write failed: %s\n", output.write_error.message());
+      return 1;
+    }
+  if (Params::snr)
+    info ("SNR:          %f dB\n", output.snr());
+
+  info ("Data Blocks:  %d\n", analysis.data_blocks);
+
+  const size_t expect_frames = analysis.n_frames + analysis.zero_frames;
+  if (output.n_output_frames() != expect_frames)
+    {
+      auto msg = string_printf ("unexpected EOF; input frames (%zd) != output frames (%zd)", expect_frames, output.n_output_frames());
+      if (Params::strict)
+        {
+          error ("audiowmark: error: %s\n", msg.c_str());
+          return 1;
+        }
+      warning ("audiowmark: warning: %s\n", msg.c_str());
+    }
+
+  Error err = out_stream->close();
+  if (err)
+    {
+      error ("audiowmark: closing output stream failed: %s\n", err.message());
+      return 1;
+    }
+  return 0;
+}
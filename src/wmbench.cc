@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "wmcommon.hh"
+#include "memorystream.hh"
+
+using std::string;
+using std::vector;
+
+/*
+ * audiowmark bench-add: add -> (codec) -> get for each combination of the
+ * parameter grid, to compare robustness and cpu cost of the settings
+ */
+
+namespace
+{
+
+struct BenchRun
+{
+  double  strength = 0;
+  int     frames_per_bit = 0;
+  string  resample_quality;
+  double  embed_realtime = 0;
+  double  detect_realtime = 0;
+  double  snr = 0;
+  int     bit_errors = -1;      // of the best match, -1: no match
+  int     expect_blocks = 0;
+  int     correct_blocks = 0;
+  size_t  n_matches = 0;
+  double  peak_rss_mb = 0;
+};
+
+const char *
+resample_quality_name (ResampleQuality quality)
+{
+  switch (quality)
+    {
+      case ResampleQuality::FAST:    return "fast";
+      case ResampleQuality::DEFAULT: return "default";
+      case ResampleQuality::BEST:    return "best";
+    }
+  return "unknown";
+}
+
+/* process wide peak resident set size (never decreases) */
+double
+peak_rss_mb()
+{
+  struct rusage usage;
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss / 1024.0; // linux: kilobytes
+}
+
+/* number of complete data blocks add writes for n_frames input frames (see WatermarkGen) */
+int
+expect_data_blocks (size_t n_frames, int sample_rate)
+{
+  const size_t frames_per_block = mark_sync_frame_count() + mark_data_frame_count();
+  const size_t n_mark_frames = n_frames * double (Params::mark_sample_rate) / sample_rate / Params::frame_size;
+  if (n_mark_frames < Params::frames_pad_start)
+    return 0;
+
+  return (n_mark_frames - Params::frames_pad_start) / frames_per_block;
+}
+
+/* replace each {in} and {out} of the codec command */
+string
+codec_command (const string& command, const string& in_file, const string& out_file)
+{
+  string result;
+  for (size_t i = 0; i < command.size(); i++)
+    {
+      if (command.compare (i, 4, "{in}") == 0)
+        {
+          result += "'" + in_file + "'";
+          i += 3;
+        }
+      else if (command.compare (i, 5, "{out}") == 0)
+        {
+          result += "'" + out_file + "'";
+          i += 4;
+        }
+      else
+        result += command[i];
+    }
+  return result;
+}
+
+/*
+ * encode and decode wm_data with the codec command, the result is stored in codec_data
+ *
+ * the files are created in a new private temporary directory, so their names can't be
+ * predicted by other users
+ */
+Error
+run_codec (const string& command, const WavData& wm_data, WavData& codec_data)
+{
+  const char *tmpdir = getenv ("TMPDIR");
+  string dir = string (tmpdir ? tmpdir : "/tmp") + "/audiowmark-bench-XXXXXX";
+
+  if (!mkdtemp (&dir[0]))
+    return Error (string_printf ("error creating temporary directory: %s", strerror (errno)));
+
+  const string wav_file = dir + "/in.wav";
+  const string out_file = dir + "/out.wav";
+
+  Error err = wm_data.save (wav_file);
+  if (!err)
+    {
+      const string cmd = codec_command (command, wav_file, out_file);
+      if (system (cmd.c_str()) != 0)
+        err = Error (string_printf ("codec command failed: %s", cmd.c_str()));
+    }
+  if (!err)
+    err = codec_data.load (out_file);
+
+  unlink (wav_file.c_str());
+  unlink (out_file.c_str());
+  if (rmdir (dir.c_str()) != 0)
+    warning ("audiowmark: failed to remove temporary directory %s: %s\n", dir.c_str(), strerror (errno));
+  return err;
+}
+
+Error
+bench_run (const Key& key, const WavData& in_data, const string& payload, const string& codec, BenchRun& run)
+{
+  const double length = double (in_data.n_frames()) / in_data.sample_rate();
+  const Log    log_level = get_log_level();
+
+  /* add */
+  vector<float> wm_samples;
+  MemoryInputStream  in_stream (in_data.samples().data(), in_data.n_frames(), in_data.n_channels(), in_data.sample_rate());
+  MemoryOutputStream out_stream (wm_samples, in_data.n_channels(), in_data.sample_rate());
+
+  set_log_level (Log::ERROR);
+  double start_time = get_time();
+  int rc = add_stream_watermark (key, &in_stream, &out_stream, payload, 0, &run.snr);
+  run.embed_realtime = length / (get_time() - start_time);
+  set_log_level (log_level);
+
+  if (rc != 0)
+    return Error ("adding watermark failed");
+
+  WavData wm_data (wm_samples, in_data.n_channels(), in_data.sample_rate(), in_data.bit_depth());
+  if (!codec.empty())
+    {
+      WavData codec_data;
+      Error err = run_codec (codec, wm_data, codec_data);
+      if (err)
+        return err;
+      wm_data = codec_data;
+    }
+
+  /* get */
+  AudioWmark::Detector::Result result;
+  std::unique_ptr<AudioInputStream> get_stream (new MemoryInputStream (wm_data.samples().data(), wm_data.n_frames(),
+                                                                       wm_data.n_channels(), wm_data.sample_rate()));
+  set_log_level (Log::ERROR);
+  start_time = get_time();
+  Error err = get_watermark_matches ({ key }, std::move (get_stream), result);
+  run.detect_realtime = double (wm_data.n_frames()) / wm_data.sample_rate() / (get_time() - start_time);
+  set_log_level (log_level);
+
+  if (err)
+    return err;
+
+  /* the matches are sorted by relevance: use the first match for the bit error rate */
+  const vector<int> payload_bits = parse_payload (payload);
+  run.n_matches = result.matches.size();
+  if (!result.matches.empty())
+    {
+      const vector<int> bits = parse_payload (result.matches[0].bits);
+
+      run.bit_errors = 0;
+      for (size_t i = 0; i < payload_bits.size(); i++)
+        run.bit_errors += (i >= bits.size() || bits[i] != payload_bits[i]);
+    }
+  /* block error rate: data blocks that were decoded correctly on their own */
+  run.expect_blocks = expect_data_blocks (in_data.n_frames(), in_data.sample_rate());
+  for (const auto& match : result.matches)
+    {
+      if ((match.type == "A" || match.type == "B") && parse_payload (match.bits) == payload_bits)
+        run.correct_blocks++;
+    }
+  run.peak_rss_mb = peak_rss_mb();
+  return Error::Code::NONE;
+}
+
+}
+
+int
+bench_add (const Key& key, const string& infile, const BenchAddGrid& grid, const string& json_file)
+{
+  WavData in_data;
+  Error err = in_data.load (infile);
+  if (err)
+    {
+      error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+
+  string payload = grid.payload;
+  if (payload.empty())
+    payload = string ("0123456789abcdef0011223344556677").substr (0, Params::payload_size / 4);
+  if (parse_payload (payload).empty())
+    return 1;
+
+  /* grid values, the current settings are used for dimensions without values */
+  const vector<double> strengths = grid.strengths.size() ? grid.strengths : vector<double> { Params::water_delta * 1000 };
+  const vector<int> frames_per_bit = grid.frames_per_bit.size() ? grid.frames_per_bit : vector<int> { Params::frames_per_bit };
+  const vector<ResampleQuality> resample_qualities = grid.resample_qualities.size() ? grid.resample_qualities : vector<ResampleQuality> { Params::resample_quality };
+
+  const double saved_water_delta = Params::water_delta;
+  const int saved_frames_per_bit = Params::frames_per_bit;
+  const ResampleQuality saved_resample_quality = Params::resample_quality;
+
+  vector<BenchRun> runs;
+  for (auto fpb : frames_per_bit)
+    {
+      for (auto quality : resample_qualities)
+        {
+          for (auto strength : strengths)
+            {
+              Params::water_delta = strength / 1000;
+              Params::frames_per_bit = fpb;
+              Params::resample_quality = quality;
+
+              BenchRun run;
+              run.strength = strength;
+              run.frames_per_bit = fpb;
+              run.resample_quality = resample_quality_name (quality);
+
+              err = bench_run (key, in_data, payload, grid.codec, run);
+              if (err)
+                break;
+
+              info ("strength %5.1f  frames-per-bit %d  resample-quality %-7s  add %6.1fx  get %6.1fx  snr %5.1f dB  bit errors %d  blocks %d/%d\n",
+                    run.strength, run.frames_per_bit, run.resample_quality.c_str(), run.embed_realtime, run.detect_realtime,
+                    run.snr, run.bit_errors, run.correct_blocks, run.expect_blocks);
+              runs.push_back (run);
+            }
+          if (err)
+            break;
+        }
+      if (err)
+        break;
+    }
+  Params::water_delta = saved_water_delta;
+  Params::frames_per_bit = saved_frames_per_bit;
+  Params::resample_quality = saved_resample_quality;
+
+  if (err)
+    {
+      error ("audiowmark: bench-add failed: %s\n", err.message());
+      return 1;
+    }
+
+  const size_t n_bits = parse_payload (payload).size();
+
+  string out = "{\n";
+  out += string_printf ("  \"input\": \"%s\",\n", json_escape (infile).c_str());
+  out += string_printf ("  \"length\": %f,\n", double (in_data.n_frames()) / in_data.sample_rate());
+  out += string_printf ("  \"sample_rate\": %d,\n", in_data.sample_rate());
+  out += string_printf ("  \"channels\": %d,\n", in_data.n_channels());
+  out += string_printf ("  \"payload\": \"%s\",\n", payload.c_str());
+  out += string_printf ("  \"codec\": %s,\n", grid.codec.empty() ? "null" : ("\"" + json_escape (grid.codec) + "\"").c_str());
+  out += "  \"runs\": [\n";
+  for (size_t i = 0; i < runs.size(); i++)
+    {
+      const BenchRun& r = runs[i];
+      out += "    {\n";
+      out += string_printf ("      \"strength\": %f,\n", r.strength);
+      out += string_printf ("      \"frames_per_bit\": %d,\n", r.frames_per_bit);
+      out += string_printf ("      \"resample_quality\": \"%s\",\n", r.resample_quality.c_str());
+      out += string_printf ("      \"embed_realtime\": %f,\n", r.embed_realtime);
+      out += string_printf ("      \"detect_realtime\": %f,\n", r.detect_realtime);
+      out += string_printf ("      \"snr\": %f,\n", r.snr);
+      if (r.bit_errors >= 0)
+        out += string_printf ("      \"ber\": %f,\n", double (r.bit_errors) / n_bits);
+      else
+        out += "      \"ber\": null,\n";
+      if (r.expect_blocks > 0)
+        out += string_printf ("      \"fer\": %f,\n", 1 - double (std::min (r.correct_blocks, r.expect_blocks)) / r.expect_blocks);
+      else
+        out += "      \"fer\": null,\n";
+      out += string_printf ("      \"matches\": %zd,\n", r.n_matches);
+      out += string_printf ("      \"peak_rss_mb\": %f\n", r.peak_rss_mb);
+      out += string_printf ("    }%s\n", i + 1 < runs.size() ? "," : "");
+    }
+  out += "  ]\n";
+  out += "}\n";
+
+  if (json_file.empty() || json_file == "-")
+    {
+      fputs (out.c_str(), stdout);
+    }
+  else
+    {
+      FILE *file = fopen (json_file.c_str(), "w");
+      if (!file)
+        {
+          error ("audiowmark: failed to open output file '%s': %s\n", json_file.c_str(), strerror (errno));
+          return 1;
+        }
+      fputs (out.c_str(), file);
+      if (fclose (file) != 0)
+        {
+          error ("audiowmark: failed to write output file '%s': %s\n", json_file.c_str(), strerror (errno));
+          return 1;
+        }
+    }
+  return 0;
+}
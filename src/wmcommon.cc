@@ -15,6 +15,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <float.h>
+#include <string.h>
+
 #include "wmcommon.hh"
 #include "fft.hh"
 #include "convcode.hh"
@@ -29,21 +32,39 @@ double Params::water_delta     = 0.01;
 bool   Params::mix             = true;
 bool   Params::hard            = false; // hard decode bits? (soft decoding is better)
 bool   Params::snr             = false; // compute/show snr while adding watermark
+bool   Params::mark_downmix    = false;
+bool   Params::mark_native_rate = false;
+double Params::add_low_latency = 0;
 bool   Params::strict          = false;
 bool   Params::detect_speed    = false;
 bool   Params::detect_speed_patient = false;
 double Params::try_speed       = -1;
 double Params::test_speed      = -1;
+SpeedEngine Params::speed_engine = SpeedEngine::FULL;
+ResampleQuality Params::resample_quality = ResampleQuality::DEFAULT;
 double Params::sync_threshold2 = 0.35;
 int    Params::get_n_best      = 8;
 size_t Params::payload_size    = 128;
 bool   Params::payload_short   = false;
+bool   Params::short_nearest   = false;
 int    Params::test_cut        = 0; // for sync test
 bool   Params::test_no_sync    = false; // disable sync
 bool   Params::test_no_limiter = false; // disable limiter
 int    Params::test_truncate   = 0;
 int    Params::expect_matches  = -1;
 double Params::get_chunk_size  = 30;
+bool   Params::get_stream      = false;
+bool   Params::get_live        = false;
+bool   Params::get_screen      = false;
+double Params::silence_threshold = -INFINITY;
+bool   Params::compact_samples = false;
+int    Params::get_min_matches = 0;
+double Params::get_time_budget = 0;
+double Params::get_sample_every  = 0;
+double Params::get_sample_length = 120;
+double Params::get_range_start   = -1;
+double Params::get_range_end     = INFINITY;
+size_t Params::max_memory        = 0;
 
 Format Params::input_format     = Format::AUTO;
 Format Params::output_format    = Format::AUTO;
@@ -53,7 +74,11 @@ RawFormat Params::raw_output_format;
 
 int    Params::hls_bit_rate = 0;
 
+vector<int> Params::mark_channels;
+
 string Params::json_output;
+string Params::ndjson_output;
+string Params::key_cache_dir;
 string Params::input_label;
 string Params::output_label;
 
@@ -88,65 +113,472 @@ FFTAnalyzer::gen_normalized_window (size_t n_values)
   return window;
 }
 
-vector<vector<complex<float>>>
-FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index)
+/*
+ * analyze one channel of the frame starting at start_index
+ *
+ * out must have space for Params::frame_size / 2 + 1 values; aligned memory
+ * (see AlignedArray) avoids copying the fft result
+ */
+void
+FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index, int ch, complex<float> *out)
 {
   assert (samples.size() >= (Params::frame_size + start_index) * m_n_channels);
 
-  float *frame     = m_fft_processor.in();
-  float *frame_fft = m_fft_processor.out();
+  run_fft (&samples[start_index * m_n_channels], 1, ch, out);
+}
 
-  vector<vector<complex<float>>> fft_out;
+/* like run_fft() above, padding of the view is analyzed as zeros */
+void
+FFTAnalyzer::run_fft (const WavView& wav_view, size_t start_index, int ch, complex<float> *out)
+{
+  assert (wav_view.n_frames() >= Params::frame_size + start_index);
+
+  /* compact samples are converted while applying the window */
+  const int16_t *compact_samples = wav_view.compact_frames (start_index, Params::frame_size);
+  if (compact_samples)
+    {
+      run_fft (compact_samples, WavData::compact_scale, ch, out);
+      return;
+    }
+  if (wav_view.need_scratch())
+    m_pad_scratch.resize (std::max<size_t> (m_pad_scratch.size(), Params::frame_size * m_n_channels));
+  run_fft (wav_view.frames (start_index, Params::frame_size, m_pad_scratch.data()), 1, ch, out);
+}
+
+/* deinterleave channel ch of frame_samples and apply the window, scaled by scale */
+template<class Sample> static inline void
+window_channel (const Sample *frame_samples, int n_channels, int ch, const float *window, float scale, float *frame)
+{
+  size_t pos = ch;
+  for (size_t x = 0; x < Params::frame_size; x++)
+    {
+      frame[x] = frame_samples[pos] * (window[x] * scale);
+      pos += n_channels;
+    }
+}
+
+/* deinterleave all channels of frame_samples (one after another) and apply the window, scaled by scale */
+template<class Sample> static inline void
+window_frame (const Sample *frame_samples, int n_channels, const float *window, float scale, float *frame)
+{
+  for (size_t x = 0; x < Params::frame_size; x++)
+    {
+      const float w = window[x] * scale;
+      for (int ch = 0; ch < n_channels; ch++)
+        frame[ch * Params::frame_size + x] = frame_samples[ch] * w;
+
+      frame_samples += n_channels;
+    }
+}
+
+/* analyze channel ch of the interleaved frame_samples (sample values are multiplied by scale) */
+void
+FFTAnalyzer::run_fft (const float *frame_samples, float scale, int ch, complex<float> *out)
+{
+  float *frame = m_fft_processor.in();
+
+  window_channel (frame_samples, m_n_channels, ch, m_window.data(), scale, frame);
+  m_fft_processor.fft (frame, out);
+}
+
+void
+FFTAnalyzer::run_fft (const int16_t *frame_samples, float scale, int ch, complex<float> *out)
+{
+  float *frame = m_fft_processor.in();
+
+  window_channel (frame_samples, m_n_channels, ch, m_window.data(), scale, frame);
+  m_fft_processor.fft (frame, out);
+}
+
+/* like run_fft() below, but reuses the memory of fft_out */
+void
+FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index, vector<vector<complex<float>>>& fft_out)
+{
+  fft_out.resize (m_n_channels);
   for (int ch = 0; ch < m_n_channels; ch++)
     {
-      size_t pos = start_index * m_n_channels + ch;
-      assert (pos + (Params::frame_size - 1) * m_n_channels < samples.size());
+      fft_out[ch].resize (Params::frame_size / 2 + 1);
+      run_fft (samples, start_index, ch, fft_out[ch].data());
+    }
+}
 
-      /* deinterleave frame data and apply window */
-      for (size_t x = 0; x < Params::frame_size; x++)
+vector<vector<complex<float>>>
+FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index)
+{
+  vector<vector<complex<float>>> fft_out;
+  run_fft (samples, start_index, fft_out);
+  return fft_out;
+}
+
+/*
+ * analyze all channels of n_frames frames (at most max_batch_frames) with one
+ * batched fft, frame f starts at start_index[f]
+ *
+ * the result contains Params::frame_size / 2 + 1 values for each frame and
+ * channel (frame 0 channel 0, frame 0 channel 1, ...), it remains valid until
+ * the next call
+ */
+const complex<float> *
+FFTAnalyzer::run_fft_batch (const vector<float>& samples, const size_t *start_index, size_t n_frames)
+{
+  assert (n_frames <= max_batch_frames);
+
+  const float *frame_samples[max_batch_frames];
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      assert (samples.size() >= (Params::frame_size + start_index[f]) * m_n_channels);
+
+      frame_samples[f] = &samples[start_index[f] * m_n_channels];
+    }
+  return run_fft_batch (frame_samples, nullptr, n_frames);
+}
+
+/* like run_fft_batch() above, padding of the view is analyzed as zeros */
+const complex<float> *
+FFTAnalyzer::run_fft_batch (const WavView& wav_view, const size_t *start_index, size_t n_frames)
+{
+  assert (n_frames <= max_batch_frames);
+
+  /* scratch space is only used for frames which overlap with the padding */
+  const size_t frame_values = Params::frame_size * m_n_channels;
+  if (wav_view.need_scratch())
+    m_pad_scratch.resize (max_batch_frames * frame_values);
+
+  const float   *frame_samples[max_batch_frames];
+  const int16_t *compact_samples[max_batch_frames];
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      assert (wav_view.n_frames() >= Params::frame_size + start_index[f]);
+
+      /* compact samples are converted while applying the window */
+      compact_samples[f] = wav_view.compact_frames (start_index[f], Params::frame_size);
+      frame_samples[f] = nullptr;
+      if (!compact_samples[f])
         {
-          frame[x] = samples[pos] * m_window[x];
-          pos += m_n_channels;
+          float *scratch = wav_view.need_scratch() ? &m_pad_scratch[f * frame_values] : nullptr;
+          frame_samples[f] = wav_view.frames (start_index[f], Params::frame_size, scratch);
         }
-      /* FFT transform */
-      m_fft_processor.fft();
+    }
+  return run_fft_batch (frame_samples, compact_samples, n_frames);
+}
 
-      /* complex<float> and frame_fft have the same layout in memory */
-      const complex<float> *first = (complex<float> *) frame_fft;
-      const complex<float> *last  = first + Params::frame_size / 2 + 1;
-      fft_out.emplace_back (first, last);
+/*
+ * batched fft of the interleaved frames frame_samples[0..n_frames), if
+ * compact_samples is not null, frames with compact_samples[f] set use the
+ * compact samples instead
+ */
+const complex<float> *
+FFTAnalyzer::run_fft_batch (const float **frame_samples, const int16_t **compact_samples, size_t n_frames)
+{
+  if (!m_batch_processor)
+    m_batch_processor.reset (new FFTBatchProcessor (Params::frame_size, max_batch_frames * m_n_channels));
+
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      float *frame = m_batch_processor->in() + f * m_n_channels * Params::frame_size;
+
+      if (compact_samples && compact_samples[f])
+        window_frame (compact_samples[f], m_n_channels, m_window.data(), WavData::compact_scale, frame);
+      else
+        window_frame (frame_samples[f], m_n_channels, m_window.data(), 1, frame);
     }
+  m_batch_processor->fft (n_frames * m_n_channels);
 
-  return fft_out;
+  return m_batch_processor->out();
 }
 
-vector<vector<complex<float>>>
-FFTAnalyzer::fft_range (const vector<float>& samples, size_t start_index, size_t frame_count)
+SilenceMap::SilenceMap (const vector<float>& samples, int n_channels)
 {
-  vector<vector<complex<float>>> fft_out;
+  if (!enabled())
+    return;
 
-  /* if there is not enough space for frame_count values, return an error (empty vector) */
-  if (samples.size() < (start_index + frame_count * Params::frame_size) * m_n_channels)
-    return fft_out;
+  const double threshold = pow (10, Params::silence_threshold / 10) * block_size * n_channels;
+  const size_t n_blocks  = (samples.size() / n_channels + block_size - 1) / block_size;
 
-  for (size_t f = 0; f < frame_count; f++)
+  m_loud_blocks.resize (n_blocks + 1);
+  for (size_t b = 0; b < n_blocks; b++)
     {
-      const size_t frame_start = (f * Params::frame_size) + start_index;
+      const size_t start = b * block_size * n_channels;
+      const size_t end   = std::min (start + block_size * n_channels, samples.size());
+
+      float energy = 0;
+      for (size_t i = start; i < end; i++)
+        energy += samples[i] * samples[i];
 
-      vector<vector<complex<float>>> frame_result = run_fft (samples, frame_start);
-      for (auto& fr : frame_result)
-        fft_out.emplace_back (std::move (fr));
+      /* a partial block at the end is compared as if it was padded with zeros */
+      m_loud_blocks[b + 1] = m_loud_blocks[b] + (energy >= threshold);
     }
-  return fft_out;
 }
 
-BitPosGen::BitPosGen (const Key& key)
+/* like the constructor above, padding of the view is silent */
+SilenceMap::SilenceMap (const WavView& wav_view)
+{
+  if (!enabled())
+    return;
+
+  const int    n_channels = wav_view.n_channels();
+  const double threshold  = pow (10, Params::silence_threshold / 10) * block_size * n_channels;
+  const size_t n_frames   = wav_view.n_frames();
+  const size_t n_blocks   = (n_frames + block_size - 1) / block_size;
+
+  vector<float> scratch (wav_view.need_scratch() ? block_size * n_channels : 0);
+
+  m_loud_blocks.resize (n_blocks + 1);
+  for (size_t b = 0; b < n_blocks; b++)
+    {
+      const size_t start = b * block_size;
+      const size_t len   = std::min (size_t (block_size), n_frames - start);
+      const float *samples = wav_view.frames (start, len, scratch.data());
+
+      float energy = 0;
+      for (size_t i = 0; i < len * n_channels; i++)
+        energy += samples[i] * samples[i];
+
+      m_loud_blocks[b + 1] = m_loud_blocks[b] + (energy >= threshold);
+    }
+}
+
+bool
+SilenceMap::enabled()
+{
+  return Params::silence_threshold > -INFINITY;
+}
+
+/* true if all blocks which overlap with the n_frames sample frames starting at index are silent */
+bool
+SilenceMap::silent (size_t index, size_t n_frames) const
+{
+  if (m_loud_blocks.empty() || n_frames == 0)
+    return false;
+
+  const size_t n_blocks = m_loud_blocks.size() - 1;
+  const size_t first = std::min (index / block_size, n_blocks);
+  const size_t last  = std::min ((index + n_frames - 1) / block_size + 1, n_blocks);
+  return m_loud_blocks[last] == m_loud_blocks[first];
+}
+
+double TimeBudget::s_deadline = 0;
+
+void
+TimeBudget::start()
+{
+  s_deadline = Params::get_time_budget > 0 ? get_time() + Params::get_time_budget : 0;
+}
+
+/* deadline for ThreadPool::set_deadline(), 0 without time budget */
+double
+TimeBudget::deadline()
+{
+  return s_deadline;
+}
+
+bool
+TimeBudget::expired()
+{
+  return s_deadline > 0 && get_time() > s_deadline;
+}
+
+static bool
+speed_search_enabled()
+{
+  return Params::detect_speed || Params::detect_speed_patient;
+}
+
+static size_t
+speed_search_share()
+{
+  return speed_search_enabled() ? Params::max_memory / 4 : 0;
+}
+
+static size_t
+chunk_share()
+{
+  return Params::max_memory - Params::max_memory / 8 - speed_search_share();
+}
+
+/* estimated bytes per sample frame of an input chunk */
+static double
+chunk_frame_bytes (int n_channels, bool compact)
+{
+  constexpr size_t n_bands = Params::max_band - Params::min_band + 1;
+  constexpr size_t cache_entry_bytes = 64; // hash table entry of one spectrum cache frame
+
+  /* spectrum cache: the sync search analyzes one frame per sync search step */
+  const double cache_bytes = double (n_channels * n_bands * sizeof (float) + cache_entry_bytes) / Params::sync_search_step;
+  const size_t sample_bytes = compact ? sizeof (int16_t) : sizeof (float);
+
+  /* samples of the chunk and the prefetch buffer for the next chunk */
+  double bytes = 2 * n_channels * sample_bytes + cache_bytes;
+
+  /* speed correction: resampled copy of the chunk with its own spectrum cache */
+  if (speed_search_enabled() || Params::try_speed > 0)
+    bytes += n_channels * sizeof (float) + cache_bytes;
+  return bytes;
+}
+
+bool
+MemoryBudget::enabled()
+{
+  return Params::max_memory > 0;
+}
+
+/* limit the number of worker threads to the thread share of the budget */
+size_t
+MemoryBudget::max_threads (size_t n_threads)
+{
+  if (!enabled())
+    return n_threads;
+  return std::max<size_t> (std::min (n_threads, Params::max_memory / 8 / thread_bytes), 1);
+}
+
+/* limit the number of speed search units that are prepared at the same time */
+size_t
+MemoryBudget::max_speed_units (size_t n_units, size_t unit_bytes)
+{
+  if (!enabled())
+    return n_units;
+  return std::max<size_t> (std::min (n_units, speed_search_share() / unit_bytes), 1);
+}
+
+/* maximum number of sample frames of one input chunk */
+size_t
+MemoryBudget::max_chunk_frames (int n_channels, bool compact)
+{
+  return chunk_share() / chunk_frame_bytes (n_channels, compact);
+}
+
+/* smallest budget (in bytes) for chunks of chunk_frames sample frames */
+size_t
+MemoryBudget::min_memory (size_t chunk_frames, int n_channels, bool compact)
+{
+  const double chunk_fraction = speed_search_enabled() ? 5 / 8. : 7 / 8.;
+  return chunk_frames * chunk_frame_bytes (n_channels, compact) / chunk_fraction;
+}
+
+/*
+ * Fast dB conversion for a range of complex values, used for the fft bands in
+ * the decoder. The scalar db_from_complex uses log2f, which cannot be
+ * vectorized by the compiler. Here we use
+ *
+ *   log2 (x) = k + log2 (m), x = m * 2^k, sqrt (0.5) <= m < sqrt (2)
+ *
+ * where log2 (m) is computed using the series 2 / ln (2) * atanh (s) with
+ * s = (m - 1) / (m + 1), |s| < 0.172.
+ *
+ * Tolerance: the difference to the scalar version is at most 1e-6 * max (|dB|, 1)
+ * (a few float ulps, checked by testdbkernel), so for typical values (between
+ * -400 dB and 100 dB) the absolute error is below 0.0004 dB.
+ *
+ * On x86 we build an extra AVX2 version of the loop and select it at runtime;
+ * on other architectures (like NEON on aarch64) the compiler vectorizes the
+ * generic version. No FMA is used, so all versions produce identical results.
+ */
+static inline uint32_t
+float_bits (float f)
+{
+  uint32_t i;
+  memcpy (&i, &f, sizeof (i));
+  return i;
+}
+
+static inline float
+bits_float (uint32_t i)
+{
+  float f;
+  memcpy (&f, &i, sizeof (f));
+  return f;
+}
+
+/*
+ * all selects are done with integer bit masks; the compiler doesn't vectorize
+ * floating point selects (possible traps) unless -fno-trapping-math is used
+ */
+static inline void __attribute__((always_inline))
+db_from_complex_loop (const float *in, float *out, size_t n, float min_db)
+{
+  constexpr float log2_db_factor = 3.01029995663981; // 10 / log2 (10)
+  constexpr float c1 = 2.88539008177792681472;       // 2 / ln (2)
+  constexpr float c3 = c1 / 3;
+  constexpr float c5 = c1 / 5;
+  constexpr float c7 = c1 / 7;
+  constexpr float c9 = c1 / 9;
+
+  const uint32_t min_db_bits = float_bits (min_db);
+
+  for (size_t i = 0; i < n; i++)
+    {
+      const float re = in[i * 2];
+      const float im = in[i * 2 + 1];
+      const float abs2 = re * re + im * im;
+      const uint32_t abs2_bits = float_bits (abs2);
+
+      /* scale denormals into the normal range by multiplying with 2^64 */
+      const uint32_t denormal_mask = -uint32_t (abs2_bits < 0x00800000);
+      const float    x = abs2 * bits_float ((0x5f800000 & denormal_mask) | (0x3f800000 & ~denormal_mask));
+
+      /* split x into exponent k and mantissa m in [sqrt (0.5), sqrt (2)) */
+      const uint32_t ix = float_bits (x);
+      const uint32_t tmp = ix - 0x3f3504f3; /* 0x3f3504f3 = sqrt (0.5) */
+      const int      k = (int32_t (tmp) >> 23) - int (64 & denormal_mask);
+      const float    m = bits_float (ix - (tmp & 0xff800000));
+
+      const float s = (m - 1) / (m + 1);
+      const float s2 = s * s;
+      const float log2_m = s * (c1 + s2 * (c3 + s2 * (c5 + s2 * (c7 + s2 * c9))));
+      const float db = (float (k) + log2_m) * log2_db_factor;
+
+      /* abs2 == 0 => min_db */
+      const uint32_t zero_mask = -uint32_t (abs2_bits == 0);
+      out[i] = bits_float ((min_db_bits & zero_mask) | (float_bits (db) & ~zero_mask));
+    }
+}
+
+static void AUDIOWMARK_EXTRA_OPT
+db_from_complex_generic (const float *in, float *out, size_t n, float min_db)
+{
+  db_from_complex_loop (in, out, n, min_db);
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+static void AUDIOWMARK_EXTRA_OPT __attribute__((target ("avx2")))
+db_from_complex_avx2 (const float *in, float *out, size_t n, float min_db)
+{
+  db_from_complex_loop (in, out, n, min_db);
+}
+
+/* safe to call from any thread */
+bool
+have_avx2()
+{
+  static bool avx2 = __builtin_cpu_supports ("avx2");
+  return avx2;
+}
+#endif
+
+/* safe to call from any thread */
+void
+db_from_complex (const std::complex<float> *in, float *out, size_t n, float min_db)
+{
+  /* complex<float> has the same layout in memory as float[2] */
+  const float *in_floats = reinterpret_cast<const float *> (in);
+
+#if defined (__x86_64__) || defined (__i386__)
+  if (have_avx2())
+    {
+      db_from_complex_avx2 (in_floats, out, n, min_db);
+      return;
+    }
+#endif
+  db_from_complex_generic (in_floats, out, n, min_db);
+}
+
+BitPosGen::BitPosGen (Random& random)
 {
   int frame_count = mark_data_frame_count() + mark_sync_frame_count();
   for (int i = 0; i < frame_count; i++)
     pos_vec.push_back (i);
 
-  Random random (key, 0, Random::Stream::frame_position);
+  random.seed (0, Random::Stream::frame_position);
   random.shuffle (pos_vec);
 }
 
@@ -176,35 +608,16 @@ mark_sync_frame_count()
   return Params::sync_bits * Params::sync_frames_per_bit;
 }
 
-vector<MixEntry>
-gen_mix_entries (const Key& key)
+int
+frame_count (const WavData& wav_data)
 {
-  const int frame_count = mark_data_frame_count();
-  vector<MixEntry> mix_entries (frame_count * Params::bands_per_frame);
-
-  UpDownGen up_down_gen (key, Random::Stream::data_up_down);
-  BitPosGen bit_pos_gen (key);
-  int entry = 0;
-  for (int f = 0; f < frame_count; f++)
-    {
-      const int index = bit_pos_gen.data_frame (f);
-      UpDownArray up, down;
-      up_down_gen.get (f, up, down);
-
-      assert (up.size() == down.size());
-      for (size_t i = 0; i < up.size(); i++)
-        mix_entries[entry++] = { index, up[i], down[i] };
-    }
-  Random random (key, /* seed */ 0, Random::Stream::mix);
-  random.shuffle (mix_entries);
-
-  return mix_entries;
+  return wav_data.n_values() / wav_data.n_channels() / Params::frame_size;
 }
 
 int
-frame_count (const WavData& wav_data)
+frame_count (const WavView& wav_view)
 {
-  return wav_data.n_values() / wav_data.n_channels() / Params::frame_size;
+  return wav_view.n_frames() / Params::frame_size;
 }
 
 vector<int>
@@ -20,15 +20,20 @@
 
 #include <array>
 #include <complex>
+#include <functional>
+#include <memory>
 
 #include "random.hh"
 #include "rawinputstream.hh"
 #include "wavdata.hh"
 #include "fft.hh"
+#include "libaudiowmark.hh"
 
 #include <assert.h>
 
 enum class Format { AUTO = 1, RAW, RF64, WAV_PIPE };
+enum class SpeedEngine { FULL, COARSE };
+enum class ResampleQuality { FAST, DEFAULT, BEST };
 
 class Params
 {
@@ -41,18 +46,26 @@ public:
 
   static           double water_delta;
   static           std::string json_output;
+  static           std::string ndjson_output;      // get --ndjson: write JSON lines while processing the input
   static           bool strict;
   static           bool mix;
   static           bool hard;                      // hard decode bits? (soft decoding is better)
   static           bool snr;                       // compute/show snr while adding watermark
+  static           std::vector<int> mark_channels; // add --mark-channels: channels to watermark (empty: all channels)
+  static           bool mark_downmix;              // add --mark-downmix: watermark the downmix of the channels
+  static           bool mark_native_rate;          // add --native-rate: generate the watermark at the input sample rate
+  static           double add_low_latency;         // add --low-latency: bound for the delay of the output in milliseconds (0: off)
 
   static           bool detect_speed;
   static           bool detect_speed_patient;
   static           double try_speed;               // manual speed correction
   static           double test_speed;              // for debugging --detect-speed
+  static           SpeedEngine speed_engine;       // --speed-engine: full or coarse grid search
+  static           ResampleQuality resample_quality; // --resample-quality: filter length of the resamplers
 
   static           size_t payload_size;            // number of payload bits for the watermark
   static           bool   payload_short;
+  static           bool   short_nearest;           // get --short-nearest: correct bit errors of short payloads
 
   static constexpr int sync_bits           = 6;
   static constexpr int sync_frames_per_bit = 85;
@@ -68,6 +81,19 @@ public:
   static constexpr double limiter_ceiling       = 0.99;
 
   static           double get_chunk_size;          // chunk size for audiowmark get to reduce memory usage
+  static           std::string key_cache_dir;      // directory for KeyTables cache files (empty: no disk cache)
+  static           bool   get_stream;              // streaming audiowmark get: small analysis window, incremental output
+  static           bool   get_live;                // live audiowmark get: like streaming, but low latency and JSON lines output
+  static           bool   get_screen;              // audiowmark get --screen: only estimate if a watermark is present (sync search only)
+  static           double silence_threshold;       // audiowmark get --silence-threshold: skip frames below this level (dB)
+  static           bool   compact_samples;         // audiowmark get --compact-samples: store input chunks with 16 bits per sample
+  static           int    get_min_matches;         // audiowmark get --min-matches: stop after this many matches of one message (0: off)
+  static           double get_time_budget;         // audiowmark get --time-budget: stop detection after this many seconds (0: off)
+  static           double get_sample_every;        // audiowmark get --sample-every: only decode windows starting every n seconds (0: off)
+  static           double get_sample_length;       // audiowmark get --sample-length: length of these windows in seconds
+  static           double get_range_start;         // audiowmark get --range: start of the analyzed part of the input in seconds (-1: off)
+  static           double get_range_end;           // audiowmark get --range: end of the analyzed part (INFINITY: end of input)
+  static           size_t max_memory;              // --max-memory: memory budget of audiowmark get in bytes (0: unlimited)
 
   static           int test_cut; // for sync test
   static           bool test_no_sync;
@@ -92,32 +118,41 @@ typedef std::array<int, 30> UpDownArray;
 class UpDownGen
 {
   Random::Stream    random_stream;
-  Random            random;
+  Random&           random;
   std::vector<int>  bands_reorder;
 
 public:
-  UpDownGen (const Key& key, Random::Stream random_stream) :
+  UpDownGen (Random& random, Random::Stream random_stream) :
     random_stream (random_stream),
-    random (key, 0, random_stream),
+    random (random),
     bands_reorder (Params::max_band - Params::min_band + 1)
   {
     UpDownArray x;
     assert (x.size() == Params::bands_per_frame);
   }
+  /* up/down bands for frames 0..n_frames-1, the random numbers for all frames are generated at once */
   void
-  get (int f, UpDownArray& up, UpDownArray& down)
+  get_all (size_t n_frames, std::vector<UpDownArray>& up, std::vector<UpDownArray>& down)
   {
-    for (size_t i = 0; i < bands_reorder.size(); i++)
-      bands_reorder[i] = Params::min_band + i;
+    /* use per frame random seed */
+    std::vector<uint64_t> random_numbers;
+    random.seed_values (0, n_frames, random_stream, bands_reorder.size(), random_numbers);
 
-    random.seed (f, random_stream); // use per frame random seed
-    random.shuffle (bands_reorder);
-
-    assert (2 * Params::bands_per_frame < bands_reorder.size());
-    for (size_t i = 0; i < Params::bands_per_frame; i++)
+    up.resize (n_frames);
+    down.resize (n_frames);
+    for (size_t f = 0; f < n_frames; f++)
       {
-        up[i]   = bands_reorder[i];
-        down[i] = bands_reorder[Params::bands_per_frame + i];
+        for (size_t i = 0; i < bands_reorder.size(); i++)
+          bands_reorder[i] = Params::min_band + i;
+
+        Random::shuffle (bands_reorder, &random_numbers[f * bands_reorder.size()]);
+
+        assert (2 * Params::bands_per_frame < bands_reorder.size());
+        for (size_t i = 0; i < Params::bands_per_frame; i++)
+          {
+            up[f][i]   = bands_reorder[i];
+            down[f][i] = bands_reorder[Params::bands_per_frame + i];
+          }
       }
   }
 };
@@ -127,7 +162,7 @@ class BitPosGen
   std::vector<int> pos_vec;
 
 public:
-  BitPosGen (const Key& key);
+  BitPosGen (Random& random);
   int sync_frame (int f);
   int data_frame (int f);
 };
@@ -137,15 +172,87 @@ class FFTAnalyzer
   int           m_n_channels = 0;
   std::vector<float> m_window;
   FFTProcessor  m_fft_processor;
+  std::unique_ptr<FFTBatchProcessor> m_batch_processor;
+  std::vector<float> m_pad_scratch;
+
+  void run_fft (const float *frame_samples, float scale, int ch, std::complex<float> *out);
+  void run_fft (const int16_t *frame_samples, float scale, int ch, std::complex<float> *out);
+  const std::complex<float> *run_fft_batch (const float **frame_samples, const int16_t **compact_samples, size_t n_frames);
 public:
+  /* maximum number of frames for run_fft_batch() */
+  static constexpr size_t max_batch_frames = 16;
+
   FFTAnalyzer (int n_channels);
 
+  const std::complex<float> *run_fft_batch (const std::vector<float>& samples, const size_t *start_index, size_t n_frames);
+  const std::complex<float> *run_fft_batch (const WavView& wav_view, const size_t *start_index, size_t n_frames);
+
+  void run_fft (const std::vector<float>& samples, size_t start_index, int ch, std::complex<float> *out);
+  void run_fft (const WavView& wav_view, size_t start_index, int ch, std::complex<float> *out);
+  void run_fft (const std::vector<float>& samples, size_t start_index, std::vector<std::vector<std::complex<float>>>& fft_out);
   std::vector<std::vector<std::complex<float>>> run_fft (const std::vector<float>& samples, size_t start_index);
-  std::vector<std::vector<std::complex<float>>> fft_range (const std::vector<float>& samples, size_t start_index, size_t frame_count);
 
   static std::vector<float> gen_normalized_window (size_t n_values);
 };
 
+/*
+ * The SilenceMap stores which blocks of block_size sample frames of the
+ * samples have an energy (mean square of all channels) below
+ * Params::silence_threshold. It is computed once, after that silent() tells
+ * in O(1) if a range of samples is silent, so that the detection stages can
+ * skip frames which cannot contain any watermark energy.
+ *
+ * Silence detection is disabled by default (silence_threshold is -inf), in
+ * this case silent() always returns false.
+ */
+class SilenceMap
+{
+  std::vector<uint32_t> m_loud_blocks; // m_loud_blocks[b]: number of non-silent blocks before block b
+public:
+  static constexpr size_t block_size = Params::sync_search_step;
+
+  SilenceMap (const std::vector<float>& samples, int n_channels);
+  SilenceMap (const WavView& wav_view);
+
+  static bool enabled();
+  bool silent (size_t index, size_t n_frames = Params::frame_size) const;
+};
+
+/*
+ * get --time-budget: the deadline for the detection, which is started when the
+ * input is opened; work which has not been started when the deadline is
+ * reached is skipped, and the results are marked as partial
+ */
+class TimeBudget
+{
+  static double s_deadline;
+public:
+  static void   start();
+  static double deadline();
+  static bool   expired();
+};
+
+/*
+ * Memory budget of audiowmark get (--max-memory)
+ *
+ * The budget is split into fixed shares: at most 1/8 for the worker threads,
+ * 1/4 for the speed search (only with speed detection), the rest is used for
+ * the chunk of input data that is analyzed at once. The sizes are estimates
+ * for the data structures which dominate the memory usage, so the budget is
+ * not an exact limit for the process.
+ */
+class MemoryBudget
+{
+public:
+  static constexpr size_t thread_bytes = 4 * 1024 * 1024; // decoder scratch and stack of one worker thread
+
+  static bool   enabled();
+  static size_t max_threads (size_t n_threads);
+  static size_t max_speed_units (size_t n_units, size_t unit_bytes);
+  static size_t max_chunk_frames (int n_channels, bool compact);
+  static size_t min_memory (size_t chunk_frames, int n_channels, bool compact);
+};
+
 struct MixEntry
 {
   int  frame;
@@ -153,37 +260,14 @@ struct MixEntry
   int  down;
 };
 
-std::vector<MixEntry> gen_mix_entries (const Key& key);
-
 size_t mark_data_frame_count();
 size_t mark_sync_frame_count();
 
 int frame_count (const WavData& wav_data);
+int frame_count (const WavView& wav_view);
 
 std::vector<int> parse_payload (const std::string& str);
 
-template<class T> std::vector<T>
-randomize_bit_order (const Key& key, const std::vector<T>& bit_vec, bool encode)
-{
-  std::vector<unsigned int> order;
-
-  for (size_t i = 0; i < bit_vec.size(); i++)
-    order.push_back (i);
-
-  Random random (key, /* seed */ 0, Random::Stream::bit_order);
-  random.shuffle (order);
-
-  std::vector<T> out_bits (bit_vec.size());
-  for (size_t i = 0; i < bit_vec.size(); i++)
-    {
-      if (encode)
-        out_bits[i] = bit_vec[order[i]];
-      else
-        out_bits[order[i]] = bit_vec[i];
-    }
-  return out_bits;
-}
-
 inline double
 window_cos (double x) /* von Hann window */
 {
@@ -223,8 +307,46 @@ db_from_complex (std::complex<float> f, float min_dB)
   return db_from_complex (f.real(), f.imag(), min_dB);
 }
 
-int add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const std::string& bits, size_t zero_frames);
+/* vectorized db_from_complex for n values */
+void db_from_complex (const std::complex<float> *in, float *out, size_t n, float min_dB);
+
+#if defined (__x86_64__) || defined (__i386__)
+bool have_avx2();
+#endif
+
+int add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const std::string& bits, size_t zero_frames,
+                          double *snr = nullptr);
 int add_watermark (const Key& key, const std::string& infile, const std::string& outfile, const std::string& bits);
+int add_watermark_reuse (const Key& key, const std::string& infile, const std::string& outfile, const std::string& bits,
+                         const std::string& reuse_file, const std::vector<std::pair<double, double>>& regions, const std::string& diff_file);
+int add_watermark_batch (const Key& key, const std::string& infile, const std::string& batch_file);
+
+/* analyze the input once, then watermark it with one payload per add_analyzed_watermark() call */
+class WatermarkAnalysis;
+Error analyze_watermark_input (const Key& key, AudioInputStream *in_stream, size_t zero_frames, std::shared_ptr<const WatermarkAnalysis>& analysis);
+int add_analyzed_watermark (const Key& key, const WatermarkAnalysis& analysis, AudioOutputStream *out_stream, const std::string& bits);
 int get_watermark (const std::vector<Key>& key_list, const std::string& infile, const std::string& orig_pattern);
+int get_watermark (const std::vector<Key>& key_list, std::unique_ptr<AudioInputStream> in_stream, const std::string& infile,
+                   const std::string& orig_pattern);
+int get_watermark_from_index (const std::vector<Key>& key_list, const std::string& index_file, const std::string& orig_pattern);
+int get_error_status();
+int merge_results (const std::vector<std::string>& json_files);
+Error get_watermark_json (const std::vector<Key>& key_list, const std::string& infile, std::string& json);
+Error get_watermark_matches (const std::vector<Key>& key_list, std::unique_ptr<AudioInputStream> in_stream, AudioWmark::Detector::Result& result);
+int serve (const std::vector<Key>& key_list, const std::string& socket_path, int max_jobs);
+typedef std::function<std::string (const std::string& request)> ServeRequestFunc;
+int serve_requests (const std::string& socket_path, int max_jobs, const ServeRequestFunc& process_request);
+int get_watermark_batch (const std::vector<Key>& key_list, const std::string& batch, int max_jobs);
+
+/* parameter grid for bench-add: empty vectors use the current setting */
+struct BenchAddGrid
+{
+  std::vector<double>          strengths;
+  std::vector<int>             frames_per_bit;
+  std::vector<ResampleQuality> resample_qualities;
+  std::string                  payload;   // empty: use default payload
+  std::string                  codec;     // shell command: encode {in} and decode to {out} (wav files)
+};
+int bench_add (const Key& key, const std::string& infile, const BenchAddGrid& grid, const std::string& json_file);
 
 #endif /* AUDIOWMARK_WM_COMMON_HH */
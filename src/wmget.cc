@@ -17,7 +17,10 @@
 
 #include <string>
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <map>
+#include <unordered_map>
 
 #include "wavdata.hh"
 #include "wmcommon.hh"
@@ -29,13 +32,17 @@
 #include "fft.hh"
 #include "threadpool.hh"
 #include "wavchunkloader.hh"
+#include "spectrumcache.hh"
+#include "spectrumindex.hh"
+#include "keytables.hh"
+#include "profile.hh"
+#include "libaudiowmark.hh"
+#include "jsonreader.hh"
 
 using std::string;
 using std::vector;
-using std::map;
 using std::min;
 using std::max;
-using std::complex;
 
 static vector<float>
 normalize_soft_bits (const vector<float>& soft_bits)
@@ -64,14 +71,29 @@ normalize_soft_bits (const vector<float>& soft_bits)
   return norm_soft_bits;
 }
 
-static vector<float>
-mix_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_channels)
+/*
+ * frames contains the dB values from SpectrumCache::get_range for all frames of
+ * one block: channel ch of frame f starts at frames[f] + ch * n_bands (the
+ * values are not copied out of the cache)
+ *
+ * The decode kernels are instantiated for the common channel counts and
+ * frames_per_bit values (see mix_or_linear_decode), so that the compiler can
+ * unroll the channel loop and replace the bit boundary modulo; a template
+ * argument of 0 means that the runtime value is used.
+ */
+template<int N_CHANNELS, int FRAMES_PER_BIT> static vector<float>
+mix_decode (const Key& key, const vector<const float *>& frames, int runtime_n_channels)
 {
+  const int n_channels = N_CHANNELS ? N_CHANNELS : runtime_n_channels;
+  const int frames_per_bit = FRAMES_PER_BIT ? FRAMES_PER_BIT : Params::frames_per_bit;
+
   vector<float> raw_bit_vec;
 
   const int frame_count = mark_data_frame_count();
+  const size_t n_bands = SpectrumCache::n_bands;
+  const size_t n_frames = frames.size();
 
-  vector<MixEntry> mix_entries = gen_mix_entries (key);
+  const vector<MixEntry>& mix_entries = KeyTables::get (key).mix_entries();
 
   double umag = 0, dmag = 0;
   for (int f = 0; f < frame_count; f++)
@@ -81,23 +103,26 @@ mix_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_chann
           for (size_t frame_b = 0; frame_b < Params::bands_per_frame; frame_b++)
             {
               int b = f * Params::bands_per_frame + frame_b;
-              const double min_db = -96;
 
-              const size_t index = mix_entries[b].frame * n_channels + ch;
-              const size_t next_index = (index + n_channels) < fft_out.size() ? index + n_channels : index - n_channels;
-              const size_t prev_index = (int (index) - n_channels) >= 0 ? index - n_channels : index + n_channels;
+              const size_t frame = mix_entries[b].frame;
+              const size_t next_frame = (frame + 1) < n_frames ? frame + 1 : frame - 1;
+              const size_t prev_frame = frame > 0 ? frame - 1 : frame + 1;
+
+              const float *db = frames[frame] + ch * n_bands;
+              const float *prev_db = frames[prev_frame] + ch * n_bands;
+              const float *next_db = frames[next_frame] + ch * n_bands;
 
-              const int u = mix_entries[b].up;
-              const int d = mix_entries[b].down;
+              const int u = mix_entries[b].up - Params::min_band;
+              const int d = mix_entries[b].down - Params::min_band;
 
-              umag += db_from_complex (fft_out[index][u], min_db);
-              umag -= (db_from_complex (fft_out[prev_index][u], min_db) + db_from_complex (fft_out[next_index][u], min_db)) * 0.5;
+              umag += db[u];
+              umag -= (prev_db[u] + next_db[u]) * 0.5;
 
-              dmag += db_from_complex (fft_out[index][d], min_db);
-              dmag -= (db_from_complex (fft_out[prev_index][d], min_db) + db_from_complex (fft_out[next_index][d], min_db)) * 0.5;
+              dmag += db[d];
+              dmag -= (prev_db[d] + next_db[d]) * 0.5;
             }
         }
-      if ((f % Params::frames_per_bit) == (Params::frames_per_bit - 1))
+      if ((f % frames_per_bit) == (frames_per_bit - 1))
         {
           raw_bit_vec.push_back (umag - dmag);
           umag = 0;
@@ -107,41 +132,49 @@ mix_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_chann
   return raw_bit_vec;
 }
 
-static vector<float>
-linear_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_channels)
+template<int N_CHANNELS, int FRAMES_PER_BIT> static vector<float>
+linear_decode (const Key& key, const vector<const float *>& frames, int runtime_n_channels)
 {
-  UpDownGen     up_down_gen (key, Random::Stream::data_up_down);
-  BitPosGen     bit_pos_gen (key);
-  vector<float> raw_bit_vec;
+  const int n_channels = N_CHANNELS ? N_CHANNELS : runtime_n_channels;
+  const int frames_per_bit = FRAMES_PER_BIT ? FRAMES_PER_BIT : Params::frames_per_bit;
+
+  const KeyTables& key_tables = KeyTables::get (key);
+  vector<float>    raw_bit_vec;
 
   const int frame_count = mark_data_frame_count();
+  const size_t n_bands = SpectrumCache::n_bands;
+  const size_t n_frames = frames.size();
 
   double umag = 0, dmag = 0;
   for (int f = 0; f < frame_count; f++)
     {
       for (int ch = 0; ch < n_channels; ch++)
         {
-          const size_t index = bit_pos_gen.data_frame (f) * n_channels + ch;
-          const size_t next_index = (index + n_channels) < fft_out.size() ? index + n_channels : index - n_channels;
-          const size_t prev_index = (int (index) - n_channels) >= 0 ? index - n_channels : index + n_channels;
+          const size_t frame = key_tables.data_frame (f);
+          const size_t next_frame = (frame + 1) < n_frames ? frame + 1 : frame - 1;
+          const size_t prev_frame = frame > 0 ? frame - 1 : frame + 1;
 
-          UpDownArray up, down;
-          up_down_gen.get (f, up, down);
+          const float *db = frames[frame] + ch * n_bands;
+          const float *prev_db = frames[prev_frame] + ch * n_bands;
+          const float *next_db = frames[next_frame] + ch * n_bands;
 
-          const double min_db = -96;
-          for (auto u : up)
+          for (auto u : key_tables.data_up (f))
             {
-              umag += db_from_complex (fft_out[index][u], min_db);
-              umag -= 0.5 * (db_from_complex (fft_out[prev_index][u], min_db) + db_from_complex (fft_out[next_index][u], min_db));
+              const int i = u - Params::min_band;
+
+              umag += db[i];
+              umag -= 0.5 * (prev_db[i] + next_db[i]);
             }
 
-          for (auto d : down)
+          for (auto d : key_tables.data_down (f))
             {
-              dmag += db_from_complex (fft_out[index][d], min_db);
-              dmag -= 0.5 * (db_from_complex (fft_out[prev_index][d], min_db) + db_from_complex (fft_out[next_index][d], min_db));
+              const int i = d - Params::min_band;
+
+              dmag += db[i];
+              dmag -= 0.5 * (prev_db[i] + next_db[i]);
             }
         }
-      if ((f % Params::frames_per_bit) == (Params::frames_per_bit - 1))
+      if ((f % frames_per_bit) == (frames_per_bit - 1))
         {
           raw_bit_vec.push_back (umag - dmag);
           umag = 0;
@@ -151,29 +184,130 @@ linear_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_ch
   return raw_bit_vec;
 }
 
-static vector<float>
-mix_or_linear_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_channels)
+template<int N_CHANNELS, int FRAMES_PER_BIT> static vector<float>
+mix_or_linear_decode_n (const Key& key, const vector<const float *>& frames, int n_channels)
 {
   if (Params::mix)
-    return mix_decode (key, fft_out, n_channels);
+    return mix_decode<N_CHANNELS, FRAMES_PER_BIT> (key, frames, n_channels);
   else
-    return linear_decode (key, fft_out, n_channels);
+    return linear_decode<N_CHANNELS, FRAMES_PER_BIT> (key, frames, n_channels);
+}
+
+static vector<float>
+mix_or_linear_decode (const Key& key, const vector<const float *>& frames, int n_channels)
+{
+  const int fpb = Params::frames_per_bit;
+
+  if (n_channels == 2 && fpb == 2)
+    return mix_or_linear_decode_n<2, 2> (key, frames, n_channels);
+  if (n_channels == 1 && fpb == 2)
+    return mix_or_linear_decode_n<1, 2> (key, frames, n_channels);
+  if (n_channels == 2 && fpb == 3)
+    return mix_or_linear_decode_n<2, 3> (key, frames, n_channels);
+  if (n_channels == 1 && fpb == 3)
+    return mix_or_linear_decode_n<1, 3> (key, frames, n_channels);
+
+  return mix_or_linear_decode_n<0, 0> (key, frames, n_channels);
 }
 
+/*
+ * scratch memory for decoding sync candidates, one per thread
+ *
+ * the decoding jobs of all candidates run on the ThreadPool workers; reusing
+ * the FFTAnalyzer (with its fft plans and buffers) and the frame pointer
+ * arrays of the worker thread avoids allocations (and lock contention in the
+ * allocator and fft planner) for each candidate
+ *
+ * since ThreadPool::wait_all() runs other jobs on the waiting thread, the
+ * scratch must not be used across a wait_all() call
+ */
+class DecodeScratch
+{
+  std::unique_ptr<FFTAnalyzer> m_fft_analyzer;
+  int                          m_n_channels = 0;
+public:
+  vector<const float *>        frames1;
+  vector<const float *>        frames2;
+
+  static DecodeScratch&
+  get (int n_channels)
+  {
+    static thread_local DecodeScratch scratch;
+
+    if (!scratch.m_fft_analyzer || scratch.m_n_channels != n_channels)
+      {
+        scratch.m_fft_analyzer.reset (new FFTAnalyzer (n_channels));
+        scratch.m_n_channels = n_channels;
+      }
+    return scratch;
+  }
+  FFTAnalyzer&
+  fft_analyzer()
+  {
+    return *m_fft_analyzer;
+  }
+};
+
 class ResultSet
 {
 public:
   enum class Type { BLOCK, CLIP, ALL };
+  /*
+   * payload bits packed into a fixed size bitset, first bit in the highest bit
+   * of the first word, so comparing the words compares the bits in the same
+   * order as comparing the bit_vec_to_str() strings
+   */
+  struct PackedBits
+  {
+    std::array<uint64_t, 2> words {};
+    uint64_t                hash = 0;
+
+    PackedBits()
+    {
+    }
+    PackedBits (const vector<int>& bit_vec)
+    {
+      assert (bit_vec.size() <= words.size() * 64);
+
+      for (size_t i = 0; i < bit_vec.size(); i++)
+        if (bit_vec[i])
+          words[i / 64] |= uint64_t (1) << (63 - i % 64);
+
+      /* a length independent hash is good enough, since all patterns have the same payload size */
+      hash = words[0] * 0x9e3779b97f4a7c15ULL ^ words[1];
+      hash ^= hash >> 29;
+    }
+    bool
+    operator== (const PackedBits& other) const
+    {
+      return hash == other.hash && words == other.words;
+    }
+    bool
+    operator< (const PackedBits& other) const
+    {
+      return words < other.words;
+    }
+    struct Hash
+    {
+      size_t
+      operator() (const PackedBits& bits) const
+      {
+        return bits.hash;
+      }
+    };
+  };
   struct Pattern
   {
     Key               key;
     double            time = 0;
     vector<int>       bit_vec;
+    PackedBits        bits;   // bit_vec packed, for fast comparisons
     float             decode_error = 0;
     SyncFinder::Score sync_score;
     Type              type;
     double            speed = 0;
     double            rating = 0;
+    bool              streamed = false; // already printed by print_stream()
 
     bool
     approx_match (const Pattern& p) const
@@ -181,23 +315,75 @@ public:
       const double time_delta = Params::frame_size / double (Params::mark_sample_rate);
       const double speed_delta = 0.01;
 
-      return key == p.key &&
+      return bits == p.bits &&
+             key == p.key &&
             (fabs (time - p.time) < time_delta || (type == Type::ALL)) &&
-             bit_vec == p.bit_vec &&
              sync_score.block_type == p.sync_score.block_type &&
              type == p.type &&
              fabs (speed - p.speed) < speed_delta;
     }
   };
+  /*
+   * get --range: soft bits of one A or B block (sync candidate), so that
+   * audiowmark merge-results can compute the "all" pattern over all ranges
+   */
+  struct SoftBlock
+  {
+    Key           key;
+    double        time = 0;
+    double        quality = 0;
+    ConvBlockType block_type = ConvBlockType::a;
+    vector<float> raw_bit_vec;
+
+    bool
+    approx_match (const SoftBlock& b) const
+    {
+      const double time_delta = Params::frame_size / 2 / double (Params::mark_sample_rate);
+
+      return key == b.key && block_type == b.block_type && fabs (time - b.time) < time_delta;
+    }
+  };
 private:
-  std::mutex      pattern_mutex;
-  vector<Pattern> patterns;
-  std::string     debug_sync;
+  /* patterns added by add_pattern(), in reverse order, not yet moved to patterns */
+  struct PatternNode
+  {
+    Pattern      pattern;
+    PatternNode *next = nullptr;
+  };
+  std::atomic<PatternNode *> new_patterns { nullptr };
+
+  vector<Pattern>   patterns;
+  vector<SoftBlock> soft_blocks;
+  std::string       debug_sync;
+  string          stream_key_name;
+  bool            partial = false; // get --time-budget: not all of the input was analyzed
 
+  /* rating contributions of the patterns removed by retire(), by key name and bits */
+  std::map<std::pair<string, string>, double> retired_rating;
+
+  /* number of patterns removed by retire(), by key name and bits */
+  std::map<std::pair<string, string>, int> retired_matches;
+
+  /* move patterns added by add_pattern() to patterns, in the order they were added */
+  void
+  collect()
+  {
+    PatternNode *node = new_patterns.exchange (nullptr, std::memory_order_acquire);
+
+    vector<PatternNode *> nodes;
+    for (; node; node = node->next)
+      nodes.push_back (node);
+
+    for (auto it = nodes.rbegin(); it != nodes.rend(); it++)
+      {
+        patterns.push_back (std::move ((*it)->pattern));
+        delete *it;
+      }
+  }
   void
   rate_patterns (const Key& key)
   {
-    map<string, float> pattern_rating;
+    std::unordered_map<PackedBits, float, PackedBits::Hash> pattern_rating;
 
     /* compute pattern rating for key */
     for (const auto& p : patterns)
@@ -211,54 +397,117 @@ private:
             float all_factor = (p.type == Type::ALL) ? 2 : 1;
 
             /* use sync quality sum to priorize patterns */
-            string bits = bit_vec_to_str (p.bit_vec);
-            pattern_rating[bits] += p.sync_score.quality * all_factor;
+            pattern_rating[p.bits] += p.sync_score.quality * all_factor;
           }
       }
     for (auto& p : patterns)
       {
         if (p.key == key)
           {
-            string bits = bit_vec_to_str (p.bit_vec);
-            p.rating = pattern_rating[bits];
+            p.rating = pattern_rating[p.bits];
+
+            if (!retired_rating.empty())
+              {
+                auto it = retired_rating.find ({ key.name(), bit_vec_to_str (p.bit_vec) });
+                if (it != retired_rating.end())
+                  p.rating += it->second;
+              }
           }
       }
   }
 public:
+  ResultSet()
+  {
+  }
+  ResultSet (const ResultSet&) = delete;
+  ResultSet& operator= (const ResultSet&) = delete;
+  ~ResultSet()
+  {
+    collect();
+  }
+  /*
+   * add_pattern can be called by any thread (safe to use from ThreadPool jobs),
+   * but all other functions must only be called after all add_pattern() calls
+   * are finished (ThreadPool::wait_all)
+   *
+   * to avoid lock contention, new patterns are pushed to a lock-free list,
+   * which is moved to the pattern vector on the first access
+   */
   void
   add_pattern (const Key& key, double time, SyncFinder::Score sync_score, const vector<int>& bit_vec, float decode_error, Type pattern_type, double speed)
   {
-    /* add_pattern can be called by any thread (safe to use from ThreadPool jobs) */
-    std::lock_guard<std::mutex> lg (pattern_mutex);
+    PatternNode *node = new PatternNode();
 
-    Pattern p;
+    Pattern& p = node->pattern;
     p.key = key;
     p.time = time;
     p.sync_score = sync_score;
     p.bit_vec = bit_vec;
+    p.bits = PackedBits (bit_vec);
     p.decode_error = decode_error;
     p.type = pattern_type;
     p.speed = speed;
 
-    patterns.push_back (p);
+    node->next = new_patterns.load (std::memory_order_relaxed);
+    while (!new_patterns.compare_exchange_weak (node->next, node, std::memory_order_release, std::memory_order_relaxed))
+      ;
+  }
+  /* get --range: not thread safe, unlike add_pattern() */
+  void
+  add_soft_block (const Key& key, double time, double quality, ConvBlockType block_type, const vector<float>& raw_bit_vec)
+  {
+    SoftBlock b;
+    b.key = key;
+    b.time = time;
+    b.quality = quality;
+    b.block_type = block_type;
+    b.raw_bit_vec = raw_bit_vec;
+    soft_blocks.push_back (std::move (b));
+  }
+  const vector<SoftBlock>&
+  get_soft_blocks() const
+  {
+    return soft_blocks;
+  }
+  /* merge-results: remove the "all" patterns of the parts, before adding the one computed from all soft blocks */
+  void
+  remove_all_patterns()
+  {
+    collect();
+    patterns.erase (std::remove_if (patterns.begin(), patterns.end(),
+                                    [] (const Pattern& p) { return p.type == Type::ALL && p.speed == 1; }),
+                    patterns.end());
+  }
+  /* get --time-budget: mark results as incomplete */
+  void
+  set_partial()
+  {
+    partial = true;
+  }
+  bool
+  is_partial() const
+  {
+    return partial;
   }
   void
   apply_time_offset (double time_offset)
   {
+    collect();
     for (auto& p : patterns)
       p.time += time_offset;
+    for (auto& b : soft_blocks)
+      b.time += time_offset;
   }
   void
   sort (const vector<Key>& key_list)
   {
+    collect();
     for (const auto& key : key_list)
       rate_patterns (key);
 
     std::sort (patterns.begin(), patterns.end(), [](const Pattern& p1, const Pattern& p2) {
       const int all1 = p1.type == Type::ALL;
       const int all2 = p2.type == Type::ALL;
-      const auto p1bits = bit_vec_to_str (p1.bit_vec);
-      const auto p2bits = bit_vec_to_str (p2.bit_vec);
 
       auto ab = [] (const Pattern& pattern) {
         switch (pattern.sync_score.block_type) {
@@ -281,13 +530,22 @@ public:
         return ab (p1) < ab (p2);
       else
         {
-          return p1bits < p2bits;
+          return p1.bits < p2.bits;
         }
     });
   }
-  void
+  /* returns the index of the first merged pattern, merged patterns are appended at the end */
+  size_t
   merge (ResultSet& other)
   {
+    collect();
+    other.collect();
+
+    if (other.partial)
+      partial = true;
+
+    const size_t first_merged = patterns.size();
+
     /* since the ResultSet "other" was usually filled from a ThreadPool, the order
      * of the patterns to merge is not always the same - to make the output of
      * audiowmark deterministic, sort the patterns to be merged by timestamp
@@ -298,96 +556,393 @@ public:
       [](const Pattern& p1, const Pattern& p2) {
         return p1.time < p2.time;
       });
+
+    /* approx_match() requires equal bits, so only patterns with the same hash need to be compared */
+    std::unordered_multimap<uint64_t, size_t> bits_index;
+    for (size_t i = 0; i < patterns.size(); i++)
+      bits_index.emplace (patterns[i].bits.hash, i);
+
     for (const auto& p : to_merge)
       {
         bool merge = true;
-        for (auto& my_p : patterns)
+        auto range = bits_index.equal_range (p.bits.hash);
+        for (auto it = range.first; it != range.second; it++)
           {
-            if (my_p.approx_match (p))
+            if (patterns[it->second].approx_match (p))
               merge = false;
           }
         if (merge)
-          patterns.push_back (p);
+          {
+            bits_index.emplace (p.bits.hash, patterns.size());
+            patterns.push_back (p);
+          }
+      }
+
+    /* soft blocks from the overlap between chunks or ranges are only kept once */
+    for (const auto& b : other.soft_blocks)
+      {
+        auto it = std::find_if (soft_blocks.begin(), soft_blocks.end(), [&] (const SoftBlock& sb) { return sb.approx_match (b); });
+        if (it == soft_blocks.end())
+          soft_blocks.push_back (b);
       }
 
     /* only keep track of debug sync information for the first chunk */
     if (debug_sync.empty())
       debug_sync = other.debug_sync;
+
+    return first_merged;
   }
   string
-  json_escape (const string& s)
+  json_type (const Pattern& pattern)
   {
-    string result;
-    for (unsigned ch : s)
+    std::string btype;
+    switch (pattern.sync_score.block_type)
       {
-        if (ch == '"' || ch == '\\')
-          {
-            result += '\\';
-            result += ch;
-          }
-        else if (ch < 32)
-          {
-            result += string_printf ("\\u%04x", ch);
-          }
-        else
-          {
-            result += ch;
-          }
+      case ConvBlockType::a:        btype = "A";    break;
+      case ConvBlockType::b:        btype = "B";    break;
+      case ConvBlockType::ab:       btype = "AB";   break;
       }
-    return result;
+    if (pattern.type == Type::ALL)
+      btype = "ALL";
+    if (pattern.type == Type::CLIP)
+      btype = "CLIP-" + btype;
+    if (pattern.speed != 1)
+      btype += "-SPEED";
+    return btype;
   }
-  void
+  /* results as JSON: pretty printed (print_json) or compact on one line (audiowmark serve) */
+  string
+  json (size_t time_length, bool one_line)
+  {
+    collect();
+    const char *nl     = one_line ? " " : "\n";
+    const char *indent = one_line ? "" : "  ";
+
+    string out = string_printf ("{ \"length\": \"%ld:%02ld\",%s", time_length / 60, time_length % 60, nl);
+    out += string_printf ("%s\"matches\": [%s", indent, nl);
+    int nth = 0;
+    for (const auto& pattern : patterns)
+      {
+        if (nth++ != 0)
+          out += string_printf (",%s", nl);
+
+        const std::string btype = json_type (pattern);
+        const int seconds = pattern.time;
+
+        /* get --range: exact times, so audiowmark merge-results can find matches of overlapping ranges */
+        string time;
+        if (Params::get_range_start >= 0)
+          time = string_printf (" \"time\": %.3f,", pattern.time);
+
+        out += string_printf ("%s%s{ \"key\": \"%s\", \"pos\": \"%d:%02d\",%s \"bits\": \"%s\", \"quality\": %.5f, \"error\": %.6f, \"rating\": %.5f, \"type\": \"%s\", \"speed\": %.6f }",
+                              indent, indent,
+                              json_escape (pattern.key.name()).c_str(),
+                              seconds / 60, seconds % 60, time.c_str(),
+                              bit_vec_to_str (pattern.bit_vec).c_str(),
+                              pattern.sync_score.quality, pattern.decode_error, pattern.rating,
+                              btype.c_str(),
+                              pattern.speed);
+      }
+    out += " ]";
+    if (Params::get_range_start >= 0)
+      out += json_soft_blocks (nl, indent);
+    if (Params::get_time_budget > 0)
+      out += string_printf (",%s%s\"partial\": %s", nl, indent, partial ? "true" : "false");
+    if (Profile::enabled())
+      out += string_printf (",%s%s\"stats\": %s", nl, indent, Profile::json().c_str());
+    out += string_printf ("%s}", nl);
+    return out;
+  }
+  /* get --range: soft bits of all blocks, for audiowmark merge-results */
+  string
+  json_soft_blocks (const char *nl, const char *indent)
+  {
+    string out = string_printf (",%s%s\"blocks\": [%s", nl, indent, nl);
+    for (size_t i = 0; i < soft_blocks.size(); i++)
+      {
+        const SoftBlock& b = soft_blocks[i];
+        if (i != 0)
+          out += string_printf (",%s", nl);
+
+        string soft_bits;
+        for (auto value : b.raw_bit_vec)
+          soft_bits += string_printf ("%s%.6g", soft_bits.empty() ? "" : ", ", value);
+
+        out += string_printf ("%s%s{ \"key\": \"%s\", \"time\": %.6f, \"quality\": %.5f, \"type\": \"%s\", \"soft_bits\": [ %s ] }",
+                              indent, indent,
+                              json_escape (b.key.name()).c_str(),
+                              b.time, b.quality,
+                              b.block_type == ConvBlockType::b ? "B" : "A",
+                              soft_bits.c_str());
+      }
+    out += " ]";
+    return out;
+  }
+  /* results for the libaudiowmark Detector */
+  vector<AudioWmark::Detector::Match>
+  matches()
+  {
+    collect();
+    vector<AudioWmark::Detector::Match> out;
+    for (const auto& pattern : patterns)
+      {
+        AudioWmark::Detector::Match match;
+        match.key_name = pattern.key.name();
+        match.time     = pattern.time;
+        match.bits     = bit_vec_to_str (pattern.bit_vec);
+        match.quality  = pattern.sync_score.quality;
+        match.error    = pattern.decode_error;
+        match.rating   = pattern.rating;
+        match.type     = json_type (pattern);
+        match.speed    = pattern.speed;
+        out.push_back (match);
+      }
+    return out;
+  }
+  /* one pattern as compact JSON object (for JSON lines output) */
+  string
+  json_line (const Pattern& pattern, bool with_rating)
+  {
+    const int seconds = pattern.time;
+    string rating;
+    if (with_rating)
+      rating = string_printf (" \"rating\": %.5f,", pattern.rating);
+
+    return string_printf ("{ \"key\": \"%s\", \"pos\": \"%d:%02d\", \"time\": %.3f, \"bits\": \"%s\", \"quality\": %.5f, \"error\": %.6f,%s \"type\": \"%s\", \"speed\": %.6f }",
+                          json_escape (pattern.key.name()).c_str(),
+                          seconds / 60, seconds % 60, pattern.time,
+                          bit_vec_to_str (pattern.bit_vec).c_str(),
+                          pattern.sync_score.quality, pattern.decode_error,
+                          rating.c_str(),
+                          json_type (pattern).c_str(),
+                          pattern.speed);
+  }
+  Error
   print_json (size_t time_length, const std::string &json_file)
   {
     FILE *outfile = fopen (json_file == "-" ? "/dev/stdout" : json_file.c_str(), "w");
     if (!outfile)
+      return Error (string_printf ("failed to open \"%s\": %s", json_file.c_str(), strerror (errno)));
+
+    fprintf (outfile, "%s\n", json (time_length, /* one_line */ false).c_str());
+    if (fclose (outfile) != 0)
+      return Error (string_printf ("failed to write \"%s\": %s", json_file.c_str(), strerror (errno)));
+    return Error::Code::NONE;
+  }
+  void
+  print_pattern (const Pattern& pattern)
+  {
+    if (pattern.type == Type::ALL) /* this is the combined pattern "all" */
       {
-        perror (("audiowmark: failed to open \"" + json_file + "\":").c_str());
-        exit (127);
+        const char *extra = "";
+        if (pattern.speed != 1)
+          extra = " SPEED";
+
+        printf ("pattern   all %s %.3f %.3f%s\n", bit_vec_to_str (pattern.bit_vec).c_str(),
+                                                  pattern.sync_score.quality, pattern.decode_error,
+                                                  extra);
       }
-    fprintf (outfile, "{ \"length\": \"%ld:%02ld\",\n", time_length / 60, time_length % 60);
-    fprintf (outfile, "  \"matches\": [\n");
-    int nth = 0;
-    for (const auto& pattern : patterns)
+    else
       {
-        if (nth++ != 0)
-          fprintf (outfile, ",\n");
+        string block_str;
 
-        std::string btype;
         switch (pattern.sync_score.block_type)
           {
-          case ConvBlockType::a:        btype = "A";    break;
-          case ConvBlockType::b:        btype = "B";    break;
-          case ConvBlockType::ab:       btype = "AB";   break;
+            case ConvBlockType::a:  block_str = "A";
+                                    break;
+            case ConvBlockType::b:  block_str = "B";
+                                    break;
+            case ConvBlockType::ab: block_str = "AB";
+                                    break;
           }
-        if (pattern.type == Type::ALL)
-          btype = "ALL";
         if (pattern.type == Type::CLIP)
-          btype = "CLIP-" + btype;
+          block_str = "CLIP-" + block_str;
         if (pattern.speed != 1)
-          btype += "-SPEED";
+          block_str += "-SPEED";
 
         const int seconds = pattern.time;
+        printf ("pattern %2d:%02d %s %.3f %.3f %s\n", seconds / 60, seconds % 60, bit_vec_to_str (pattern.bit_vec).c_str(),
+                  pattern.sync_score.quality, pattern.decode_error, block_str.c_str());
+      }
+  }
+  /*
+   * streaming output: print the BLOCK/CLIP patterns starting at index first
+   * immediately (in the order they were merged), the all patterns are printed
+   * by print() at the end
+   */
+  void
+  print_stream (size_t first)
+  {
+    collect();
+    for (size_t i = first; i < patterns.size(); i++)
+      {
+        Pattern& pattern = patterns[i];
+        if (pattern.type == Type::ALL)
+          continue;
+
+        if (pattern.key.name() != stream_key_name)
+          {
+            printf ("key %s\n", pattern.key.name().c_str());
+            stream_key_name = pattern.key.name();
+          }
+        print_pattern (pattern);
+        pattern.streamed = true;
+      }
+    fflush (stdout);
+  }
+  /*
+   * live output: print one JSON object per line for each BLOCK/CLIP pattern
+   * starting at index first, returns the number of printed patterns that
+   * match orig_bits
+   *
+   * since the patterns are printed before all results are known, there is no
+   * rating (and there are no all patterns)
+   */
+  int
+  print_live (size_t first, const vector<int>& orig_bits)
+  {
+    collect();
+    int match_count = 0;
+    for (size_t i = first; i < patterns.size(); i++)
+      {
+        Pattern& pattern = patterns[i];
+        if (pattern.type == Type::ALL || pattern.streamed)
+          continue;
+
+        printf ("%s\n", json_line (pattern, /* with_rating */ false).c_str());
+        pattern.streamed = true;
+
+        if (pattern.bit_vec == orig_bits)
+          match_count++;
+      }
+    fflush (stdout);
+    return match_count;
+  }
+  /*
+   * NDJSON output: write one JSON object per line for each BLOCK/CLIP pattern
+   * starting at index first (as print_live, but to outfile); the all patterns
+   * and the ratings are written by print_ndjson_summary() at the end
+   */
+  void
+  print_ndjson (size_t first, FILE *outfile)
+  {
+    collect();
+    for (size_t i = first; i < patterns.size(); i++)
+      {
+        const Pattern& pattern = patterns[i];
+        if (pattern.type != Type::ALL)
+          fprintf (outfile, "%s\n", json_line (pattern, /* with_rating */ false).c_str());
+      }
+    fflush (outfile);
+  }
+  /* NDJSON output: the last line, with the (rated) all patterns and the rating of each distinct key/bits combination */
+  void
+  print_ndjson_summary (size_t time_length, FILE *outfile)
+  {
+    collect();
+
+    std::map<std::pair<string, string>, double> rating = retired_rating;
+    for (const auto& p : patterns)
+      rating[{ p.key.name(), bit_vec_to_str (p.bit_vec) }] += p.sync_score.quality * ((p.type == Type::ALL) ? 2 : 1);
+
+    vector<std::pair<std::pair<string, string>, double>> ratings (rating.begin(), rating.end());
+    std::stable_sort (ratings.begin(), ratings.end(), [] (const auto& r1, const auto& r2) {
+      if (r1.first.first != r2.first.first)
+        return r1.first.first < r2.first.first;
+      return r1.second > r2.second;
+    });
+
+    string out = string_printf ("{ \"summary\": { \"length\": \"%ld:%02ld\", \"matches\": [", time_length / 60, time_length % 60);
+    int nth = 0;
+    for (const auto& pattern : patterns)
+      {
+        if (pattern.type == Type::ALL)
+          out += string_printf ("%s %s", nth++ ? "," : "", json_line (pattern, /* with_rating */ true).c_str());
+      }
+    out += " ], \"ratings\": [";
+    nth = 0;
+    for (const auto& r : ratings)
+      {
+        out += string_printf ("%s { \"key\": \"%s\", \"bits\": \"%s\", \"rating\": %.5f }", nth++ ? "," : "",
+                              json_escape (r.first.first).c_str(), r.first.second.c_str(), r.second);
+      }
+    out += " ]";
+    if (Params::get_time_budget > 0)
+      out += string_printf (", \"partial\": %s", partial ? "true" : "false");
+    if (Profile::enabled())
+      out += string_printf (", \"stats\": %s", Profile::json().c_str());
+    out += " } }";
+    fprintf (outfile, "%s\n", out.c_str());
+    fflush (outfile);
+  }
+  /*
+   * forget BLOCK/CLIP patterns before min_time, but keep their contribution to
+   * the rating: for NDJSON output, this keeps the memory usage constant, while
+   * the all patterns and ratings at the end are the same as without retire()
+   */
+  void
+  retire (double min_time)
+  {
+    collect();
+    auto retired = [min_time] (const Pattern& p) { return p.type != Type::ALL && p.time < min_time; };
+    for (const auto& p : patterns)
+      {
+        if (retired (p))
+          {
+            retired_rating[{ p.key.name(), bit_vec_to_str (p.bit_vec) }] += p.sync_score.quality;
+            retired_matches[{ p.key.name(), bit_vec_to_str (p.bit_vec) }]++;
+          }
+      }
+    patterns.erase (std::remove_if (patterns.begin(), patterns.end(), retired), patterns.end());
+  }
+  /*
+   * get --min-matches: true if at least min_matches block or clip patterns
+   * have the same key and bits; all patterns are not counted, since they are
+   * combined from block patterns that are already counted
+   */
+  bool
+  has_min_matches (int min_matches)
+  {
+    collect();
 
-        fprintf (outfile, "    { \"key\": \"%s\", \"pos\": \"%d:%02d\", \"bits\": \"%s\", \"quality\": %.5f, \"error\": %.6f, \"rating\": %.5f, \"type\": \"%s\", \"speed\": %.6f }",
-                 json_escape (pattern.key.name()).c_str(),
-                 seconds / 60, seconds % 60,
-                 bit_vec_to_str (pattern.bit_vec).c_str(),
-                 pattern.sync_score.quality, pattern.decode_error, pattern.rating,
-                 btype.c_str(),
-                 pattern.speed);
+    std::map<std::pair<string, string>, int> matches = retired_matches;
+    for (const auto& p : patterns)
+      {
+        if (p.type != Type::ALL)
+          matches[{ p.key.name(), bit_vec_to_str (p.bit_vec) }]++;
+      }
+    for (const auto& m : matches)
+      {
+        if (m.second >= min_matches)
+          return true;
       }
-    fprintf (outfile, " ]\n}\n");
-    fclose (outfile);
+    return false;
+  }
+  /*
+   * forget patterns before min_time: for live input, this keeps the memory
+   * usage constant, while later chunks can still be deduplicated against
+   * the recent patterns
+   */
+  void
+  expire (double min_time)
+  {
+    collect();
+    patterns.erase (std::remove_if (patterns.begin(), patterns.end(),
+                                    [min_time] (const Pattern& p) { return p.type == Type::ALL || p.time < min_time; }),
+                    patterns.end());
   }
   void
   print()
   {
+    collect();
     string last_key_name;
     bool   print_speed = true;
 
     for (const auto& pattern : patterns)
       {
+        if (pattern.streamed)
+          continue;
+
         if (pattern.key.name() != last_key_name)
           {
             printf ("key %s\n", pattern.key.name().c_str());
@@ -405,43 +960,13 @@ public:
                 }
             print_speed = false;
           }
-        if (pattern.type == Type::ALL) /* this is the combined pattern "all" */
-          {
-            const char *extra = "";
-            if (pattern.speed != 1)
-              extra = " SPEED";
-
-            printf ("pattern   all %s %.3f %.3f%s\n", bit_vec_to_str (pattern.bit_vec).c_str(),
-                                                      pattern.sync_score.quality, pattern.decode_error,
-                                                      extra);
-          }
-        else
-          {
-            string block_str;
-
-            switch (pattern.sync_score.block_type)
-              {
-                case ConvBlockType::a:  block_str = "A";
-                                        break;
-                case ConvBlockType::b:  block_str = "B";
-                                        break;
-                case ConvBlockType::ab: block_str = "AB";
-                                        break;
-              }
-            if (pattern.type == Type::CLIP)
-              block_str = "CLIP-" + block_str;
-            if (pattern.speed != 1)
-              block_str += "-SPEED";
-
-            const int seconds = pattern.time;
-            printf ("pattern %2d:%02d %s %.3f %.3f %s\n", seconds / 60, seconds % 60, bit_vec_to_str (pattern.bit_vec).c_str(),
-                      pattern.sync_score.quality, pattern.decode_error, block_str.c_str());
-          }
+        print_pattern (pattern);
       }
   }
   int
   print_match_count (const vector<int>& orig_bits)
   {
+    collect();
     int match_count = 0;
 
     for (auto p : patterns)
@@ -463,8 +988,9 @@ public:
     printf ("%s", debug_sync.c_str());
   }
   double
-  best_quality() const
+  best_quality()
   {
+    collect();
     double q = -1;
     for (const auto& pattern : patterns)
       if (pattern.sync_score.quality > q)
@@ -473,6 +999,17 @@ public:
   }
 };
 
+/* get --screen: best sync quality of all candidates */
+static double
+max_sync_quality (const vector<SyncFinder::KeyResult>& key_results)
+{
+  double quality = 0;
+  for (const auto& key_result : key_results)
+    for (const auto& sync_score : key_result.sync_scores)
+      quality = max (quality, sync_score.quality);
+  return quality;
+}
+
 /*
  * The block decoder is responsible for finding whole data blocks inside the
  * input file and decoding them. This only works for files that are large
@@ -494,202 +1031,289 @@ class BlockDecoder
   int debug_sync_frame_count = 0;
   const double speed = 0;
   vector<SyncFinder::KeyResult> key_results; // stored here for sync debugging
+
 public:
-  BlockDecoder (double speed) :
-    speed (speed)
-  {
-  }
-  void
-  run (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set)
+  struct PatternRawBits {
+    bool          valid = false;
+    size_t        index = 0;
+    double        quality = 0;
+    vector<float> raw_bit_vec;
+    ConvBlockType block_type = ConvBlockType::a;
+  };
+private:
+  /*
+   * for each B block, find the A block before it which is closest to one block_size
+   * earlier (within frame_size / 2), returns (a, b) pairs of pattern indices
+   *
+   * patterns are sorted by index, so the candidate A blocks of consecutive B
+   * blocks are found with one sweep over the A blocks
+   */
+  static vector<std::pair<size_t, size_t>>
+  find_ab_pairs (const vector<PatternRawBits>& patterns, size_t block_size)
   {
-    ThreadPool thread_pool;
-    SyncFinder sync_finder;
-    FFTAnalyzer fft_analyzer (wav_data.n_channels());
-    key_results = sync_finder.search (key_list, wav_data, SyncFinder::Mode::BLOCK);
+    vector<size_t> a_blocks;
+    for (size_t j = 0; j < patterns.size(); j++)
+      if (patterns[j].block_type == ConvBlockType::a)
+        a_blocks.push_back (j);
 
-    for (const auto& key_result : key_results)
+    const int64_t max_dist = Params::frame_size / 2;
+
+    vector<std::pair<size_t, size_t>> pairs;
+    size_t first_a = 0;
+    for (size_t i = 0; i < patterns.size(); i++)
       {
-        const Key&  key = key_result.key;
+        if (patterns[i].block_type != ConvBlockType::b)
+          continue;
 
-        struct PatternRawBits {
-          size_t        index;
-          double        quality;
-          vector<float> raw_bit_vec;
-          ConvBlockType block_type;
-        };
-        vector<PatternRawBits> pattern_raw_vec;
-        for (auto sync_score : key_result.sync_scores)
-          {
-            const size_t count = mark_sync_frame_count() + mark_data_frame_count();
-            const size_t index = sync_score.index;
+        const int64_t expect = int64_t (patterns[i].index) - int64_t (block_size);
+        while (first_a < a_blocks.size() && int64_t (patterns[a_blocks[first_a]].index) <= expect - max_dist)
+          first_a++;
 
-            auto fft_range_out = fft_analyzer.fft_range (wav_data.samples(), index, count);
-            if (fft_range_out.size())
+        int64_t best_abs_dist = max_dist;
+        int     best_j = -1;
+        for (size_t a = first_a; a < a_blocks.size() && a_blocks[a] < i; a++)
+          {
+            const int64_t abs_dist = std::abs (int64_t (patterns[a_blocks[a]].index) - expect);
+            if (abs_dist < best_abs_dist)
               {
-                /* ---- retrieve bits from watermark ---- */
-                vector<float> raw_bit_vec = mix_or_linear_decode (key, fft_range_out, wav_data.n_channels());
-                assert (raw_bit_vec.size() == code_size (ConvBlockType::a, Params::payload_size));
+                best_j = a_blocks[a];
+                best_abs_dist = abs_dist;
+              }
+            else if (int64_t (patterns[a_blocks[a]].index) > expect)
+              {
+                break; // all remaining A blocks are even further away
+              }
+          }
+        if (best_j >= 0)
+          pairs.emplace_back (best_j, i);
+      }
+    return pairs;
+  }
+  /*
+   * find consecutive blocks with the right distance (block_size), with A B A B
+   * ordering, possibly with missing blocks in between; returns the chain of
+   * pattern indices with the highest sync quality sum
+   *
+   * the next block after a block only depends on the block itself, so it is
+   * computed once per block, and the chain starting at each block is obtained
+   * by following these links
+   */
+  static vector<size_t>
+  find_all_blocks (const vector<PatternRawBits>& patterns, size_t block_size)
+  {
+    if (patterns.empty())
+      return {};
 
-                raw_bit_vec = randomize_bit_order (key, raw_bit_vec, /* encode */ false);
+    const size_t max_block_idx = lrint (patterns.back().index / double (block_size) + 0.5);
 
-                PatternRawBits raw_bits;
-                raw_bits.index = index;
-                raw_bits.quality = sync_score.quality;
-                raw_bits.raw_bit_vec = raw_bit_vec;
-                raw_bits.block_type = sync_score.block_type;
-                pattern_raw_vec.push_back (raw_bits);
+    vector<int> next_block (patterns.size(), -1);
+    for (size_t last = 0; last < patterns.size(); last++)
+      {
+        for (size_t block_idx = 1; block_idx <= max_block_idx; block_idx++)
+          {
+            const int64_t expect_start  = patterns[last].index + block_idx * block_size;
+            const int64_t max_dist      = block_idx * Params::frame_size / 2;
 
-                /* ---- deal with this pattern ---- */
-                const double time = double (sync_score.index) / wav_data.sample_rate();
-                thread_pool.add_job ([this, key, sync_score, raw_bit_vec, time, &result_set]()
-                  {
-                    float decode_error = 0;
-                    vector<int> bit_vec = code_decode_soft (sync_score.block_type, normalize_soft_bits (raw_bit_vec), &decode_error);
+            /* enforce A B A B block ordering */
+            auto   expect_block_type = patterns[last].block_type;
+            if (block_idx & 1)
+              expect_block_type = expect_block_type == ConvBlockType::a ? ConvBlockType::b : ConvBlockType::a;
 
-                    if (!bit_vec.empty())
-                      result_set.add_pattern (key, time, sync_score, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
-                  });
-              }
-          }
-        /* AB pattern: try to find an A block followed by a B block with the right distance (sync + data frame count) */
-        for (size_t i = 0; i < pattern_raw_vec.size(); i++)
-          {
-            if (pattern_raw_vec[i].block_type == ConvBlockType::b)
+            /* first pattern which could be within max_dist (patterns are sorted by index) */
+            auto it = std::lower_bound (patterns.begin() + last, patterns.end(), expect_start - max_dist + 1,
+                                        [] (const PatternRawBits& p, int64_t index) { return int64_t (p.index) < index; });
+
+            int64_t best_abs_dist = max_dist;
+            for (; it != patterns.end() && int64_t (it->index) < expect_start + max_dist; it++)
               {
-                int best_j = -1;
-                int best_abs_dist = Params::frame_size / 2;
-                for (size_t j = 0; j < i; j++)
+                const int64_t abs_dist = std::abs (expect_start - int64_t (it->index));
+                if (abs_dist < best_abs_dist && it->block_type == expect_block_type)
                   {
-                    if (pattern_raw_vec[j].block_type == ConvBlockType::a)
-                      {
-                        size_t count = mark_sync_frame_count() + mark_data_frame_count();
-                        int    abs_dist = std::abs (int (pattern_raw_vec[i].index - pattern_raw_vec[j].index) - int (count * Params::frame_size));
-
-                        if (abs_dist < best_abs_dist)
-                          {
-                            best_j = j;
-                            best_abs_dist = abs_dist;
-                          }
-                      }
+                    next_block[last] = it - patterns.begin();
+                    best_abs_dist = abs_dist;
                   }
-                /* join A and B block -> AB block */
-                if (best_j >= 0)
-                  {
-                    const auto& a_pattern = pattern_raw_vec[best_j];
-                    const auto& b_pattern = pattern_raw_vec[i];
+              }
+            if (next_block[last] >= 0)
+              break;
+          }
+      }
 
-                    vector<float> ab_bits (a_pattern.raw_bit_vec.size() * 2);
-                    for (size_t k = 0; k <  a_pattern.raw_bit_vec.size(); k++)
-                      {
-                        ab_bits[k * 2]     = a_pattern.raw_bit_vec[k];
-                        ab_bits[k * 2 + 1] = b_pattern.raw_bit_vec[k];
-                      }
+    /* prefer "all" patterns with higher sync sum */
+    vector<size_t> best_all_blocks;
+    float          best_sum = 0;
+    for (size_t i = 0; i < patterns.size(); i++)
+      {
+        float sum = 0;
+        for (int b = i; b >= 0; b = next_block[b])
+          sum += patterns[b].quality;
 
-                    const double time = double (b_pattern.index) / wav_data.sample_rate();
-                    thread_pool.add_job ([this, key, a_pattern, b_pattern, ab_bits, time, &result_set]()
-                      {
-                        float decode_error = 0;
-                        vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, normalize_soft_bits (ab_bits), &decode_error);
-
-                        if (!bit_vec.empty())
-                          {
-                            SyncFinder::Score score_ab  { 0, 0, ConvBlockType::ab };
-                            score_ab.index = b_pattern.index;
-                            score_ab.quality = (a_pattern.quality + b_pattern.quality) / 2;
-                            result_set.add_pattern (key, time, score_ab, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
-                          }
-                      });
-                  }
-              }
+        if (sum > best_sum)
+          {
+            best_sum = sum;
+            best_all_blocks.clear();
+            for (int b = i; b >= 0; b = next_block[b])
+              best_all_blocks.push_back (b);
           }
+      }
+    return best_all_blocks;
+  }
+public:
+  BlockDecoder (double speed) :
+    speed (speed)
+  {
+  }
+  /*
+   * average the A / B bits of the consecutive blocks for an "all" pattern,
+   * returns false if there are not enough blocks (this is also used by
+   * audiowmark merge-results, for the blocks of all get --range parts)
+   */
+  static bool
+  all_soft_bits (const vector<PatternRawBits>& pattern_raw_vec, size_t block_size, SyncFinder::Score& score_all, vector<float>& soft_bit_vec)
+  {
+    vector<size_t> best_all_blocks = find_all_blocks (pattern_raw_vec, block_size);
+    if (best_all_blocks.size() <= 1)
+      return false;
+
+    vector<float> raw_bit_vec_all (code_size (ConvBlockType::ab, Params::payload_size));
+    vector<int>   raw_bit_vec_norm (2);
+
+    score_all = SyncFinder::Score { 0, 0 };
+
+    for (auto block_index : best_all_blocks)
+      {
+        const auto& pattern = pattern_raw_vec[block_index];
+        /* ---- update "all" pattern ---- */
+        score_all.quality += pattern.quality;
 
-        /* all pattern: try to detect consecutive blocks with the right distance (sync + data frame count) */
-        vector<size_t> best_all_blocks;
-        for (size_t i = 0; i < pattern_raw_vec.size(); i++)
+        int ab = pattern.block_type == ConvBlockType::b ? 1 : 0;
+        for (size_t i = 0; i < pattern.raw_bit_vec.size(); i++)
           {
-            size_t count = mark_sync_frame_count() + mark_data_frame_count();
-            size_t max_block_idx = lrint (pattern_raw_vec.back().index / double (count * Params::frame_size) + 0.5);
+            raw_bit_vec_all[i * 2 + ab] += pattern.raw_bit_vec[i];
+          }
+        raw_bit_vec_norm[ab]++;
+      }
 
-            vector<size_t> all_blocks;
-            all_blocks.push_back (i);
+    for (size_t i = 0; i < raw_bit_vec_all.size(); i += 2)
+      {
+        raw_bit_vec_all[i]     /= max (raw_bit_vec_norm[0], 1); /* normalize A soft bits with number of A blocks */
+        raw_bit_vec_all[i + 1] /= max (raw_bit_vec_norm[1], 1); /* normalize B soft bits with number of B blocks */
+      }
+    score_all.quality /= raw_bit_vec_norm[0] + raw_bit_vec_norm[1];
 
-            size_t block_idx = 1;
-            while (block_idx <= max_block_idx)
+    soft_bit_vec = normalize_soft_bits (raw_bit_vec_all);
+    return true;
+  }
+  /* get --screen: only run the sync search and return the best sync quality */
+  double
+  screen (const vector<Key>& key_list, const WavView& wav_data, SpectrumCache& spectrum_cache)
+  {
+    SyncFinder sync_finder;
+    return max_sync_quality (sync_finder.search (key_list, wav_data, spectrum_cache, SyncFinder::Mode::BLOCK));
+  }
+  void
+  run (const vector<Key>& key_list, const WavView& wav_data, SpectrumCache& spectrum_cache, ResultSet& result_set)
+  {
+    Profile::Timer timer (Profile::Stage::BLOCK_DECODER);
+    ThreadPool thread_pool;
+    SyncFinder sync_finder;
+    key_results = sync_finder.search (key_list, wav_data, spectrum_cache, SyncFinder::Mode::BLOCK);
+
+    /* get --time-budget: decoding jobs which are not started before the deadline are skipped */
+    thread_pool.set_deadline (TimeBudget::deadline());
+
+    const size_t block_size = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size;
+    for (const auto& key_result : key_results)
+      {
+        const Key&  key = key_result.key;
+
+        /* ---- retrieve bits from watermark: one job per sync candidate ---- */
+        vector<PatternRawBits> pattern_raw_vec (key_result.sync_scores.size());
+        ThreadPool extract_pool;
+        extract_pool.set_deadline (TimeBudget::deadline());
+        for (size_t i = 0; i < key_result.sync_scores.size(); i++)
+          {
+            extract_pool.add_job ([this, &key, &key_result, &wav_data, &spectrum_cache, &pattern_raw_vec, &thread_pool, &result_set, i]()
               {
-                size_t expect_start = pattern_raw_vec[all_blocks.back()].index + block_idx * (count * Params::frame_size);
-                int    best_j = -1;
-                int    best_abs_dist = block_idx * Params::frame_size / 2;
+                const auto&  sync_score = key_result.sync_scores[i];
+                const size_t count = mark_sync_frame_count() + mark_data_frame_count();
 
-                /* enforce A B A B block ordering */
-                auto   expect_block_type = pattern_raw_vec[all_blocks.back()].block_type;
-                if (block_idx & 1)
-                  expect_block_type = expect_block_type == ConvBlockType::a ? ConvBlockType::b : ConvBlockType::a;
+                DecodeScratch& scratch = DecodeScratch::get (wav_data.n_channels());
+                if (!spectrum_cache.get_range (scratch.fft_analyzer(), sync_score.index, count, scratch.frames1))
+                  return;
 
-                for (size_t j = all_blocks.back(); j < pattern_raw_vec.size(); j++)
-                  {
-                    int abs_dist = std::abs (int (expect_start) - int (pattern_raw_vec[j].index));
-                    if (abs_dist < best_abs_dist)
-                      {
-                        if (pattern_raw_vec[j].block_type == expect_block_type)
-                          {
-                            best_j = j;
-                            best_abs_dist = abs_dist;
-                          }
-                      }
-                  }
+                vector<float> raw_bit_vec = mix_or_linear_decode (key, scratch.frames1, wav_data.n_channels());
+                assert (raw_bit_vec.size() == code_size (ConvBlockType::a, Params::payload_size));
 
-                if (best_j >= 0)
-                  {
-                    all_blocks.push_back (best_j);
-                    block_idx = 1;
-                  }
-                else
+                PatternRawBits& raw_bits = pattern_raw_vec[i];
+                raw_bits.valid = true;
+                raw_bits.index = sync_score.index;
+                raw_bits.quality = sync_score.quality;
+                raw_bits.raw_bit_vec = randomize_bit_order (key, raw_bit_vec, /* encode */ false);
+                raw_bits.block_type = sync_score.block_type;
+
+                /* ---- deal with this pattern ---- */
+                const double time = double (sync_score.index) / wav_data.sample_rate();
+                thread_pool.add_job ([this, key, sync_score, raw_bit_vec = raw_bits.raw_bit_vec, time, &result_set]()
                   {
-                    block_idx++;
-                  }
-              }
-            auto sync_sum = [&] (auto blocks)
-              {
-                float sum = 0;
-                for (auto block_idx : blocks)
-                  sum += pattern_raw_vec[block_idx].quality;
-                return sum;
-              };
-            /* prefer "all" patterns with higher sync sum */
-            if (sync_sum (all_blocks) > sync_sum (best_all_blocks))
-              best_all_blocks = all_blocks;
+                    float decode_error = 0;
+                    vector<int> bit_vec = code_decode_soft (sync_score.block_type, normalize_soft_bits (raw_bit_vec), &decode_error);
+
+                    if (!bit_vec.empty())
+                      result_set.add_pattern (key, time, sync_score, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
+                  });
+              });
           }
-        /* all pattern: average the A / B bits of the consecutive blocks for an "all" pattern */
-        if (best_all_blocks.size() > 1)
+        extract_pool.wait_all();
+        if (extract_pool.n_skipped())
+          result_set.set_partial();
+
+        /* candidates for which not enough frames were available are skipped, the others remain sorted by index */
+        pattern_raw_vec.erase (std::remove_if (pattern_raw_vec.begin(), pattern_raw_vec.end(), [] (const PatternRawBits& p) { return !p.valid; }),
+                               pattern_raw_vec.end());
+
+        /* AB pattern: try to find an A block followed by a B block with the right distance (sync + data frame count) */
+        for (const auto& ab : find_ab_pairs (pattern_raw_vec, block_size))
           {
-            vector<float> raw_bit_vec_all (code_size (ConvBlockType::ab, Params::payload_size));
-            vector<int>   raw_bit_vec_norm (2);
+            const auto& a_pattern = pattern_raw_vec[ab.first];
+            const auto& b_pattern = pattern_raw_vec[ab.second];
 
-            SyncFinder::Score score_all { 0, 0 };
+            vector<float> ab_bits (a_pattern.raw_bit_vec.size() * 2);
+            for (size_t k = 0; k <  a_pattern.raw_bit_vec.size(); k++)
+              {
+                ab_bits[k * 2]     = a_pattern.raw_bit_vec[k];
+                ab_bits[k * 2 + 1] = b_pattern.raw_bit_vec[k];
+              }
 
-            for (auto block_index : best_all_blocks)
+            const double time = double (b_pattern.index) / wav_data.sample_rate();
+            const double quality = (a_pattern.quality + b_pattern.quality) / 2;
+            const size_t b_index = b_pattern.index;
+            thread_pool.add_job ([this, key, b_index, quality, ab_bits, time, &result_set]()
               {
-                const auto& pattern = pattern_raw_vec[block_index];
-                /* ---- update "all" pattern ---- */
-                score_all.quality += pattern.quality;
+                float decode_error = 0;
+                vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, normalize_soft_bits (ab_bits), &decode_error);
 
-                int ab = pattern.block_type == ConvBlockType::b ? 1 : 0;
-                for (size_t i = 0; i < pattern.raw_bit_vec.size(); i++)
+                if (!bit_vec.empty())
                   {
-                    raw_bit_vec_all[i * 2 + ab] += pattern.raw_bit_vec[i];
+                    SyncFinder::Score score_ab  { 0, 0, ConvBlockType::ab };
+                    score_ab.index = b_index;
+                    score_ab.quality = quality;
+                    result_set.add_pattern (key, time, score_ab, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
                   }
-                raw_bit_vec_norm[ab]++;
-              }
-
-            for (size_t i = 0; i < raw_bit_vec_all.size(); i += 2)
-              {
-                raw_bit_vec_all[i]     /= max (raw_bit_vec_norm[0], 1); /* normalize A soft bits with number of A blocks */
-                raw_bit_vec_all[i + 1] /= max (raw_bit_vec_norm[1], 1); /* normalize B soft bits with number of B blocks */
-              }
-            score_all.quality /= raw_bit_vec_norm[0] + raw_bit_vec_norm[1];
+              });
+          }
 
-            vector<float> soft_bit_vec = normalize_soft_bits (raw_bit_vec_all);
+        /* get --range: keep the soft bits, merge-results computes the "all" pattern over all ranges */
+        if (Params::get_range_start >= 0 && speed == 1)
+          {
+            for (const auto& p : pattern_raw_vec)
+              result_set.add_soft_block (key, double (p.index) / wav_data.sample_rate(), p.quality, p.block_type, p.raw_bit_vec);
+          }
 
+        /* all pattern: average the A / B bits of the consecutive blocks for an "all" pattern */
+        SyncFinder::Score score_all { 0, 0 };
+        vector<float>     soft_bit_vec;
+        if (all_soft_bits (pattern_raw_vec, block_size, score_all, soft_bit_vec))
+          {
             thread_pool.add_job ([this, key, score_all, soft_bit_vec, &result_set]()
               {
                 float decode_error = 0;
@@ -701,6 +1325,8 @@ public:
           }
       }
     thread_pool.wait_all();
+    if (thread_pool.n_skipped())
+      result_set.set_partial();
 
     debug_sync_frame_count = frame_count (wav_data);
   }
@@ -765,15 +1391,25 @@ class ClipDecoder
 {
   const int frames_per_block = 0;
   const double speed = 0;
+  bool   screen_only = false;
+  double screen_quality = 0;
 
   void
-  run_padded (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set, double time_offset_sec)
+  run_padded (const vector<Key>& key_list, const WavView& wav_data, SpectrumCache& spectrum_cache, ResultSet& result_set, double time_offset_sec)
   {
     SyncFinder                    sync_finder;
-    vector<SyncFinder::KeyResult> key_results = sync_finder.search (key_list, wav_data, SyncFinder::Mode::CLIP);
-    FFTAnalyzer                   fft_analyzer (wav_data.n_channels());
+    vector<SyncFinder::KeyResult> key_results = sync_finder.search (key_list, wav_data, spectrum_cache, SyncFinder::Mode::CLIP);
+    if (screen_only)
+      {
+        screen_quality = max (screen_quality, max_sync_quality (key_results));
+        return;
+      }
+    DecodeScratch&                scratch = DecodeScratch::get (wav_data.n_channels());
+    FFTAnalyzer&                  fft_analyzer = scratch.fft_analyzer();
     ThreadPool                    thread_pool;
 
+    thread_pool.set_deadline (TimeBudget::deadline());
+
     for (const auto& key_result : key_results)
       {
         const Key& key = key_result.key;
@@ -781,12 +1417,11 @@ class ClipDecoder
           {
             const size_t count = mark_sync_frame_count() + mark_data_frame_count();
             const size_t index = sync_score.index;
-            auto fft_range_out1 = fft_analyzer.fft_range (wav_data.samples(), index, count);
-            auto fft_range_out2 = fft_analyzer.fft_range (wav_data.samples(), index + count * Params::frame_size, count);
-            if (fft_range_out1.size() && fft_range_out2.size())
+            if (spectrum_cache.get_range (fft_analyzer, index, count, scratch.frames1) &&
+                spectrum_cache.get_range (fft_analyzer, index + count * Params::frame_size, count, scratch.frames2))
               {
-                const auto raw_bit_vec1 = randomize_bit_order (key, mix_or_linear_decode (key, fft_range_out1, wav_data.n_channels()), /* encode */ false);
-                const auto raw_bit_vec2 = randomize_bit_order (key, mix_or_linear_decode (key, fft_range_out2, wav_data.n_channels()), /* encode */ false);
+                const auto raw_bit_vec1 = randomize_bit_order (key, mix_or_linear_decode (key, scratch.frames1, wav_data.n_channels()), /* encode */ false);
+                const auto raw_bit_vec2 = randomize_bit_order (key, mix_or_linear_decode (key, scratch.frames2, wav_data.n_channels()), /* encode */ false);
                 const size_t bits_per_block = raw_bit_vec1.size();
                 vector<float> raw_bit_vec;
                 for (size_t i = 0; i < bits_per_block; i++)
@@ -818,10 +1453,12 @@ class ClipDecoder
           }
       }
     thread_pool.wait_all();
+    if (thread_pool.n_skipped())
+      result_set.set_partial();
   }
   enum class Pos { START, END };
   void
-  run_block (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set, Pos pos)
+  run_block (const vector<Key>& key_list, const WavData& wav_data, SpectrumCache& spectrum_cache, ResultSet& result_set, Pos pos)
   {
     const size_t n = (frames_per_block + 5) * Params::frame_size * wav_data.n_channels();
 
@@ -849,21 +1486,30 @@ class ClipDecoder
         first_sample = wav_data.n_values() - n;
         last_sample  = wav_data.n_values();
       }
+    Profile::Timer padding_timer (Profile::Stage::CLIP_PADDING);
+
     const double time_offset = double (first_sample) / wav_data.sample_rate() / wav_data.n_channels();
-    vector<float> ext_samples (wav_data.samples().begin() + first_sample, wav_data.samples().begin() + last_sample);
 
     if (0)
       {
-        printf ("%d: %f..%f\n", int (pos), time_offset, time_offset + double (ext_samples.size()) / wav_data.sample_rate() / wav_data.n_channels());
+        printf ("%d: %f..%f\n", int (pos), time_offset, time_offset + double (last_sample - first_sample) / wav_data.sample_rate() / wav_data.n_channels());
         printf ("%f< >%f\n",
           double (pad_samples_start) / wav_data.sample_rate() / wav_data.n_channels(),
           double (pad_samples_end) / wav_data.sample_rate() / wav_data.n_channels());
       }
-    ext_samples.insert (ext_samples.begin(), pad_samples_start, 0);
-    ext_samples.insert (ext_samples.end(),   pad_samples_end, 0);
 
-    WavData l_wav_data (ext_samples, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
-    run_padded (key_list, l_wav_data, result_set, time_offset);
+    /* zero padded view of the clip samples: the padding is neither stored nor copied */
+    const int n_channels = wav_data.n_channels();
+    WavView l_wav_data (wav_data, pad_samples_start / n_channels, first_sample / n_channels,
+                        (last_sample - first_sample) / n_channels, pad_samples_end / n_channels);
+
+    /* frames that don't overlap with the padding are shared with the spectrum cache of the original data */
+    const size_t data_start = l_wav_data.data_start();
+    const size_t data_end   = l_wav_data.data_end();
+    SpectrumCache l_spectrum_cache (l_wav_data, spectrum_cache, first_sample / n_channels, data_start, data_end);
+    padding_timer.stop();
+
+    run_padded (key_list, l_wav_data, l_spectrum_cache, result_set, time_offset);
    }
 public:
   ClipDecoder(double speed) :
@@ -872,19 +1518,41 @@ public:
   {
   }
   void
-  run (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set)
+  run (const vector<Key>& key_list, const WavData& wav_data, SpectrumCache& spectrum_cache, ResultSet& result_set)
   {
     const int wav_frames = wav_data.n_values() / (Params::frame_size * wav_data.n_channels());
     if (wav_frames < frames_per_block * 3.1) /* clip decoder is only used for small wavs */
       {
-        run_block (key_list, wav_data, result_set, Pos::START);
-        run_block (key_list, wav_data, result_set, Pos::END);
+        Profile::Timer timer (Profile::Stage::CLIP_DECODER);
+        run_block (key_list, wav_data, spectrum_cache, result_set, Pos::START);
+        run_block (key_list, wav_data, spectrum_cache, result_set, Pos::END);
       }
   }
+  /* get --screen: only run the sync search and return the best sync quality (0 if the input is not small) */
+  double
+  screen (const vector<Key>& key_list, const WavData& wav_data, SpectrumCache& spectrum_cache)
+  {
+    ResultSet result_set;
+
+    screen_only = true;
+    screen_quality = 0;
+    run (key_list, wav_data, spectrum_cache, result_set);
+    screen_only = false;
+    return screen_quality;
+  }
 };
 
-static void
-decode (ResultSet& result_set, const vector<Key>& key_list, const WavData& wav_data, const vector<int>& orig_bits, bool first_chunk)
+/* memory of one chunk of wav data and its spectrum cache, for --profile */
+static size_t
+chunk_memory (const WavData& wav_data, SpectrumCache& spectrum_cache)
+{
+  const size_t sample_bytes = wav_data.is_compact() ? sizeof (int16_t) : sizeof (float);
+  return wav_data.n_values() * sample_bytes + spectrum_cache.memory_bytes();
+}
+
+static Error
+decode (ResultSet& result_set, const vector<Key>& key_list, const WavData& wav_data, SpectrumCache& spectrum_cache,
+        const vector<int>& orig_bits, bool run_clip_decoder)
 {
   /*
    * The strategy for integrating speed detection into decoding is this:
@@ -894,59 +1562,138 @@ decode (ResultSet& result_set, const vector<Key>& key_list, const WavData& wav_d
    *
    * The reason to do it this way is that the detected speed may be wrong (on short clips)
    * and we don't want to loose a successful clip decoder match in this case.
+   *
+   * With --min-matches or --time-budget, the stages run in the order of their
+   * expected value instead: block decoder, clip decoder, speed. The remaining
+   * stages are skipped once the chunk has enough matches or the time budget is
+   * used up.
    */
-  if (Params::detect_speed || Params::detect_speed_patient || Params::try_speed > 0)
-    {
-      vector<DetectSpeedResult> speed_results;
-      if (Params::detect_speed || Params::detect_speed_patient)
-        speed_results = detect_speed (key_list, wav_data, !orig_bits.empty());
-      else
-        {
-          for (const auto& key : key_list)
-            {
-              DetectSpeedResult speed_result;
-              speed_result.key   = key;
-              speed_result.speed = Params::try_speed;
-              speed_results.push_back (speed_result);
-            }
-        }
+  const bool priority_order = Params::get_min_matches > 0 || Params::get_time_budget > 0;
+  auto skip_stage = [&] {
+    if (Params::get_min_matches > 0 && result_set.has_min_matches (Params::get_min_matches))
+      return true;
 
-      for (const auto& speed_result : speed_results)
-        {
-          WavData wav_data_speed = resample_ratio (wav_data, speed_result.speed, Params::mark_sample_rate * speed_result.speed);
+    /* get --time-budget: the results of this chunk are incomplete if a stage is skipped */
+    if (TimeBudget::expired())
+      {
+        result_set.set_partial();
+        return true;
+      }
+    return false;
+  };
+  auto decode_speed = [&]() -> Error {
+    vector<DetectSpeedResult> speed_results;
+    if (Params::detect_speed || Params::detect_speed_patient)
+      {
+        Profile::Timer timer (Profile::Stage::SPEED);
+        Error err = detect_speed (key_list, wav_data, !orig_bits.empty(), speed_results);
+        if (err)
+          return err;
+      }
+    else
+      {
+        for (const auto& key : key_list)
+          {
+            DetectSpeedResult speed_result;
+            speed_result.key   = key;
+            speed_result.speed = Params::try_speed;
+            speed_results.push_back (speed_result);
+          }
+      }
+
+    /* keys with the same speed (always for --try-speed) share one resampled copy of the wav data */
+    vector<std::pair<double, vector<Key>>> speed_keys;
+    for (const auto& speed_result : speed_results)
+      {
+        auto it = std::find_if (speed_keys.begin(), speed_keys.end(), [&] (const auto& sk) { return sk.first == speed_result.speed; });
+        if (it != speed_keys.end())
+          it->second.push_back (speed_result.key);
+        else
+          speed_keys.push_back ({ speed_result.speed, { speed_result.key } });
+      }
+    for (const auto& sk : speed_keys)
+      {
+        if (priority_order && skip_stage())
+          break;
 
-          BlockDecoder block_decoder (speed_result.speed);
-          block_decoder.run ({ speed_result.key }, wav_data_speed, result_set);
+        const double       speed = sk.first;
+        const vector<Key>& keys  = sk.second;
 
-          if (first_chunk)
-            {
-              ClipDecoder clip_decoder (speed_result.speed);
-              clip_decoder.run ({ speed_result.key }, wav_data_speed, result_set);
-            }
-        }
+        Profile::Timer resample_timer (Profile::Stage::RESAMPLE);
+        WavData wav_data_speed;
+        Error err = resample_ratio (wav_data, speed, Params::mark_sample_rate * speed, wav_data_speed);
+        if (err)
+          return err;
+        resample_timer.stop();
+        SpectrumCache spectrum_cache_speed (wav_data_speed);
+
+        BlockDecoder block_decoder (speed);
+        block_decoder.run (keys, wav_data_speed, spectrum_cache_speed, result_set);
+
+        if (run_clip_decoder)
+          {
+            ClipDecoder clip_decoder (speed);
+            clip_decoder.run (keys, wav_data_speed, spectrum_cache_speed, result_set);
+          }
+        if (Profile::enabled())
+          Profile::peak (Profile::Counter::MEMORY_SPEED, chunk_memory (wav_data_speed, spectrum_cache_speed));
+      }
+    return Error::Code::NONE;
+  };
+  const bool run_speed = Params::detect_speed || Params::detect_speed_patient || Params::try_speed > 0;
+  if (run_speed && !priority_order)
+    {
+      Error err = decode_speed();
+      if (err)
+        return err;
     }
 
+  /* all decoder stages for the original wav data share one spectrum cache */
   BlockDecoder block_decoder (1);
-  block_decoder.run (key_list, wav_data, result_set);
+  block_decoder.run (key_list, wav_data, spectrum_cache, result_set);
 
-  if (first_chunk)
+  if (run_clip_decoder && !(priority_order && skip_stage()))
     {
       ClipDecoder clip_decoder (1);
-      clip_decoder.run (key_list, wav_data, result_set);
+      clip_decoder.run (key_list, wav_data, spectrum_cache, result_set);
+    }
+
+  if (run_speed && priority_order && !skip_stage())
+    {
+      Error err = decode_speed();
+      if (err)
+        return err;
     }
 
+  if (Profile::enabled())
+    Profile::peak (Profile::Counter::MEMORY_CHUNK, chunk_memory (wav_data, spectrum_cache));
+
   result_set.set_debug_sync (block_decoder.debug_sync());
+  return Error::Code::NONE;
 }
 
 int
-report (ResultSet& result_set, size_t time_length, const vector<int>& orig_bits)
+report (ResultSet& result_set, size_t time_length, const vector<int>& orig_bits, FILE *ndjson_file = nullptr)
 {
   if (!Params::json_output.empty())
-    result_set.print_json (time_length, Params::json_output);
+    {
+      Error err = result_set.print_json (time_length, Params::json_output);
+      if (err)
+        {
+          error ("audiowmark: %s\n", err.message());
+          return 127;
+        }
+    }
 
-  if (Params::json_output != "-")
+  if (ndjson_file)
+    result_set.print_ndjson_summary (time_length, ndjson_file);
+
+  if (Params::json_output != "-" && Params::ndjson_output != "-")
     result_set.print();
 
+  if (result_set.is_partial())
+    warning ("audiowmark: time budget exceeded, the results are incomplete\n");
+
   if (!orig_bits.empty())
     {
       int match_count = result_set.print_match_count (orig_bits);
@@ -968,8 +1715,77 @@ report (ResultSet& result_set, size_t time_length, const vector<int>& orig_bits)
   return 0;
 }
 
+/*
+ * get --screen: map the best sync quality to a probability that the input is
+ * watermarked
+ *
+ * without watermark the best sync quality is typically below 0.3, for
+ * watermarked input it is typically above 0.7; a logistic function centered
+ * at the sync threshold is used to map the quality to a probability
+ */
+static double
+screen_probability (double sync_quality)
+{
+  const double scale = 0.04;
+
+  return 1 / (1 + exp (-(sync_quality - Params::sync_threshold2) / scale));
+}
+
+/* get --screen uses exit status 1 for unmarked input, so errors need a distinct exit status */
 int
-get_watermark (const vector<Key>& key_list, const string& infile, const string& orig_pattern)
+get_error_status()
+{
+  return Params::get_screen ? 2 : 1;
+}
+
+static int
+report_screen (double sync_quality)
+{
+  const double probability = screen_probability (sync_quality);
+  const bool   marked = probability >= 0.5;
+
+  if (!Params::json_output.empty())
+    {
+      FILE *outfile = fopen (Params::json_output == "-" ? "/dev/stdout" : Params::json_output.c_str(), "w");
+      if (!outfile)
+        {
+          error ("audiowmark: failed to open \"%s\": %s\n", Params::json_output.c_str(), strerror (errno));
+          return get_error_status();
+        }
+      string stats;
+      if (Profile::enabled())
+        stats = ", \"stats\": " + Profile::json();
+      fprintf (outfile, "{ \"screen\": { \"marked\": %s, \"probability\": %.5f, \"quality\": %.5f }%s }\n",
+               marked ? "true" : "false", probability, sync_quality, stats.c_str());
+      fclose (outfile);
+    }
+  if (Params::json_output != "-")
+    printf ("screen %s %.5f %.3f\n", marked ? "marked" : "unmarked", probability, sync_quality);
+
+  return marked ? 0 : 1;
+}
+
+/* end of the current chunk in seconds: the analyzed length of an input that is not read completely (get --min-matches) */
+static double
+chunk_end_time (WavChunkLoader& wav_chunk_loader)
+{
+  const WavData& wav_data = wav_chunk_loader.wav_data();
+  return wav_chunk_loader.time_offset() + wav_data.n_frames() / double (wav_data.sample_rate());
+}
+
+/* create the spectrum cache for the current chunk, reusing the spectrum of the overlap between the previous chunk and this chunk */
+static void
+next_spectrum_cache (WavChunkLoader& wav_chunk_loader, std::unique_ptr<SpectrumCache>& spectrum_cache, size_t& spectrum_cache_offset)
+{
+  std::unique_ptr<SpectrumCache> chunk_spectrum_cache (new SpectrumCache (wav_chunk_loader.wav_data()));
+  if (spectrum_cache)
+    chunk_spectrum_cache->take_frames (*spectrum_cache, wav_chunk_loader.frame_offset() - spectrum_cache_offset);
+  spectrum_cache = std::move (chunk_spectrum_cache);
+  spectrum_cache_offset = wav_chunk_loader.frame_offset();
+}
+
+static int
+get_watermark (const vector<Key>& key_list, WavChunkLoader& wav_chunk_loader, const string& infile, const string& orig_pattern)
 {
   ResultSet result_set;
 
@@ -978,18 +1794,38 @@ get_watermark (const vector<Key>& key_list, const string& infile, const string&
     {
       orig_bitvec = parse_payload (orig_pattern);
       if (orig_bitvec.empty())
-        return 1;
+        return get_error_status();
+    }
+
+  /* NDJSON output is written while the input is processed, so the file is opened before loading the input */
+  std::unique_ptr<FILE, decltype (&fclose)> ndjson_file (nullptr, fclose);
+  if (!Params::ndjson_output.empty())
+    {
+      ndjson_file.reset (fopen (Params::ndjson_output == "-" ? "/dev/stdout" : Params::ndjson_output.c_str(), "w"));
+      if (!ndjson_file)
+        {
+          perror (("audiowmark: failed to open \"" + Params::ndjson_output + "\":").c_str());
+          return get_error_status();
+        }
     }
 
   bool first_chunk = true;
-  WavChunkLoader wav_chunk_loader (infile);
+  std::unique_ptr<SpectrumCache> spectrum_cache;
+  size_t spectrum_cache_offset = 0;
+
+  const double live_horizon = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size / double (Params::mark_sample_rate);
+  int live_match_count = 0;
+  double screen_quality = 0;
+  double scan_length = -1; // get --min-matches: length of the input that was analyzed before stopping early
+
+  TimeBudget::start();
   while (!wav_chunk_loader.done())
     {
       Error err = wav_chunk_loader.load_next_chunk();
       if (err)
         {
           error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
-          return 1;
+          return get_error_status();
         }
 
       if (!wav_chunk_loader.done())
@@ -997,17 +1833,783 @@ get_watermark (const vector<Key>& key_list, const string& infile, const string&
           const WavData& wav_data = wav_chunk_loader.wav_data();
           assert (wav_data.sample_rate() == Params::mark_sample_rate);
 
+          next_spectrum_cache (wav_chunk_loader, spectrum_cache, spectrum_cache_offset);
+
+          if (Params::get_screen)
+            {
+              BlockDecoder block_decoder (1);
+              screen_quality = max (screen_quality, block_decoder.screen (key_list, wav_data, *spectrum_cache));
+
+              if (first_chunk && screen_probability (screen_quality) < 0.5)
+                {
+                  ClipDecoder clip_decoder (1);
+                  screen_quality = max (screen_quality, clip_decoder.screen (key_list, wav_data, *spectrum_cache));
+                }
+              /* one watermarked chunk is enough, no need to load the rest of the input */
+              if (screen_probability (screen_quality) >= 0.5)
+                {
+                  wav_chunk_loader.cancel_prefetch();
+                  break;
+                }
+
+              first_chunk = false;
+              continue;
+            }
+
           ResultSet chunk_result_set;
 
-          decode (chunk_result_set, key_list, wav_data, orig_bitvec, first_chunk);
+          /* live mode: the first chunks are small, use the clip decoder only if the whole input fits into the first chunk */
+          bool run_clip_decoder = first_chunk && Params::get_range_start <= 0;
+          if (Params::get_live)
+            run_clip_decoder = wav_chunk_loader.frame_offset() == 0 && wav_chunk_loader.last_chunk();
+
+          err = decode (chunk_result_set, key_list, wav_data, *spectrum_cache, orig_bitvec, run_clip_decoder);
+          if (err)
+            {
+              error ("audiowmark: %s\n", err.message());
+              return get_error_status();
+            }
           chunk_result_set.apply_time_offset (wav_chunk_loader.time_offset());
 
-          result_set.merge (chunk_result_set);
+          size_t first_merged = result_set.merge (chunk_result_set);
+          if (Params::get_live)
+            {
+              live_match_count += result_set.print_live (first_merged, orig_bitvec);
+
+              /* patterns of later chunks can't be duplicates of patterns before the start of this chunk */
+              result_set.expire (wav_chunk_loader.time_offset() - live_horizon);
+            }
+          else if (ndjson_file)
+            {
+              if (Params::ndjson_output != "-")
+                result_set.print_stream (first_merged);
+              result_set.print_ndjson (first_merged, ndjson_file.get());
+
+              /* the match count for cmp needs all patterns */
+              if (orig_bitvec.empty())
+                result_set.retire (wav_chunk_loader.time_offset() - live_horizon);
+            }
+          else if (Params::get_stream && Params::json_output != "-")
+            {
+              result_set.print_stream (first_merged);
+            }
           first_chunk = false;
+
+          /* get --min-matches: no need to load the rest of the input */
+          if (Params::get_min_matches > 0 && result_set.has_min_matches (Params::get_min_matches))
+            {
+              scan_length = chunk_end_time (wav_chunk_loader);
+              wav_chunk_loader.cancel_prefetch();
+              break;
+            }
+          /* get --time-budget: the rest of the input is not loaded (skipped work of this chunk marks the results as partial) */
+          if (TimeBudget::expired())
+            {
+              if (!wav_chunk_loader.last_chunk())
+                result_set.set_partial();
+              scan_length = chunk_end_time (wav_chunk_loader);
+              wav_chunk_loader.cancel_prefetch();
+              break;
+            }
+        }
+    }
+  if (Params::get_live)
+    {
+      if (orig_bitvec.empty())
+        return 0;
+
+      printf ("match_count %d\n", live_match_count);
+      if (Params::expect_matches >= 0)
+        return live_match_count == Params::expect_matches ? 0 : 1;
+      return live_match_count ? 0 : 1;
+    }
+  if (Params::get_screen)
+    return report_screen (screen_quality);
+
+  result_set.sort (key_list);
+
+  size_t time_length = lrint (scan_length >= 0 ? scan_length : wav_chunk_loader.length());
+  return report (result_set, time_length, orig_bitvec, ndjson_file.get());
+}
+
+/*
+ * get --sample-every: only decode windows of --sample-length seconds, which
+ * start every --sample-every seconds of the input
+ *
+ * the input stream is seeked to the start of each window, so the input between
+ * the windows is not even decoded, and the time needed depends on the number of
+ * windows instead of the length of the input; each window is analyzed like a
+ * short input file (block decoder, clip decoder and speed detection)
+ */
+static int
+get_watermark_sampled (const vector<Key>& key_list, AudioInputStream& in_stream, const string& infile, const string& orig_pattern)
+{
+  vector<int> orig_bitvec;
+  if (!orig_pattern.empty())
+    {
+      orig_bitvec = parse_payload (orig_pattern);
+      if (orig_bitvec.empty())
+        return 1;
+    }
+
+  const size_t n_frames = in_stream.n_frames();
+  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
+    {
+      error ("audiowmark: --sample-every needs an input file with known length (not a pipe or raw stream): %s\n", infile.c_str());
+      return 1;
+    }
+  const int    n_channels = in_stream.n_channels();
+  const int    sample_rate = in_stream.sample_rate();
+  const size_t window_frames = lrint (Params::get_sample_length * sample_rate);
+
+  ResultSet result_set;
+  double scan_length = n_frames / double (sample_rate); // get --min-matches / --time-budget: end of the last analyzed window
+
+  TimeBudget::start();
+  vector<float> samples;
+  for (size_t window = 0; ; window++)
+    {
+      const size_t start = lrint (window * Params::get_sample_every * sample_rate);
+      if (start >= n_frames)
+        break;
+
+      Error err = in_stream.seek (start);
+      if (!err)
+        {
+          Profile::Timer timer (Profile::Stage::INPUT);
+          err = in_stream.read_frames (samples, min (window_frames, n_frames - start));
+        }
+      if (err)
+        {
+          error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+          return 1;
+        }
+      if (samples.empty())
+        break;
+
+      const double window_end = (start + samples.size() / n_channels) / double (sample_rate);
+      WavData wav_data (samples, n_channels, sample_rate, in_stream.bit_depth());
+      if (sample_rate != Params::mark_sample_rate)
+        {
+          Profile::Timer timer (Profile::Stage::RESAMPLE);
+          WavData wav_data_in = wav_data;
+          err = resample (wav_data_in, Params::mark_sample_rate, wav_data);
+        }
+      ResultSet window_result_set;
+      if (!err)
+        {
+          SpectrumCache spectrum_cache (wav_data);
+          err = decode (window_result_set, key_list, wav_data, spectrum_cache, orig_bitvec, /* run_clip_decoder */ true);
+        }
+      if (err)
+        {
+          error ("audiowmark: %s\n", err.message());
+          return 1;
+        }
+      window_result_set.apply_time_offset (start / double (sample_rate));
+
+      size_t first_merged = result_set.merge (window_result_set);
+      if (Params::get_stream && Params::json_output != "-")
+        result_set.print_stream (first_merged);
+
+      if (Params::get_min_matches > 0 && result_set.has_min_matches (Params::get_min_matches))
+        {
+          scan_length = window_end;
+          break;
+        }
+      if (TimeBudget::expired())
+        {
+          if (size_t (lrint ((window + 1) * Params::get_sample_every * sample_rate)) < n_frames)
+            result_set.set_partial();
+          scan_length = window_end;
+          break;
         }
     }
   result_set.sort (key_list);
 
-  size_t time_length = lrint (wav_chunk_loader.length());
+  size_t time_length = lrint (scan_length);
   return report (result_set, time_length, orig_bitvec);
 }
+
+int
+get_watermark (const vector<Key>& key_list, const string& infile, const string& orig_pattern)
+{
+  if (Params::get_sample_every > 0)
+    {
+      Error err;
+      std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (infile, err);
+      if (err)
+        {
+          error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+          return get_error_status();
+        }
+      return get_watermark_sampled (key_list, *in_stream, infile, orig_pattern);
+    }
+  WavChunkLoader wav_chunk_loader (infile);
+  return get_watermark (key_list, wav_chunk_loader, infile, orig_pattern);
+}
+
+/* like get_watermark, but for an already opened input stream (infile is only used for error messages) */
+int
+get_watermark (const vector<Key>& key_list, std::unique_ptr<AudioInputStream> in_stream, const string& infile, const string& orig_pattern)
+{
+  if (Params::get_sample_every > 0)
+    return get_watermark_sampled (key_list, *in_stream, infile, orig_pattern);
+
+  WavChunkLoader wav_chunk_loader (std::move (in_stream));
+  return get_watermark (key_list, wav_chunk_loader, infile, orig_pattern);
+}
+
+/*
+ * get --from-index: run the block decoder on the frames of a spectrum index
+ *
+ * the index is processed in chunks like the input of get_watermark, with
+ * chunk starts on the sync search grid, so all frames of the sync search are
+ * part of the index; the clip decoder and speed detection need the samples,
+ * so they are not available
+ */
+int
+get_watermark_from_index (const vector<Key>& key_list, const string& index_file, const string& orig_pattern)
+{
+  vector<int> orig_bitvec;
+  if (!orig_pattern.empty())
+    {
+      orig_bitvec = parse_payload (orig_pattern);
+      if (orig_bitvec.empty())
+        return get_error_status();
+    }
+
+  SpectrumIndex index;
+  Error err = index.load (index_file);
+  if (err)
+    {
+      error ("audiowmark: error loading index: %s\n", err.message());
+      return get_error_status();
+    }
+
+  /* the views of the chunks are padding only: the cache takes all frames from the index */
+  const WavData no_samples ({}, index.n_channels(), Params::mark_sample_rate, 16);
+
+  const size_t block_frames = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size;
+  const size_t step = Params::sync_search_step;
+  const size_t overlap_frames = (2 * block_frames + step - 1) / step * step;
+  const size_t chunk_frames = std::max<size_t> (lrint (Params::get_chunk_size * 60 * Params::mark_sample_rate) / step * step,
+                                                overlap_frames + step);
+
+  ResultSet result_set;
+  double screen_quality = 0;
+  size_t scan_frames = index.n_frames(); // get --min-matches / --time-budget: end of the analyzed part of the index
+
+  TimeBudget::start();
+  for (size_t chunk_start = 0; chunk_start < index.n_frames(); chunk_start += chunk_frames - overlap_frames)
+    {
+      const size_t n_frames = min (chunk_frames, index.n_frames() - chunk_start);
+      const WavView wav_view (no_samples, n_frames, 0, 0, 0);
+      SpectrumCache spectrum_cache (wav_view, index, chunk_start);
+
+      BlockDecoder block_decoder (1);
+      if (Params::get_screen)
+        {
+          screen_quality = max (screen_quality, block_decoder.screen (key_list, wav_view, spectrum_cache));
+          if (screen_probability (screen_quality) >= 0.5)
+            break;
+        }
+      else
+        {
+          ResultSet chunk_result_set;
+          block_decoder.run (key_list, wav_view, spectrum_cache, chunk_result_set);
+          chunk_result_set.set_debug_sync (block_decoder.debug_sync());
+          chunk_result_set.apply_time_offset (double (chunk_start) / Params::mark_sample_rate);
+
+          size_t first_merged = result_set.merge (chunk_result_set);
+          if (Params::get_stream && Params::json_output != "-")
+            result_set.print_stream (first_merged);
+
+          if (Params::get_min_matches > 0 && result_set.has_min_matches (Params::get_min_matches))
+            {
+              scan_frames = chunk_start + n_frames;
+              break;
+            }
+          if (TimeBudget::expired())
+            {
+              if (chunk_start + n_frames < index.n_frames())
+                result_set.set_partial();
+              scan_frames = chunk_start + n_frames;
+              break;
+            }
+        }
+      if (chunk_start + n_frames >= index.n_frames())
+        break;
+    }
+  if (Params::get_screen)
+    return report_screen (screen_quality);
+
+  result_set.sort (key_list);
+
+  size_t time_length = lrint (double (scan_frames) / Params::mark_sample_rate);
+  return report (result_set, time_length, orig_bitvec);
+}
+
+/*
+ * detect the watermark in infile and return the results as one line of JSON
+ * (the same data as get --json), without printing anything
+ *
+ * this is used by audiowmark serve, where many requests are processed by one
+ * process, so it may be called from multiple threads at the same time
+ */
+/* decode all chunks (without any output), used by audiowmark serve and libaudiowmark */
+static Error
+get_result_set (const vector<Key>& key_list, WavChunkLoader& wav_chunk_loader, ResultSet& result_set, double& length)
+{
+  bool first_chunk = true;
+  std::unique_ptr<SpectrumCache> spectrum_cache;
+  size_t spectrum_cache_offset = 0;
+
+  while (!wav_chunk_loader.done())
+    {
+      Error err = wav_chunk_loader.load_next_chunk();
+      if (err)
+        return err;
+
+      if (!wav_chunk_loader.done())
+        {
+          next_spectrum_cache (wav_chunk_loader, spectrum_cache, spectrum_cache_offset);
+
+          ResultSet chunk_result_set;
+          err = decode (chunk_result_set, key_list, wav_chunk_loader.wav_data(), *spectrum_cache, /* orig_bits */ {}, first_chunk);
+          if (err)
+            return err;
+          chunk_result_set.apply_time_offset (wav_chunk_loader.time_offset());
+
+          result_set.merge (chunk_result_set);
+          first_chunk = false;
+
+          if (Params::get_min_matches > 0 && result_set.has_min_matches (Params::get_min_matches))
+            {
+              length = chunk_end_time (wav_chunk_loader);
+              wav_chunk_loader.cancel_prefetch();
+              result_set.sort (key_list);
+              return Error::Code::NONE;
+            }
+        }
+    }
+  length = wav_chunk_loader.length();
+  result_set.sort (key_list);
+  return Error::Code::NONE;
+}
+
+Error
+get_watermark_json (const vector<Key>& key_list, const string& infile, string& json)
+{
+  ResultSet result_set;
+  WavChunkLoader wav_chunk_loader (infile);
+
+  double length = 0;
+  Error err = get_result_set (key_list, wav_chunk_loader, result_set, length);
+  if (err)
+    return err;
+
+  json = result_set.json (lrint (length), /* one_line */ true);
+  return Error::Code::NONE;
+}
+
+Error
+get_watermark_matches (const vector<Key>& key_list, std::unique_ptr<AudioInputStream> in_stream, AudioWmark::Detector::Result& result)
+{
+  ResultSet result_set;
+  WavChunkLoader wav_chunk_loader (std::move (in_stream));
+
+  double length = 0;
+  Error err = get_result_set (key_list, wav_chunk_loader, result_set, length);
+  if (err)
+    return err;
+
+  result.length  = length;
+  result.matches = result_set.matches();
+  return Error::Code::NONE;
+}
+
+static Error
+read_text_file (const string& filename, string& text)
+{
+  std::unique_ptr<FILE, decltype (&fclose)> file (fopen (filename.c_str(), "r"), fclose);
+  if (!file)
+    return Error (strerror (errno));
+
+  char buffer[4096];
+  size_t n;
+  while ((n = fread (buffer, 1, sizeof (buffer), file.get())) > 0)
+    text.append (buffer, n);
+  if (ferror (file.get()))
+    return Error (strerror (errno));
+
+  return Error::Code::NONE;
+}
+
+/* parser for the results of get --json, for audiowmark merge-results */
+class ResultJsonParser : public JsonReader
+{
+  /* "m:ss" as seconds */
+  static bool
+  parse_minutes (const string& str, double& seconds)
+  {
+    int minutes, secs;
+    if (sscanf (str.c_str(), "%d:%d", &minutes, &secs) != 2)
+      return false;
+
+    seconds = minutes * 60 + secs;
+    return true;
+  }
+  static bool
+  parse_type (string type, ResultSet::Type& pattern_type, ConvBlockType& block_type)
+  {
+    const string speed_suffix = "-SPEED";
+    if (type.size() > speed_suffix.size() && type.compare (type.size() - speed_suffix.size(), string::npos, speed_suffix) == 0)
+      type.resize (type.size() - speed_suffix.size());
+
+    pattern_type = ResultSet::Type::BLOCK;
+    block_type   = ConvBlockType::a;
+    if (type == "ALL")
+      {
+        pattern_type = ResultSet::Type::ALL;
+        return true;
+      }
+    if (type.compare (0, 5, "CLIP-") == 0)
+      {
+        pattern_type = ResultSet::Type::CLIP;
+        type = type.substr (5);
+      }
+    if (type == "A")
+      block_type = ConvBlockType::a;
+    else if (type == "B")
+      block_type = ConvBlockType::b;
+    else if (type == "AB")
+      block_type = ConvBlockType::ab;
+    else
+      return false;
+    return true;
+  }
+  static const Key&
+  find_key (vector<Key>& key_list, const string& key_name)
+  {
+    auto it = std::find_if (key_list.begin(), key_list.end(), [&] (const Key& key) { return key.name() == key_name; });
+    if (it == key_list.end())
+      {
+        Key key;
+        key.set_name (key_name);
+        it = key_list.insert (key_list.end(), key);
+      }
+    return *it;
+  }
+  Error
+  parse_match (ResultSet& result_set, vector<Key>& key_list)
+  {
+    string key_name, bits, type;
+    double time = -1, pos = 0, quality = 0, decode_error = 0, speed = 1;
+
+    if (!parse_char ('{'))
+      return Error ("expected match object");
+    do
+      {
+        string name, raw, str;
+        bool   is_string;
+
+        skip_space();
+        if (!parse_string (name) || !parse_char (':'))
+          return Error ("expected member name");
+        skip_space();
+        if (name == "key" || name == "pos" || name == "bits" || name == "type")
+          {
+            if (!parse_value (raw, str, is_string) || !is_string)
+              return Error ("match member '" + name + "' needs to be a string");
+            if (name == "key")
+              key_name = str;
+            else if (name == "pos" && !parse_minutes (str, pos))
+              return Error ("bad match position '" + str + "'");
+            else if (name == "bits")
+              bits = str;
+            else if (name == "type")
+              type = str;
+          }
+        else if (name == "time" || name == "quality" || name == "error" || name == "speed")
+          {
+            if (!parse_value (raw, str, is_string) || is_string)
+              return Error ("match member '" + name + "' needs to be a number");
+            const double value = atof (raw.c_str());
+            if (name == "time")
+              time = value;
+            else if (name == "quality")
+              quality = value;
+            else if (name == "error")
+              decode_error = value;
+            else if (name == "speed")
+              speed = value;
+          }
+        else if (!skip_value()) /* rating is computed again after merging */
+          {
+            return Error ("bad value for match member '" + name + "'");
+          }
+      }
+    while (parse_char (','));
+    if (!parse_char ('}'))
+      return Error ("expected ',' or '}'");
+
+    ResultSet::Type pattern_type;
+    SyncFinder::Score sync_score { 0, quality, ConvBlockType::a };
+    if (!parse_type (type, pattern_type, sync_score.block_type))
+      return Error ("unsupported match type '" + type + "'");
+
+    vector<int> bit_vec = bit_str_to_vec (bits);
+    if (bit_vec.empty())
+      return Error ("bad match bits '" + bits + "'");
+
+    /* results of get without --range only contain the position in seconds */
+    if (time < 0)
+      time = pos;
+
+    result_set.add_pattern (find_key (key_list, key_name), time, sync_score, bit_vec, decode_error, pattern_type, speed);
+    return Error::Code::NONE;
+  }
+  Error
+  parse_soft_block (ResultSet& result_set, vector<Key>& key_list)
+  {
+    string        key_name, type;
+    double        time = -1, quality = 0;
+    vector<float> raw_bit_vec;
+
+    if (!parse_char ('{'))
+      return Error ("expected block object");
+    do
+      {
+        string name, raw, str;
+        bool   is_string;
+
+        skip_space();
+        if (!parse_string (name) || !parse_char (':'))
+          return Error ("expected member name");
+        skip_space();
+        if (name == "key" || name == "type")
+          {
+            if (!parse_value (raw, str, is_string) || !is_string)
+              return Error ("block member '" + name + "' needs to be a string");
+            if (name == "key")
+              key_name = str;
+            else
+              type = str;
+          }
+        else if (name == "time" || name == "quality")
+          {
+            if (!parse_value (raw, str, is_string) || is_string)
+              return Error ("block member '" + name + "' needs to be a number");
+            if (name == "time")
+              time = atof (raw.c_str());
+            else
+              quality = atof (raw.c_str());
+          }
+        else if (name == "soft_bits")
+          {
+            if (!parse_char ('['))
+              return Error ("block soft_bits need to be an array");
+            if (!parse_char (']'))
+              {
+                do
+                  {
+                    skip_space();
+                    if (!parse_value (raw, str, is_string) || is_string)
+                      return Error ("block soft_bits need to be numbers");
+                    raw_bit_vec.push_back (atof (raw.c_str()));
+                  }
+                while (parse_char (','));
+                if (!parse_char (']'))
+                  return Error ("expected ',' or ']'");
+              }
+          }
+        else if (!skip_value())
+          {
+            return Error ("bad value for block member '" + name + "'");
+          }
+      }
+    while (parse_char (','));
+    if (!parse_char ('}'))
+      return Error ("expected ',' or '}'");
+
+    if (type != "A" && type != "B")
+      return Error ("unsupported block type '" + type + "'");
+    if (time < 0)
+      return Error ("block without time");
+    if (raw_bit_vec.size() != code_size (ConvBlockType::a, Params::payload_size))
+      return Error ("bad number of block soft bits");
+
+    result_set.add_soft_block (find_key (key_list, key_name), time, quality, type == "B" ? ConvBlockType::b : ConvBlockType::a, raw_bit_vec);
+    return Error::Code::NONE;
+  }
+public:
+  ResultJsonParser (const string& text) :
+    JsonReader (text)
+  {
+  }
+  /* have_blocks: the results contain the soft bits of the blocks (get --range) */
+  Error
+  parse (ResultSet& result_set, vector<Key>& key_list, double& length, bool& have_blocks)
+  {
+    have_blocks = false;
+    if (!parse_char ('{'))
+      return Error ("expected JSON object");
+    do
+      {
+        string name, raw, str;
+        bool   is_string;
+
+        skip_space();
+        if (!parse_string (name) || !parse_char (':'))
+          return Error ("expected member name");
+        skip_space();
+        if (name == "length")
+          {
+            if (!parse_value (raw, str, is_string) || !is_string || !parse_minutes (str, length))
+              return Error ("bad length");
+          }
+        else if (name == "matches")
+          {
+            if (!parse_char ('['))
+              return Error ("matches need to be an array");
+            if (!parse_char (']'))
+              {
+                do
+                  {
+                    Error err = parse_match (result_set, key_list);
+                    if (err)
+                      return err;
+                  }
+                while (parse_char (','));
+                if (!parse_char (']'))
+                  return Error ("expected ',' or ']'");
+              }
+          }
+        else if (name == "blocks")
+          {
+            if (!parse_char ('['))
+              return Error ("blocks need to be an array");
+            if (!parse_char (']'))
+              {
+                do
+                  {
+                    Error err = parse_soft_block (result_set, key_list);
+                    if (err)
+                      return err;
+                  }
+                while (parse_char (','));
+                if (!parse_char (']'))
+                  return Error ("expected ',' or ']'");
+              }
+            have_blocks = true;
+          }
+        else if (name == "partial")
+          {
+            if (!parse_value (raw, str, is_string))
+              return Error ("bad value for partial");
+            if (raw == "true")
+              result_set.set_partial();
+          }
+        else if (!skip_value())
+          {
+            return Error ("bad value for member '" + name + "'");
+          }
+      }
+    while (parse_char (','));
+    if (!parse_char ('}') || !at_end())
+      return Error ("expected end of JSON object");
+    return Error::Code::NONE;
+  }
+};
+
+/*
+ * audiowmark merge-results: merge the results of get --json for parts of one
+ * input (get --range), as if the whole input had been processed by one get
+ *
+ * the results of each file are merged like the results of the chunks of one
+ * input: duplicate matches (from the overlap between the ranges) are removed,
+ * and the rating is computed again from all matches
+ *
+ * the "all" pattern of each range only combines the blocks of this range, so
+ * if all files contain the soft bits of their blocks, the "all" pattern is
+ * computed again from the blocks of all ranges
+ */
+static void
+merge_all_patterns (ResultSet& result_set, const vector<Key>& key_list)
+{
+  const size_t block_size = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size;
+
+  result_set.remove_all_patterns();
+  for (const auto& key : key_list)
+    {
+      vector<BlockDecoder::PatternRawBits> pattern_raw_vec;
+      for (const auto& b : result_set.get_soft_blocks())
+        {
+          if (b.key == key)
+            {
+              BlockDecoder::PatternRawBits raw_bits;
+              raw_bits.valid = true;
+              raw_bits.index = lrint (b.time * Params::mark_sample_rate);
+              raw_bits.quality = b.quality;
+              raw_bits.raw_bit_vec = b.raw_bit_vec;
+              raw_bits.block_type = b.block_type;
+              pattern_raw_vec.push_back (raw_bits);
+            }
+        }
+      std::stable_sort (pattern_raw_vec.begin(), pattern_raw_vec.end(),
+                        [] (const BlockDecoder::PatternRawBits& p1, const BlockDecoder::PatternRawBits& p2) { return p1.index < p2.index; });
+
+      SyncFinder::Score score_all { 0, 0 };
+      vector<float>     soft_bit_vec;
+      if (BlockDecoder::all_soft_bits (pattern_raw_vec, block_size, score_all, soft_bit_vec))
+        {
+          float decode_error = 0;
+          vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, soft_bit_vec, &decode_error);
+
+          if (!bit_vec.empty())
+            result_set.add_pattern (key, /* time */ 0.0, score_all, bit_vec, decode_error, ResultSet::Type::ALL, 1);
+        }
+    }
+}
+
+int
+merge_results (const vector<string>& json_files)
+{
+  ResultSet   result_set;
+  vector<Key> key_list;
+  double      length = 0;
+  bool        all_have_blocks = !json_files.empty();
+
+  for (const auto& json_file : json_files)
+    {
+      string text;
+      Error err = read_text_file (json_file, text);
+      if (!err)
+        {
+          ResultSet file_result_set;
+          double    file_length = 0;
+          bool      have_blocks = false;
+
+          err = ResultJsonParser (text).parse (file_result_set, key_list, file_length, have_blocks);
+          if (!err)
+            {
+              all_have_blocks = all_have_blocks && have_blocks;
+              if (file_result_set.is_partial())
+                result_set.set_partial();
+              result_set.merge (file_result_set);
+              length = max (length, file_length);
+            }
+        }
+      if (err)
+        {
+          error ("audiowmark: error reading results from '%s': %s\n", json_file.c_str(), err.message());
+          return 1;
+        }
+    }
+  if (all_have_blocks)
+    merge_all_patterns (result_set, key_list);
+
+  result_set.sort (key_list);
+  return report (result_set, lrint (length), {});
+}
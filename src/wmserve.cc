@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2025 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <functional>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "wmcommon.hh"
+#include "keytables.hh"
+#include "jsonreader.hh"
+
+using std::string;
+using std::vector;
+
+/*
+ * audiowmark serve: detection server
+ *
+ * Since the server is a long running process, the state which is expensive
+ * to create for each audiowmark get invocation (key tables, fft plans, worker
+ * threads) is created once and reused for all requests.
+ *
+ * Requests are read line by line from stdin (or from each connection of a
+ * unix socket), each request is answered with one line of JSON. Requests are
+ * processed in parallel, so the responses are not necessarily in the same
+ * order as the requests; the response contains the id and filename of the
+ * request.
+ *
+ * Request:   { "id": 1, "file": "/path/to/input.wav" }
+ *            (or just the filename)
+ *
+ * Response:  { "id": 1, "file": "/path/to/input.wav", "time": 0.123, "result": { "length": ..., "matches": [...] } }
+ *            { "id": 1, "file": "/path/to/input.wav", "error": "..." }
+ *
+ * audiowmark get --batch uses the same machinery for a list of files (or all
+ * files of a directory), and writes one record per file in the list order:
+ *
+ * Record:    { "file": "/path/to/input.wav", "time": 0.123, "result": { ... } }
+ */
+
+/* limits the number of requests that are processed at the same time (for all connections) */
+class JobLimit
+{
+  std::mutex              mutex;
+  std::condition_variable cond;
+  int                     n_jobs = 0;
+  const int               max_jobs = 0;
+public:
+  JobLimit (int max_jobs) :
+    max_jobs (max_jobs)
+  {
+  }
+  void
+  acquire()
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    cond.wait (lock, [this] { return n_jobs < max_jobs; });
+    n_jobs++;
+  }
+  void
+  release()
+  {
+    std::lock_guard<std::mutex> lg (mutex);
+    n_jobs--;
+    cond.notify_one();
+  }
+};
+
+/*
+ * each request runs on its own thread (the number of threads is bounded by
+ * JobLimit); requests are not scheduler jobs, because a thread which waits
+ * for its decode jobs could otherwise steal a queued request and run it nested
+ */
+class RequestThreads
+{
+  struct Request
+  {
+    std::thread       thread;
+    std::atomic<bool> done { false };
+  };
+  std::list<std::unique_ptr<Request>> requests;
+
+  void
+  join_done()
+  {
+    auto it = requests.begin();
+    while (it != requests.end())
+      {
+        if ((*it)->done)
+          {
+            (*it)->thread.join();
+            it = requests.erase (it);
+          }
+        else
+          it++;
+      }
+  }
+public:
+  void
+  start (std::function<void()> fun)
+  {
+    join_done();
+
+    requests.emplace_back (new Request());
+    Request *request = requests.back().get();
+    request->thread = std::thread ([fun, request]()
+      {
+        fun();
+        request->done = true;
+      });
+  }
+  void
+  join_all()
+  {
+    for (auto& request : requests)
+      request->thread.join();
+    requests.clear();
+  }
+  ~RequestThreads()
+  {
+    join_all();
+  }
+};
+
+/* minimal parser for request objects: only string, number, true/false/null values are supported */
+class RequestParser : public JsonReader
+{
+  /* number syntax from the JSON spec: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+  static bool
+  is_json_number (const string& raw)
+  {
+    size_t i = 0;
+    auto digits = [&] () {
+      const size_t start = i;
+      while (i < raw.size() && isdigit (raw[i]))
+        i++;
+      return i > start;
+    };
+    if (i < raw.size() && raw[i] == '-')
+      i++;
+    if (i < raw.size() && raw[i] == '0')
+      i++;
+    else if (!digits())
+      return false;
+    if (i < raw.size() && raw[i] == '.')
+      {
+        i++;
+        if (!digits())
+          return false;
+      }
+    if (i < raw.size() && (raw[i] == 'e' || raw[i] == 'E'))
+      {
+        i++;
+        if (i < raw.size() && (raw[i] == '+' || raw[i] == '-'))
+          i++;
+        if (!digits())
+          return false;
+      }
+    return i == raw.size();
+  }
+public:
+  RequestParser (const string& text) :
+    JsonReader (text)
+  {
+  }
+  Error
+  parse (string& id, string& file)
+  {
+    skip_space();
+    if (pos >= text.size() || text[pos] != '{')
+      {
+        /* no JSON object: the request is just the filename */
+        size_t end = text.find_last_not_of (" \t\r\n");
+        file = text.substr (pos, end + 1 - pos);
+        return Error::Code::NONE;
+      }
+    pos++;
+
+    bool have_file = false;
+    skip_space();
+    if (pos < text.size() && text[pos] == '}')
+      pos++;
+    else
+      {
+        while (true)
+          {
+            string name, raw, str;
+            bool   is_string;
+
+            skip_space();
+            if (!parse_string (name))
+              return Error ("request: expected member name");
+            skip_space();
+            if (pos >= text.size() || text[pos++] != ':')
+              return Error ("request: expected ':'");
+            skip_space();
+            if (!parse_value (raw, str, is_string))
+              return Error ("request: unsupported value for member '" + name + "'");
+
+            if (name == "id")
+              {
+                /* the id is copied to the response, so it needs to be valid JSON */
+                if (is_string)
+                  id = "\"" + json_escape (str) + "\"";
+                else if (raw == "true" || raw == "false" || raw == "null" || is_json_number (raw))
+                  id = raw;
+                else
+                  return Error ("request: id needs to be a string, number, true, false or null");
+              }
+            else if (name == "file")
+              {
+                if (!is_string)
+                  return Error ("request: file needs to be a string");
+                file = str;
+                have_file = true;
+              }
+            else
+              {
+                return Error ("request: unknown member '" + name + "'");
+              }
+
+            skip_space();
+            if (pos < text.size() && text[pos] == ',')
+              {
+                pos++;
+                continue;
+              }
+            if (pos < text.size() && text[pos] == '}')
+              {
+                pos++;
+                break;
+              }
+            return Error ("request: expected ',' or '}'");
+          }
+      }
+    skip_space();
+    if (pos != text.size())
+      return Error ("request: unexpected data after request object");
+    if (!have_file)
+      return Error ("request: missing file");
+    return Error::Code::NONE;
+  }
+};
+
+/* detect watermarks in file: JSON members for one response / batch record */
+static string
+file_result_json (const vector<Key>& key_list, const string& file, Error& err)
+{
+  const string out = "\"file\": \"" + json_escape (file) + "\"";
+  const double start_time = get_time();
+
+  string json;
+  err = get_watermark_json (key_list, file, json);
+  if (err)
+    return out + ", \"error\": \"" + json_escape (err.message()) + "\"";
+
+  return out + string_printf (", \"time\": %.3f, \"result\": ", get_time() - start_time) + json;
+}
+
+static string
+process_request (const vector<Key>& key_list, const string& request)
+{
+  string id = "null";
+  string file;
+
+  Error err = RequestParser (request).parse (id, file);
+
+  string response = "{ \"id\": " + id;
+  if (!err)
+    return response + ", " + file_result_json (key_list, file, err) + " }";
+
+  if (!file.empty())
+    response += ", \"file\": \"" + json_escape (file) + "\"";
+  return response + ", \"error\": \"" + json_escape (err.message()) + "\" }";
+}
+
+/* read requests from in_file until eof, write the responses to out_file */
+static void
+serve_connection (const ServeRequestFunc& process_request, FILE *in_file, FILE *out_file, JobLimit& job_limit)
+{
+  RequestThreads request_threads;
+  std::mutex     out_mutex;
+
+  char   *line = nullptr;
+  size_t  line_size = 0;
+  ssize_t len;
+  while ((len = getline (&line, &line_size, in_file)) >= 0)
+    {
+      const string request (line, len);
+      if (request.find_first_not_of (" \t\r\n") == string::npos)
+        continue;
+
+      job_limit.acquire();
+      request_threads.start ([&process_request, request, out_file, &out_mutex, &job_limit]()
+        {
+          const string response = process_request (request);
+          {
+            std::lock_guard<std::mutex> lg (out_mutex);
+            fprintf (out_file, "%s\n", response.c_str());
+            fflush (out_file);
+          }
+          job_limit.release();
+        });
+    }
+  free (line);
+  request_threads.join_all();
+}
+
+static int
+serve_socket (const ServeRequestFunc& process_request, const string& socket_path, JobLimit& job_limit)
+{
+  sockaddr_un addr = { 0, };
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof (addr.sun_path))
+    {
+      error ("audiowmark: socket path '%s' is too long\n", socket_path.c_str());
+      return 1;
+    }
+  strcpy (addr.sun_path, socket_path.c_str());
+
+  int listen_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    {
+      error ("audiowmark: failed to create socket: %s\n", strerror (errno));
+      return 1;
+    }
+
+  /* remove stale socket from a previous server */
+  struct stat st;
+  if (stat (socket_path.c_str(), &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (socket_path.c_str());
+
+  if (bind (listen_fd, (sockaddr *) &addr, sizeof (addr)) != 0 || listen (listen_fd, 64) != 0)
+    {
+      error ("audiowmark: failed to listen on socket '%s': %s\n", socket_path.c_str(), strerror (errno));
+      close (listen_fd);
+      return 1;
+    }
+  info ("audiowmark: serving requests on %s\n", socket_path.c_str());
+
+  while (true)
+    {
+      int fd = accept (listen_fd, nullptr, nullptr);
+      if (fd < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+
+          error ("audiowmark: failed to accept connection: %s\n", strerror (errno));
+          close (listen_fd);
+          return 1;
+        }
+      std::thread ([&process_request, fd, &job_limit]()
+        {
+          FILE *in_file  = fdopen (fd, "r");
+          FILE *out_file = fdopen (dup (fd), "w");
+          if (in_file && out_file)
+            serve_connection (process_request, in_file, out_file, job_limit);
+
+          if (in_file)
+            fclose (in_file);
+          else
+            close (fd);
+          if (out_file)
+            fclose (out_file);
+        }).detach();
+    }
+}
+
+/*
+ * serve requests from stdin (socket_path empty) or from a unix socket, each
+ * request line is answered with the line returned by process_request
+ *
+ * this is shared by the detection server and hls-serve
+ */
+int
+serve_requests (const string& socket_path, int max_jobs, const ServeRequestFunc& process_request)
+{
+  /* clients may disconnect before the response is written */
+  signal (SIGPIPE, SIG_IGN);
+
+  JobLimit job_limit (max_jobs);
+  if (socket_path.empty())
+    {
+      serve_connection (process_request, stdin, stdout, job_limit);
+      return 0;
+    }
+  return serve_socket (process_request, socket_path, job_limit);
+}
+
+int
+serve (const vector<Key>& key_list, const string& socket_path, int max_jobs)
+{
+  /* compute the key tables before the first request */
+  for (const auto& key : key_list)
+    KeyTables::get (key);
+
+  return serve_requests (socket_path, max_jobs, [&key_list] (const string& request) { return process_request (key_list, request); });
+}
+
+/* files for get --batch: all files of a directory (sorted) or the lines of a list file ("-": stdin) */
+static Error
+read_batch_files (const string& batch, vector<string>& files)
+{
+  struct stat st;
+  if (batch != "-" && stat (batch.c_str(), &st) == 0 && S_ISDIR (st.st_mode))
+    {
+      DIR *dir = opendir (batch.c_str());
+      if (!dir)
+        return Error (string_printf ("failed to open directory '%s': %s", batch.c_str(), strerror (errno)));
+
+      while (dirent *entry = readdir (dir))
+        {
+          if (entry->d_name[0] == '.') /* skip hidden files, "." and ".." */
+            continue;
+
+          const string path = batch + "/" + entry->d_name;
+          if (stat (path.c_str(), &st) == 0 && S_ISREG (st.st_mode))
+            files.push_back (path);
+        }
+      closedir (dir);
+      std::sort (files.begin(), files.end());
+      return Error::Code::NONE;
+    }
+
+  FILE *list_file = batch == "-" ? stdin : fopen (batch.c_str(), "r");
+  if (!list_file)
+    return Error (string_printf ("failed to open batch list '%s': %s", batch.c_str(), strerror (errno)));
+
+  char   *line = nullptr;
+  size_t  line_size = 0;
+  ssize_t len;
+  while ((len = getline (&line, &line_size, list_file)) >= 0)
+    {
+      const string file (line, len);
+      const size_t end = file.find_last_not_of (" \t\r\n");
+      if (end != string::npos)
+        files.push_back (file.substr (0, end + 1));
+    }
+  free (line);
+  if (list_file != stdin)
+    fclose (list_file);
+  return Error::Code::NONE;
+}
+
+/*
+ * get --batch: files are decoded in parallel (at most max_jobs at the same
+ * time, each on its own request thread); since the decode jobs of all files
+ * share one scheduler, the threadpool jobs of one large file can use the
+ * cores which are not needed by the other files
+ */
+int
+get_watermark_batch (const vector<Key>& key_list, const string& batch, int max_jobs)
+{
+  vector<string> files;
+  Error err = read_batch_files (batch, files);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+
+  /* compute the key tables before decoding the first file */
+  for (const auto& key : key_list)
+    KeyTables::get (key);
+
+  RequestThreads request_threads;
+  JobLimit       job_limit (max_jobs);
+  std::mutex     out_mutex;
+
+  /* records are written in list order, as soon as all previous records are done */
+  vector<string> records (files.size());
+  vector<bool>   done (files.size());
+  size_t         n_written = 0;
+  int            n_errors = 0;
+
+  for (size_t i = 0; i < files.size(); i++)
+    {
+      job_limit.acquire();
+      request_threads.start ([&, i]()
+        {
+          Error file_err;
+          const string record = "{ " + file_result_json (key_list, files[i], file_err) + " }";
+          {
+            std::lock_guard<std::mutex> lg (out_mutex);
+            if (file_err)
+              n_errors++;
+
+            records[i] = record;
+            done[i] = true;
+            while (n_written < files.size() && done[n_written])
+              {
+                printf ("%s\n", records[n_written].c_str());
+                records[n_written].clear();
+                n_written++;
+              }
+            fflush (stdout);
+          }
+          job_limit.release();
+        });
+    }
+  request_threads.join_all();
+
+  return n_errors ? 1 : 0;
+}
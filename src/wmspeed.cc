@@ -21,8 +21,13 @@
 #include "threadpool.hh"
 #include "fft.hh"
 #include "resample.hh"
+#include "profile.hh"
 
 #include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 using std::function;
 using std::vector;
@@ -58,23 +63,34 @@ struct SpeedScanParams
   int    n_center_steps = 0;
 };
 
+/*
+ * Sync bit magnitudes of the speed search: one row per analysis position, one
+ * column per sync frame bit. The up and down magnitudes are stored in two
+ * separate planes, and each column is contiguous, because compare_bits()
+ * reads one column at a time, at consecutive rows for consecutive offsets.
+ */
 class MagMatrix
 {
-public:
-  struct Mags
-  {
-    float umag = 0;
-    float dmag = 0;
-  };
-private:
-  vector<Mags> m_data;
+  vector<float> m_umag;
+  vector<float> m_dmag;
   int m_cols = 0;
   int m_rows = 0;
 public:
-  Mags&
-  operator() (int row, int col)
+  void
+  set (int row, int col, float umag, float dmag)
   {
-    return m_data[col * m_rows + row];
+    m_umag[col * m_rows + row] = umag;
+    m_dmag[col * m_rows + row] = dmag;
+  }
+  const float *
+  umag_col (int col) const
+  {
+    return &m_umag[col * m_rows];
+  }
+  const float *
+  dmag_col (int col) const
+  {
+    return &m_dmag[col * m_rows];
   }
   void
   resize (int rows, int cols)
@@ -85,8 +101,10 @@ public:
     /* - don't preserve contents on resize
      * - free unused memory on resize
      */
-    vector<Mags> new_data (m_rows * m_cols);
-    m_data.swap (new_data);
+    vector<float> new_umag (m_rows * m_cols);
+    vector<float> new_dmag (m_rows * m_cols);
+    m_umag.swap (new_umag);
+    m_dmag.swap (new_dmag);
   }
   int
   rows()
@@ -95,6 +113,192 @@ public:
   }
 };
 
+/*
+ * Batched analysis of frames of the clip downsampled by factor 2 (frames of
+ * sub_frame_size samples): frames are collected with add() and analyzed with
+ * one batched fft for up to max_frames frames (all channels), like
+ * FFTAnalyzer::run_fft_batch does for full size frames. For each frame, the
+ * dB values of the bins [first_bin, first_bin + n_bins) summed over all
+ * channels are passed to the callback; flush() analyzes the remaining frames.
+ */
+class SubFrameBatch
+{
+public:
+  typedef function<void (size_t id, const float *db)> Callback;
+
+  static constexpr int    sub_frame_size = Params::frame_size / 2;
+  static constexpr size_t max_frames = 16;
+  static constexpr float  min_db = -96;
+
+private:
+  const vector<float>& samples;
+  const int            n_channels;
+  const int            first_bin;
+  const int            n_bins;
+  const Callback       callback;
+  const vector<float>  window;
+  FFTBatchProcessor    fft_batch;
+  vector<float>        ch_db;
+  vector<float>        frame_db;
+  size_t               batch_id[max_frames];
+  size_t               batch_size = 0;
+
+public:
+  SubFrameBatch (const WavData& wav_data, int first_bin, int n_bins, const Callback& callback) :
+    samples (wav_data.samples()),
+    n_channels (wav_data.n_channels()),
+    first_bin (first_bin),
+    n_bins (n_bins),
+    callback (callback),
+    window (FFTAnalyzer::gen_normalized_window (sub_frame_size)),
+    fft_batch (sub_frame_size, max_frames * wav_data.n_channels()),
+    ch_db (n_bins),
+    frame_db (n_bins)
+  {
+  }
+  /* analyze the frame starting at pos, the callback gets id */
+  void
+  add (size_t id, size_t pos)
+  {
+    /* deinterleave frame data and apply window */
+    float *in = fft_batch.in() + batch_size * n_channels * sub_frame_size;
+    for (int i = 0; i < sub_frame_size; i++)
+      for (int ch = 0; ch < n_channels; ch++)
+        in[ch * sub_frame_size + i] = samples[ch + (pos + i) * n_channels] * window[i];
+
+    batch_id[batch_size++] = id;
+    if (batch_size == max_frames)
+      flush();
+  }
+  void
+  flush()
+  {
+    const size_t n_out = sub_frame_size / 2 + 1;
+
+    fft_batch.fft (batch_size * n_channels);
+    for (size_t b = 0; b < batch_size; b++)
+      {
+        std::fill (frame_db.begin(), frame_db.end(), 0);
+        for (int ch = 0; ch < n_channels; ch++)
+          {
+            db_from_complex (fft_batch.out() + (b * n_channels + ch) * n_out + first_bin, ch_db.data(), n_bins, min_db);
+            for (int i = 0; i < n_bins; i++)
+              frame_db[i] += ch_db[i];
+          }
+        callback (batch_id[b], frame_db.data());
+      }
+    batch_size = 0;
+  }
+};
+
+/*
+ * Shared analysis of the speed clip for the SpeedSync objects of one search
+ * stage: the clip downsampled by factor 2 (at its original speed), and the
+ * spectrogram of this signal with a hop size of a quarter of the sub sync
+ * search step, built lazily by the first prepare job that needs it.
+ *
+ * A SpeedSync with a center speed c would normally resample the clip by c / 2
+ * and compute its own spectrogram. Resampling by c scales time by c and
+ * frequencies by 1 / c, so instead the magnitudes are interpolated from the
+ * shared spectrogram at the corresponding time and frequency. This is not
+ * exactly the same (the analysis window is not scaled), which is fine for the
+ * grid search with many center speeds, but not used for the final refinement.
+ */
+class SpeedSpectrum
+{
+  static constexpr int hop_div   = 4;
+  static constexpr int first_bin = Params::min_band / 2;
+  static constexpr int last_bin  = std::min<int> (Params::max_band * 2, Params::frame_size / 4);
+  static constexpr int n_bins    = last_bin - first_bin + 1;
+
+  const WavData&  in_data;
+  std::once_flag  once;
+  Error           analyze_error;
+  vector<float>   db;          // n_frames * n_bins, dB values summed over all channels
+  size_t          n_frames = 0;
+  int             hop = 0;
+
+  Error analyze();
+public:
+  SpeedSpectrum (const WavData& in_data) :
+    in_data (in_data)
+  {
+  }
+  Error
+  prepare()
+  {
+    std::call_once (once, [this]() { analyze_error = analyze(); });
+    return analyze_error;
+  }
+  void get_bands (double center, size_t pos, float *out) const;
+};
+
+Error
+SpeedSpectrum::analyze()
+{
+  /* like SpeedSync::prepare_mags, with center = 1 (the clip is long enough for all center speeds) */
+  WavData in_data_sub;
+  Error err = resample_ratio (in_data, 0.5, Params::mark_sample_rate / 2, in_data_sub);
+  if (err)
+    return err;
+
+  const int sub_frame_size = SubFrameBatch::sub_frame_size;
+  hop = Params::sync_search_step / 2 / hop_div;
+
+  n_frames = 0;
+  for (size_t pos = 0; pos + sub_frame_size < in_data_sub.n_frames(); pos += hop)
+    n_frames++;
+  db.assign (n_frames * n_bins, 0);
+
+  const int n_channels = in_data_sub.n_channels();
+  const SilenceMap silence_map (in_data_sub.samples(), n_channels);
+
+  SubFrameBatch batch (in_data_sub, first_bin, n_bins, [&] (size_t f, const float *frame_db)
+    {
+      std::copy (frame_db, frame_db + n_bins, &db[f * n_bins]);
+    });
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      if (silence_map.silent (f * hop, sub_frame_size))
+        std::fill (&db[f * n_bins], &db[(f + 1) * n_bins], SubFrameBatch::min_db * n_channels);
+      else
+        batch.add (f, f * hop);
+    }
+  batch.flush();
+  return Error::Code::NONE;
+}
+
+/*
+ * dB values of the bands min_band..max_band for the frame starting at pos of
+ * the clip resampled by center / 2 (prepare() must have been called)
+ */
+void
+SpeedSpectrum::get_bands (double center, size_t pos, float *out) const
+{
+  const int sub_frame_size = Params::frame_size / 2;
+
+  /* the frame center maps to frame center, interpolate between the two closest frames */
+  const double fpos = std::max (((pos + sub_frame_size / 2) / center - sub_frame_size / 2) / hop, 0.0);
+  const size_t f0 = std::min<size_t> (fpos, n_frames - 1);
+  const size_t f1 = std::min (f0 + 1, n_frames - 1);
+  const float  ffrac = std::min (fpos - f0, 1.0);
+
+  const float *db0 = &db[f0 * n_bins];
+  const float *db1 = &db[f1 * n_bins];
+  for (int band = Params::min_band; band <= Params::max_band; band++)
+    {
+      const double bpos = band * center - first_bin;
+      const int    b0 = bpos;
+      const float  bfrac = bpos - b0;
+
+      assert (b0 >= 0 && b0 + 1 < n_bins);
+
+      const float v0 = db0[b0] + (db0[b0 + 1] - db0[b0]) * bfrac;
+      const float v1 = db1[b0] + (db1[b0 + 1] - db1[b0]) * bfrac;
+      *out++ = v0 + (v1 - v0) * ffrac;
+    }
+}
+
 class SpeedSync
 {
 public:
@@ -110,16 +314,16 @@ public:
     std::vector<int> up;
     std::vector<int> down;
   };
-  struct BitValue
+  /* state of all offsets for one relative speed (structure of arrays, one array per sync bit) */
+  struct CmpStates
   {
-    float umag = 0;
-    float dmag = 0;
-    int count = 0;
-  };
-  struct CmpState
-  {
-    int offset = 0;
-    BitValue bit_values[Params::sync_bits];
+    double        relative_speed = 0;
+    vector<int>   offset;
+    vector<float> umag[Params::sync_bits];
+    vector<float> dmag[Params::sync_bits];
+    vector<int>   count_delta[Params::sync_bits];  // count[i] = sum (count_delta[0..i])
+    size_t        begin = 0;
+    size_t        end = 0;
   };
 private:
   static constexpr int OFFSET_SHIFT = 16;
@@ -127,29 +331,36 @@ private:
   vector<SyncBit> sync_bits;
   MagMatrix sync_matrix;
 
-  void prepare_mags (const SpeedScanParams& scan_params);
-  void compare (double relative_speed);
+  Error prepare_mags (const SpeedScanParams& scan_params);
+  static constexpr int compare_speeds_per_job = 4; // relative speeds evaluated in one pass over the mag matrix
+  void compare (const vector<double>& relative_speeds);
   template<int BLOCK>
-  void compare_bits (vector<CmpState>& cmp_states, double relative_speed);
+  void compare_bits (vector<CmpStates>& cmp_states_vec);
 
   std::mutex mutex;
   vector<Score> result_scores;
   const WavData& in_data;
+  std::shared_ptr<SpeedSpectrum> spectrum;
   const double center;
   const int    frames_per_block;
 
 public:
-  SpeedSync (const Key& key, const WavData& in_data, double center) :
+  /* frame_step > 1: only use every frame_step-th sync frame of each sync bit (coarse speed engine)
+   * spectrum: if not null, the mags are derived from this shared analysis of in_data
+   */
+  SpeedSync (const Key& key, const WavData& in_data, std::shared_ptr<SpeedSpectrum> spectrum, double center, int frame_step) :
     in_data (in_data),
+    spectrum (spectrum),
     center (center),
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count())
   {
-    // constructor is run in the main thread; everything that is not thread-safe must happen here
+    // constructor can run in any thread (from the speed search task graph), KeyTables are thread-safe
     auto sync_finder_bits = SyncFinder::get_sync_bits (key, SyncFinder::Mode::BLOCK);
     for (size_t bit = 0; bit < sync_finder_bits.size(); bit++)
       {
-        for (const auto& frame_bit : sync_finder_bits[bit])
+        for (size_t f = 0; f < sync_finder_bits[bit].size(); f += frame_step)
           {
+            const auto& frame_bit = sync_finder_bits[bit][f];
             SyncBit sb;
 
             sb.bit    = bit;
@@ -164,7 +375,7 @@ public:
   }
   struct Jobs
   {
-    function<void()>         prepare_job;
+    function<Error()>        prepare_job;
     vector<function<void()>> search_jobs;
     function<void()>         free_memory;
   };
@@ -173,15 +384,20 @@ public:
   {
     Jobs jobs;
 
-    jobs.prepare_job = [this, &scan_params]() { prepare_mags (scan_params); };
+    jobs.prepare_job = [this, &scan_params]() { return prepare_mags (scan_params); };
 
     result_scores.clear();
 
+    vector<double> relative_speeds;
     for (int p = -scan_params.n_steps; p <= scan_params.n_steps; p++)
       {
-        const double relative_speed = pow (scan_params.step, p) * speed / center;
+        relative_speeds.push_back (pow (scan_params.step, p) * speed / center);
 
-        jobs.search_jobs.push_back ([relative_speed, this]() { compare (relative_speed); });
+        if (relative_speeds.size() == compare_speeds_per_job || p == scan_params.n_steps)
+          {
+            jobs.search_jobs.push_back ([relative_speeds, this]() { compare (relative_speeds); });
+            relative_speeds.clear();
+          }
       }
 
     jobs.free_memory = [this]() { sync_matrix.resize (0, 0); };
@@ -201,21 +417,66 @@ public:
   }
 };
 
-void
+/* on error, the mag matrix is empty (so the search jobs don't find anything) */
+Error
 SpeedSync::prepare_mags (const SpeedScanParams& scan_params)
 {
-  // we downsample the audio by factor 2 to improve performance
-  WavData in_data_sub (resample_ratio_truncate (in_data, center / 2, Params::mark_sample_rate / 2, /* truncate to length */ scan_params.seconds / center));
-
   const int sub_frame_size = Params::frame_size / 2;
   const int sub_sync_search_step = Params::sync_search_step / 2;
+  constexpr size_t n_bands = Params::max_band - Params::min_band + 1;
+
+  std::array<float, n_bands> fft_out_db;
+  auto set_row = [&] (int row, const float *bands_db)
+    {
+      int col = 0;
+      for (const auto& sync_bit : sync_bits)
+        {
+          float umag = 0, dmag = 0;
+
+          for (size_t i = 0; i < sync_bit.up.size(); i++)
+            {
+              umag += bands_db[sync_bit.up[i]];
+              dmag += bands_db[sync_bit.down[i]];
+            }
+          sync_matrix.set (row, col++, umag, dmag);
+        }
+      assert (col == int (sync_bits.size()));
+    };
+
+  if (spectrum)
+    {
+      Error err = spectrum->prepare();
+      if (err)
+        {
+          sync_matrix.resize (0, sync_bits.size());
+          return err;
+        }
+
+      /* same number of rows as the resampled clip below */
+      const size_t in_frames = min<size_t> (in_data.n_frames(), lrint (in_data.sample_rate() * scan_params.seconds / center));
+      const size_t sub_frames = lrint (in_frames * (center / 2));
 
-  vector<float> window = FFTAnalyzer::gen_normalized_window (sub_frame_size);
+      int n_sync_rows = 0;
+      for (size_t ppos = 0; ppos + sub_frame_size < sub_frames; ppos += sub_sync_search_step)
+        n_sync_rows++;
+      sync_matrix.resize (n_sync_rows, sync_bits.size());
 
-  FFTProcessor fft_processor (sub_frame_size);
+      for (int row = 0; row < n_sync_rows; row++)
+        {
+          spectrum->get_bands (center, row * sub_sync_search_step, fft_out_db.data());
+          set_row (row, fft_out_db.data());
+        }
+      return Error::Code::NONE;
+    }
 
-  float *in = fft_processor.in();
-  float *out = fft_processor.out();
+  // we downsample the audio by factor 2 to improve performance
+  WavData in_data_sub;
+  Error err = resample_ratio_truncate (in_data, center / 2, Params::mark_sample_rate / 2, /* truncate to length */ scan_params.seconds / center, in_data_sub);
+  if (err)
+    {
+      sync_matrix.resize (0, sync_bits.size());
+      return err;
+    }
 
   /* set mag matrix size */
   int n_sync_rows = 0;
@@ -224,122 +485,159 @@ SpeedSync::prepare_mags (const SpeedScanParams& scan_params)
     n_sync_rows++;
   sync_matrix.resize (n_sync_rows, n_sync_cols);
 
+  /* silent frames are not analyzed, their bands are min_db (like the fft of zeros) */
+  const SilenceMap silence_map (in_data_sub.samples(), in_data_sub.n_channels());
+
+  /* rows are independent, so they can be set in the order the batches are analyzed */
+  SubFrameBatch batch (in_data_sub, Params::min_band, n_bands, set_row);
+
   size_t pos = 0;
   int row = 0;
   while (pos + sub_frame_size < in_data_sub.n_frames())
     {
-      int col = 0;
-      const std::vector<float>& samples = in_data_sub.samples();
-      std::array<float, Params::max_band - Params::min_band + 1> fft_out_db;
-
-      fft_out_db.fill (0);
-
-      for (int ch = 0; ch < in_data_sub.n_channels(); ch++)
+      if (silence_map.silent (pos, sub_frame_size))
         {
-          for (int i = 0; i < sub_frame_size; i++)
-            {
-              in[i] = samples[ch + (pos + i) * in_data_sub.n_channels()] * window[i];
-            }
-          fft_processor.fft();
-
-          for (int i = Params::min_band; i <= Params::max_band; i++)
-            {
-              const float min_db = -96;
-
-              fft_out_db[i - Params::min_band] += db_from_complex (out[i * 2], out[i * 2 + 1], min_db);
-            }
+          fft_out_db.fill (SubFrameBatch::min_db * in_data_sub.n_channels());
+          set_row (row, fft_out_db.data());
         }
-      for (const auto& sync_bit : sync_bits)
+      else
         {
-          float umag = 0, dmag = 0;
-
-          for (size_t i = 0; i < sync_bit.up.size(); i++)
-            {
-              umag += fft_out_db[sync_bit.up[i]];
-              dmag += fft_out_db[sync_bit.down[i]];
-            }
-          sync_matrix (row, col++) = MagMatrix::Mags {umag, dmag};
+          batch.add (row, pos);
         }
-      assert (col == n_sync_cols);
       row++;
       pos += sub_sync_search_step;
     }
+  batch.flush();
   assert (row == n_sync_rows);
+  return Error::Code::NONE;
 }
 
-template<int BLOCK> void
-SpeedSync::compare_bits (vector<CmpState>& cmp_states, double relative_speed)
+/* add the magnitudes of one sync frame bit (at index (offset + frame_offset) >> shift) to n states */
+static inline void
+add_mags_loop (const int *offset, size_t n, int frame_offset, int shift, const float *umag_col, const float *dmag_col,
+               float *umag, float *dmag)
 {
-  const int steps_per_frame = Params::frame_size / Params::sync_search_step;
-  const double relative_speed_inv = 1 / relative_speed;
+  for (size_t i = 0; i < n; i++)
+    {
+      const int index = (offset[i] + frame_offset) >> shift;
 
-  auto begin = cmp_states.end();
-  auto end = cmp_states.end();
-  for (size_t mi = 0; mi < sync_bits.size(); mi++)
+      umag[i] += umag_col[index];
+      dmag[i] += dmag_col[index];
+    }
+}
+
+static void AUDIOWMARK_EXTRA_OPT
+add_mags_generic (const int *offset, size_t n, int frame_offset, int shift, const float *umag_col, const float *dmag_col,
+                  float *umag, float *dmag)
+{
+  add_mags_loop (offset, n, frame_offset, shift, umag_col, dmag_col, umag, dmag);
+}
+
+#if defined (__x86_64__) || defined (__i386__)
+static void AUDIOWMARK_EXTRA_OPT __attribute__((target ("avx2")))
+add_mags_avx2 (const int *offset, size_t n, int frame_offset, int shift, const float *umag_col, const float *dmag_col,
+               float *umag, float *dmag)
+{
+  add_mags_loop (offset, n, frame_offset, shift, umag_col, dmag_col, umag, dmag);
+}
+#endif
+
+/* each state accumulates its values in the same order as a scalar loop would, so all versions produce identical results */
+static void
+add_mags (const int *offset, size_t n, int frame_offset, int shift, const float *umag_col, const float *dmag_col,
+          float *umag, float *dmag)
+{
+#if defined (__x86_64__) || defined (__i386__)
+  if (have_avx2())
     {
-      const int frame_offset = ((BLOCK * frames_per_block + sync_bits[mi].frame) * steps_per_frame * relative_speed_inv + 0.5) * (1 << OFFSET_SHIFT);
+      add_mags_avx2 (offset, n, frame_offset, shift, umag_col, dmag_col, umag, dmag);
+      return;
+    }
+#endif
+  add_mags_generic (offset, n, frame_offset, shift, umag_col, dmag_col, umag, dmag);
+}
 
-      while (begin > cmp_states.begin())
-        {
-          auto prev = begin - 1;
-
-          /*
-           * don't use OFFSET_SHIFT here; just ensure that index is positive
-           * to ensure that shifted value will properly round to nearest frame
-           * later on
-           */
-          int index = prev->offset + frame_offset;
-          if (index < 0)
-            break;
+/*
+ * evaluate all relative speeds of cmp_states_vec in one pass over the sync
+ * matrix: each column is used for all speeds while it is in the cache
+ */
+template<int BLOCK> void
+SpeedSync::compare_bits (vector<CmpStates>& cmp_states_vec)
+{
+  const int steps_per_frame = Params::frame_size / Params::sync_search_step;
 
-          begin = prev;
-        }
-      while (end > cmp_states.begin())
-        {
-          auto prev = end - 1;
+  for (auto& cs : cmp_states_vec)
+    cs.begin = cs.end = cs.offset.size();
 
-          int index = (prev->offset + frame_offset) >> OFFSET_SHIFT;
-          if (index < sync_matrix.rows())
-            break;
+  for (size_t mi = 0; mi < sync_bits.size(); mi++)
+    {
+      const int bit = sync_bits[mi].bit;
 
-          end = prev;
-        }
+      /* odd blocks have inverted sync bits */
+      const float *umag_col = (BLOCK & 1) ? sync_matrix.dmag_col (mi) : sync_matrix.umag_col (mi);
+      const float *dmag_col = (BLOCK & 1) ? sync_matrix.umag_col (mi) : sync_matrix.dmag_col (mi);
 
-      for (auto it = begin; it != end; it++)
+      for (auto& cs : cmp_states_vec)
         {
-          int index = (it->offset + frame_offset) >> OFFSET_SHIFT;
+          const double relative_speed_inv = 1 / cs.relative_speed;
+          const int frame_offset = ((BLOCK * frames_per_block + sync_bits[mi].frame) * steps_per_frame * relative_speed_inv + 0.5) * (1 << OFFSET_SHIFT);
 
-          auto& bv = it->bit_values[sync_bits[mi].bit];
-          auto mags = sync_matrix (index, mi);
-          if (BLOCK & 1)
+          while (cs.begin > 0)
+            {
+              /*
+               * don't use OFFSET_SHIFT here; just ensure that index is positive
+               * to ensure that shifted value will properly round to nearest frame
+               * later on
+               */
+              int index = cs.offset[cs.begin - 1] + frame_offset;
+              if (index < 0)
+                break;
+
+              cs.begin--;
+            }
+          while (cs.end > 0)
             {
-              bv.umag += mags.dmag;
-              bv.dmag += mags.umag;
+              int index = (cs.offset[cs.end - 1] + frame_offset) >> OFFSET_SHIFT;
+              if (index < sync_matrix.rows())
+                break;
+
+              cs.end--;
             }
-          else
+          if (cs.begin < cs.end)
             {
-              bv.umag += mags.umag;
-              bv.dmag += mags.dmag;
+              add_mags (&cs.offset[cs.begin], cs.end - cs.begin, frame_offset, OFFSET_SHIFT, umag_col, dmag_col,
+                        &cs.umag[bit][cs.begin], &cs.dmag[bit][cs.begin]);
+
+              cs.count_delta[bit][cs.begin]++;
+              cs.count_delta[bit][cs.end]--;
             }
-          bv.count++;
         }
     }
 }
 
 void
-SpeedSync::compare (double relative_speed)
+SpeedSync::compare (const vector<double>& relative_speeds)
 {
   const int steps_per_frame = Params::frame_size / Params::sync_search_step;
   const int pad_start = frames_per_block * steps_per_frame + /* add a bit of overlap to handle boundaries */ steps_per_frame;
 
   assert (steps_per_frame * Params::sync_search_step == Params::frame_size);
 
-  vector<CmpState> cmp_states;
-  for (int offset =  -pad_start; offset < 0; offset++)
+  vector<CmpStates> cmp_states_vec (relative_speeds.size());
+  for (size_t s = 0; s < relative_speeds.size(); s++)
     {
-      CmpState cs;
-      cs.offset = offset * ((1 << OFFSET_SHIFT) / relative_speed);
-      cmp_states.push_back (cs);
+      CmpStates& cs = cmp_states_vec[s];
+
+      cs.relative_speed = relative_speeds[s];
+      for (int offset =  -pad_start; offset < 0; offset++)
+        cs.offset.push_back (offset * ((1 << OFFSET_SHIFT) / cs.relative_speed));
+
+      for (size_t bit = 0; bit < Params::sync_bits; bit++)
+        {
+          cs.umag[bit].resize (cs.offset.size());
+          cs.dmag[bit].resize (cs.offset.size());
+          cs.count_delta[bit].resize (cs.offset.size() + 1);
+        }
     }
 
   /*
@@ -348,37 +646,44 @@ SpeedSync::compare (double relative_speed)
    *  - two more blocks are necessary since speed detection ScanParams uses 50 seconds at most,
    *    and short payload (12 bits) has a block length of slightly over 30 seconds
    */
-  compare_bits<0> (cmp_states, relative_speed);
-  compare_bits<1> (cmp_states, relative_speed);
-  compare_bits<2> (cmp_states, relative_speed);
+  compare_bits<0> (cmp_states_vec);
+  compare_bits<1> (cmp_states_vec);
+  compare_bits<2> (cmp_states_vec);
 
-  Score best_score;
-  for (const auto& cs : cmp_states)
+  vector<Score> scores;
+  for (const auto& cs : cmp_states_vec)
     {
-      double sync_quality = 0;
-      int bit_count = 0;
+      Score best_score;
+      int count[Params::sync_bits] = { 0, };
 
-      for (size_t bit = 0; bit < Params::sync_bits; bit++)
+      for (size_t i = 0; i < cs.offset.size(); i++)
         {
-          const auto& bv = cs.bit_values[bit];
+          double sync_quality = 0;
+          int bit_count = 0;
 
-          sync_quality += SyncFinder::bit_quality (bv.umag, bv.dmag, bit) * bv.count;
-          bit_count += bv.count;
-        }
-      if (bit_count)
-        {
-          sync_quality /= bit_count;
-          sync_quality = fabs (SyncFinder::normalize_sync_quality (sync_quality));
+          for (size_t bit = 0; bit < Params::sync_bits; bit++)
+            {
+              count[bit] += cs.count_delta[bit][i];
 
-          if (sync_quality > best_score.quality)
+              sync_quality += SyncFinder::bit_quality (cs.umag[bit][i], cs.dmag[bit][i], bit) * count[bit];
+              bit_count += count[bit];
+            }
+          if (bit_count)
             {
-              best_score.quality = sync_quality;
-              best_score.speed = relative_speed * center;
+              sync_quality /= bit_count;
+              sync_quality = fabs (SyncFinder::normalize_sync_quality (sync_quality));
+
+              if (sync_quality > best_score.quality)
+                {
+                  best_score.quality = sync_quality;
+                  best_score.speed = cs.relative_speed * center;
+                }
             }
         }
+      scores.push_back (best_score);
     }
   std::lock_guard<std::mutex> lg (mutex);
-  result_scores.push_back (best_score);
+  result_scores.insert (result_scores.end(), scores.begin(), scores.end());
 }
 
 /*
@@ -451,25 +756,30 @@ public:
     printf ("range = [ %.2f .. %.2f ]\n", bound (-1), bound (1));
   }
 
-  vector<SpeedSync::Jobs> get_jobs (const Key& key, const SpeedScanParams& scan_params, const vector<double>& speeds);
+  vector<SpeedSync::Jobs> get_jobs (const Key& key, const SpeedScanParams& scan_params, const vector<double>& speeds, int frame_step);
   vector<SpeedSync::Score> get_results();
 };
 
 vector<SpeedSync::Jobs>
-SpeedSearch::get_jobs (const Key& key, const SpeedScanParams& scan_params, const vector<double>& speeds)
+SpeedSearch::get_jobs (const Key& key, const SpeedScanParams& scan_params, const vector<double>& speeds, int frame_step)
 {
   /* speed is between 0.8 and 1.25, so we use a clip seconds factor of 1.3 to provide enough samples */
   clipped_in_data = get_speed_clip (clip_location, in_data, scan_params.seconds * 1.3);
 
   speed_sync.clear();
 
+  /* with many center speeds per speed (grid search), share one analysis of the clip */
+  std::shared_ptr<SpeedSpectrum> spectrum;
+  if (scan_params.n_center_steps > 0)
+    spectrum = std::make_shared<SpeedSpectrum> (clipped_in_data);
+
   for (auto speed : speeds)
     {
       for (int c = -scan_params.n_center_steps; c <= scan_params.n_center_steps; c++)
         {
           double c_speed = speed * pow (scan_params.step, c * (scan_params.n_steps * 2 + 1));
 
-          speed_sync.push_back (std::make_unique<SpeedSync> (key, clipped_in_data, c_speed));
+          speed_sync.push_back (std::make_unique<SpeedSync> (key, clipped_in_data, spectrum, c_speed, frame_step));
         }
     }
 
@@ -572,57 +882,10 @@ get_best_clip_location (const Key& key, const WavData& in_data, double seconds,
   return clip_location;
 }
 
-/* Try to process blocks of jobs on our ThreadPool with high concurrency. Examples:
- *
- * number of jobs: split_jobs with threads == 32
-* 1: 1
-* 2: 2
-* 3: 3
-* [...]
-* 31: 31
-* 32: 32
-* 33: 17 16
-* 34: 17 17
-* 35: 18 17
-* 36: 18 18
-* [...]
-* 63: 32 31
-* 64: 32 32
-* 65: 32 17 16
-* 66: 32 17 17
-* [...]
-*/
-vector<int>
-split_jobs (int jobs, int threads)
-{
-  vector<int> split_jobs;
-
-  auto update_split_jobs = [&] (int j) {
-    assert (j >= 0 && j <= jobs);
-    if (j)
-      {
-        split_jobs.push_back (j);
-        jobs -= j;
-      }
-  };
-  /* as long as the remaining number of jobs is very large, simply process one block using all threads */
-  while (jobs > 2 * threads)
-    update_split_jobs (threads);
-
-  /* remaining jobs in [threads, 2 * threads]: process half of the remaining jobs */
-  if (jobs > threads)
-    update_split_jobs ((jobs + 1) / 2);
-
-  /* process remaining jobs */
-  update_split_jobs (jobs);
-
-  return split_jobs;
-}
-
-vector<DetectSpeedResult>
-detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_results)
+Error
+detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_results, vector<DetectSpeedResult>& results)
 {
-  vector<DetectSpeedResult> results;
+  results.clear();
 
   /* typically even for high strength we need at least a few seconds of audio
    * in in_data for successful speed detection, but our algorithm won't work at
@@ -630,7 +893,7 @@ detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_re
    */
   double in_seconds = double (in_data.n_frames()) / in_data.sample_rate();
   if (in_seconds < 0.25)
-    return results;
+    return Error::Code::NONE;
 
   const SpeedScanParams scan1_normal /* first pass: find approximation: speed approximately 0.8..1.25 */
     {
@@ -670,89 +933,170 @@ detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_re
     };
   const double scan3_smooth_distance = 20;
   const double speed_sync_threshold = 0.4;
-  const int    n_best = Params::detect_speed_patient ? 15 : 5;
+
+  /* coarse speed engine: the grid search (scan1) only uses every 4th sync frame, which is
+   * less accurate, so more candidates are improved by the second pass
+   */
+  const bool   coarse = Params::speed_engine == SpeedEngine::COARSE;
+  const int    scan1_frame_step = coarse ? 4 : 1;
+  const int    n_best = (Params::detect_speed_patient ? 15 : 5) * (coarse ? 2 : 1);
 
   // SpeedSearch::debug_range (scan1);
 
   const int    clip_candidates = 5;
 
+  /*
+   * Speed search task graph: each key runs through the stages scan1 -> scan2
+   * -> scan3 independently. As soon as all SpeedSync units of one stage of a
+   * key are done, the speeds for its next stage are selected and the units of
+   * the next stage are queued, without a barrier for the other keys.
+   *
+   * Each unit is one prepare job followed by its search jobs; after the last
+   * search job the mag matrix of the unit is freed. Since a mag matrix needs
+   * a lot of memory, at most n_threads units are prepared at the same time
+   * (fewer if the memory budget is exceeded), the other units wait in the
+   * queue.
+   */
   struct KeySpeedSearch
   {
     Key                           key;
     std::unique_ptr<SpeedSearch>  speed_search;
     vector<SpeedSync::Score>      scores;
+    int                           stage = 0;
+    size_t                        units_open = 0;
+  };
+  struct Unit
+  {
+    KeySpeedSearch   *key_speed_search = nullptr;
+    SpeedSync::Jobs   jobs;
   };
-  vector<KeySpeedSearch> key_speed_search_vec;
+  vector<KeySpeedSearch> key_speed_search_vec (key_list.size());
   ThreadPool thread_pool;
 
-  auto run_search = [&] (const SpeedScanParams& scan_params, auto get_speeds) {
-    vector<SpeedSync::Jobs> jobs;
-
-    for (auto& key_speed_search : key_speed_search_vec)
-      {
-        auto more_jobs = key_speed_search.speed_search->get_jobs (key_speed_search.key, scan_params, get_speeds (key_speed_search));
-        jobs.insert (jobs.end(), more_jobs.begin(), more_jobs.end());
-      }
-
-    size_t start = 0;
-    for (size_t count : split_jobs (jobs.size(), thread_pool.n_threads()))
-      {
-        for (size_t i = 0; i < count; i++)
-          thread_pool.add_job (jobs[start + i].prepare_job);
-
-        thread_pool.wait_all();
-
-        for (size_t i = 0; i < count; i++)
-          {
-            for (auto job : jobs[start + i].search_jobs)
-              thread_pool.add_job (job);
-          }
-
-        thread_pool.wait_all();
-
-        for (size_t i = 0; i < count; i++)
-          jobs[start + i].free_memory();
+  std::mutex        graph_mutex;
+  std::deque<std::shared_ptr<Unit>> pending_units;
+  size_t            n_active_units = 0;
+  Error             prepare_error;
 
-        start += count;
-      }
-    assert (start == jobs.size());
+  /* mag matrix of one unit: up and down magnitude of each sync frame for each analysis position */
+  const size_t      unit_rows = scan3.seconds * Params::mark_sample_rate / Params::sync_search_step;
+  const size_t      unit_bytes = unit_rows * mark_sync_frame_count() * 2 * sizeof (float);
+  const size_t      max_active_units = MemoryBudget::max_speed_units (thread_pool.n_threads(), unit_bytes);
 
-    for (auto& key_speed_search : key_speed_search_vec)
-      key_speed_search.scores = key_speed_search.speed_search->get_results();
-  };
+  const SpeedScanParams *stage_params[] = { &scan1, &scan2, &scan3 };
+  const int n_stages = 3;
 
-  /* initial search using grid */
-  for (auto& key : key_list)
-    {
-      const double clip_location = get_best_clip_location (key, in_data, scan1.seconds, clip_candidates);
+  std::function<void()> schedule_units;
+  std::function<void (KeySpeedSearch&)> start_stage;
+  std::function<void (KeySpeedSearch&)> finish_stage;
 
-      key_speed_search_vec.push_back ({key, std::make_unique<SpeedSearch> (in_data, clip_location), {}});
-    }
-  run_search (scan1, [] (auto& key_speed_search) -> vector<double>
+  /* start queued units while there are free slots (graph_mutex must be locked) */
+  schedule_units = [&]()
     {
-      return { 1.0 };
-    });
+      while (n_active_units < max_active_units && !pending_units.empty())
+        {
+          std::shared_ptr<Unit> unit = pending_units.front();
+          pending_units.pop_front();
+          n_active_units++;
+          Profile::peak (Profile::Counter::MEMORY_SPEED, n_active_units * unit_bytes);
 
-  /* improve N best matches */
-  run_search (scan2, [n_best] (auto& key_speed_search) -> vector<double>
+          thread_pool.add_job ([&, unit]()
+            {
+              {
+                Profile::Span span ("speed_prepare_job");
+                Error err = unit->jobs.prepare_job();
+                if (err)
+                  {
+                    std::lock_guard<std::mutex> lg (graph_mutex);
+                    if (!prepare_error)
+                      prepare_error = err;
+                  }
+              }
+
+              auto search_jobs_open = std::make_shared<std::atomic<size_t>> (unit->jobs.search_jobs.size());
+              for (const auto& search_job : unit->jobs.search_jobs)
+                {
+                  thread_pool.add_job ([&, unit, search_job, search_jobs_open]()
+                    {
+                      {
+                        Profile::Span span ("speed_search_job");
+                        search_job();
+                      }
+                      if (--*search_jobs_open != 0)
+                        return;
+
+                      /* last search job of this unit */
+                      unit->jobs.free_memory();
+
+                      KeySpeedSearch& key_speed_search = *unit->key_speed_search;
+                      bool stage_done;
+                      {
+                        std::lock_guard<std::mutex> lg (graph_mutex);
+                        n_active_units--;
+                        stage_done = --key_speed_search.units_open == 0;
+                        schedule_units();
+                      }
+                      if (stage_done)
+                        finish_stage (key_speed_search);
+                    });
+                }
+            });
+        }
+    };
+  start_stage = [&] (KeySpeedSearch& key_speed_search)
     {
-      select_n_best_scores (key_speed_search.scores, n_best);
-
       vector<double> speeds;
-      for (auto score : key_speed_search.scores)
-        speeds.push_back (score.speed);
+      switch (key_speed_search.stage)
+        {
+          case 0: /* initial search using grid */
+            speeds = { 1.0 };
+            break;
+          case 1: /* improve N best matches */
+            select_n_best_scores (key_speed_search.scores, n_best);
 
-      return speeds;
-    });
+            for (auto score : key_speed_search.scores)
+              speeds.push_back (score.speed);
+            break;
+          case 2: /* improve best match */
+            select_n_best_scores (key_speed_search.scores, 1);
 
-  /* improve best match */
-  for (auto& key_speed_search : key_speed_search_vec)
-    select_n_best_scores (key_speed_search.scores, 1);
+            speeds = { key_speed_search.scores[0].speed };
+            break;
+        }
+      const SpeedScanParams& scan_params = *stage_params[key_speed_search.stage];
+      const int frame_step = key_speed_search.stage == 0 ? scan1_frame_step : 1;
+      auto jobs = key_speed_search.speed_search->get_jobs (key_speed_search.key, scan_params, speeds, frame_step);
+
+      std::lock_guard<std::mutex> lg (graph_mutex);
+      key_speed_search.units_open = jobs.size();
+      for (auto& unit_jobs : jobs)
+        pending_units.push_back (std::make_shared<Unit> (Unit { &key_speed_search, std::move (unit_jobs) }));
+      schedule_units();
+    };
+  finish_stage = [&] (KeySpeedSearch& key_speed_search)
+    {
+      key_speed_search.scores = key_speed_search.speed_search->get_results();
+      key_speed_search.stage++;
+
+      if (key_speed_search.stage < n_stages)
+        start_stage (key_speed_search);
+    };
 
-  run_search (scan3, [] (auto& key_speed_search) -> vector<double>
+  for (size_t k = 0; k < key_list.size(); k++)
     {
-      return { key_speed_search.scores[0].speed };
-    });
+      thread_pool.add_job ([&, k]()
+        {
+          KeySpeedSearch& key_speed_search = key_speed_search_vec[k];
+
+          const double clip_location = get_best_clip_location (key_list[k], in_data, scan1.seconds, clip_candidates);
+          key_speed_search.key = key_list[k];
+          key_speed_search.speed_search = std::make_unique<SpeedSearch> (in_data, clip_location);
+          start_stage (key_speed_search);
+        });
+    }
+  thread_pool.wait_all();
+  if (prepare_error)
+    return prepare_error;
 
   for (auto& key_speed_search : key_speed_search_vec)
     {
@@ -777,5 +1121,5 @@ detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_re
             results.push_back ({ key_speed_search.key, best_speed });
         }
     }
-  return results;
+  return Error::Code::NONE;
 }
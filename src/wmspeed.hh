@@ -27,6 +27,6 @@ struct DetectSpeedResult
   double speed = 0;
 };
 
-std::vector<DetectSpeedResult> detect_speed (const std::vector<Key>& key_list, const WavData& in_data, bool print_results);
+Error detect_speed (const std::vector<Key>& key_list, const WavData& in_data, bool print_results, std::vector<DetectSpeedResult>& results);
 
 #endif /* AUDIOWMARK_WM_SPEED_HH */
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=batch-add-test.wav
+BATCH=batch-add-test.txt
+OUT1_WAV=batch-add-test-out1.wav
+OUT2_WAV=batch-add-test-out2.wav
+REF_WAV=batch-add-test-ref.wav
+
+TEST_MSG2=0123456789abcdef0123456789abcdef
+
+for SR in 44100 48000
+do
+  audiowmark test-gen-noise $IN_WAV 30 $SR
+
+  cat > $BATCH << EOB
+# batch file: one output per line
+$OUT1_WAV $TEST_MSG
+"$OUT2_WAV" $TEST_MSG2
+EOB
+  audiowmark_add --batch $BATCH $IN_WAV
+
+  audiowmark_cmp --expect-matches 1 $OUT1_WAV $TEST_MSG
+  audiowmark_cmp --expect-matches 1 $OUT2_WAV $TEST_MSG2
+
+  # batch output must be identical to the output of a normal add
+  audiowmark_add $IN_WAV $REF_WAV $TEST_MSG2
+  cmp -s $OUT2_WAV $REF_WAV || die "batch output differs from add output (sample rate $SR)"
+
+  rm $IN_WAV $BATCH $OUT1_WAV $OUT2_WAV $REF_WAV
+done
+
+# more outputs than can be written at the same time (64): the second group of outputs
+# uses the input analyzed again (input file) or the kept analysis (input from pipe)
+audiowmark test-gen-noise $IN_WAV 5 44100
+audiowmark_add $IN_WAV $REF_WAV $TEST_MSG2
+for INPUT in file pipe
+do
+  for i in $(seq 65)
+  do
+    echo "batch-add-test-many-$i.wav $TEST_MSG2"
+  done > $BATCH
+  if [ $INPUT == file ]; then
+    audiowmark_add --batch $BATCH $IN_WAV
+  else
+    cat $IN_WAV | audiowmark_add --batch $BATCH -
+  fi
+  for i in 1 64 65
+  do
+    cmp -s batch-add-test-many-$i.wav $REF_WAV || die "batch output $i of 65 differs from add output (input from $INPUT)"
+  done
+  rm batch-add-test-many-*.wav
+done
+
+# errors: no partially written outputs are left behind
+cat > $BATCH << EOB
+$OUT1_WAV $TEST_MSG
+batch-add-test-missing-dir/out.wav $TEST_MSG2
+EOB
+if $AUDIOWMARK -q add --batch $BATCH $IN_WAV 2> /dev/null; then
+  die "batch add with missing output directory did not fail"
+fi
+[ -e $OUT1_WAV ] && die "batch add error left output $OUT1_WAV"
+
+rm $IN_WAV $BATCH $REF_WAV
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+source test-common.sh
+
+BATCH_DIR=batch-test.dir
+BATCH_LIST=batch-test.list
+BATCH_OUT=batch-test.out
+
+TEST_MSG2=0123456789abcdef0123456789abcdef
+
+rm -rf $BATCH_DIR
+mkdir $BATCH_DIR || die "failed to create batch directory"
+audiowmark test-gen-noise $BATCH_DIR/in.wav 30 44100
+audiowmark_add $BATCH_DIR/in.wav $BATCH_DIR/out1.wav $TEST_MSG
+audiowmark_add $BATCH_DIR/in.wav $BATCH_DIR/out2.wav $TEST_MSG2
+
+# directory: all files, sorted by name
+$AUDIOWMARK get --batch $BATCH_DIR --max-jobs 2 > $BATCH_OUT || die "failed to run audiowmark get --batch (directory)"
+
+[ "$(wc -l < $BATCH_OUT)" == 3 ] || die "expected 3 records"
+sed -n 1p $BATCH_OUT | grep -q '"file": "'$BATCH_DIR/in.wav'"' || die "bad order of records"
+sed -n 2p $BATCH_OUT | grep '"file": "'$BATCH_DIR/out1.wav'"' | grep -q '"bits": "'$TEST_MSG'"' || die "watermark not detected in first file"
+sed -n 3p $BATCH_OUT | grep '"file": "'$BATCH_DIR/out2.wav'"' | grep -q '"bits": "'$TEST_MSG2'"' || die "watermark not detected in second file"
+
+# list file: records in list order, errors are reported per file
+cat > $BATCH_LIST << EOL
+$BATCH_DIR/out2.wav
+$BATCH_DIR/missing.wav
+$BATCH_DIR/out1.wav
+EOL
+$AUDIOWMARK get --batch $BATCH_LIST > $BATCH_OUT && die "missing file should result in exit status 1"
+
+[ "$(wc -l < $BATCH_OUT)" == 3 ] || die "expected 3 records"
+sed -n 1p $BATCH_OUT | grep -q '"bits": "'$TEST_MSG2'"' || die "watermark not detected in first list entry"
+sed -n 2p $BATCH_OUT | grep -q '"error": ' || die "missing error for missing file"
+sed -n 3p $BATCH_OUT | grep '"time": ' | grep -q '"bits": "'$TEST_MSG'"' || die "watermark not detected in last list entry"
+
+rm -rf $BATCH_DIR $BATCH_LIST $BATCH_OUT
+exit 0
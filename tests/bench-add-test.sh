@@ -0,0 +1,28 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=bench-add-test.wav
+OUT_WAV=bench-add-test-out.wav
+JSON=bench-add-test.json
+BENCH_TMP=bench-add-test-tmp.$$
+
+audiowmark test-gen-noise $IN_WAV 120 44100
+
+# the codec command just copies the file; temporary files are created in TMPDIR and removed afterwards
+mkdir -p $BENCH_TMP
+TMPDIR=$BENCH_TMP $AUDIOWMARK bench-add $IN_WAV --strength 10,15 --payload $TEST_MSG --codec "cp {in} {out}" --json $JSON 2> /dev/null ||
+  die "bench-add failed"
+[ -z "$(ls -A $BENCH_TMP)" ] || die "bench-add did not remove its temporary files"
+
+[ "$(grep -c '"strength": ' $JSON)" == 2 ] || die "expected 2 runs in bench-add output"
+[ "$(grep -c '"ber": 0.000000' $JSON)" == 2 ] || die "bench-add: watermark not detected without bit errors"
+
+# snr of the first run (strength 10) is the snr of add --snr
+BENCH_SNR="$(grep '"snr": ' $JSON | head -1 | sed 's/.*"snr": \([^,]*\),/\1/')"
+ADD_SNR="$($AUDIOWMARK add --snr --strength 10 $IN_WAV $OUT_WAV $TEST_MSG 2>&1 | grep '^SNR:' | awk '{print $2}')"
+[ "$BENCH_SNR" == "$ADD_SNR" ] || die "bench-add snr ($BENCH_SNR) differs from add --snr ($ADD_SNR)"
+
+rm $IN_WAV $OUT_WAV $JSON
+rmdir $BENCH_TMP
+exit 0
@@ -13,6 +13,7 @@ do
   audiowmark test-change-speed $OUT_WAV $OUTS_WAV $SPEED
   audiowmark_cmp $OUTS_WAV $TEST_MSG --detect-speed --test-speed $SPEED
   audiowmark_cmp $OUTS_WAV $TEST_MSG --detect-speed-patient --test-speed $SPEED
+  audiowmark_cmp $OUTS_WAV $TEST_MSG --detect-speed --speed-engine coarse --test-speed $SPEED
 done
 
 rm $IN_WAV $OUT_WAV $OUTS_WAV
@@ -7,6 +7,7 @@ if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
 fi
 
 HLS_DIR=hls-test-dir.$$
+TEST_MSG2=0123456789abcdef0123456789abcdef
 mkdir -p $HLS_DIR
 
 # generate input sample
@@ -30,6 +31,29 @@ do
 done
 cp $HLS_DIR/as0/out.m3u8 $HLS_DIR/as0m/out.m3u8
 
+# precomputed variants must be identical to the hls-add output
+audiowmark hls-prepare --variants $TEST_MSG,$TEST_MSG2 $HLS_DIR/as0 $HLS_DIR/as0var out.m3u8 $HLS_DIR/test-input.wav
+for i in $(cd $HLS_DIR/as0; ls out*.ts)
+do
+  cmp -s $HLS_DIR/as0m/$i $HLS_DIR/as0var/${i%.ts}.v0.ts || die "hls-prepare variant differs from hls-add output ($i)"
+done
+
+# hls-serve must produce the same segments as hls-add; every segment is requested
+# with another message first, so the second request uses the cached segment
+mkdir -p $HLS_DIR/as0srv
+for i in $(cd $HLS_DIR/as0; ls out*.ts)
+do
+  echo "$HLS_DIR/as0prep/$i $HLS_DIR/as0srv/${i%.ts}.msg2.ts $TEST_MSG2"
+  echo "$HLS_DIR/as0prep/$i $HLS_DIR/as0srv/$i $TEST_MSG"
+done > $HLS_DIR/serve-requests
+$AUDIOWMARK hls-serve --max-jobs 1 < $HLS_DIR/serve-requests > $HLS_DIR/serve-responses || die "failed to run audiowmark hls-serve"
+[ "$(wc -l < $HLS_DIR/serve-responses)" == "$(wc -l < $HLS_DIR/serve-requests)" ] || die "hls-serve: missing responses"
+grep -q '"error"' $HLS_DIR/serve-responses && die "hls-serve: error response"
+for i in $(cd $HLS_DIR/as0; ls out*.ts)
+do
+  cmp -s $HLS_DIR/as0m/$i $HLS_DIR/as0srv/$i || die "hls-serve output differs from hls-add output ($i)"
+done
+
 # convert watermarked hls back to wav
 ffmpeg $FFMPEG_Q -nostdin -y -i $HLS_DIR/as0m/out.m3u8 $HLS_DIR/test-output.wav
 
@@ -39,7 +63,7 @@ audiowmark_cmp --expect-matches 5 $HLS_DIR/test-output.wav $TEST_MSG
 rm $HLS_DIR/as0*/*.ts
 rm $HLS_DIR/as0*/out.m3u8
 rmdir $HLS_DIR/as0*
-rm $HLS_DIR/test-*.wav
+rm $HLS_DIR/test-*.wav $HLS_DIR/serve-requests $HLS_DIR/serve-responses
 rm $HLS_DIR/replay.m3u8
 rmdir $HLS_DIR
 
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=index-test.wav
+OUT_WAV=index-test-out.wav
+CUT_WAV=index-test-out-cut.wav
+INDEX=index-test.awmidx
+CUT_INDEX=index-test-cut.awmidx
+BAD_INDEX=index-test-bad.awmidx
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark cut-start $OUT_WAV $CUT_WAV 44300
+
+# the index is created without key, detection only needs the index file
+$AUDIOWMARK index $OUT_WAV $INDEX || die "failed to create index"
+audiowmark_cmp --from-index $INDEX $TEST_MSG
+$AUDIOWMARK get --from-index --screen $INDEX > /dev/null || die "watermark not detected by get --from-index --screen"
+
+# sync positions between the hop positions of the index
+$AUDIOWMARK index --hop 32 $CUT_WAV $CUT_INDEX || die "failed to create index with --hop"
+audiowmark_cmp --from-index $CUT_INDEX $TEST_MSG
+
+# corrupted header (n_index_frames = 2^34) and truncated data must be rejected with an error
+cp $INDEX $BAD_INDEX
+printf '\x00\x00\x00\x00\x04\x00\x00\x00' | dd of=$BAD_INDEX bs=1 seek=44 conv=notrunc 2> /dev/null
+RC=0
+$AUDIOWMARK get --from-index $BAD_INDEX > /dev/null 2>&1 || RC=$?
+[ $RC == 1 ] || die "index with corrupted header should fail with an error"
+head -c 10000 $INDEX > $BAD_INDEX
+RC=0
+$AUDIOWMARK get --from-index $BAD_INDEX > /dev/null 2>&1 || RC=$?
+[ $RC == 1 ] || die "truncated index should fail with an error"
+
+if $AUDIOWMARK index --hop 100 $OUT_WAV $INDEX 2> /dev/null; then
+  die "index with unsupported --hop should fail"
+fi
+
+rm $IN_WAV $OUT_WAV $CUT_WAV $INDEX $CUT_INDEX $BAD_INDEX
+exit 0
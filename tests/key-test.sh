@@ -36,5 +36,13 @@ audiowmark_add --test-key 42 $OUT1_WAV $OUT2_WAV $TEST_MSG2
 audiowmark_cmp --expect-matches 1 $OUT2_WAV $TEST_MSG
 audiowmark_cmp --test-key 42 --expect-matches 1 $OUT2_WAV $TEST_MSG2
 
+# key tables cache: first run writes the cache file, second run uses it
+KEY_CACHE=key-test-cache
+mkdir -p $KEY_CACHE
+audiowmark_cmp --key-cache $KEY_CACHE --test-key 42 --expect-matches 1 $OUT2_WAV $TEST_MSG2
+[ "$(ls $KEY_CACHE | wc -l)" == 1 ] || die "key tables cache file missing"
+audiowmark_cmp --key-cache $KEY_CACHE --test-key 42 --expect-matches 1 $OUT2_WAV $TEST_MSG2
+rm -rf $KEY_CACHE
+
 rm $IN_WAV $KEY1 $KEY2 $OUT1_WAV $OUT2_WAV
 exit 0
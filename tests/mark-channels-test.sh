@@ -0,0 +1,32 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=mark-channels-test.wav
+OUT_WAV=mark-channels-test-out.wav
+DIFF_WAV=mark-channels-test-diff.wav
+
+# quiet input: the limiter doesn't change any samples, so unmarked channels are not touched at all
+audiowmark test-gen-noise --volume 0.1 $IN_WAV 120 44100
+
+# --mark-channels: the unmarked channel stays bit-identical
+audiowmark_add --mark-channels 0 $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark test-subtract $IN_WAV $OUT_WAV $DIFF_WAV
+PEAKS=($($AUDIOWMARK test-info $DIFF_WAV channel_peaks))
+[ "${PEAKS[0]}" != "0" ] || die "marked channel 0 is unchanged"
+[ "${PEAKS[1]}" == "0" ] || die "unmarked channel 1 was changed (peak difference ${PEAKS[1]})"
+
+# --mark-downmix: the watermark is detected
+audiowmark_add --mark-downmix $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp $OUT_WAV $TEST_MSG
+
+# out-of-range channel lists are rejected
+for CHANNELS in 2 0,2 -1 0,0
+do
+  if $AUDIOWMARK add --mark-channels $CHANNELS $IN_WAV $OUT_WAV $TEST_MSG 2> /dev/null; then
+    die "add --mark-channels $CHANNELS should fail for stereo input"
+  fi
+done
+
+rm $IN_WAV $OUT_WAV $DIFF_WAV
+exit 0
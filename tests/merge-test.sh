@@ -0,0 +1,41 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=merge-test.wav
+OUT_WAV=merge-test-out.wav
+PART1=merge-test-part1.json
+PART2=merge-test-part2.json
+
+audiowmark test-gen-noise $IN_WAV 400 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+
+# detection in two parts, the second part starts within a watermark block
+$AUDIOWMARK get --range 0:190 --json $PART1 $OUT_WAV > /dev/null || die "get --range failed for the first part"
+$AUDIOWMARK get --range 190: --json $PART2 $OUT_WAV > /dev/null || die "get --range failed for the second part"
+grep -q '"time": ' $PART2 || die "get --range json output without exact times"
+grep -q '"soft_bits": ' $PART2 || die "get --range json output without block soft bits"
+
+# merged results: the same matches as detection on the whole input
+WHOLE="$($AUDIOWMARK get $OUT_WAV | grep -c "pattern.*$TEST_MSG")"
+MERGED="$($AUDIOWMARK merge-results $PART1 $PART2 | grep -c "pattern.*$TEST_MSG")"
+[ "$WHOLE" == "$MERGED" ] || die "merged results ($MERGED matches) differ from whole input ($WHOLE matches)"
+
+# the merged "all" pattern is combined from the blocks of all parts, like for the whole input
+WHOLE_ALL="$($AUDIOWMARK get $OUT_WAV | grep "pattern   all" | awk '{print $3}')"
+[ "$WHOLE_ALL" == "$TEST_MSG" ] || die "no all pattern for the whole input"
+
+PARTS=()
+for START in 0 50 100 150 200 250 300 350
+do
+  PART=merge-test-part-$START.json
+  $AUDIOWMARK get --range $START:$((START + 50)) --json $PART $OUT_WAV > /dev/null || die "get --range failed for part $START"
+  PARTS+=($PART)
+done
+MERGED_ALL="$($AUDIOWMARK merge-results $PART1 $PART2 | grep "pattern   all" | awk '{print $3}')"
+[ "$MERGED_ALL" == "$WHOLE_ALL" ] || die "merged all pattern ($MERGED_ALL) differs from whole input ($WHOLE_ALL)"
+MERGED_ALL="$($AUDIOWMARK merge-results "${PARTS[@]}" | grep "pattern   all" | awk '{print $3}')"
+[ "$MERGED_ALL" == "$WHOLE_ALL" ] || die "merged all pattern of short parts ($MERGED_ALL) differs from whole input ($WHOLE_ALL)"
+
+rm $IN_WAV $OUT_WAV $PART1 $PART2 "${PARTS[@]}"
+exit 0
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+source test-common.sh
+
+TESTWAVFORMAT=$TOP_BUILDDIR/src/testwavformat
+
+IN_WAV=parallel-decode-test.wav
+OUT_WAV=parallel-decode-test-out.wav
+OUT_FLAC=parallel-decode-test-out.flac
+WAV_RESULT=parallel-decode-test-wav.txt
+FLAC_RESULT=parallel-decode-test-flac.txt
+
+# 70 seconds are more than 2 segments of the parallel decoder (512k frames each)
+audiowmark test-gen-noise $IN_WAV 70 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+$TESTWAVFORMAT convert $OUT_WAV $OUT_FLAC flac || die "failed to convert $OUT_WAV to flac"
+
+# the flac file is decoded by several workers (even on machines with few cores), the results must be identical to wav input
+for RANGE in "" "--range 20:50"
+do
+  $AUDIOWMARK --threads 4 get $RANGE $OUT_WAV > $WAV_RESULT || die "failed to run get $RANGE for wav input"
+  $AUDIOWMARK --threads 4 get $RANGE $OUT_FLAC > $FLAC_RESULT || die "failed to run get $RANGE for flac input"
+  grep -q $TEST_MSG $WAV_RESULT || die "watermark not detected by get $RANGE"
+  cmp -s $WAV_RESULT $FLAC_RESULT || die "get $RANGE results for flac input differ from wav input"
+done
+
+rm $IN_WAV $OUT_WAV $OUT_FLAC $WAV_RESULT $FLAC_RESULT
+exit 0
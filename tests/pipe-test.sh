@@ -4,6 +4,7 @@ source test-common.sh
 
 IN_WAV=pipe-test.wav
 OUT_WAV=pipe-test-out.wav
+LOG_TXT=pipe-test-log.txt
 
 audiowmark test-gen-noise $IN_WAV 200 44100
 cat $IN_WAV | audiowmark_add - - $TEST_MSG > $OUT_WAV || die "watermark from pipe failed"
@@ -12,5 +13,19 @@ cat $OUT_WAV | audiowmark_cmp --expect-matches 5 - $TEST_MSG || die "watermark d
 
 check_length $IN_WAV $OUT_WAV
 
-rm $IN_WAV $OUT_WAV
+# bounded delay: one frame per read, short limiter blocks
+cat $IN_WAV | audiowmark_add --low-latency 100 - - $TEST_MSG > $OUT_WAV || die "low latency watermark from pipe failed"
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+
+# the measured latency must not exceed the reported maximum
+cat $IN_WAV | $AUDIOWMARK --strict add --low-latency 100 - - $TEST_MSG 2> $LOG_TXT > /dev/null || die "low latency watermark info failed"
+MAX_LATENCY=$(awk '/^Max Latency:/ { print $3 }' $LOG_TXT)
+LATENCY=$(awk '/^Latency:/ { print $2 }' $LOG_TXT)
+[ -n "$MAX_LATENCY" ] && [ -n "$LATENCY" ] || die "low latency info missing"
+awk -v l=$LATENCY -v m=$MAX_LATENCY 'BEGIN { exit !(l <= m) }' || die "latency $LATENCY ms exceeds max latency $MAX_LATENCY ms"
+$AUDIOWMARK add --low-latency 10 $IN_WAV /dev/null $TEST_MSG 2>/dev/null && die "too small --low-latency should fail"
+
+check_length $IN_WAV $OUT_WAV
+
+rm $IN_WAV $OUT_WAV $LOG_TXT
 exit 0
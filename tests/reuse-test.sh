@@ -0,0 +1,44 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=reuse-test.wav
+OLD_WAV=reuse-test-old.wav
+EDIT_WAV=reuse-test-edit.wav
+FULL_WAV=reuse-test-full.wav
+OUT_WAV=reuse-test-out.wav
+
+for SR in 44100 48000
+do
+  audiowmark test-gen-noise $IN_WAV 120 $SR
+  audiowmark_add $IN_WAV $OLD_WAV $TEST_MSG
+
+  # re-embedded regions (including their block alignment and context) must be identical to a full add
+  audiowmark_add --reuse $OLD_WAV --regions 30:40,90.5:91 $IN_WAV $OUT_WAV $TEST_MSG
+  cmp -s $OLD_WAV $OUT_WAV || die "add --regions output differs from add output (sample rate $SR)"
+
+  # no changes: everything is copied
+  audiowmark_add --reuse $OLD_WAV --diff $IN_WAV $IN_WAV $OUT_WAV $TEST_MSG
+  cmp -s $OLD_WAV $OUT_WAV || die "add --diff output differs from add output (sample rate $SR)"
+
+  # edited input: overwrite one second (16 bit stereo frames) with audio from the start of the input
+  FRAMES=$(audiowmark test-info $IN_WAV frames)
+  HEADER=$(($(stat -c %s $IN_WAV) - FRAMES * 4))
+
+  # the first watermark block ends after frames_pad_start + sync and data frames (250 + 2226 frames of 1024 samples)
+  BLOCK_END=$(((250 + 2226) * 1024 * SR / 44100))
+  for EDIT_START in $((BLOCK_END - SR / 2)) $((SR * 83 + 1234))
+  do
+    cp $IN_WAV $EDIT_WAV
+    dd if=$IN_WAV of=$EDIT_WAV bs=4096 iflag=skip_bytes,count_bytes oflag=seek_bytes conv=notrunc status=none \
+       skip=$((HEADER + SR * 4)) seek=$((HEADER + EDIT_START * 4)) count=$((SR * 4)) || die "failed to edit input"
+    cmp -s $IN_WAV $EDIT_WAV && die "edited input is identical to input"
+
+    audiowmark_add $EDIT_WAV $FULL_WAV $TEST_MSG
+    audiowmark_add --reuse $OLD_WAV --diff $IN_WAV $EDIT_WAV $OUT_WAV $TEST_MSG
+    cmp -s $FULL_WAV $OUT_WAV || die "add --diff output for edit at frame $EDIT_START differs from add output (sample rate $SR)"
+  done
+
+  rm $IN_WAV $OLD_WAV $EDIT_WAV $FULL_WAV $OUT_WAV
+done
+exit 0
@@ -5,6 +5,8 @@ source test-common.sh
 IN_WAV=sample-rate-test.wav
 OUT_WAV=sample-rate-test-out.wav
 OUT_48000_WAV=sample-rate-test-out-48000.wav
+OUT_FAST_WAV=sample-rate-test-out-fast.wav
+OUT_BEST_WAV=sample-rate-test-out-best.wav
 
 audiowmark test-gen-noise $IN_WAV 200 32000
 audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
@@ -12,5 +14,20 @@ audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
 audiowmark test-resample $OUT_WAV $OUT_48000_WAV 48000
 audiowmark_cmp --expect-matches 5 $OUT_48000_WAV $TEST_MSG
 
-rm $IN_WAV $OUT_WAV $OUT_48000_WAV
+# shorter / longer resampler filters
+audiowmark_add --resample-quality fast $IN_WAV $OUT_FAST_WAV $TEST_MSG
+audiowmark_cmp --resample-quality fast --expect-matches 5 $OUT_FAST_WAV $TEST_MSG
+audiowmark_add --resample-quality best $IN_WAV $OUT_BEST_WAV $TEST_MSG
+audiowmark_cmp --resample-quality best --expect-matches 5 $OUT_BEST_WAV $TEST_MSG
+cmp -s $OUT_FAST_WAV $OUT_BEST_WAV && die "--resample-quality fast and best produce the same output"
+
+# watermark generated at the input sample rate, without resampling
+for SR in 32000 48000
+do
+  audiowmark test-gen-noise $IN_WAV 200 $SR
+  audiowmark_add --native-rate $IN_WAV $OUT_WAV $TEST_MSG
+  audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+done
+
+rm $IN_WAV $OUT_WAV $OUT_48000_WAV $OUT_FAST_WAV $OUT_BEST_WAV
 exit 0
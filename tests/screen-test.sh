@@ -0,0 +1,28 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=screen-test.wav
+OUT_WAV=screen-test-out.wav
+CUT_WAV=screen-test-out-cut.wav
+JSON=screen-test.json
+
+audiowmark test-gen-noise $IN_WAV 70 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark cut-start $OUT_WAV $CUT_WAV 44300
+
+# exit status: 0 if the input is watermarked, 1 if not, 2 for errors
+$AUDIOWMARK get --screen $OUT_WAV > /dev/null || die "watermark not detected by get --screen"
+$AUDIOWMARK get --screen $CUT_WAV > /dev/null || die "watermark not detected by get --screen (clip)"
+RC=0
+$AUDIOWMARK get --screen $IN_WAV > /dev/null || RC=$?
+[ $RC == 1 ] || die "get --screen exit status for unmarked input: $RC (expected 1)"
+RC=0
+$AUDIOWMARK get --screen screen-test-missing.wav > /dev/null 2>&1 || RC=$?
+[ $RC == 2 ] || die "get --screen exit status for missing input: $RC (expected 2)"
+
+$AUDIOWMARK get --screen --json $JSON $OUT_WAV > /dev/null || die "watermark not detected by get --screen --json"
+grep -q '"marked": true' $JSON || die "unexpected get --screen json output"
+
+rm $IN_WAV $OUT_WAV $CUT_WAV $JSON
+exit 0
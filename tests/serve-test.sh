@@ -0,0 +1,33 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=serve-test.wav
+OUT1_WAV=serve-test-out1.wav
+OUT2_WAV=serve-test-out2.wav
+SERVE_OUT=serve-test.out
+
+TEST_MSG2=0123456789abcdef0123456789abcdef
+
+audiowmark test-gen-noise $IN_WAV 30 44100
+audiowmark_add $IN_WAV $OUT1_WAV $TEST_MSG
+audiowmark_add $IN_WAV $OUT2_WAV $TEST_MSG2
+
+# requests can be processed in parallel, so the order of the responses is not fixed
+cat << EOR | $AUDIOWMARK serve --max-jobs 2 > $SERVE_OUT || die "failed to run audiowmark serve"
+{ "id": 1, "file": "$OUT1_WAV" }
+{ "id": "two", "file": "$OUT2_WAV" }
+$IN_WAV
+{ "id": 4 }
+{ "id": abc, "file": "$OUT1_WAV" }
+EOR
+
+[ "$(wc -l < $SERVE_OUT)" == 5 ] || die "expected 5 responses"
+grep '"id": 1,' $SERVE_OUT | grep -q '"bits": "'$TEST_MSG'"' || die "watermark not detected in first request"
+grep '"id": "two",' $SERVE_OUT | grep -q '"bits": "'$TEST_MSG2'"' || die "watermark not detected in second request"
+grep '"file": "'$IN_WAV'"' $SERVE_OUT | grep -q '"result": ' || die "missing result for plain filename request"
+grep '"id": 4,' $SERVE_OUT | grep -q '"error": ' || die "missing error for invalid request"
+grep '"id": null,' $SERVE_OUT | grep -q '"error": "request: id needs' || die "missing error for invalid id"
+
+rm $IN_WAV $OUT1_WAV $OUT2_WAV $SERVE_OUT
+exit 0
@@ -0,0 +1,25 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=silence-test.wav
+OUT_WAV=silence-test-out.wav
+SILENT_WAV=silence-test-silent.wav
+
+# input with two silent gaps (30s-50s and 120s-140s), one second of 16 bit stereo data is 176400 bytes
+audiowmark test-gen-noise $IN_WAV 200 44100
+dd if=/dev/zero of=$IN_WAV bs=176400 seek=30 count=20 conv=notrunc 2> /dev/null
+dd if=/dev/zero of=$IN_WAV bs=176400 seek=120 count=20 conv=notrunc 2> /dev/null
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+
+# skipping the silent frames must not change the number of matches
+MATCHES=$($AUDIOWMARK cmp $OUT_WAV $TEST_MSG | awk '/^match_count/ { print $2 }') || true
+[ "0$MATCHES" -gt 0 ] || die "watermark not detected in input with silent gaps"
+audiowmark_cmp --silence-threshold -80 --expect-matches $MATCHES $OUT_WAV $TEST_MSG
+
+# pure silence: no false matches
+audiowmark test-gen-noise --volume 0 $SILENT_WAV 60 44100
+audiowmark_cmp --silence-threshold -80 --expect-matches 0 $SILENT_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $SILENT_WAV
+exit 0
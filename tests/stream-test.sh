@@ -0,0 +1,43 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=stream-test.wav
+OUT_WAV=stream-test-out.wav
+
+# long enough for more than one chunk in streaming mode
+audiowmark test-gen-noise $IN_WAV 400 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --stream --expect-matches 11 $OUT_WAV $TEST_MSG
+cat $OUT_WAV | audiowmark_cmp --stream --expect-matches 11 - $TEST_MSG || die "streaming watermark detection from pipe failed"
+
+# live mode: no all pattern, each match is one json line
+cat $OUT_WAV | audiowmark_cmp --live --expect-matches 10 - $TEST_MSG || die "live watermark detection from pipe failed"
+[ "$($AUDIOWMARK get --live $OUT_WAV | grep -c '"bits": "'$TEST_MSG'"')" == 10 ] || die "unexpected live json output"
+
+# ndjson: one json line per block match, summary with the all pattern at the end
+audiowmark_cmp --ndjson /dev/null --expect-matches 11 $OUT_WAV $TEST_MSG || die "ndjson watermark detection failed"
+NDJSON="$($AUDIOWMARK get --ndjson - $OUT_WAV)"
+[ "$(echo "$NDJSON" | grep -c '^{ "key": .*"bits": "'$TEST_MSG'"')" == 10 ] || die "unexpected ndjson block output"
+echo "$NDJSON" | tail -1 | grep -q '^{ "summary": .*"type": "ALL"' || die "unexpected ndjson summary"
+
+# early exit: the message is found in the first chunk, the rest of the input is not analyzed
+audiowmark_cmp --first-match $OUT_WAV $TEST_MSG || die "watermark detection with --first-match failed"
+audiowmark_cmp --min-matches 3 $OUT_WAV $TEST_MSG || die "watermark detection with --min-matches failed"
+$AUDIOWMARK get --min-matches 3 --json - $OUT_WAV | grep -q '"length": "6:40"' && die "--min-matches did not stop early"
+
+# time budget: complete results if the budget is large enough, partial results otherwise
+audiowmark_cmp --time-budget 1000 --expect-matches 11 $OUT_WAV $TEST_MSG || die "watermark detection with --time-budget failed"
+$AUDIOWMARK get --time-budget 1000 --json - $OUT_WAV | grep -q '"partial": false' || die "unexpected partial result"
+$AUDIOWMARK get --time-budget 0.001 --json - $OUT_WAV 2>/dev/null | grep -q '"partial": true' || die "missing partial flag"
+
+# sampled detection: only analyze windows at 0:00 and 3:20, input must be seekable
+audiowmark_cmp --sample-every 200 --sample-length 120 $OUT_WAV $TEST_MSG || die "sampled watermark detection failed"
+cat $OUT_WAV | $AUDIOWMARK get --sample-every 200 - 2>/dev/null && die "sampled watermark detection from pipe should fail"
+
+# memory budget: more than one chunk (about 3.5 minutes), too small budgets are rejected
+audiowmark_cmp --max-memory 200 $OUT_WAV $TEST_MSG || die "watermark detection with --max-memory failed"
+$AUDIOWMARK get --max-memory 16 $OUT_WAV 2>/dev/null && die "get with too small --max-memory should fail"
+
+rm $IN_WAV $OUT_WAV
+exit 0
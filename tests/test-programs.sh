@@ -2,7 +2,7 @@
 
 source test-common.sh
 
-for TEST in testrawconverter
+for TEST in testrawconverter testdbkernel testaudiobuffer testlibapi
 do
   if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
     $TOP_BUILDDIR/src/$TEST > /dev/null
@@ -11,4 +11,19 @@ do
   fi
 done
 
+for K in 12 16 20
+do
+  if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+    $TOP_BUILDDIR/src/testshortcode $K check > /dev/null
+  else
+    $TOP_BUILDDIR/src/testshortcode $K check
+  fi
+done
+
+if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+  $TOP_BUILDDIR/src/testrandom check > /dev/null
+else
+  $TOP_BUILDDIR/src/testrandom check
+fi
+
 exit 0
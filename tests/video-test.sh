@@ -0,0 +1,27 @@
+#!/bin/bash
+
+source test-common.sh
+
+if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+  FFMPEG_Q="-v quiet"
+fi
+
+IN_WAV=video-test.wav
+IN_VIDEO=video-test.mp4
+OUT_VIDEO=video-test-out.mp4
+
+# generate input video: noise as aac audio, small test pattern video
+audiowmark test-gen-noise $IN_WAV 200 44100
+ffmpeg $FFMPEG_Q -nostdin -y -f lavfi -i testsrc=size=160x120:rate=10 -i $IN_WAV \
+  -map 0:v -map 1:a -c:v mpeg4 -c:a aac -ab 192k -shortest $IN_VIDEO
+
+audiowmark video-add $IN_VIDEO $OUT_VIDEO $TEST_MSG
+
+# the output must still contain the video stream
+[ "$(ffprobe -v error -select_streams v -show_entries stream=codec_type -of csv=p=0 $OUT_VIDEO)" == "video" ] || die "video stream missing in video-add output"
+
+# detect watermark
+$AUDIOWMARK --strict video-get $OUT_VIDEO | grep -q "pattern   all $TEST_MSG" || die "video-get did not find watermark"
+
+rm $IN_WAV $IN_VIDEO $OUT_VIDEO
+exit 0
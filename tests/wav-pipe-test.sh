@@ -36,4 +36,19 @@ do
   rm $IN_WAV $OUT1_WAV $OUT2_WAV $OUT3_WAV
 done
 
+# --read-buffer: the buffer size must not change the output
+audiowmark test-gen-noise $IN_WAV 200 44100
+cat $IN_WAV | audiowmark_add --format wav-pipe - - $TEST_MSG > $OUT1_WAV || die "watermark from pipe failed"
+cat $IN_WAV | $AUDIOWMARK -q --strict --read-buffer 4 add --format wav-pipe - - $TEST_MSG > $OUT2_WAV || die "watermark with small read buffer failed"
+cmp -s $OUT1_WAV $OUT2_WAV || die "output with --read-buffer 4 differs"
+
+for KB in 3 1048577 4194304
+do
+  RC=0
+  $AUDIOWMARK --read-buffer $KB add $IN_WAV $OUT2_WAV $TEST_MSG 2>/dev/null || RC=$?
+  [ "$RC" == 1 ] || die "--read-buffer $KB should fail"
+done
+
+rm $IN_WAV $OUT1_WAV $OUT2_WAV
+
 exit 0
@@ -63,4 +63,8 @@ do
   compare_fmt_snr $FMT_WAV $MARK_WAV 32.3
 done
 
+# RF64 output can be read back (the detection uses a memory mapping for uncompressed wav/rf64 input)
+audiowmark_add --output-format rf64 $IN_WAV $MARK_WAV $TEST_MSG
+audiowmark_cmp $MARK_WAV $TEST_MSG
+
 rm $IN_WAV $FMT_WAV $MARK_WAV